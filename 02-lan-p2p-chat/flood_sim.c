@@ -0,0 +1,203 @@
+/*
+ * Runs a flooding network (see flood.c) in one process, to see what
+ * duplicate suppression saves: `nodes' nodes on the loopback, each with its
+ * own socket and about `degree' neighbors, all on one reactor. Each node is
+ * linked to the next in a ring, so all can be reached, and to random others.
+ *
+ * For every TTL up to `ttl', `queries' queries for the name of a random node
+ * are flooded from random nodes, one at a time, first with the Bloom filter
+ * turned off and then with it on. For each it prints how many nodes a query
+ * reached, the datagrams it cost in all and at most from any one node, the
+ * share of duplicates received, and how often the name was found.
+ *
+ * Usage: flood_sim <nodes> [<degree> [<queries> [<ttl>]]]
+ */
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define QUIET_MS    10      /* a query is over when nothing moves this long */
+
+
+struct node {
+    struct flood       *flood;
+    struct peer_table  *neighbors;
+    int                 sockfd;
+    struct sockaddr_in  addr;
+    char                name[16];
+    struct flood_stats  before;     /* when the run started */
+};
+
+static struct reactor *reactor;
+static struct node *nodes;
+static int nnodes;
+static int degree = 4;
+static int nqueries = 20;
+static int ttl = FLOOD_TTL;
+
+static uint64_t query_id;
+static int found, hits;
+
+static void on_node(struct reactor *r, int fd, int events, void *arg)
+{
+    struct node *n = arg;
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+
+    while (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &from, &len) >= 0) {
+        flood_handle(n->flood, &msg, &from);
+        len = sizeof(from);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        err_ret("recv_message error");
+}
+
+/* The node with the name answers. */
+static void on_query(struct flood *f, const struct flood_query *q, void *arg)
+{
+    struct node *n = arg;
+
+    if (strcmp(q->payload, n->name) == 0)
+        flood_hit(f, q, n->name, strlen(n->name));
+}
+
+static void on_hit(struct flood *f, uint64_t id, const char *payload,
+                   size_t len, const struct sockaddr_in *from, void *arg)
+{
+    if (id != query_id)
+        return;
+    if (hits++ == 0)
+        found++;
+}
+
+static void link_nodes(int a, int b)
+{
+    peer_table_add(nodes[a].neighbors, &nodes[b].addr);
+    peer_table_add(nodes[b].neighbors, &nodes[a].addr);
+}
+
+struct result {
+    double  reached;        /* % of the other nodes */
+    double  sent;           /* datagrams per query */
+    double  max_sent;       /* by one node, per query */
+    double  duplicates;     /* % of what was received */
+    int     found;
+    unsigned long lost;
+};
+
+static void run(int suppress, int query_ttl, struct result *res)
+{
+    int i, q;
+
+    for (i = 0; i < nnodes; ++i) {
+        flood_suppress(nodes[i].flood, suppress);
+        flood_get_stats(nodes[i].flood, &nodes[i].before);
+    }
+
+    found = 0;
+    for (q = 0; q < nqueries; ++q) {
+        struct node *from = &nodes[random() % nnodes];
+        struct node *want = &nodes[random() % nnodes];
+
+        hits = 0;
+        query_id = flood_query(from->flood, want->name, strlen(want->name),
+                               query_ttl);
+        while (reactor_once(reactor, QUIET_MS) > 0)
+            ;
+    }
+
+    unsigned long received = 0, sent = 0, dups = 0, max_sent = 0;
+    for (i = 0; i < nnodes; ++i) {
+        struct flood_stats st;
+        flood_get_stats(nodes[i].flood, &st);
+
+        unsigned long s = st.sent - nodes[i].before.sent;
+        received += st.received - nodes[i].before.received;
+        sent += s;
+        dups += st.duplicates - nodes[i].before.duplicates;
+        max_sent = max(max_sent, s);
+    }
+
+    /* A node is reached once; every other copy it gets is a duplicate. */
+    res->reached = 100.0 * (received - dups) / ((double) nqueries * (nnodes - 1));
+    res->sent = (double) sent / nqueries;
+    res->max_sent = (double) max_sent / nqueries;
+    res->duplicates = received ? 100.0 * dups / received : 0.0;
+    res->found = found;
+    res->lost = sent - received;
+}
+
+int main(int argc, char **argv)
+{
+    int i, j, t;
+
+    if (argc < 2)
+        err_quit("usage: flood_sim <nodes> [<degree> [<queries> [<ttl>]]]");
+    if ( (nnodes = atoi(argv[1])) < 2)
+        err_quit("There must be at least two nodes");
+    if (argc > 2 && ((degree = atoi(argv[2])) < 2 || degree >= nnodes))
+        err_quit("The degree must be at least 2 and less than the nodes");
+    if (argc > 3 && (nqueries = atoi(argv[3])) < 1)
+        err_quit("The number of queries must be positive");
+    if (argc > 4 && ((ttl = atoi(argv[4])) < 1 || ttl > 255))
+        err_quit("The TTL must be between 1 and 255");
+
+    srandom(getpid());
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+
+    nodes = Calloc(nnodes, sizeof(*nodes));
+    for (i = 0; i < nnodes; ++i) {
+        struct node *n = &nodes[i];
+        socklen_t len = sizeof(n->addr);
+
+        n->sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+        n->addr.sin_family = AF_INET;
+        n->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Bind(n->sockfd, (SA *) &n->addr, sizeof(n->addr));
+        Getsockname(n->sockfd, (SA *) &n->addr, &len);
+        Fcntl(n->sockfd, F_SETFL, Fcntl(n->sockfd, F_GETFL, 0) | O_NONBLOCK);
+        snprintf(n->name, sizeof(n->name), "node%d", i);
+
+        n->neighbors = peer_table_create(degree);
+        n->flood = flood_create(reactor, n->sockfd, &n->addr, n->neighbors,
+                                on_query, on_hit, n);
+        if (reactor_add(reactor, n->sockfd, REACTOR_IN, on_node, n) < 0)
+            err_sys("reactor_add error");
+    }
+
+    /* The ring gives everyone two; random links make up the rest. */
+    unsigned long links = 0;
+    for (i = 0; i < nnodes; ++i)
+        link_nodes(i, (i + 1) % nnodes);
+    for (i = 0; i < nnodes; ++i) {
+        for (j = 0; j < 100 && nodes[i].neighbors->count < degree; ++j) {
+            int k = random() % nnodes;
+            if (k != i && nodes[k].neighbors->count < degree)
+                link_nodes(i, k);
+        }
+    }
+    int max_degree = 0;
+    for (i = 0; i < nnodes; ++i) {
+        links += nodes[i].neighbors->count;
+        max_degree = max(max_degree, nodes[i].neighbors->count);
+    }
+
+    printf("%d nodes, %.1f neighbors avg, %d max; %d queries per TTL\n",
+           nnodes, (double) links / nnodes, max_degree, nqueries);
+    printf("          -------- no filter --------  ---------- filter ----------\n");
+    printf(" TTL reach  per query  node max  dups  per query  node max  dups found\n");
+    for (t = 1; t <= ttl; ++t) {
+        struct result off, on;
+        run(0, t, &off);
+        run(1, t, &on);
+        printf("%4d %4.0f%% %10.0f %9.2f %4.0f%% %10.0f %9.2f %4.0f%% %4d%%\n",
+               t, on.reached, off.sent, off.max_sent, off.duplicates, on.sent,
+               on.max_sent, on.duplicates, 100 * on.found / nqueries);
+        if (off.lost + on.lost > 0)
+            printf("     (%lu datagrams lost)\n", off.lost + on.lost);
+    }
+
+    exit(0);
+}
@@ -0,0 +1,219 @@
+/*
+ * Runs a whole Kademlia network (see kad.c) in one process, to see how
+ * lookups scale: `nodes' nodes on the loopback, each with its own socket,
+ * all on one reactor. They join INFLIGHT at a time, each through a random
+ * node already in, then each stores its address under the hash of its name, then
+ * `lookups' names are looked up from random nodes. The hops, queries and
+ * time per lookup are printed along with log2 of the number of nodes.
+ *
+ * Usage: kad_sim <nodes> [<lookups>]
+ */
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define INFLIGHT 64     /* joins, stores or lookups going at once */
+
+
+struct node {
+    struct kad         *kad;
+    int                 sockfd;
+    struct sockaddr_in  addr;
+};
+
+static struct reactor *reactor;
+static struct node *nodes;
+static int nnodes;
+static int nlookups = 1000;
+
+static int joined, joins_started;
+static int stored, stores_started;
+static int looked_up, lookups_started;
+
+static unsigned long hops, max_hops, rpcs, timeouts, found, wrong;
+static uint64_t lookup_ms, max_lookup_ms;
+static uint64_t started;
+
+static void join_more(void);
+static void store_more(void);
+static void lookup_more(void);
+
+static void on_node(struct reactor *r, int fd, int events, void *arg)
+{
+    struct node *n = arg;
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+
+    while (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &from, &len) >= 0) {
+        kad_handle(n->kad, &msg, &from);
+        len = sizeof(from);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        err_ret("recv_message error");
+}
+
+static void name_of(int i, char *name, size_t size)
+{
+    snprintf(name, size, "user%d", i);
+}
+
+static void on_joined(struct kad *k, const struct kad_result *res, void *arg)
+{
+    joined++;
+    if (joined % 1000 == 0 || joined == nnodes)
+        printf("%d nodes joined in %llu ms\n", joined,
+               (unsigned long long) (now_ms() - started));
+    if (joined == nnodes) {
+        started = now_ms();
+        store_more();
+        return;
+    }
+    join_more();
+}
+
+/* The first node is alone; the others join through one that's in. */
+static void join_more(void)
+{
+    while (joins_started < nnodes && joins_started - joined < INFLIGHT &&
+            (joins_started == 0 || joined > 0)) {
+        struct node *n = &nodes[joins_started++];
+        if (n == nodes) {
+            kad_join(n->kad, NULL, 0, on_joined, NULL);
+        } else {
+            struct node *via = &nodes[random() % joined];
+            kad_join(n->kad, &via->addr, 1, on_joined, NULL);
+        }
+    }
+}
+
+static void on_stored(struct kad *k, const struct kad_result *res, void *arg)
+{
+    if (++stored == nnodes) {
+        printf("%d names stored in %llu ms\n", nnodes,
+               (unsigned long long) (now_ms() - started));
+        started = now_ms();
+        lookup_more();
+        return;
+    }
+    store_more();
+}
+
+static void store_more(void)
+{
+    while (stores_started < nnodes && stores_started - stored < INFLIGHT) {
+        struct node *n = &nodes[stores_started];
+        char name[16];
+        uint8_t key[KAD_ID_LEN];
+        char value[6];
+
+        /* Counted first: with no one to ask, on_stored is called at once. */
+        name_of(stores_started++, name, sizeof(name));
+        kad_key(name, key);
+        memcpy(value, &n->addr.sin_addr.s_addr, 4);
+        memcpy(value + 4, &n->addr.sin_port, 2);
+        kad_store(n->kad, key, value, sizeof(value), on_stored, NULL);
+    }
+}
+
+static void on_found(struct kad *k, const struct kad_result *res, void *arg)
+{
+    struct node *want = arg;
+
+    if (res->found) {
+        found++;
+        if (res->len != 6 ||
+                memcmp(res->value, &want->addr.sin_addr.s_addr, 4) != 0 ||
+                memcmp((const char *) res->value + 4, &want->addr.sin_port, 2) != 0)
+            wrong++;
+    }
+    hops += res->hops;
+    max_hops = max(max_hops, (unsigned long) res->hops);
+    rpcs += res->rpcs;
+    timeouts += res->timeouts;
+    lookup_ms += res->elapsed_ms;
+    max_lookup_ms = max(max_lookup_ms, res->elapsed_ms);
+
+    if (++looked_up == nlookups) {
+        reactor_stop(reactor);
+        return;
+    }
+    lookup_more();
+}
+
+static void lookup_more(void)
+{
+    while (lookups_started < nlookups &&
+            lookups_started - looked_up < INFLIGHT) {
+        int from = random() % nnodes, to = random() % nnodes;
+        char name[16];
+        uint8_t key[KAD_ID_LEN];
+
+        lookups_started++;
+        name_of(to, name, sizeof(name));
+        kad_key(name, key);
+        kad_find_value(nodes[from].kad, key, on_found, &nodes[to]);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2)
+        err_quit("usage: kad_sim <nodes> [<lookups>]");
+    if ( (nnodes = atoi(argv[1])) < 1)
+        err_quit("The number of nodes must be positive");
+    if (argc > 2 && (nlookups = atoi(argv[2])) < 1)
+        err_quit("The number of lookups must be positive");
+
+    srandom(getpid());
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+
+    nodes = Calloc(nnodes, sizeof(*nodes));
+    for (i = 0; i < nnodes; ++i) {
+        struct node *n = &nodes[i];
+        socklen_t len = sizeof(n->addr);
+
+        n->sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+        n->addr.sin_family = AF_INET;
+        n->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Bind(n->sockfd, (SA *) &n->addr, sizeof(n->addr));
+        Getsockname(n->sockfd, (SA *) &n->addr, &len);
+        Fcntl(n->sockfd, F_SETFL, Fcntl(n->sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+        n->kad = kad_create(reactor, n->sockfd, &n->addr);
+        if (reactor_add(reactor, n->sockfd, REACTOR_IN, on_node, n) < 0)
+            err_sys("reactor_add error");
+    }
+
+    started = now_ms();
+    join_more();
+    /* A single node has no one to ask, and is done already. */
+    if (looked_up < nlookups)
+        reactor_run(reactor);
+
+    int log2n = 0;
+    for (i = nnodes; i > 1; i >>= 1)
+        log2n++;
+    printf("%d lookups among %d nodes (log2 N = %d):\n", nlookups, nnodes,
+           log2n);
+    printf("  %lu found, %lu wrong\n", found, wrong);
+    printf("  hops: %.2f avg, %lu max\n", (double) hops / nlookups, max_hops);
+    printf("  queries: %.2f avg, %lu timeouts\n", (double) rpcs / nlookups,
+           timeouts);
+    printf("  time: %.2f ms avg, %llu ms max, %llu ms in all\n",
+           (double) lookup_ms / nlookups, (unsigned long long) max_lookup_ms,
+           (unsigned long long) (now_ms() - started));
+
+    struct kad_stats st;
+    unsigned long contacts = 0;
+    for (i = 0; i < nnodes; ++i) {
+        kad_get_stats(nodes[i].kad, &st);
+        contacts += st.contacts;
+    }
+    printf("  routing table: %.1f contacts avg\n", (double) contacts / nnodes);
+
+    exit(0);
+}
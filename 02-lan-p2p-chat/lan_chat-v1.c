@@ -4,6 +4,10 @@
  * It uses a simple pkt-line-based protocol.
  * It doesn't check whether the port to which we try to bind is being used.
  *
+ * The listener, the search for a peer and the user input share one event
+ * loop in a single process. Whoever connects first, we or the peer, that
+ * connection carries the chat both ways.
+ *
  * Usage: lan_chat-v1 <listen-port> <user-id>
  */
 
@@ -18,14 +22,28 @@
 
 #define END_SIGNAL "am-end"
 
+#define MAX_CONNS 64
+#define CONNECT_TIMEOUT_MS 1000
+#define RETRY_MS 200        /* pause between sweeps of the port range */
+
 
 static int listen_port;
 static char *user_name;
 
+/*
+ * Peer table shared by the receiving and the sending side: every connection
+ * we read messages from, with what came on it so far, and the one we send
+ * ours on.
+ */
+static int conns[MAX_CONNS];
+static struct stream_in *conn_in[MAX_CONNS];
+static int conn_count;
+static int send_fd = -1;
+
 
-int spawn_listener(int);
-int connect_to_listener();
-void message_loop(int);
+void start_listener(struct reactor*, int);
+void connect_to_listener(struct reactor*);
+void message_loop(struct reactor*);
 
 int main(int argc, char **argv)
 {
@@ -37,138 +55,308 @@ int main(int argc, char **argv)
         err_quit("Ports must be in range [%d:%d]", PORT_MIN, PORT_MAX);
 
     user_name = argv[2];
-    if (strlen(user_name) > 10)
-        err_quit("The user_name must be at most 10 characters");
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
+
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
 
-    
     /*
-     * Spawns a listener process which accepts any connection and outputs each
-     * received message on the terminal.
+     * Accepts any connection and outputs each received message on the
+     * terminal.
      */
-    int listenerpid = spawn_listener(listen_port);
+    start_listener(reactor, listen_port);
 
     /*
-     * Connects to a listener and waits for user input. On each new line input
-     * by user, creates a message according to the protocol and sends it over
-     * the socket.
+     * Looks for a listener to connect to and waits for user input. On each
+     * new line input by user, creates a message according to the protocol
+     * and sends it over the socket.
      */
-    int sockfd = connect_to_listener();
-    message_loop(sockfd);
+    connect_to_listener(reactor);
+    message_loop(reactor);
 
 
-    kill(listenerpid, SIGKILL);
+    reactor_free(reactor);
     exit(0);
 }
 
 
-void listener_task(int);
+int bind_listener(int);
+static void on_accept(struct reactor*, int, int, void*);
+static void on_conn(struct reactor*, int, int, void*);
+static void add_conn(struct reactor*, int);
+static void remove_conn(struct reactor*, int);
 
-int spawn_listener(int listen_port)
+void start_listener(struct reactor *reactor, int listen_port)
 {
-    int listenerpid;
-    if ( (listenerpid = Fork()) == 0 ) {
-        listener_task(listen_port);
-        exit(0);
-    }
+    int listenfd = bind_listener(listen_port);
 
-    return listenerpid;
+    if (reactor_add(reactor, listenfd, REACTOR_IN, on_accept, NULL) < 0)
+        err_sys("reactor_add error");
 }
 
-
-int find_peer(int);
-
-int connect_to_listener()
+static void on_accept(struct reactor *reactor, int listenfd, int events,
+                      void *arg)
 {
-    int sockfd;
-    sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+    int connfd = Accept(listenfd, (SA *) NULL, NULL);
 
-    /*
-     * This is the most crucial part of the peer-to-peer chat.
-     *
-     * The problem is, that in order to chat with someone, we must first find
-     * him. In server-side solutions, we would contact a central server, bound
-     * on a well-known port, and ask it to route each message we type to the
-     * peer we are interested in.
-     *
-     * When we have no centralized entity, however, we must use the peer
-     * infrastructure to send our messages to the desired location. One of the
-     * simplest situations in which we can be is that peers are on the same
-     * host, only bound on different ports. If we know the range of the ports,
-     * we can iterate over it and try connecting to every (ip, port) pair until
-     * success.
-     *
-     * Even though this situation is somewhat artificial it is simple-enough
-     * for educational purposes and it enables us to test our system locally.
-     */
-    find_peer(sockfd);
+    add_conn(reactor, connfd);
+}
 
-    return sockfd;
+/*
+ * Connections are non-blocking: what comes is buffered until a message is
+ * whole, so a peer that stops halfway holds up nobody else.
+ */
+static void on_conn(struct reactor *reactor, int connfd, int events, void *arg)
+{
+    struct stream_in *in = arg;
+    struct p2p_msg msg;
+    ssize_t n;
+
+    while ( (n = stream_read_message(connfd, in, &msg)) > 0)
+        printf("%s\n", msg.body);
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        remove_conn(reactor, connfd);
 }
 
 
-void message_loop(int sockfd)
-{
-    char message[1024];
-    while (fgets(message, sizeof(message), stdin) &&
-            strncmp(message, END_SIGNAL, strlen(END_SIGNAL)) != 0) {
-        char *to_send = create_send_msg(message, user_name);
+static void stop_search(struct reactor*);
+static void start_search(struct reactor*);
 
-        Writen(sockfd, to_send, strlen(to_send));
+static void add_conn(struct reactor *reactor, int connfd)
+{
+    if (conn_count == MAX_CONNS) {
+        err_msg("too many connections");
+        Close(connfd);
+        return;
+    }
 
-        free(to_send);
+    struct stream_in *in = Calloc(1, sizeof(*in));
+    Fcntl(connfd, F_SETFL, Fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+    if (reactor_add(reactor, connfd, REACTOR_IN, on_conn, in) < 0)
+        err_sys("reactor_add error");
+    conns[conn_count] = connfd;
+    conn_in[conn_count++] = in;
+
+    /* A peer that found us first spares us the search. */
+    if (send_fd < 0) {
+        send_fd = connfd;
+        stop_search(reactor);
     }
 }
 
+static void remove_conn(struct reactor *reactor, int connfd)
+{
+    int i;
+    for (i = 0; i < conn_count; ++i) {
+        if (conns[i] == connfd) {
+            free(conn_in[i]);
+            conns[i] = conns[--conn_count];
+            conn_in[i] = conn_in[conn_count];
+            break;
+        }
+    }
+    reactor_del(reactor, connfd);
+    Close(connfd);
+
+    if (connfd == send_fd) {
+        send_fd = conn_count > 0 ? conns[0] : -1;
+        if (send_fd < 0) {
+            printf("Peer left\n");
+            start_search(reactor);
+        }
+    }
+}
 
-int bind_listener(int);
 
-void listener_task(int listen_port)
+/*
+ * This is the most crucial part of the peer-to-peer chat.
+ *
+ * The problem is, that in order to chat with someone, we must first find
+ * him. In server-side solutions, we would contact a central server, bound
+ * on a well-known port, and ask it to route each message we type to the
+ * peer we are interested in.
+ *
+ * When we have no centralized entity, however, we must use the peer
+ * infrastructure to send our messages to the desired location. One of the
+ * simplest situations in which we can be is that peers are on the same
+ * host, only bound on different ports. If we know the range of the ports,
+ * we can iterate over it and try connecting to every (ip, port) pair until
+ * success.
+ *
+ * Even though this situation is somewhat artificial it is simple-enough
+ * for educational purposes and it enables us to test our system locally.
+ *
+ * Connects are non-blocking and driven by the event loop, so the listener
+ * keeps working while we search.
+ */
+void connect_to_listener(struct reactor *reactor)
 {
-    int listenfd = bind_listener(listen_port);
+    start_search(reactor);
+}
 
-    while (1) {
-        int connfd = Accept(listenfd, (SA *) NULL, NULL);
+static int searching;
+static int search_fd = -1;          /* connect in progress */
+static int current_port = PORT_MIN;
+static struct reactor_timer *search_timer;
 
-        char msg_len_hex[4];
-        while (read(connfd, msg_len_hex, sizeof(msg_len_hex)) > 0) {
-            unsigned int msg_len = hex_to_int(msg_len_hex);
-            msg_len -= 5;
-            char *message = malloc(msg_len);
+static void try_next_port(struct reactor*);
 
-            Readn(connfd, message, msg_len);
-            message[msg_len] = 0;
-            printf("%s\n", message);
+static void on_search_timer(struct reactor *reactor, void *arg)
+{
+    search_timer = NULL;
 
-            free(message);
-        }
+    /* The connect in progress took too long; give up on it. */
+    if (search_fd >= 0) {
+        reactor_del(reactor, search_fd);
+        Close(search_fd);
+        search_fd = -1;
+    }
+    try_next_port(reactor);
+}
 
-        Close(connfd);
+static void on_connect(struct reactor *reactor, int sockfd, int events,
+                       void *arg)
+{
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    reactor_cancel(reactor, search_timer);
+    search_timer = NULL;
+    reactor_del(reactor, sockfd);
+    search_fd = -1;
+
+    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
+            error != 0) {
+        Close(sockfd);
+        try_next_port(reactor);
+        return;
     }
+
+    printf("Bound!\n");
+    add_conn(reactor, sockfd);
 }
 
-int find_peer(int sockfd)
+/*
+ * Starts a connect to the next port of the range. After a whole sweep
+ * without success, waits RETRY_MS before starting over.
+ */
+static void try_next_port(struct reactor *reactor)
 {
+    if (!searching)
+        return;
+
     struct sockaddr_in servaddr;
     bzero(&servaddr, sizeof(servaddr));
     servaddr.sin_family = AF_INET;
     Inet_pton(AF_INET, "127.0.0.1", &servaddr.sin_addr);
 
-    int current_port = PORT_MIN;
-    do {
-        if (current_port > PORT_MAX)
-            current_port = PORT_MIN;
+    while (current_port <= PORT_MAX) {
+        int port = current_port++;
+        if (port == listen_port)
+            continue;
+
+        servaddr.sin_port = htons(port);
+
+        int sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+        Fcntl(sockfd, F_SETFL, Fcntl(sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+        /* Loopback connects may complete or fail at once. */
+        if (connect(sockfd, (SA *) &servaddr, sizeof(servaddr)) == 0 ||
+                errno == EINPROGRESS) {
+            search_fd = sockfd;
+            if (reactor_add(reactor, sockfd, REACTOR_OUT, on_connect, NULL) < 0)
+                err_sys("reactor_add error");
+            search_timer = reactor_timer(reactor, CONNECT_TIMEOUT_MS, 0,
+                                         on_search_timer, NULL);
+            return;
+        }
+        Close(sockfd);
+    }
+
+    current_port = PORT_MIN;
+    search_timer = reactor_timer(reactor, RETRY_MS, 0, on_search_timer, NULL);
+}
 
-        if (current_port == listen_port)
-            current_port++;
+/*
+ * If stop_search left a connect running, or a timer is pending, that attempt
+ * goes on with the search when it ends; starting another would leak it.
+ */
+static void start_search(struct reactor *reactor)
+{
+    searching = 1;
+    current_port = PORT_MIN;
+    if (search_fd < 0 && search_timer == NULL)
+        try_next_port(reactor);
+}
 
-        servaddr.sin_port = htons(current_port);
-        current_port++;
-    } while (connect(sockfd, (SA *) &servaddr, sizeof(servaddr)) < 0);
+/*
+ * A connect in progress is left to finish: the peer may have accepted it
+ * already, and closing it would look like we left.
+ */
+static void stop_search(struct reactor *reactor)
+{
+    searching = 0;
 
-    printf("Bound!\n");
+    if (search_fd < 0) {
+        reactor_cancel(reactor, search_timer);
+        search_timer = NULL;
+    }
+}
+
+
+static void on_input(struct reactor*, int, int, void*);
+
+void message_loop(struct reactor *reactor)
+{
+    if (reactor_add(reactor, fileno(stdin), REACTOR_IN, on_input, NULL) < 0)
+        err_sys("reactor_add error");
+
+    reactor_run(reactor);
+}
+
+static void on_input(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char message[1024];
+    ssize_t n;
+    if ( (n = Read(fd, message, sizeof(message) - 1)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+    message[n] = 0;
+
+    if (strncmp(message, END_SIGNAL, strlen(END_SIGNAL)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+
+    if (send_fd < 0) {
+        err_msg("No peer yet");
+        return;
+    }
 
-    --current_port;
-    return current_port;
+    struct send_msg to_send;
+    create_send_msg(message, &to_send);
+
+    struct msghdr hdr;
+    bzero(&hdr, sizeof(hdr));
+    hdr.msg_iov = to_send.iov;
+    hdr.msg_iovlen = to_send.iovcnt;
+
+    /*
+     * A peer that has gone is dropped, without the SIGPIPE, and so is one
+     * that left its socket buffer full: half a message would garble the rest.
+     */
+    ssize_t sent = sendmsg(send_fd, &hdr, MSG_NOSIGNAL);
+    if (sent != (ssize_t) to_send.len) {
+        if (sent < 0)
+            err_ret("sendmsg error");
+        else
+            err_msg("peer too slow, dropped");
+        remove_conn(reactor, send_fd);
+    }
 }
 
 
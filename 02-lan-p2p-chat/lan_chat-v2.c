@@ -1,16 +1,20 @@
 /*
  * This version implements chatting with peers on the same subnet.
- * The subnet address is passed as an argument. We iterate over the
- * possible IPs in the subnet /24 and try to connect to each one.
+ * The subnet address is passed as an argument, as a /24 or in CIDR
+ * notation. We try to connect to every host in the subnet, SCAN_CONNS of
+ * them at a time, and keep every connection that succeeds.
  *
- * Usage: lan_chat-v2 <subnet-address> <user-name> <start-idx>
+ * The listener, the search for peers and the user input share one event
+ * loop in a single process. Our messages go out on every connection, ours
+ * or the peer's, and we read from all of them.
+ *
+ * Usage: lan_chat-v2 <subnet-address>[/<prefix>] <user-name> <start-idx>
  */
 
 /*
  * TODO:
- * 1. Try to make it work with non-byte-bounded subnets.
- * 2. Try to make it work with IPv6 and be protocol-independent.
- * 3. We don't have any authentication currently. Think and implement a clever
+ * 1. Try to make it work with IPv6 and be protocol-independent.
+ * 2. We don't have any authentication currently. Think and implement a clever
  *  solution of this problem.
  */
 #include "../lib/unp.h"
@@ -20,151 +24,331 @@
 
 #define END_SIGNAL "am-end"
 
+#define MAX_CONNS 64
+#define SCAN_CONNS 256      /* connects in flight at once */
+#define CONNECT_TIMEOUT_MS 1000
+#define RETRY_MS 1000       /* pause between sweeps of the subnet */
+
 
 static char *subnet_address;
 static char *user_name;
 static int start_idx;
 
+/*
+ * Peer table shared by the receiving and the sending side: every connection
+ * and the host at its other end. We read from every connection, and send
+ * to each host once: it and we may each have connected to the other. What
+ * came on each connection so far waits in conn_in until a message is whole.
+ */
+static int conns[MAX_CONNS];
+static struct in_addr conn_hosts[MAX_CONNS];
+static struct stream_in *conn_in[MAX_CONNS];
+static int conn_count;
+
 
-int spawn_listener(int);
-int connect_to_listener();
-void message_loop(int);
+void start_listener(struct reactor*, int);
+void connect_to_listener(struct reactor*);
+void message_loop(struct reactor*);
 
 int main(int argc, char **argv)
 {
     if (argc < 3)
-        err_quit("usage: lan_chat <subnet-address> <user-name> <start-idx>");
+        err_quit("usage: lan_chat <subnet-address>[/<prefix>] <user-name> <start-idx>");
 
     subnet_address = argv[1];
-    if (!inet_aton(subnet_address, NULL))
-        err_quit("The subnet address must be a valid IPv4 address");
+    uint32_t first, count;
+    if (sweep_parse(subnet_address, &first, &count) < 0)
+        err_quit("The subnet must be an IPv4 address, optionally with a /prefix");
 
     user_name = argv[2];
-    if (strlen(user_name) > 10)
-        err_quit("The user_name must be at most 10 characters");
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
 
     if (argc == 4)
         start_idx = atoi(argv[3]);
     
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+
     /*
-     * Spawns a listener process which accepts any connection and outputs each
-     * received message on the terminal.
+     * Accepts any connection and outputs each received message on the
+     * terminal.
      */
-    int listenerpid = spawn_listener(CHAT_PORT);
+    start_listener(reactor, CHAT_PORT);
 
     /*
-     * Connects to a listener and waits for user input. On each new line input
-     * by user, creates a message according to the protocol and sends it over
-     * the socket.
+     * Looks for a listener to connect to and waits for user input. On each
+     * new line input by user, creates a message according to the protocol
+     * and sends it over the socket.
      */
-    int sockfd = connect_to_listener();
-    message_loop(sockfd);
+    connect_to_listener(reactor);
+    message_loop(reactor);
 
 
-    kill(listenerpid, SIGKILL);
+    reactor_free(reactor);
     exit(0);
 }
 
 
-void listener_task(int);
+int bind_listener(int);
+static void stop_search(struct reactor*);
+static void start_search(struct reactor*);
+static int is_self(int);
+static void on_accept(struct reactor*, int, int, void*);
+static void on_conn(struct reactor*, int, int, void*);
+static void add_conn(struct reactor*, int, const struct sockaddr_in*);
+static void remove_conn(struct reactor*, int);
+
+void start_listener(struct reactor *reactor, int listen_port)
+{
+    int listenfd = bind_listener(listen_port);
+
+    if (reactor_add(reactor, listenfd, REACTOR_IN, on_accept, NULL) < 0)
+        err_sys("reactor_add error");
+}
 
-int spawn_listener(int listen_port)
+static void on_accept(struct reactor *reactor, int listenfd, int events,
+                      void *arg)
 {
-    int listenerpid;
-    if ( (listenerpid = Fork()) == 0 ) {
-        listener_task(listen_port);
-        exit(0);
+    struct sockaddr_in cliaddr;
+    socklen_t len = sizeof(cliaddr);
+    int connfd = Accept(listenfd, (SA *) &cliaddr, &len);
+
+    if (is_self(connfd) != 0) {
+        Close(connfd);
+        return;
     }
 
-    return listenerpid;
+    /* A peer that found us first spares us the search. */
+    if (conn_count == 0)
+        stop_search(reactor);
+    add_conn(reactor, connfd, &cliaddr);
 }
 
+/*
+ * Connections are non-blocking: what comes is buffered until a message is
+ * whole, so a peer that stops halfway holds up nobody else.
+ */
+static void on_conn(struct reactor *reactor, int connfd, int events, void *arg)
+{
+    struct stream_in *in = arg;
+    struct p2p_msg msg;
+    ssize_t n;
+
+    while ( (n = stream_read_message(connfd, in, &msg)) > 0)
+        printf("%s\n", msg.body);
+    if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        remove_conn(reactor, connfd);
+}
 
-int find_peer(int);
 
-int connect_to_listener()
+static void add_conn(struct reactor *reactor, int connfd,
+                     const struct sockaddr_in *addr)
 {
-    int sockfd;
-    sockfd = Socket(AF_INET, SOCK_STREAM, 0);
+    if (conn_count == MAX_CONNS) {
+        err_msg("too many connections");
+        Close(connfd);
+        return;
+    }
 
-    /*
-     * Now, we'll use a different algorithm to find our peers on a LAN.
-     *
-     * We will iterate over all the hosts in a given subnet, try to connect to
-     * each one on a given port, and if the connection is successful, start 
-     * chatting with them.
-     */
-    find_peer(sockfd);
+    struct stream_in *in = Calloc(1, sizeof(*in));
+    Fcntl(connfd, F_SETFL, Fcntl(connfd, F_GETFL, 0) | O_NONBLOCK);
+    if (reactor_add(reactor, connfd, REACTOR_IN, on_conn, in) < 0)
+        err_sys("reactor_add error");
+    conns[conn_count] = connfd;
+    conn_in[conn_count] = in;
+    conn_hosts[conn_count++] = addr->sin_addr;
+}
 
-    return sockfd;
+static void remove_conn(struct reactor *reactor, int connfd)
+{
+    int i;
+    for (i = 0; i < conn_count; ++i) {
+        if (conns[i] == connfd) {
+            free(conn_in[i]);
+            conns[i] = conns[--conn_count];
+            conn_in[i] = conn_in[conn_count];
+            conn_hosts[i] = conn_hosts[conn_count];
+            break;
+        }
+    }
+    reactor_del(reactor, connfd);
+    Close(connfd);
+
+    if (conn_count == 0) {
+        printf("Peer left\n");
+        start_search(reactor);
+    }
 }
 
 
-void message_loop(int sockfd)
+/*
+ * Now, we'll use a different algorithm to find our peers on a LAN.
+ *
+ * We will try to connect to all the hosts in a given subnet on a given
+ * port, and chat with each one the connection is successful to.
+ *
+ * The connects are non-blocking, SCAN_CONNS of them in flight at a time on
+ * the event loop, so the listener keeps working while we search, and a host
+ * that doesn't answer costs CONNECT_TIMEOUT_MS of one slot instead of a full
+ * TCP connect timeout of the whole search.
+ */
+void connect_to_listener(struct reactor *reactor)
 {
-    char message[1024];
-    while (fgets(message, sizeof(message), stdin) &&
-            strncmp(message, END_SIGNAL, strlen(END_SIGNAL)) != 0) {
-        char *to_send = create_send_msg(message, user_name);
+    start_search(reactor);
+}
 
-        Writen(sockfd, to_send, strlen(to_send));
+static int searching;
+static struct scan *scan;
+static struct reactor_timer *retry_timer;
 
-        free(to_send);
+static void on_found(struct scan *scan, int connfd,
+                     const struct sockaddr_in *addr, void *arg)
+{
+    if (is_self(connfd) != 0) {
+        Close(connfd);
+        return;
     }
+
+    printf("Bound to %s\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+    add_conn(arg, connfd, addr);
 }
 
+static void on_retry(struct reactor *reactor, void *arg)
+{
+    retry_timer = NULL;
+    start_search(reactor);
+}
 
-int bind_listener(int);
+/* After a whole sweep without success, waits RETRY_MS before starting over. */
+static void on_scanned(struct scan *done, void *arg)
+{
+    struct reactor *reactor = arg;
+    struct scan_stats stats;
+    scan_get_stats(done, &stats);
+    printf("Scanned %u hosts in %llu ms: %lu listening\n", stats.hosts,
+           (unsigned long long) stats.elapsed_ms, stats.connected);
+
+    scan_free(done);
+    scan = NULL;
+
+    if (searching && conn_count == 0)
+        retry_timer = reactor_timer(reactor, RETRY_MS, 0, on_retry, NULL);
+    searching = 0;
+}
 
-void listener_task(int listen_port)
+static void start_search(struct reactor *reactor)
 {
-    int listenfd = bind_listener(listen_port);
+    /* Still going; it will find whoever is there. */
+    if (scan != NULL)
+        return;
+
+    searching = 1;
+    /* start_idx is a host number; the scan counts from the first host. */
+    if ( (scan = scan_start(reactor, subnet_address, start_idx - 1, CHAT_PORT,
+                            SCAN_CONNS, CONNECT_TIMEOUT_MS, on_found,
+                            on_scanned, reactor)) == NULL)
+        err_sys("scan_start error");
+}
 
-    while (1) {
-        int connfd = Accept(listenfd, (SA *) NULL, NULL);
+/*
+ * Connects in progress are left to finish: the peer may have accepted them
+ * already, and closing them would look like we left.
+ */
+static void stop_search(struct reactor *reactor)
+{
+    searching = 0;
 
-        // TODO: Put message parsing in function
-        char msg_len_hex[4];
-        while (read(connfd, msg_len_hex, sizeof(msg_len_hex)) > 0) {
-            unsigned int msg_len = hex_to_int(msg_len_hex);
-            msg_len -= 5;
-            char *message = malloc(msg_len);
+    if (scan != NULL)
+        scan_stop(scan);
+    reactor_cancel(reactor, retry_timer);
+    retry_timer = NULL;
+}
 
-            Readn(connfd, message, msg_len);
-            message[msg_len] = 0;
-            printf("%s\n", message);
 
-            free(message);
-        }
+/*
+ * The scan reaches our own address too. Both ends of that connection are
+ * ours; they have the same address. Returns -1 if the peer has already
+ * reset the connection (ENOTCONN), which is no use either.
+ */
+static int is_self(int connfd)
+{
+    struct sockaddr_in local, peer;
+    socklen_t local_len = sizeof(local), peer_len = sizeof(peer);
 
-        Close(connfd);
+    if (getsockname(connfd, (SA *) &local, &local_len) < 0 ||
+            getpeername(connfd, (SA *) &peer, &peer_len) < 0) {
+        err_ret("is_self error");
+        return -1;
     }
+
+    return sock_cmp_addr((SA *) &local, (SA *) &peer, local_len) == 0;
 }
 
-int find_peer(int sockfd)
+
+static void on_input(struct reactor*, int, int, void*);
+
+void message_loop(struct reactor *reactor)
 {
-    struct sockaddr_in servaddr;
-    bzero(&servaddr, sizeof(servaddr));
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(CHAT_PORT);
+    if (reactor_add(reactor, fileno(stdin), REACTOR_IN, on_input, NULL) < 0)
+        err_sys("reactor_add error");
 
-    /* Remove the last octet from the address */
-    char *dot = strrchr(subnet_address, '.');
-    dot[1] = 0;
+    reactor_run(reactor);
+}
 
-    int i = start_idx;
-    char try_address[strlen(subnet_address) + 4];
-    do {
-        snprintf(try_address, sizeof(try_address), "%s%d", subnet_address, i);
-        printf("Trying %s\n", try_address);
-        ++i;
+static void on_input(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char message[1024];
+    ssize_t n;
+    if ( (n = Read(fd, message, sizeof(message) - 1)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+    message[n] = 0;
 
-        Inet_pton(AF_INET, try_address, &servaddr.sin_addr);
-    } while (connect(sockfd, (SA *) &servaddr, sizeof(servaddr)) < 0);
+    if (strncmp(message, END_SIGNAL, strlen(END_SIGNAL)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
 
-    printf("Bound!\n");
+    if (conn_count == 0) {
+        err_msg("No peer yet");
+        return;
+    }
+
+    struct send_msg to_send;
+    create_send_msg(message, &to_send);
 
-    return -1;
+    struct msghdr hdr;
+    bzero(&hdr, sizeof(hdr));
+    hdr.msg_iov = to_send.iov;
+    hdr.msg_iovlen = to_send.iovcnt;
+
+    /*
+     * To every peer, on the last connection to it. One that has gone is
+     * dropped, without the SIGPIPE, and so is one that left its socket
+     * buffer full: half a message would garble the rest. remove_conn moves
+     * the last into its place, which is done with already.
+     */
+    int i, k;
+    for (i = conn_count - 1; i >= 0; --i) {
+        for (k = i + 1; k < conn_count; ++k) {
+            if (conn_hosts[k].s_addr == conn_hosts[i].s_addr)
+                break;
+        }
+        if (k < conn_count)
+            continue;
+        ssize_t sent = sendmsg(conns[i], &hdr, MSG_NOSIGNAL);
+        if (sent != (ssize_t) to_send.len) {
+            if (sent < 0)
+                err_ret("sendmsg error");
+            else
+                err_msg("peer too slow, dropped");
+            remove_conn(reactor, conns[i]);
+        }
+    }
 }
 
 
@@ -1,9 +1,20 @@
 /*
  * This version implements chatting with peers on the same subnet.
- * The subnet address is passed as an argument. The peer-finding algorithm is
- * the same as in lan_chat-v2, except that now we're using UDP.
+ * The subnet address is passed as an argument. Like lan_chat-v2, it looks
+ * for peers by asking every host of the subnet, except that now we're using
+ * UDP.
  *
- * Usage: lan_chat-v3 <subnet-address> <user-name> <start-idx>
+ * The whole subnet is swept at once: probes go out at a steady rate
+ * (P2P_SWEEP_PPS a second, SWEEP_PPS by default) and the answers are taken
+ * as they arrive, so a /24 is covered in a fraction of a second and everyone
+ * who answers becomes a peer. A subnet larger than a /24 can be given in
+ * CIDR notation.
+ *
+ * The listener, the sweep and the user input share one event loop in a
+ * single process, and one peer table: a peer that asks us for a chat gets
+ * our messages too.
+ *
+ * Usage: lan_chat-v3 <subnet-address>[/<prefix>] <user-name> <start-idx>
  */
 
 /*
@@ -22,188 +33,194 @@
 
 #define END_SIGNAL "am-end"
 
+#define SWEEP_PPS 2000      /* probes per second */
 
-struct sockaddr_in found_peer;
+
+/* Peer table shared by the receiving and the sending side */
+static struct peer_table *peers;
+static struct fanout_stats fanout;
 
 static char *subnet_address;
 static char *user_name;
 static int start_idx;
+static int sweep_pps = SWEEP_PPS;
 
 
-int spawn_listener(int);
-int connect_to_listener();
-void message_loop(int);
+void start_listener(struct reactor*, int);
+void connect_to_listener(struct reactor*);
+void message_loop(struct reactor*);
 
 int main(int argc, char **argv)
 {
     if (argc < 3)
-        err_quit("usage: lan_chat <subnet-address> <user-name> <start-idx>");
+        err_quit("usage: lan_chat <subnet-address>[/<prefix>] <user-name> <start-idx>");
 
     subnet_address = argv[1];
-    if (!inet_aton(subnet_address, NULL))
-        err_quit("The subnet address must be a valid IPv4 address");
+    uint32_t first, count;
+    if (sweep_parse(subnet_address, &first, &count) < 0)
+        err_quit("The subnet must be an IPv4 address, optionally with a /prefix");
 
     user_name = argv[2];
-    if (strlen(user_name) > 10)
-        err_quit("The user_name must be at most 10 characters");
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
+
+    peers = peer_table_create(0);
 
     start_idx = 80;
     if (argc == 4)
         start_idx = atoi(argv[3]);
-    
+
+    if (getenv("P2P_SWEEP_PPS") != NULL)
+        sweep_pps = atoi(getenv("P2P_SWEEP_PPS"));
+    if (sweep_pps < 1)
+        err_quit("P2P_SWEEP_PPS must be positive");
+
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+
     /*
-     * Spawns a listener process which accepts any connection and outputs each
-     * received message on the terminal.
+     * Receives messages on CHAT_PORT and outputs each of them on the
+     * terminal.
      */
-    int listenerpid = spawn_listener(CHAT_PORT);
+    start_listener(reactor, CHAT_PORT);
 
     /*
-     * Connects to a listener and waits for user input. On each new line input
-     * by user, creates a message according to the protocol and sends it over
-     * the socket.
+     * Looks for a listener and waits for user input. On each new line input
+     * by user, creates a message according to the protocol and sends it to
+     * the peers.
      */
-    int sockfd = connect_to_listener();
-    message_loop(sockfd);
+    connect_to_listener(reactor);
+    message_loop(reactor);
 
 
-    kill(listenerpid, SIGKILL);
+    reactor_free(reactor);
     exit(0);
 }
 
 
-void listener_task(int);
-
-int spawn_listener(int listen_port)
-{
-    int listenerpid;
-    if ( (listenerpid = Fork()) == 0 ) {
-        listener_task(listen_port);
-        exit(0);
-    }
-
-    return listenerpid;
-}
-
-
-struct sockaddr_in find_peer(int);
-
-int connect_to_listener()
-{
-    int sockfd;
-    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
-
-    /*
-     * Now, we'll use a different algorithm to find our peers on a LAN.
-     *
-     * We will iterate over all the hosts in a given subnet, try to connect to
-     * one on a given port, and if the connection is successful, start 
-     * chatting with them.
-     */
-    found_peer = find_peer(sockfd);
-
-    return sockfd;
-}
-
+int bind_listener(int);
+static void on_listen(struct reactor*, int, int, void*);
 
-void message_loop(int sockfd)
+void start_listener(struct reactor *reactor, int listen_port)
 {
-    char message[1024];
-    while (fgets(message, sizeof(message), stdin) &&
-            strncmp(message, END_SIGNAL, strlen(END_SIGNAL)) != 0) {
-        char *to_send = create_send_msg(message, user_name);
+    int listenfd = bind_listener(listen_port);
 
-        Sendto(sockfd, to_send, strlen(to_send), 0,
-            (SA *) &found_peer, sizeof(found_peer));
-
-        free(to_send);
-    }
+    if (reactor_add(reactor, listenfd, REACTOR_IN, on_listen, NULL) < 0)
+        err_sys("reactor_add error");
 }
 
-int bind_listener(int);
-
 /*
  * TODO: It's not an orthogonal design: If I modify some part of the code to
  *       send a protocol message, the response must be handled here.
  */
-void listener_task(int listen_port)
+static void on_listen(struct reactor *reactor, int listenfd, int events,
+                      void *arg)
 {
-    int listenfd;
     struct sockaddr_in peeraddr;
-    socklen_t peeraddr_len;
-
-    listenfd = bind_listener(listen_port);
-    peeraddr_len = sizeof(peeraddr);
-
-    while (1) {
-        char *message = 
-            recv_message(listenfd, (SA *) &peeraddr, &peeraddr_len);
+    socklen_t peeraddr_len = sizeof(peeraddr);
 
-        message += 4; /* Skip length */
+    char *buf = Msg_pool_get();
+    struct p2p_msg msg;
+    if (recv_message(listenfd, buf, MSG_POOL_BUFSIZE, &msg,
+                     (SA *) &peeraddr, &peeraddr_len) < 0) {
+        err_ret("recv_message error");
+    } else if (msg.op == P2P_OP_AUTH_CAN) {
+        printf("Received AUTH_CAN\n");
 
-        if (strncmp(message, AUTH_CAN, strlen(AUTH_CAN)) == 0) {
-            printf("Received AUTH_CAN\n");
+        auth_accept(listenfd, (SA *) &peeraddr, peeraddr_len);
 
-            auth_accept(listenfd, (SA *) &peeraddr, peeraddr_len);
+        printf("Sent auth accept\n");
 
-            printf("Sent auth accept\n");
-        } else {
-            printf("%s\n", message);
-        }
-
-        message -= 4; /* Unskip length */
-
-        free(message);
+        /* It asked from an ephemeral port; it listens on ours. */
+        peeraddr.sin_port = htons(CHAT_PORT);
+        peer_table_add(peers, &peeraddr);
+    } else if (msg.op == P2P_OP_CHAT) {
+        printf("%s\n", msg.body);
     }
+    msg_pool_put(buf);
 }
 
 
-static void update_try_address(char*, size_t, char*, int, struct sockaddr_in*);
+static void on_responder(struct sweep*, const struct sockaddr_in*, void*);
+static void on_swept(struct sweep*, void*);
+
+static int search_fd;
 
-struct sockaddr_in find_peer(int sockfd)
+/*
+ * Now, we'll use a different algorithm to find our peers on a LAN.
+ *
+ * We will ask all the hosts in a given subnet for a chat on a given port,
+ * and chat with every one of them that accepts.
+ *
+ * The sweep paces the requests and hands over the answers whenever they
+ * arrive; the user can type in the meantime.
+ */
+void connect_to_listener(struct reactor *reactor)
 {
-    struct timeval tv;
-    tv.tv_sec = 1;
-    tv.tv_usec = 0;
-    Setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    search_fd = Socket(AF_INET, SOCK_DGRAM, 0);
 
-    struct sockaddr_in servaddr;
-    socklen_t servaddr_len = sizeof(servaddr);
-    bzero(&servaddr, servaddr_len);
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(CHAT_PORT);
+    /* start_idx is a host number; the sweep counts from the first host. */
+    if (sweep_start(reactor, search_fd, subnet_address, start_idx - 1,
+                    CHAT_PORT, sweep_pps, on_responder, on_swept, NULL) == NULL)
+        err_sys("sweep_start error");
+}
 
-    /* Remove the last octet from the address */
-    char *dot = strrchr(subnet_address, '.');
-    dot[1] = 0;
+static void on_responder(struct sweep *sweep, const struct sockaddr_in *addr,
+                         void *arg)
+{
+    if (peer_table_add(peers, addr))
+        printf("Bound to %s\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+}
 
-    int i = start_idx;
-    char try_address[strlen(subnet_address) + 4];
-    int is_conn = 0;
-    do {
-        update_try_address(try_address, sizeof(try_address),
-            subnet_address, i, &servaddr);
-        printf("Trying %s\n", try_address);
+static void on_swept(struct sweep *sweep, void *arg)
+{
+    struct sweep_stats stats;
+    sweep_get_stats(sweep, &stats);
+    printf("Swept %u hosts in %llu ms: %d answered, %lu probes failed\n",
+           stats.hosts, (unsigned long long) stats.elapsed_ms,
+           stats.responders, stats.failed);
 
-        auth_request(sockfd, (SA *) &servaddr, servaddr_len);
-        printf("Sent auth request\n");
+    sweep_free(sweep);
+}
 
-        is_conn = auth_try_confirm(sockfd, (SA *) &servaddr, &servaddr_len);
 
-        ++i;
-    } while (!is_conn);
+static void on_input(struct reactor*, int, int, void*);
 
-    printf("Bound!\n");
+void message_loop(struct reactor *reactor)
+{
+    if (reactor_add(reactor, fileno(stdin), REACTOR_IN, on_input, NULL) < 0)
+        err_sys("reactor_add error");
 
-    return servaddr;
+    reactor_run(reactor);
 }
 
-static void update_try_address(char *try_address, size_t try_address_len,
-                               char *subnet_address, int host, 
-                               struct sockaddr_in *servaddr)
+static void on_input(struct reactor *reactor, int fd, int events, void *arg)
 {
-    snprintf(try_address, try_address_len, "%s%d", subnet_address, host);
+    char message[1024];
+    ssize_t n;
+    if ( (n = Read(fd, message, sizeof(message) - 1)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+    message[n] = 0;
+
+    if (strncmp(message, END_SIGNAL, strlen(END_SIGNAL)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+
+    if (peers->count == 0) {
+        err_msg("No peer yet");
+        return;
+    }
+
+    struct send_msg to_send;
+    create_send_msg(message, &to_send);
 
-    Inet_pton(AF_INET, try_address, &servaddr->sin_addr);
+    send_fanout_report(search_fd, to_send.iov, to_send.iovcnt, peers->addrs,
+                       peers->count, &fanout);
 }
 
 
@@ -4,10 +4,21 @@
  * responded with ``auth: OFC''. It then starts a group chat with them using
  * unicast UDP packets.
  *
- * It uses bind_address to disable self-reception of requests. This only works
- * for singlehomed hosts, though.
+ * With `all' for the broadcast address, it asks on every interface that can
+ * broadcast, each with its own socket, and tags each peer with the interface
+ * it was found on; the bind address is then ignored. Otherwise it asks on
+ * the interface with the bind address only. Requests from any of our own
+ * addresses are ignored.
  *
- * Usage: lan_chat-v4 <broadcast-address> <user-name> <bind-address>
+ * Messages go out to the whole peer table in one sendmmsg; set FANOUT_DEBUG
+ * in the environment to log every send.
+ *
+ * The peer table is saved to a cache file (P2P_PEER_CACHE, by default
+ * ~/.lan_chat-v4.peers) on exit. On startup the cached peers are asked
+ * directly, all at once, and the chat starts as soon as they answered;
+ * discovery goes on in the background, broadcast retries and all.
+ *
+ * Usage: lan_chat-v4 <broadcast-address>|all <user-name> <bind-address>
  */
 
 /*
@@ -16,42 +27,78 @@
 #include "../lib/unp.h"
 #include "../lib/p2p.h"
 
+#include <net/if.h>
+
 #define CHAT_PORT 11001
 
 #define CMD_END "am-end"
 #define CMD_FIND "am-find"
+#define CMD_STATS "am-stats"
 
-#define MAX_PEERS 255
+
+#define FIND_WINDOW_MS 5000 /* the longest discovery may take */
+#define FIND_QUIET_MS 20    /* the least it waits for more answers */
+#define FIND_RETRIES 1      /* times auth_request is repeated */
+#define PROBE_MS 250        /* how long cached peers have to answer */
 
 
 /* TODO: Pass by ref and make them local */
-static int peer_count;
-static struct sockaddr_in peers[MAX_PEERS];
+static struct peer_table *peers;
+static struct fanout_stats fanout;
 
 static char *user_name;
 static char *bind_addr;
 static char *broadcast_address;
+static char *cache_path;
+static int find_retries = FIND_RETRIES;
+
+static struct p2p_iface *ifaces;    /* the links we look for peers on */
+static int nifaces;
 
 
 int connect_to_listener();
 void message_loop(int);
+static char *default_cache_path(const char*);
 
 int main(int argc, char **argv)
 {
     if (argc < 4)
-        err_quit("usage: lan_chat <broadcast-address> <user-name> <bind-address>");
+        err_quit("usage: lan_chat <broadcast-address>|all <user-name> <bind-address>");
 
     broadcast_address = argv[1];
-    if (!inet_aton(broadcast_address, NULL))
-        err_quit("The broadcast address must be a valid IPv4 address");
+    if (strcmp(broadcast_address, "all") != 0 &&
+            !inet_aton(broadcast_address, NULL))
+        err_quit("The broadcast address must be a valid IPv4 address or `all'");
 
     user_name = argv[2];
-    if (strlen(user_name) > 10)
-        err_quit("The user_name must be at most 10 characters");
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
+
+    peers = peer_table_create(0);
 
     bind_addr = argv[3];
     if (!inet_aton(bind_addr, NULL))
         err_quit("The bind address must be a valid IPv4 address");
+
+    if (strcmp(broadcast_address, "all") == 0) {
+        nifaces = iface_select(IFF_BROADCAST, NULL, &ifaces);
+        if (nifaces == 0)
+            err_quit("No interface to broadcast on");
+    } else {
+        nifaces = iface_select(IFF_BROADCAST, bind_addr, &ifaces);
+        ifaces[0].brdaddr.sin_family = AF_INET;
+        Inet_pton(AF_INET, broadcast_address, &ifaces[0].brdaddr.sin_addr);
+    }
+
+    if (getenv("FANOUT_DEBUG") != NULL)
+        fanout_d_flag = 1;
+    if ( (cache_path = getenv("P2P_PEER_CACHE")) == NULL)
+        cache_path = default_cache_path(".lan_chat-v4.peers");
+    if (getenv("P2P_FIND_RETRIES") != NULL)
+        find_retries = atoi(getenv("P2P_FIND_RETRIES"));
+    if (find_retries < 0)
+        err_quit("P2P_FIND_RETRIES must not be negative");
    
     /*
      * Find a group of peers to which we can chat to.
@@ -68,6 +115,19 @@ int main(int argc, char **argv)
     exit(0);
 }
 
+/* `name' in the home directory, or in the current one without a HOME */
+static char *default_cache_path(const char *name)
+{
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return (char *) name;
+
+    char *path = Malloc(strlen(home) + strlen(name) + 2);
+    sprintf(path, "%s/%s", home, name);
+
+    return path;
+}
+
 
 void find_peer(int);
 
@@ -90,6 +150,11 @@ int connect_to_listener()
 
 
 int bind_listener(int);
+static void send_to_peers(int, const struct send_msg*);
+static void request_all(void);
+static void on_confirm(struct reactor*, int, int, void*);
+
+static struct reactor *loop;    /* discovery, which goes on during the chat */
 
 /* TODO: Too large; break into subfunctions */
 void message_loop(int sockfd)
@@ -101,158 +166,252 @@ void message_loop(int sockfd)
     listenfd = bind_listener(CHAT_PORT);
     peeraddr_len = sizeof(peeraddr);
 
+    char *buf = Msg_pool_get();
+
     fd_set rset;
-    int maxfd = listenfd;
+    int maxfd = max(listenfd, reactor_fd(loop));
     FD_ZERO(&rset);
 
     for ( ; ; ) {
         FD_SET(listenfd, &rset);
+        FD_SET(reactor_fd(loop), &rset);
         FD_SET(fileno(stdin), &rset);
         Select(maxfd + 1, &rset, NULL, NULL, NULL);
 
+        /* Late answers, and the retries of a window that's still open */
+        if (FD_ISSET(reactor_fd(loop), &rset))
+            reactor_once(loop, 0);
+
         if (FD_ISSET(listenfd, &rset)) { /* Received data */
             printf("Has data\n");
-            char *message = 
-                recv_message(listenfd, (SA *) &peeraddr, &peeraddr_len);
-
-            if (bind_addr && 
-                    strncmp(bind_addr,
-                            Sock_ntop((SA *) &peeraddr, sizeof(peeraddr)),
-                            strlen(bind_addr)) != 0) {
+            struct p2p_msg msg;
+            if (recv_message(listenfd, buf, MSG_POOL_BUFSIZE, &msg,
+                             (SA *) &peeraddr, &peeraddr_len) < 0) {
+                err_ret("recv_message error");
+            } else if (!iface_is_local(ifaces, nifaces, &peeraddr)) {
                 printf("Received data\n");
 
-                message += 4; /* Skip length */
-
-                if (strncmp(message, AUTH_CAN, strlen(AUTH_CAN)) == 0) {
+                if (msg.op == P2P_OP_AUTH_CAN) {
                     printf("Received AUTH_CAN\n");
 
                     auth_accept(listenfd, (const SA *) &peeraddr, peeraddr_len);
                     peeraddr.sin_port = htons(CHAT_PORT);
-                    peers[peer_count++] = peeraddr;
+                    peer_table_add_on(peers, &peeraddr,
+                            iface_index_of(ifaces, nifaces, &peeraddr));
 
                     printf("Sent auth accept\n");
-                } else {
-                    printf("%s\n", message);
+                } else if (msg.op == P2P_OP_CHAT) {
+                    printf("%s\n", msg.body);
                 }
-
-                message -= 4; /* Unskip length */
             }
-
-            free(message);
         }
 
         if (FD_ISSET(fileno(stdin), &rset)) { /* Collect input for sending */
             char message[1024];
+            ssize_t n;
             /* TODO: handle Read errors */
-            if (Read(fileno(stdin), message, sizeof(message))) {
+            if ( (n = Read(fileno(stdin), message, sizeof(message) - 1)) ) {
+                message[n] = 0;
                 if (strncmp(message, CMD_END, strlen(CMD_END)) == 0) {
                     break;
+                } else if (strncmp(message, CMD_STATS, strlen(CMD_STATS)) == 0) {
+                    fanout_print_stats(&fanout);
+                    msg_pool_print_stats();
+                    iface_print_peers(ifaces, nifaces, peers);
                 } else if (strncmp(message, CMD_FIND, strlen(CMD_FIND)) == 0) {
-                    struct sockaddr_in reqaddr;
-                    reqaddr.sin_family = AF_INET;
-                    reqaddr.sin_port = htons(CHAT_PORT);
-                    Inet_pton(AF_INET, broadcast_address, &reqaddr.sin_addr);
-
-                    socklen_t reqaddr_len = sizeof(reqaddr);
-
-                    auth_request(sockfd, (SA *) &reqaddr, reqaddr_len);
-                    const int is_confirm =
-                        auth_try_confirm(sockfd, (SA *) &reqaddr, &reqaddr_len);
-                    if (is_confirm > 0) {
-                        peers[peer_count++] = reqaddr;
-                    } else {
-                        err_sys("rcvfrom error");
-                    }
+                    /* The answers are taken at the top of the loop. */
+                    request_all();
                 } else {
-                    char *to_send = create_send_msg(message, user_name);
-
-                    int i;
-                    for (i = 0; i < peer_count; ++i) {
-                        printf("Sending to %s\n", Sock_ntop((SA *) &peers[i], sizeof(peers[i])));
-                        Sendto(sockfd, to_send, strlen(to_send), 0,
-                                (SA *) &peers[i], sizeof(peers[i]));
-                    }
+                    struct send_msg to_send;
+                    create_send_msg(message, &to_send);
 
-                    free(to_send);
+                    send_to_peers(sockfd, &to_send);
                 }
             }
         }
     }
+
+    msg_pool_put(buf);
+
+    if (peer_cache_save(cache_path, peers) < 0)
+        err_ret("can't save the peer cache to %s", cache_path);
+}
+
+
+/*
+ * Sends one message to the whole peer table with as few syscalls as possible
+ * and reports the peers it could not be delivered to.
+ */
+static void send_to_peers(int sockfd, const struct send_msg *to_send)
+{
+    send_fanout_report(sockfd, to_send->iov, to_send->iovcnt, peers->addrs,
+                       peers->count, &fanout);
 }
 
+static void finish_probe(struct reactor*, void*);
+static void finish_find(struct reactor*, void*);
+static void on_window(struct reactor*, void*);
 
-static void finish_find(int);
+static struct peer_table *cached;   /* cached peers yet to answer */
+static struct find_window *window;  /* while discovery is going */
+static int probing;                 /* cached peers may still answer */
+static int waiting;                 /* the chat hasn't started yet */
 
 void find_peer(int sockfd)
 {
-    struct sockaddr_in servaddr;
-    socklen_t servaddr_len = sizeof(servaddr);
-    bzero(&servaddr, servaddr_len);
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(CHAT_PORT);
-    Inet_pton(AF_INET, broadcast_address, &servaddr.sin_addr);
+    if ( (loop = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    if (reactor_add(loop, sockfd, REACTOR_IN, on_confirm, NULL) < 0)
+        err_sys("reactor_add error");
 
+    /*
+     * Every link gets a socket of its own, bound to our address there, so
+     * the broadcast leaves from the right source and the answers tell which
+     * link they came from. All of them are asked at once.
+     */
+    int i;
     const int on = 1;
-    Setsockopt(sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+    for (i = 0; i < nifaces; ++i) {
+        struct p2p_iface *iface = &ifaces[i];
+
+        iface->sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+        Setsockopt(iface->sockfd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        if (iface->index != 0) {
+            struct sockaddr_in addr = iface->addr;
+            addr.sin_port = 0;
+            Bind(iface->sockfd, (SA *) &addr, sizeof(addr));
+        }
+        if (reactor_add(loop, iface->sockfd, REACTOR_IN, on_confirm,
+                        iface) < 0)
+            err_sys("reactor_add error");
+    }
 
-    sigset_t sigset_alrm, sigset_empty;
-    fd_set rset;
-    Sigemptyset(&sigset_alrm);
-    Sigemptyset(&sigset_empty);
-    Sigaddset(&sigset_alrm, SIGALRM);
+    /*
+     * The peers we knew last time are asked directly, all in one go, so the
+     * chat can start as soon as they answered: within a round trip rather
+     * than after the discovery window.
+     */
+    cached = peer_table_create(0);
+    if (peer_cache_load(cache_path, cached) < 0 && errno != ENOENT)
+        err_ret("can't load the peer cache from %s", cache_path);
+    if (cached->count > 0) {
+        send_fanout(sockfd, auth_can_frame, P2P_HDRLEN, cached->addrs,
+                    cached->count, NULL, &fanout);
+        probing = 1;
+        reactor_timer(loop, PROBE_MS, 0, finish_probe, NULL);
+    }
 
-    Signal(SIGALRM, finish_find);
+    /*
+     * Send auth_request and gather the responses until they stop coming: the
+     * window closes once nobody new has answered for a few round trips, as
+     * measured on the answers so far, or after FIND_WINDOW_MS at the latest.
+     * On a quiet LAN that's tens of milliseconds instead of 5 seconds.
+     *
+     * The window runs on reactor timers rather than alarm(5), so there is no
+     * signal to race with the wait on the socket. If the cached peers start
+     * the chat first, message_loop keeps the reactor going, so the window
+     * still sees its retries out and later answers are still taken.
+     */
+    window = find_window_create(FIND_QUIET_MS, FIND_WINDOW_MS, find_retries);
+    request_all();
+    find_window_sent(window);
+    reactor_timer(loop, find_window_timeout(window), 0, on_window, NULL);
+
+    waiting = 1;
+    while (waiting)
+        reactor_once(loop, -1);
+
+    if (peers->count > 0) {
+        printf("Found %d peers\n", peers->count);
+        if (nifaces > 1)
+            iface_print_peers(ifaces, nifaces, peers);
+    } else {
+        printf("No one found\n");
+    }
+}
 
+/* Broadcasts auth_request on every link. */
+static void request_all(void)
+{
+    int i;
+
+    for (i = 0; i < nifaces; ++i) {
+        struct sockaddr_in reqaddr = ifaces[i].brdaddr;
+        reqaddr.sin_port = htons(CHAT_PORT);
+        auth_request(ifaces[i].sockfd, (SA *) &reqaddr, sizeof(reqaddr));
+    }
+}
+
+/*
+ * `arg' is the interface the socket is on, or NULL if it isn't on one in
+ * particular.
+ */
+static void on_confirm(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct p2p_iface *iface = arg;
     struct sockaddr_in peeraddr;
     socklen_t peeraddr_len = sizeof(peeraddr);
 
-    /*
-     * Send auth_request and gather all responses which were received in the
-     * next 5 seconds. These are the peers to which you can chat.
-     */
-    auth_request(sockfd, (const SA *) &servaddr, servaddr_len);
-
-    /* 
-     * Race condition scenario:
-     * 1. Start a peer; wait until it says that there are no peers.
-     * 2. Start another peer
-     * 3. The first peer should say that it has received AUTH_CAN
-     * 4. The second peer should not be able to do a thing
-     *
-     * Fixed with pselect
-     */
-    Sigprocmask(SIG_BLOCK, &sigset_alrm, NULL);
-    alarm(5);
-    for ( ; ; ) {
-        FD_SET(sockfd, &rset);
-        int n = pselect(sockfd + 1, &rset, NULL, NULL, NULL, &sigset_empty);
-        if (n < 0) {
-            if (errno == EINTR)
-                break;
-            else
-                err_sys("pselect error");
-        } else if (n != 1)
-            err_sys("pselect error: returned %d\n", n);
-
-        const int is_confirm = 
-            auth_try_confirm(sockfd, (SA *) &peeraddr, &peeraddr_len);
-        if (is_confirm > 0) {
-            /* Add the address to the array of peers */
-            peers[peer_count++] = peeraddr;
-        } else
-            err_sys("auth_try_confirm error");
+    const int is_confirm =
+        auth_try_confirm(fd, (SA *) &peeraddr, &peeraddr_len);
+    if (is_confirm <= 0) {
+        /* This socket stays open for the whole chat; don't die of noise. */
+        err_msg("unexpected datagram from %s",
+                Sock_ntop((SA *) &peeraddr, peeraddr_len));
+        return;
     }
 
-    if (peer_count > 0) {
-        printf("Found %d peers\n", peer_count);
-    } else {
-        printf("No one found\n");
+    /* Add the address to the array of peers */
+    const int is_new = peer_table_add_on(peers, &peeraddr, iface != NULL ?
+            iface->index : iface_index_of(ifaces, nifaces, &peeraddr));
+    if (window != NULL)
+        find_window_reply(window, is_new);
+
+    if (probing && peer_table_remove(cached, &peeraddr) == 0 &&
+            cached->count == 0)
+        finish_probe(reactor, NULL);
+}
+
+/*
+ * The cached peers had their chance. If any of them, or anyone else, has
+ * answered by now, that's enough to start with.
+ */
+static void finish_probe(struct reactor *reactor, void *arg)
+{
+    probing = 0;
+    if (peers->count > 0)
+        waiting = 0;
+}
+
+/* Repeats the request if it may have been missed, or ends discovery. */
+static void on_window(struct reactor *reactor, void *arg)
+{
+    switch (find_window_check(window)) {
+    case FIND_RETRY:
+        request_all();
+        find_window_sent(window);
+        break;
+    case FIND_DONE:
+        finish_find(reactor, NULL);
+        return;
     }
+
+    reactor_timer(reactor, find_window_timeout(window), 0, on_window, NULL);
 }
 
-static void finish_find(int signo)
+static void finish_find(struct reactor *reactor, void *arg)
 {
-    return;
+    if (fanout_d_flag)
+        find_window_print_stats(window);
+    find_window_free(window);
+    window = NULL;
+
+    if (!waiting)
+        printf("Discovery finished: %d peers\n", peers->count);
+    waiting = 0;
+    probing = 0;
+    peer_table_free(cached);
+    cached = NULL;
 }
 
 
@@ -11,13 +11,74 @@
  * Funny idea: use multicast addresses for group determination. This way we use
  * the Network layer to handle this for us. 
  *
- * Usage: lan_chat-v5 <multicast-address> <user-name> <bind-address>
+ * The sockets and stdin are served by an epoll reactor. Incoming datagrams
+ * are drained in batches with recvmmsg and outgoing ones go to the whole peer
+ * table in one sendmmsg; `am-stats' shows the counters. Set FANOUT_DEBUG in
+ * the environment to log every send.
+ *
+ * Set P2P_IO_URING in the environment to move the sockets to io_uring:
+ * multishot receives fill buffers the kernel takes from a ring we provide,
+ * and a message to the group is one batch of sendmsg requests. Kernels
+ * without the needed features fall back to the epoll path.
+ *
+ * Set P2P_WORKERS to a number of threads to shard chat receive across cores:
+ * each worker has its own SO_REUSEPORT socket on CHAT_PORT, so the kernel
+ * spreads peers between them, and hands the lines to print to this thread
+ * through a lock-free queue.
+ *
+ * Peers that stay silent for longer than a grace period are dropped from the
+ * table, so laptops that left stop costing a send per message. Any message
+ * counts as a sign of life; when we have sent nothing for a heartbeat
+ * interval, a heartbeat goes out instead, at the next tick of the heartbeat
+ * timer, so up to two intervals may pass between messages to a peer.
+ * P2P_HEARTBEAT_MS and P2P_PEER_GRACE_MS override the defaults; the grace
+ * period must be at least two intervals. A peer we dropped is taken back as
+ * soon as we hear from it again.
+ *
+ * The peer table is saved to a cache file (P2P_PEER_CACHE, by default
+ * ~/.lan_chat-v5.peers) now and then and on exit. On startup the cached
+ * peers are asked directly, all at once, and the chat starts as soon as they
+ * answered instead of after the whole discovery window; discovery goes on in
+ * the background.
+ *
+ * The group is joined and asked on the interface with the bind address, or
+ * with `all' for it, on every interface that can multicast, each with a
+ * socket of its own; peers are tagged with the interface they were found
+ * on, and `am-stats' counts them per interface. With `all', interfaces
+ * are also followed as they come and go, through rtnetlink: a new address
+ * is asked on at once, and a gone one is dropped.
+ *
+ * Set P2P_SWIM in the environment to keep the membership with SWIM (see
+ * swim.c) instead of heartbeats and everyone answering every request: each
+ * peer pings one other per period (P2P_SWIM_PERIOD_MS), asks a few others
+ * to try when there's no ack, and the news of who joined or failed travels
+ * piggybacked on the pings and the chat. A join request is answered by a
+ * few members at random, and the newcomer gets the member list from them.
+ * Not with P2P_WORKERS.
+ *
+ * Set P2P_RELIABLE in the environment to have chat messages delivered
+ * reliably and in order (see rudp.c): each peer acknowledges what it got,
+ * and what it didn't get is sent again after a timeout that follows that
+ * peer's round-trip time, all still over the one UDP socket. Heartbeats and
+ * membership traffic stay as they are. The timeout is at least 1 ms, or
+ * P2P_RTO_MIN_US microseconds. Not with P2P_WORKERS.
+ *
+ * Set P2P_PACE in the environment to pace what goes to the whole table
+ * (see pacer.c), so a message to a large room doesn't go out as one burst
+ * that overflows the socket buffers on either end: each interface sends at
+ * a rate of its own, which halves on a loss and climbs back while nothing
+ * is lost, and what is over the rate waits its turn on the reactor. With
+ * P2P_RELIABLE the losses are the ones the acks show. A positive number in
+ * it caps the rate, in Mbit/s. The sends then don't go through io_uring.
+ *
+ * Usage: lan_chat-v5 <multicast-address> <user-name> <bind-address>|all [<batch-size>]
  */
 
 /*
  * TODO:
  */
-#include "../lib/unp.h"
+#include "../lib/unpthread.h"
+#include "../lib/unpifi.h"
 #include "../lib/p2p.h"
 #include <net/if.h>
 
@@ -25,17 +86,50 @@
 
 #define CMD_END "am-end"
 #define CMD_FIND "am-find"
+#define CMD_STATS "am-stats"
+
+
+#define FIND_WINDOW_MS 5000 /* the longest discovery may take */
+#define FIND_QUIET_MS 20    /* the least it waits for more answers */
+#define FIND_RETRIES 1      /* times auth_request is repeated */
+#define PROBE_MS 250        /* how long cached peers have to answer */
+#define CACHE_SAVE_MS 60000
+
+#define HEARTBEAT_MS 5000
+#define GRACE_HEARTBEATS 3  /* default grace period, in heartbeats */
 
-#define MAX_PEERS 255
+#define SWIM_PERIOD_MS 1000
+#define JOIN_REPLIES 3      /* members that answer a join request, with SWIM */
+
+#define URING_NBUFS 64      /* receive buffers on the io_uring */
+
+#define MAX_WORKERS 64
+#define INBOX_SIZE 4096     /* lines queued for printing */
 
 
 /* TODO: Pass by ref and make them local */
-static int peer_count;
-static struct sockaddr_in peers[MAX_PEERS];
+static struct peer_table *peers;
+static struct fanout_stats fanout;
 
 static char *user_name;
 static char *bind_addr;
 static char *multicast_address;
+static char *cache_path;
+static int find_retries = FIND_RETRIES;
+
+static struct p2p_iface *ifaces;    /* the links we look for peers on */
+static int nifaces;
+static int batch_size = P2P_BATCH;
+static int use_uring;
+static int nworkers;
+static int heartbeat_ms = HEARTBEAT_MS;
+static int grace_ms;
+static int use_swim;
+static int swim_period_ms = SWIM_PERIOD_MS;
+static int use_reliable;
+static int rto_min_us;
+static int use_pace;
+static int pace_mbps;   /* 0: no cap but the pacer's */
 
 struct peer_pair {
     int listenfd;
@@ -45,23 +139,85 @@ struct peer_pair {
 
 int connect_to_listener();
 void message_loop(int);
+static char *default_cache_path(const char*);
 
 int main(int argc, char **argv)
 {
     if (argc < 4)
-        err_quit("usage: lan_chat <multicast-address> <user-name> <bind-address>");
+        err_quit("usage: lan_chat <multicast-address> <user-name> <bind-address>|all [<batch-size>]");
 
     multicast_address = argv[1];
     if (!inet_aton(multicast_address, NULL))
         err_quit("The multicast address must be a valid IPv4 address");
 
     user_name = argv[2];
-    if (strlen(user_name) > 10)
-        err_quit("The user_name must be at most 10 characters");
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
+
+    peers = peer_table_create(0);
 
     bind_addr = argv[3];
-    if (!inet_aton(bind_addr, NULL))
-        err_quit("The bind address must be a valid IPv4 address");
+    if (strcmp(bind_addr, "all") == 0) {
+        nifaces = iface_select(IFF_MULTICAST, NULL, &ifaces);
+        if (nifaces == 0)
+            err_quit("No interface to multicast on");
+    } else if (inet_aton(bind_addr, NULL)) {
+        nifaces = iface_select(IFF_MULTICAST, bind_addr, &ifaces);
+    } else {
+        err_quit("The bind address must be a valid IPv4 address or `all'");
+    }
+
+    if (argc == 5)
+        batch_size = atoi(argv[4]);
+    if (batch_size < 1)
+        err_quit("The batch size must be positive");
+
+    if (getenv("FANOUT_DEBUG") != NULL)
+        fanout_d_flag = 1;
+    if (getenv("P2P_IO_URING") != NULL)
+        use_uring = 1;
+    if (getenv("P2P_WORKERS") != NULL) {
+        nworkers = atoi(getenv("P2P_WORKERS"));
+        if (nworkers < 0 || nworkers > MAX_WORKERS)
+            err_quit("P2P_WORKERS must be between 0 and %d", MAX_WORKERS);
+    }
+    if (getenv("P2P_HEARTBEAT_MS") != NULL)
+        heartbeat_ms = atoi(getenv("P2P_HEARTBEAT_MS"));
+    if (heartbeat_ms < 1)
+        err_quit("P2P_HEARTBEAT_MS must be positive");
+    grace_ms = GRACE_HEARTBEATS * heartbeat_ms;
+    if (getenv("P2P_PEER_GRACE_MS") != NULL)
+        grace_ms = atoi(getenv("P2P_PEER_GRACE_MS"));
+    if (grace_ms < 2 * heartbeat_ms)
+        err_quit("P2P_PEER_GRACE_MS must be at least twice the heartbeat "
+                 "interval");
+    if ( (cache_path = getenv("P2P_PEER_CACHE")) == NULL)
+        cache_path = default_cache_path(".lan_chat-v5.peers");
+    if (getenv("P2P_FIND_RETRIES") != NULL)
+        find_retries = atoi(getenv("P2P_FIND_RETRIES"));
+    if (find_retries < 0)
+        err_quit("P2P_FIND_RETRIES must not be negative");
+    if (getenv("P2P_SWIM") != NULL)
+        use_swim = 1;
+    if (getenv("P2P_SWIM_PERIOD_MS") != NULL)
+        swim_period_ms = atoi(getenv("P2P_SWIM_PERIOD_MS"));
+    if (swim_period_ms < 1)
+        err_quit("P2P_SWIM_PERIOD_MS must be positive");
+    if (use_swim && nworkers > 0)
+        err_quit("P2P_SWIM doesn't go with P2P_WORKERS");
+    if (getenv("P2P_RELIABLE") != NULL)
+        use_reliable = 1;
+    if (use_reliable && nworkers > 0)
+        err_quit("P2P_RELIABLE doesn't go with P2P_WORKERS");
+    if (getenv("P2P_RTO_MIN_US") != NULL &&
+            (rto_min_us = atoi(getenv("P2P_RTO_MIN_US"))) < 1)
+        err_quit("P2P_RTO_MIN_US must be positive");
+    if (getenv("P2P_PACE") != NULL) {
+        use_pace = 1;
+        if ( (pace_mbps = atoi(getenv("P2P_PACE"))) < 0)
+            err_quit("P2P_PACE must not be negative");
+    }
    
     /*
      * Find a group of peers to which we can chat to.
@@ -78,6 +234,19 @@ int main(int argc, char **argv)
     exit(0);
 }
 
+/* `name' in the home directory, or in the current one without a HOME */
+static char *default_cache_path(const char *name)
+{
+    const char *home = getenv("HOME");
+    if (home == NULL)
+        return (char *) name;
+
+    char *path = Malloc(strlen(home) + strlen(name) + 2);
+    sprintf(path, "%s/%s", home, name);
+
+    return path;
+}
+
 
 void find_peer(int);
 
@@ -100,180 +269,891 @@ int connect_to_listener()
 
 
 struct peer_pair bind_listener(int);
+int bind_chat_socket(int, int);
+static void on_message(struct reactor*, int, int, void*);
+static void on_join(struct reactor*, int, int, void*);
+static void on_input(struct reactor*, int, int, void*);
+static void on_uring(struct reactor*, int, int, void*);
+static void handle_messages(int, struct msg_batch*);
+static void handle_joins(int, struct msg_batch*);
+static void handle_message(int, struct p2p_msg*, struct sockaddr_in*);
+static void heard_from(const struct sockaddr_in*);
+static void on_heartbeat(struct reactor*, void*);
+static void liveness_stats(void);
+static void on_confirm(struct reactor*, int, int, void*);
+static void save_cache(struct reactor*, void*);
+static void handle_join(int, struct p2p_msg*, struct sockaddr_in*);
+static void send_to_peers(int, const struct send_msg*);
+static void request_all(void);
+static void request_on(const struct p2p_iface*);
+static void start_workers(int);
+static void on_inbox(struct reactor*, int, int, void*);
+static void workers_stats(void);
+static void on_member(struct swim*, const struct sockaddr_in*, int, void*);
+static void send_reliably(const struct send_msg*);
+static void on_reliable(struct rudp*, struct p2p_msg*, const struct sockaddr_in*,
+                        void*);
+static void on_undelivered(struct rudp*, const struct sockaddr_in*, int, void*);
+
+static int sendfd;
+static struct reactor *loop;    /* discovery runs on it, then the chat */
+static struct peer_pair peer_socks;
+static int joined;                  /* peer_socks.joinfd is in the group */
+static struct msg_batch *msgs;
+static struct msg_batch *joins;
+static struct msg_uring *uring;
+static struct msg_queue *inbox;
+static struct swim *swim;
+static struct rudp *rudp;
+static struct pacer *pacer;
+static struct ifi_watch *ifwatch;   /* with "all" for the bind address */
+static int join_slot;       /* msg_uring_recv slot of joinfd */
+
+static uint64_t last_sent;  /* ms when we last sent to the whole table */
+static unsigned long heartbeats_sent;
+static unsigned long heartbeats_received;
+static unsigned long readmitted;
+
+/* Puts the sockets on the reactor, for when io_uring is not in use. */
+static void add_sockets(struct reactor *reactor)
+{
+    /* With workers, chat messages never reach this thread. */
+    if (peer_socks.listenfd >= 0 &&
+            reactor_add(reactor, peer_socks.listenfd, REACTOR_IN | REACTOR_ET,
+                        on_message, msgs) < 0)
+        err_sys("reactor_add error");
+    if (reactor_add(reactor, peer_socks.joinfd, REACTOR_IN | REACTOR_ET,
+                    on_join, joins) < 0)
+        err_sys("reactor_add error");
+}
 
-/* TODO: Too large; break into subfunctions */
+/*
+ * The listen, join and stdin descriptors are handled by callbacks on an
+ * epoll reactor. Adding another socket is one reactor_add, and a wakeup only
+ * costs as much as the number of ready descriptors.
+ */
 void message_loop(int sockfd)
 {
-    struct peer_pair peer_socks;
-    struct sockaddr_in peeraddr;
-    socklen_t peeraddr_len;
-
     peer_socks = bind_listener(CHAT_PORT);
-    peeraddr_len = sizeof(peeraddr);
+    sendfd = sockfd;
 
-    fd_set rset;
-    int maxfd = max(peer_socks.listenfd, peer_socks.joinfd);
-    FD_ZERO(&rset);
+    /*
+     * Each wakeup drains up to batch_size datagrams per socket with a single
+     * recvmmsg, instead of one recvfrom per select.
+     */
+    msgs = msg_batch_create(batch_size);
+    joins = msg_batch_create(batch_size);
+
+    /* Discovery left sendfd on it, to take late answers. */
+    struct reactor *reactor = loop;
+
+    if (use_uring) {
+        /* Receive buffers come from the ring, not from the batches. */
+        if ( (uring = msg_uring_create(URING_NBUFS, &fanout)) == NULL) {
+            err_ret("io_uring unavailable, using epoll");
+        } else if ((peer_socks.listenfd >= 0 &&
+                    msg_uring_recv(uring, peer_socks.listenfd) < 0) ||
+                   (join_slot = msg_uring_recv(uring, peer_socks.joinfd)) < 0) {
+            err_ret("msg_uring_recv error, using epoll");
+            msg_uring_free(uring);
+            uring = NULL;
+        }
+    }
 
-    for ( ; ; ) {
-        FD_SET(peer_socks.listenfd, &rset);
-        FD_SET(peer_socks.joinfd, &rset);
-        FD_SET(fileno(stdin), &rset);
-        Select(maxfd + 1, &rset, NULL, NULL, NULL);
+    if (uring != NULL) {
+        if (reactor_add(reactor, msg_uring_fd(uring), REACTOR_IN,
+                        on_uring, NULL) < 0)
+            err_sys("reactor_add error");
+    } else {
+        add_sockets(reactor);
+    }
 
-        /* TODO: The length skipping *will* lead to a buffer overrun */
-        if (FD_ISSET(peer_socks.listenfd, &rset)) { /* Received message */
-            printf("Has data\n");
-            char *message = 
-                recv_message(peer_socks.listenfd, (SA *) &peeraddr, &peeraddr_len);
+    if (nworkers > 0) {
+        start_workers(CHAT_PORT);
+        if (reactor_add(reactor, msg_queue_fd(inbox), REACTOR_IN,
+                        on_inbox, NULL) < 0)
+            err_sys("reactor_add error");
+    }
 
-            printf("Received data\n");
+    if (reactor_add(reactor, fileno(stdin), REACTOR_IN, on_input, NULL) < 0)
+        err_sys("reactor_add error");
+
+    int i;
+    if (use_swim) {
+        /*
+         * Pings come in on listenfd, and acks and member lists on sendfd,
+         * like the late answers to discovery.
+         */
+        swim = swim_create(reactor, sendfd, CHAT_PORT, swim_period_ms,
+                           on_member, NULL);
+        for (i = 0; i < nifaces; ++i)
+            swim_add_self(swim, &ifaces[i].addr);
+        for (i = 0; i < peers->count; ++i)
+            swim_add(swim, &peers->addrs[i]);
+        /* The ones that answered know the rest. */
+        for (i = 0; i < min(peers->count, JOIN_REPLIES); ++i)
+            swim_sync(swim, &peers->addrs[random() % peers->count]);
+    } else {
+        /* Discovery took a while; the grace period starts now. */
+        for (i = 0; i < peers->count; ++i)
+            peer_table_touch(peers, &peers->addrs[i]);
 
-            message += 4; /* Skip length */
+        last_sent = now_ms();
+        reactor_timer(reactor, heartbeat_ms, 1, on_heartbeat, NULL);
+    }
+    /*
+     * Data comes in on listenfd and is acknowledged from there; the acks
+     * for ours come in on sendfd.
+     */
+    if (use_pace)
+        pacer = pacer_create(reactor, sendfd, pace_mbps * 125000LL);
+    if (use_reliable) {
+        rudp = rudp_create(reactor, sendfd, on_reliable, on_undelivered, NULL);
+        rudp_set_rto(rudp, (int64_t) rto_min_us * 1000, 0);
+        if (pacer != NULL)
+            rudp_set_pacer(rudp, pacer);
+    }
+    reactor_timer(reactor, CACHE_SAVE_MS, 1, save_cache, NULL);
+
+    reactor_run(reactor);
+    save_cache(reactor, NULL);
+
+    if (rudp != NULL)
+        rudp_free(rudp);
+    if (pacer != NULL)
+        pacer_free(pacer);
+    if (swim != NULL)
+        swim_free(swim);
+    if (ifwatch != NULL)
+        ifi_watch_free(ifwatch);
+    reactor_free(reactor);
+    if (uring != NULL)
+        msg_uring_free(uring);
+    msg_batch_free(msgs);
+    msg_batch_free(joins);
+}
 
-            printf("%s\n", message);
+/* Received messages; edge-triggered, so drain the socket. */
+static void on_message(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct msg_batch *b = arg;
+    int n;
+    do {
+        if ( (n = recv_batch(fd, b)) < 0) {
+            err_ret("recv_batch error");
+            return;
+        }
+        handle_messages(fd, b);
+    } while (n == b->cap);
+}
+
+/* Received join requests */
+static void on_join(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct msg_batch *b = arg;
+    int n;
+    do {
+        if ( (n = recv_batch(fd, b)) < 0) {
+            err_ret("recv_batch error");
+            return;
+        }
+        handle_joins(fd, b);
+    } while (n == b->cap);
+}
+
+static void uring_recv(int slot, struct p2p_msg *msg,
+                       struct sockaddr_in *peeraddr, void *arg)
+{
+    if (slot == join_slot)
+        handle_join(peer_socks.joinfd, msg, peeraddr);
+    else
+        handle_message(peer_socks.listenfd, msg, peeraddr);
+}
 
-            message -= 4; /* Unskip length */
+/*
+ * Completions on the io_uring. If receiving fails before anything ever
+ * arrived, the kernel can't do multishot recvmsg; go back to epoll.
+ */
+static void on_uring(struct reactor *reactor, int fd, int events, void *arg)
+{
+    if (msg_uring_process(uring, uring_recv, NULL) >= 0)
+        return;
+
+    err_ret("io_uring receive failed, using epoll");
+    reactor_del(reactor, fd);
+    msg_uring_free(uring);
+    uring = NULL;
 
-            free(message);
+    add_sockets(reactor);
+}
+
+/* Collect input for sending */
+static void on_input(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char message[1024];
+    ssize_t n;
+    /* TODO: handle Read errors */
+    if ( (n = Read(fd, message, sizeof(message) - 1)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+    message[n] = 0;
+
+    if (strncmp(message, CMD_END, strlen(CMD_END)) == 0) {
+        reactor_stop(reactor);
+    } else if (strncmp(message, CMD_STATS, strlen(CMD_STATS)) == 0) {
+        batch_stats(msgs, "messages");
+        batch_stats(joins, "joins");
+        if (uring != NULL)
+            msg_uring_print_stats(uring);
+        fanout_print_stats(&fanout);
+        liveness_stats();
+        if (swim != NULL)
+            swim_print_stats(swim);
+        if (rudp != NULL)
+            rudp_print_stats(rudp);
+        if (pacer != NULL)
+            pacer_print_stats(pacer);
+        iface_print_peers(ifaces, nifaces, peers);
+        if (nworkers > 0)
+            workers_stats();
+        msg_pool_print_stats();
+    } else if (strncmp(message, CMD_FIND, strlen(CMD_FIND)) == 0) {
+        /* The answers come in through on_confirm. */
+        request_all();
+    } else {
+        struct send_msg to_send;
+        create_send_msg(message, &to_send);
+        if (swim != NULL)
+            swim_piggyback(swim, &to_send);
+
+        if (rudp != NULL)
+            send_reliably(&to_send);
+        else
+            send_to_peers(sendfd, &to_send);
+    }
+}
+
+static void handle_messages(int listenfd, struct msg_batch *msgs)
+{
+    int i, shown = 0;
+    for (i = 0; i < msgs->count; ++i) {
+        struct p2p_msg msg;
+        struct sockaddr_in *peeraddr;
+        if (batch_message(msgs, i, &msg, &peeraddr) < 0) {
+            err_ret("batch_message error");
+            continue;
         }
 
-        if (FD_ISSET(peer_socks.joinfd, &rset)) { /* Received join request */
-            char *message = 
-                recv_message(peer_socks.joinfd, (SA *) &peeraddr, &peeraddr_len);
+        /* Heartbeats alone aren't worth a line. */
+        if ((msg.op == P2P_OP_CHAT || msg.op == P2P_OP_RUDP_DATA) && !shown++)
+            printf("Has data: %d datagrams\n", msgs->count);
+        handle_message(listenfd, &msg, peeraddr);
+    }
+}
 
-            message += 4; /* Skip length */
+static void handle_joins(int joinfd, struct msg_batch *joins)
+{
+    int i;
+    for (i = 0; i < joins->count; ++i) {
+        struct p2p_msg msg;
+        struct sockaddr_in *peeraddr;
+        if (batch_message(joins, i, &msg, &peeraddr) < 0)
+            err_ret("batch_message error");
+        else
+            handle_join(joinfd, &msg, peeraddr);
+    }
+}
 
-            /* TODO: This won't work. We'll just multicast our message back
-             *       to all the peers.
-             */
-            if (strncmp(message, AUTH_CAN, strlen(AUTH_CAN)) == 0) {
-                printf("Received AUTH_CAN\n");
+/*
+ * Messages to CHAT_PORT. Besides chat and heartbeats, there are join requests
+ * from restarted peers probing their cache; they are answered on `replyfd'.
+ * With SWIM, there are pings too, and gossip on the chat.
+ */
+static void handle_message(int replyfd, struct p2p_msg *msg,
+                           struct sockaddr_in *peeraddr)
+{
+    if (rudp != NULL && rudp_handle(rudp, replyfd, msg, peeraddr))
+        return;
+    if (swim != NULL && swim_handle(swim, msg, peeraddr))
+        return;
+
+    if (msg->op == P2P_OP_CHAT) {
+        heard_from(peeraddr);
+        printf("%s\n", msg->body);
+    } else if (msg->op == P2P_OP_HEARTBEAT) {
+        heard_from(peeraddr);
+        heartbeats_received++;
+    } else if (msg->op == P2P_OP_AUTH_CAN) {
+        handle_join(replyfd, msg, peeraddr);
+    }
+}
+
+/*
+ * Chat and heartbeats come from the peer's sending socket; the table has it
+ * under CHAT_PORT.
+ */
+static void heard_from(const struct sockaddr_in *peeraddr)
+{
+    struct sockaddr_in addr = *peeraddr;
+    addr.sin_port = htons(CHAT_PORT);
+
+    /* SWIM knows who's alive; someone new to it is a member now. */
+    if (swim != NULL) {
+        if (swim_add(swim, &addr))
+            readmitted++;
+        return;
+    }
 
-                auth_accept(peer_socks.joinfd, (const SA *) &peeraddr, peeraddr_len);
-                peeraddr.sin_port = htons(CHAT_PORT);
-                peers[peer_count++] = peeraddr;
+    if (peer_table_touch(peers, &addr) < 0) {
+        peer_table_add_on(peers, &addr, iface_index_of(ifaces, nifaces, &addr));
+        readmitted++;
+    }
+}
 
-                printf("Sent auth accept\n");
-            }
+static void on_expired(const struct sockaddr_in *addr, void *arg)
+{
+    printf("Peer %s timed out\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+}
+
+/* The peer table follows the SWIM membership. */
+static void on_member(struct swim *s, const struct sockaddr_in *addr,
+                      int event, void *arg)
+{
+    switch (event) {
+    case SWIM_JOIN:
+        peer_table_add_on(peers, addr, iface_index_of(ifaces, nifaces, addr));
+        break;
+    case SWIM_LEAVE:
+        printf("Peer %s failed\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+        peer_table_remove(peers, addr);
+        break;
+    case SWIM_SUSPECT:
+        if (fanout_d_flag)
+            printf("Peer %s suspected\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+        break;
+    case SWIM_ALIVE:
+        if (fanout_d_flag)
+            printf("Peer %s alive\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+        break;
+    }
+}
+
+/*
+ * Runs every heartbeat interval. A message to the group already told every
+ * peer we're alive, so a heartbeat only goes out after a quiet interval.
+ */
+static void on_heartbeat(struct reactor *reactor, void *arg)
+{
+    uint64_t now = now_ms();
+
+    if (now - last_sent >= (uint64_t) heartbeat_ms && peers->count > 0) {
+        struct send_msg beat;
+        beat.iov[0].iov_base = (void *) heartbeat_frame;
+        beat.iov[0].iov_len = P2P_HDRLEN;
+        beat.iovcnt = 1;
+        beat.len = P2P_HDRLEN;
+
+        heartbeats_sent += peers->count;
+        send_to_peers(sendfd, &beat);
+    }
+
+    if (now > (uint64_t) grace_ms)
+        peer_table_expire(peers, now - grace_ms, on_expired, NULL);
+}
+
+static void liveness_stats(void)
+{
+    printf("peers: %d live, %lu expired, %lu readmitted\n",
+           peers->count, peers->expired, readmitted);
+    printf("heartbeats: %lu sent, %lu received\n",
+           heartbeats_sent, heartbeats_received);
+}
+
+/*
+ * A negative `replyfd' means the request was already answered. With SWIM,
+ * a request to the group is answered by about JOIN_REPLIES of its members,
+ * so a newcomer doesn't get an answer from everyone; a unicast one, from a
+ * peer probing its cache, always is.
+ */
+static void handle_join(int replyfd, struct p2p_msg *msg,
+                        struct sockaddr_in *peeraddr)
+{
+    /* TODO: This won't work. We'll just multicast our message back
+     *       to all the peers.
+     */
+    if (msg->op != P2P_OP_AUTH_CAN)
+        return;
+    if (iface_is_local(ifaces, nifaces, peeraddr))
+        return;     /* our own request, looped back */
+
+    printf("Received AUTH_CAN\n");
+
+    if (swim != NULL && replyfd == peer_socks.joinfd &&
+            random() % (swim_members(swim)->count + 1) >= JOIN_REPLIES)
+        replyfd = -1;
+    if (replyfd >= 0) {
+        auth_accept(replyfd, (const SA *) peeraddr, sizeof(*peeraddr));
+        printf("Sent auth accept\n");
+    }
+    peeraddr->sin_port = htons(CHAT_PORT);
+    if (swim != NULL)
+        swim_add(swim, peeraddr);
+    else
+        peer_table_add_on(peers, peeraddr,
+                          iface_index_of(ifaces, nifaces, peeraddr));
+}
+
+static void save_cache(struct reactor *reactor, void *arg)
+{
+    if (peer_cache_save(cache_path, peers) < 0)
+        err_ret("can't save the peer cache to %s", cache_path);
+}
+
+
+/*
+ * Sends one message to the whole peer table with as few syscalls as possible,
+ * or hands it to the pacer, and reports the peers it could not be delivered
+ * to.
+ */
+static void send_to_peers(int sockfd, const struct send_msg *to_send)
+{
+    last_sent = now_ms();
+
+    /* The pacer sends on the socket it was made for, sendfd. */
+    if (pacer != NULL) {
+        int dropped = pacer_fanout(pacer, to_send->iov, to_send->iovcnt,
+                                   peers->addrs, peers->iface, peers->count);
+        if (dropped > 0)
+            err_msg("%d sends dropped: too many wait to be paced", dropped);
+        return;
+    }
+
+    /* Failures are reported as the sends complete. */
+    if (uring != NULL) {
+        if (msg_uring_fanout(uring, sockfd, to_send->iov, to_send->iovcnt,
+                             peers->addrs, peers->count) < 0)
+            err_ret("msg_uring_fanout error");
+        return;
+    }
+
+    send_fanout_report(sockfd, to_send->iov, to_send->iovcnt, peers->addrs,
+                       peers->count, &fanout);
+}
+
+
+/* Queued for each peer, to be sent again until it's acknowledged. */
+static void send_reliably(const struct send_msg *to_send)
+{
+    int refused;
+
+    last_sent = now_ms();
+    if ( (refused = rudp_fanout(rudp, to_send->iov, to_send->iovcnt,
+                                peers->addrs, peers->iface,
+                                peers->count)) < 0)
+        err_ret("rudp_fanout error");
+    else if (refused > 0)
+        err_msg("%d peers are too far behind to take more", refused);
+}
+
+/* What came inside a DATA frame is handled like any other message. */
+static void on_reliable(struct rudp *r, struct p2p_msg *msg,
+                        const struct sockaddr_in *from, void *arg)
+{
+    struct sockaddr_in peeraddr = *from;
+
+    handle_message(peer_socks.listenfd, msg, &peeraddr);
+}
+
+static void on_undelivered(struct rudp *r, const struct sockaddr_in *to,
+                           int lost, void *arg)
+{
+    printf("%d messages to %s were not delivered\n", lost,
+           Sock_ntop((SA *) to, sizeof(*to)));
+}
+
+/*
+ * A worker receives chat messages on its own SO_REUSEPORT socket, with its
+ * own reactor, and queues what it got for the terminal thread, which owns
+ * the peer table: the lines to print and who sent them. Join requests are
+ * answered right away and queued too.
+ */
+struct inbox_item {
+    struct sockaddr_in   from;
+    int                  op;
+    char                 line[];    /* empty for heartbeats */
+};
 
-            message -= 4; /* Unskip length */
+#define INBOX_MAXLINE (MSG_POOL_BUFSIZE - sizeof(struct inbox_item) - 1)
+
+/* The counters are read by the terminal thread, hence atomic. */
+struct worker {
+    pthread_t           tid;
+    int                 sockfd;
+    struct msg_batch   *batch;
+    unsigned long       queued;
+    unsigned long       received;
+    unsigned long       wakeups;
+};
 
-            free(message);
+static struct worker workers[MAX_WORKERS];
+
+static void on_worker_message(struct reactor *reactor, int fd, int events,
+                              void *arg)
+{
+    struct worker *w = arg;
+    int n;
+    do {
+        if ( (n = recv_batch(fd, w->batch)) < 0) {
+            err_ret("recv_batch error");
+            return;
+        }
+        if (n > 0) {
+            __atomic_add_fetch(&w->received, n, __ATOMIC_RELAXED);
+            __atomic_add_fetch(&w->wakeups, 1, __ATOMIC_RELAXED);
         }
 
-        if (FD_ISSET(fileno(stdin), &rset)) { /* Collect input for sending */
-            char message[1024];
-            /* TODO: handle Read errors */
-            if (Read(fileno(stdin), message, sizeof(message))) {
-                if (strncmp(message, CMD_END, strlen(CMD_END)) == 0) {
-                    break;
-                } else if (strncmp(message, CMD_FIND, strlen(CMD_FIND)) == 0) {
-                    struct sockaddr_in reqaddr;
-                    reqaddr.sin_family = AF_INET;
-                    reqaddr.sin_port = htons(CHAT_PORT);
-                    Inet_pton(AF_INET, multicast_address, &reqaddr.sin_addr);
-
-                    socklen_t reqaddr_len = sizeof(reqaddr);
-
-                    auth_request(sockfd, (SA *) &reqaddr, reqaddr_len);
-                    const int is_confirm =
-                        auth_try_confirm(sockfd, (SA *) &reqaddr, &reqaddr_len);
-                    if (is_confirm > 0) {
-                        peers[peer_count++] = reqaddr;
-                    } else {
-                        err_sys("rcvfrom error");
-                    }
-                } else {
-                    char *to_send = create_send_msg(message, user_name);
-
-                    int i;
-                    for (i = 0; i < peer_count; ++i) {
-                        printf("Sending to %s\n", Sock_ntop((SA *) &peers[i], sizeof(peers[i])));
-                        Sendto(sockfd, to_send, strlen(to_send), 0,
-                                (SA *) &peers[i], sizeof(peers[i]));
-                    }
-
-                    free(to_send);
-                }
+        int i;
+        for (i = 0; i < n; ++i) {
+            struct p2p_msg msg;
+            struct sockaddr_in *peeraddr;
+            if (batch_message(w->batch, i, &msg, &peeraddr) < 0) {
+                err_ret("batch_message error");
+                continue;
             }
+            if (msg.op == P2P_OP_AUTH_CAN)
+                auth_accept(fd, (const SA *) peeraddr, sizeof(*peeraddr));
+            else if (msg.op != P2P_OP_CHAT && msg.op != P2P_OP_HEARTBEAT)
+                continue;
+
+            /* The batch buffer is reused, so the line gets its own. */
+            struct inbox_item *item;
+            if ( (item = msg_pool_get()) == NULL)
+                continue;
+            item->from = *peeraddr;
+            item->op = msg.op;
+            size_t len = min(msg.len, INBOX_MAXLINE);
+            memcpy(item->line, msg.body, len);
+            item->line[len] = 0;
+            if (msg_queue_push(inbox, item) < 0)
+                msg_pool_put(item);
+            else
+                __atomic_add_fetch(&w->queued, 1, __ATOMIC_RELAXED);
         }
-    }
+    } while (n == w->batch->cap);
 }
 
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct reactor *reactor;
 
-static void finish_find(int);
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    if (reactor_add(reactor, w->sockfd, REACTOR_IN | REACTOR_ET,
+                    on_worker_message, w) < 0)
+        err_sys("reactor_add error");
 
-void find_peer(int sockfd)
+    /* Runs until the process exits. */
+    reactor_run(reactor);
+
+    return NULL;
+}
+
+static void start_workers(int listen_port)
 {
-    struct sockaddr_in servaddr;
-    socklen_t servaddr_len = sizeof(servaddr);
-    bzero(&servaddr, servaddr_len);
-    servaddr.sin_family = AF_INET;
-    servaddr.sin_port = htons(CHAT_PORT);
-    Inet_pton(AF_INET, multicast_address, &servaddr.sin_addr);
+    if ( (inbox = msg_queue_create(INBOX_SIZE)) == NULL)
+        err_sys("msg_queue_create error");
+
+    int i;
+    for (i = 0; i < nworkers; ++i) {
+        workers[i].sockfd = bind_chat_socket(listen_port, 1);
+        workers[i].batch = msg_batch_create(batch_size);
+        Pthread_create(&workers[i].tid, NULL, worker_main, &workers[i]);
+    }
+}
 
-    sigset_t sigset_alrm, sigset_empty;
-    fd_set rset;
-    Sigemptyset(&sigset_alrm);
-    Sigemptyset(&sigset_empty);
-    Sigaddset(&sigset_alrm, SIGALRM);
+/* Messages queued by the workers */
+static void on_inbox(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct inbox_item *item;
+    do {
+        while ( (item = msg_queue_pop(inbox)) != NULL) {
+            struct p2p_msg msg;
+            msg.op = item->op;
+            msg.flags = 0;
+            msg.body = item->line;
+            msg.len = strlen(item->line);
+            msg.gossip = NULL;
+            msg.gossip_len = 0;
+            handle_message(-1, &msg, &item->from);
+            msg_pool_put(item);
+        }
+    } while (msg_queue_sleep(inbox));
+}
 
-    Signal(SIGALRM, finish_find);
+static void workers_stats(void)
+{
+    struct msg_queue_stats stats;
+    int i;
+
+    for (i = 0; i < nworkers; ++i)
+        printf("worker %d: %lu messages queued, %lu datagrams in %lu wakeups\n",
+               i, __atomic_load_n(&workers[i].queued, __ATOMIC_RELAXED),
+               __atomic_load_n(&workers[i].received, __ATOMIC_RELAXED),
+               __atomic_load_n(&workers[i].wakeups, __ATOMIC_RELAXED));
+
+    msg_queue_get_stats(inbox, &stats);
+    printf("inbox: %lu messages handled, %lu dropped, %lu wakeups\n",
+           stats.popped, stats.dropped, stats.wakeups);
+}
 
-    struct sockaddr_in peeraddr;
-    socklen_t peeraddr_len = sizeof(peeraddr);
+static void finish_probe(struct reactor*, void*);
+static void finish_find(struct reactor*, void*);
+static void on_window(struct reactor*, void*);
+static void open_iface(struct p2p_iface*);
+static void on_ifchange(struct ifi_watch*, int, const struct ifi_info*, void*);
+int join_multicast(int, const SA*, const struct p2p_iface*);
+
+static struct peer_table *cached;   /* cached peers yet to answer */
+static struct find_window *window;  /* while discovery is going */
+static int probing;                 /* cached peers may still answer */
+static int waiting;                 /* the chat hasn't started yet */
+
+void find_peer(int sockfd)
+{
+    if ( (loop = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    if (reactor_add(loop, sockfd, REACTOR_IN, on_confirm, NULL) < 0)
+        err_sys("reactor_add error");
+
+    int i;
+    for (i = 0; i < nifaces; ++i)
+        open_iface(&ifaces[i]);
 
     /*
-     * Send auth_request and gather all responses which were received in the
-     * next 5 seconds. These are the peers to which you can chat.
+     * Rather than looking again every now and then, we're told when an
+     * address comes or goes.
      */
-    auth_request(sockfd, (const SA *) &servaddr, servaddr_len);
-
-    /* 
-     * Race condition scenario:
-     * 1. Start a peer; wait until it says that there are no peers.
-     * 2. Start another peer
-     * 3. The first peer should say that it has received AUTH_CAN
-     * 4. The second peer should not be able to do a thing
-     *
-     * Fixed with pselect
+    if (strcmp(bind_addr, "all") == 0 &&
+            (ifwatch = ifi_watch_create(loop, AF_INET, 0, on_ifchange,
+                                        NULL)) == NULL)
+        err_ret("can't watch the interfaces");
+
+    /*
+     * The peers we knew last time are asked directly, all in one go, so the
+     * chat can start as soon as they answered: within a round trip rather
+     * than after the discovery window.
      */
-    Sigprocmask(SIG_BLOCK, &sigset_alrm, NULL);
-    alarm(5);
-    for ( ; ; ) {
-        FD_SET(sockfd, &rset);
-        int n = pselect(sockfd + 1, &rset, NULL, NULL, NULL, &sigset_empty);
-        if (n < 0) {
-            if (errno == EINTR)
-                break;
-            else
-                err_sys("pselect error");
-        } else if (n != 1)
-            err_sys("pselect error: returned %d\n", n);
-
-        const int is_confirm = 
-            auth_try_confirm(sockfd, (SA *) &peeraddr, &peeraddr_len);
-        if (is_confirm > 0) {
-            /* Add the address to the array of peers */
-            peers[peer_count++] = peeraddr;
-        } else
-            err_sys("auth_try_confirm error");
+    cached = peer_table_create(0);
+    if (peer_cache_load(cache_path, cached) < 0 && errno != ENOENT)
+        err_ret("can't load the peer cache from %s", cache_path);
+    if (cached->count > 0) {
+        send_fanout(sockfd, auth_can_frame, P2P_HDRLEN, cached->addrs,
+                    cached->count, NULL, &fanout);
+        probing = 1;
+        reactor_timer(loop, PROBE_MS, 0, finish_probe, NULL);
     }
 
-    if (peer_count > 0) {
-        printf("Found %d peers\n", peer_count);
+    /*
+     * Send auth_request and gather the responses until they stop coming: the
+     * window closes once nobody new has answered for a few round trips, as
+     * measured on the answers so far, or after FIND_WINDOW_MS at the latest.
+     * On a quiet LAN that's tens of milliseconds instead of 5 seconds.
+     *
+     * The window runs on reactor timers rather than alarm(5), so there is no
+     * signal to race with the wait on the socket. Answers that come in after
+     * the chat started are still taken.
+     */
+    window = find_window_create(FIND_QUIET_MS, FIND_WINDOW_MS, find_retries);
+    request_all();
+    find_window_sent(window);
+    reactor_timer(loop, find_window_timeout(window), 0, on_window, NULL);
+
+    waiting = 1;
+    while (waiting)
+        reactor_once(loop, -1);
+
+    if (peers->count > 0) {
+        printf("Found %d peers\n", peers->count);
+        if (nifaces > 1)
+            iface_print_peers(ifaces, nifaces, peers);
     } else {
         printf("No one found\n");
     }
 }
 
-static void finish_find(int signo)
+/*
+ * Every link gets a socket of its own, sending to the group out of that
+ * interface from our address there, so the answers tell which link they
+ * came from.
+ */
+static void open_iface(struct p2p_iface *iface)
 {
-    return;
+    iface->sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    if (iface->index != 0) {
+        struct sockaddr_in addr = iface->addr;
+        addr.sin_port = 0;
+        Bind(iface->sockfd, (SA *) &addr, sizeof(addr));
+        Setsockopt(iface->sockfd, IPPROTO_IP, IP_MULTICAST_IF,
+                   &iface->addr.sin_addr, sizeof(iface->addr.sin_addr));
+    }
+
+    /* By index, as the array moves when interfaces come and go. */
+    if (reactor_add(loop, iface->sockfd, REACTOR_IN, on_confirm,
+                    (void *) (intptr_t) iface->index) < 0)
+        err_sys("reactor_add error");
+}
+
+static void group_addr(struct sockaddr_in *addr, int port)
+{
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    Inet_pton(AF_INET, multicast_address, &addr->sin_addr);
+}
+
+/* Sends auth_request to the group on `iface'. */
+static void request_on(const struct p2p_iface *iface)
+{
+    struct sockaddr_in reqaddr;
+    group_addr(&reqaddr, CHAT_PORT);
+
+    auth_request(iface->sockfd, (SA *) &reqaddr, sizeof(reqaddr));
+}
+
+/* Sends auth_request to the group on every link. */
+static void request_all(void)
+{
+    int i;
+
+    for (i = 0; i < nifaces; ++i)
+        request_on(&ifaces[i]);
+}
+
+/*
+ * An address that can multicast came or went. A new one is set up like the
+ * ones we started with and asked at once; the answers come in through
+ * on_confirm. The peers found on a gone one are left to expire.
+ */
+static void on_ifchange(struct ifi_watch *w, int event,
+                        const struct ifi_info *ifi, void *arg)
+{
+    if ((ifi->ifi_flags & IFF_LOOPBACK) || (ifi->ifi_flags & IFF_MULTICAST) == 0)
+        return;
+
+    int pos = iface_find(ifaces, nifaces, ifi);
+    const char *addr = Sock_ntop_host(ifi->ifi_addr, sizeof(struct sockaddr_in));
+
+    if (event == IFI_ADDED && pos < 0) {
+        printf("%s (%s) is up, looking for peers there\n", ifi->ifi_name, addr);
+
+        struct p2p_iface *iface = iface_add(&ifaces, &nifaces, ifi);
+        open_iface(iface);
+        if (joined) {
+            struct sockaddr_in grp;
+            group_addr(&grp, CHAT_PORT);
+            /* Already in, if the link went away and came back. */
+            if (join_multicast(peer_socks.joinfd, (SA *) &grp, iface) < 0 &&
+                    errno != EADDRINUSE)
+                err_ret("mcast_join error on %s", iface->name);
+        }
+        request_on(iface);
+    } else if (event == IFI_DELETED && pos >= 0) {
+        printf("%s (%s) is gone\n", ifi->ifi_name, addr);
+
+        reactor_del(loop, ifaces[pos].sockfd);
+        close(ifaces[pos].sockfd);
+        iface_remove(ifaces, &nifaces, pos);
+    }
+}
+
+/*
+ * `arg' is the index of the interface the socket is on, or 0 for the sending
+ * socket, which with SWIM also gets the acks and member lists.
+ */
+static void on_confirm(struct reactor *reactor, int fd, int events, void *arg)
+{
+    const int ifindex = (intptr_t) arg;
+    struct sockaddr_in peeraddr;
+    socklen_t peeraddr_len = sizeof(peeraddr);
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+
+    if (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &peeraddr,
+                     &peeraddr_len) < 0) {
+        /* This socket stays open for the whole chat; don't die of noise. */
+        err_ret("recv_message error");
+        return;
+    }
+    if (rudp != NULL && rudp_handle(rudp, fd, &msg, &peeraddr))
+        return;
+    if (swim != NULL && swim_handle(swim, &msg, &peeraddr))
+        return;
+    if (msg.op != P2P_OP_AUTH_OFC) {
+        err_msg("unexpected datagram from %s",
+                Sock_ntop((SA *) &peeraddr, peeraddr_len));
+        return;
+    }
+
+    /* Add the address to the array of peers */
+    const int is_new = peer_table_add_on(peers, &peeraddr, ifindex != 0 ?
+            ifindex : iface_index_of(ifaces, nifaces, &peeraddr));
+    if (window != NULL)
+        find_window_reply(window, is_new);
+    /* A late answer: it knows the members we may not. */
+    if (swim != NULL && swim_add(swim, &peeraddr))
+        swim_sync(swim, &peeraddr);
+
+    if (probing && peer_table_remove(cached, &peeraddr) == 0 &&
+            cached->count == 0)
+        finish_probe(reactor, NULL);
+}
+
+/*
+ * The cached peers had their chance. If any of them, or anyone else, has
+ * answered by now, that's enough to start with.
+ */
+static void finish_probe(struct reactor *reactor, void *arg)
+{
+    probing = 0;
+    if (peers->count > 0)
+        waiting = 0;
 }
 
-int join_multicast(int sockfd, const SA *grp)
+/* Repeats the request if it may have been missed, or ends discovery. */
+static void on_window(struct reactor *reactor, void *arg)
+{
+    switch (find_window_check(window)) {
+    case FIND_RETRY:
+        request_all();
+        find_window_sent(window);
+        break;
+    case FIND_DONE:
+        finish_find(reactor, NULL);
+        return;
+    }
+
+    reactor_timer(reactor, find_window_timeout(window), 0, on_window, NULL);
+}
+
+static void finish_find(struct reactor *reactor, void *arg)
+{
+    if (fanout_d_flag)
+        find_window_print_stats(window);
+    find_window_free(window);
+    window = NULL;
+
+    if (!waiting)
+        printf("Discovery finished: %d peers\n", peers->count);
+    waiting = 0;
+    probing = 0;
+    peer_table_free(cached);
+    cached = NULL;
+}
+
+/* Joins `grp' on `iface', or where the routing table says if it's not known. */
+int join_multicast(int sockfd, const SA *grp, const struct p2p_iface *iface)
 {
     struct ip_mreq mreq;
 
@@ -281,22 +1161,29 @@ int join_multicast(int sockfd, const SA *grp)
            &((const struct sockaddr_in *) grp)->sin_addr,
            sizeof(struct in_addr));
 
-    mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+    if (iface->index != 0)
+        mreq.imr_interface = iface->addr.sin_addr;
+    else
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
 
     return setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
                       &mreq, sizeof(mreq));
 }
 
-struct peer_pair bind_listener(int listen_port)
+/*
+ * Creates a socket on which we'll receive messages. Sockets bound with
+ * `reuseport' set form a group the kernel spreads datagrams over, by a hash
+ * of the sender's address.
+ */
+int bind_chat_socket(int listen_port, int reuseport)
 {
-    struct peer_pair res;
-
-    /* Create socket on which we'll receive messages */
-    res.listenfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    int sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
 
     int opt = 1;
-    Setsockopt(res.listenfd, SOL_SOCKET, SO_REUSEADDR,
+    Setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR,
         (const char*)&opt, sizeof(opt));
+    if (reuseport)
+        Setsockopt(sockfd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
 
     struct sockaddr_in servaddr;
     bzero(&servaddr, sizeof(servaddr));
@@ -304,12 +1191,25 @@ struct peer_pair bind_listener(int listen_port)
     servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
     servaddr.sin_port = htons(listen_port);
 
-    Bind(res.listenfd, (SA *) &servaddr, sizeof(servaddr));
+    Bind(sockfd, (SA *) &servaddr, sizeof(servaddr));
+
+    return sockfd;
+}
+
+struct peer_pair bind_listener(int listen_port)
+{
+    struct peer_pair res;
+
+    /* With workers, each of them binds its own socket instead. */
+    if (nworkers > 0)
+        res.listenfd = -1;
+    else
+        res.listenfd = bind_chat_socket(listen_port, 0);
 
     /* Create socket on which we'll listen for joins */
     res.joinfd = Socket(AF_INET, SOCK_DGRAM, 0);
 
-    opt = 1;
+    int opt = 1;
     Setsockopt(res.joinfd, SOL_SOCKET, SO_REUSEADDR,
         (const char*)&opt, sizeof(opt));
 
@@ -321,8 +1221,12 @@ struct peer_pair bind_listener(int listen_port)
 
     Bind(res.joinfd, (SA *) &multiaddr, sizeof(multiaddr));
 
-    if (join_multicast(res.joinfd, (SA *) &multiaddr) < 0) 
-        err_sys("mcast_join error");
+    int i;
+    for (i = 0; i < nifaces; ++i) {
+        if (join_multicast(res.joinfd, (SA *) &multiaddr, &ifaces[i]) < 0)
+            err_sys("mcast_join error on %s", ifaces[i].name);
+    }
+    joined = 1;
 
     return res;
 }
@@ -0,0 +1,212 @@
+/*
+ * This version finds peers by their user name through a Kademlia DHT (see
+ * kad.c) instead of asking the whole LAN, so it works wherever the nodes can
+ * reach each other, not just on one link.
+ *
+ * On startup the node joins the DHT through the nodes given on the command
+ * line and stores its address under the hash of its user name; it stores it
+ * again every REPUBLISH_MS, as stored values expire. `am-find <name>' looks
+ * the name up and adds whoever has it to the peers; anyone we get a message
+ * from is added too, so they can answer. Messages go to all the peers.
+ *
+ * The DHT and the chat share one UDP socket on the bind address, which must
+ * be one the other nodes can reach us at.
+ *
+ * Usage: lan_chat-v6 <user-name> <bind-address>[:port] [<node-address>[:port] ...]
+ */
+
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define KAD_PORT 11002
+
+#define CMD_END "am-end"
+#define CMD_FIND "am-find"
+#define CMD_STATS "am-stats"
+
+#define REPUBLISH_MS (20 * 60 * 1000)
+
+
+static struct peer_table *peers;
+static struct fanout_stats fanout;
+
+static char *user_name;
+static struct sockaddr_in self;
+static struct kad *kad;
+static int sockfd;
+
+static void on_socket(struct reactor*, int, int, void*);
+static void on_input(struct reactor*, int, int, void*);
+static void on_joined(struct kad*, const struct kad_result*, void*);
+static void publish(struct reactor*, void*);
+static void send_to_peers(const struct send_msg*);
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        err_quit("usage: lan_chat-v6 <user-name> <bind-address>[:port] [<node-address>[:port] ...]");
+
+    user_name = argv[1];
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
+
+    if (addr_parse(argv[2], KAD_PORT, &self) < 0)
+        err_quit("%s is not a valid IPv4 address and port", argv[2]);
+    if (self.sin_addr.s_addr == htonl(INADDR_ANY))
+        err_quit("The bind address must be one the others can reach");
+
+    int i, nnodes = argc - 3;
+    struct sockaddr_in *nodes = Calloc(max(nnodes, 1), sizeof(*nodes));
+    for (i = 0; i < nnodes; ++i) {
+        if (addr_parse(argv[3 + i], KAD_PORT, &nodes[i]) < 0)
+            err_quit("%s is not a valid IPv4 address and port", argv[3 + i]);
+    }
+
+    if (getenv("FANOUT_DEBUG") != NULL)
+        fanout_d_flag = 1;
+
+    peers = peer_table_create(0);
+    srandom(getpid() ^ now_ms());
+
+    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    Bind(sockfd, (SA *) &self, sizeof(self));
+
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    if (reactor_add(reactor, sockfd, REACTOR_IN, on_socket, NULL) < 0)
+        err_sys("reactor_add error");
+    if (reactor_add(reactor, fileno(stdin), REACTOR_IN, on_input, NULL) < 0)
+        err_sys("reactor_add error");
+
+    kad = kad_create(reactor, sockfd, &self);
+    kad_join(kad, nodes, nnodes, on_joined, reactor);
+    free(nodes);
+
+    reactor_run(reactor);
+
+    kad_free(kad);
+    reactor_free(reactor);
+
+    exit(0);
+}
+
+static void on_joined(struct kad *k, const struct kad_result *res, void *arg)
+{
+    struct reactor *reactor = arg;
+
+    if (res->nclosest > 0)
+        printf("Joined the DHT: %d nodes near us, %d hops, %llu ms\n",
+               res->nclosest, res->hops, (unsigned long long) res->elapsed_ms);
+    else
+        printf("No one to join; waiting for others to join us\n");
+
+    publish(reactor, NULL);
+    reactor_timer(reactor, REPUBLISH_MS, 1, publish, NULL);
+}
+
+static void on_published(struct kad *k, const struct kad_result *res, void *arg)
+{
+    if (fanout_d_flag)
+        printf("Stored our address on %d nodes\n", res->nclosest);
+}
+
+/* Our address goes under the hash of our name. */
+static void publish(struct reactor *reactor, void *arg)
+{
+    uint8_t key[KAD_ID_LEN];
+    char value[6];
+
+    kad_key(user_name, key);
+    memcpy(value, &self.sin_addr.s_addr, 4);
+    memcpy(value + 4, &self.sin_port, 2);
+    kad_store(kad, key, value, sizeof(value), on_published, NULL);
+}
+
+static void on_found(struct kad *k, const struct kad_result *res, void *arg)
+{
+    char *name = arg;
+
+    if (!res->found || res->len != 6) {
+        printf("No one is called %s\n", name);
+    } else {
+        struct sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        memcpy(&addr.sin_addr.s_addr, res->value, 4);
+        memcpy(&addr.sin_port, (const char *) res->value + 4, 2);
+
+        peer_table_add(peers, &addr);
+        printf("Found %s at %s (%d hops, %d queries, %llu ms)\n", name,
+               Sock_ntop((SA *) &addr, sizeof(addr)), res->hops, res->rpcs,
+               (unsigned long long) res->elapsed_ms);
+    }
+
+    free(name);
+}
+
+/* The DHT and the chat come in on the same socket. */
+static void on_socket(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+    struct sockaddr_in peeraddr;
+    socklen_t len = sizeof(peeraddr);
+
+    if (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &peeraddr, &len) < 0) {
+        err_ret("recv_message error");
+        return;
+    }
+    if (kad_handle(kad, &msg, &peeraddr))
+        return;
+
+    if (msg.op == P2P_OP_CHAT) {
+        peer_table_add(peers, &peeraddr);
+        printf("%s\n", msg.body);
+    }
+}
+
+/* Collect input for sending */
+static void on_input(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char message[1024];
+    ssize_t n;
+    if ( (n = Read(fd, message, sizeof(message) - 1)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+    message[n] = 0;
+
+    if (strncmp(message, CMD_END, strlen(CMD_END)) == 0) {
+        reactor_stop(reactor);
+    } else if (strncmp(message, CMD_STATS, strlen(CMD_STATS)) == 0) {
+        printf("peers: %d\n", peers->count);
+        kad_print_stats(kad);
+        fanout_print_stats(&fanout);
+    } else if (strncmp(message, CMD_FIND, strlen(CMD_FIND)) == 0) {
+        char *name = message + strlen(CMD_FIND);
+        name += strspn(name, " \t");
+        name[strcspn(name, " \t\r\n")] = 0;
+        if (*name == 0) {
+            printf("usage: %s <user-name>\n", CMD_FIND);
+            return;
+        }
+
+        uint8_t key[KAD_ID_LEN];
+        kad_key(name, key);
+        kad_find_value(kad, key, on_found, strdup(name));
+    } else {
+        struct send_msg to_send;
+        create_send_msg(message, &to_send);
+
+        send_to_peers(&to_send);
+    }
+}
+
+/* Sends one message to the whole peer table. */
+static void send_to_peers(const struct send_msg *to_send)
+{
+    send_fanout_report(sockfd, to_send->iov, to_send->iovcnt, peers->addrs,
+                       peers->count, &fanout);
+}
@@ -0,0 +1,223 @@
+/*
+ * This version finds peers by their user name by flooding the question
+ * through an overlay of neighbors, as Gnutella does (see flood.c), so it
+ * reaches past the nodes we know, and past the LAN.
+ *
+ * The neighbors are the nodes given on the command line and whoever greets
+ * us, up to MAX_NEIGHBORS. Neighbors greet each other with a heartbeat every
+ * HEARTBEAT_MS and are dropped after GRACE_HEARTBEATS of silence.
+ * `am-find <name>' floods a query for the name FLOOD_TTL hops out; the node
+ * with that name answers us directly and becomes a peer. Anyone we get a
+ * message from becomes one too, so they can answer. Messages go to all the
+ * peers.
+ *
+ * The overlay and the chat share one UDP socket on the bind address, which
+ * must be one the other nodes can reach us at.
+ *
+ * Usage: lan_chat-v7 <user-name> <bind-address>[:port] [<neighbor-address>[:port] ...]
+ */
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define FLOOD_PORT 11004
+
+#define CMD_END "am-end"
+#define CMD_FIND "am-find"
+#define CMD_STATS "am-stats"
+
+#define MAX_NEIGHBORS 8
+#define HEARTBEAT_MS 10000
+#define GRACE_HEARTBEATS 3
+
+
+static struct peer_table *peers;
+static struct peer_table *neighbors;
+static struct fanout_stats fanout;
+
+static char *user_name;
+static struct sockaddr_in self;
+static struct flood *flood;
+static int sockfd;
+
+static uint64_t find_id;        /* of our last am-find */
+static char find_name[P2P_MAXNAME + 1];
+
+static void on_socket(struct reactor*, int, int, void*);
+static void on_input(struct reactor*, int, int, void*);
+static void on_query(struct flood*, const struct flood_query*, void*);
+static void on_hit(struct flood*, uint64_t, const char*, size_t,
+                   const struct sockaddr_in*, void*);
+static void heartbeat(struct reactor*, void*);
+static void send_to_peers(const struct send_msg*);
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+        err_quit("usage: lan_chat-v7 <user-name> <bind-address>[:port] [<neighbor-address>[:port] ...]");
+
+    user_name = argv[1];
+    if (strlen(user_name) > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
+    send_msg_init(user_name);
+
+    if (addr_parse(argv[2], FLOOD_PORT, &self) < 0)
+        err_quit("%s is not a valid IPv4 address and port", argv[2]);
+    if (self.sin_addr.s_addr == htonl(INADDR_ANY))
+        err_quit("The bind address must be one the others can reach");
+
+    if (getenv("FANOUT_DEBUG") != NULL)
+        fanout_d_flag = 1;
+
+    peers = peer_table_create(0);
+    neighbors = peer_table_create(MAX_NEIGHBORS);
+    srandom(getpid() ^ now_ms());
+
+    int i;
+    for (i = 3; i < argc && neighbors->count < MAX_NEIGHBORS; ++i) {
+        struct sockaddr_in addr;
+        if (addr_parse(argv[i], FLOOD_PORT, &addr) < 0)
+            err_quit("%s is not a valid IPv4 address and port", argv[i]);
+        peer_table_add(neighbors, &addr);
+    }
+
+    sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    Bind(sockfd, (SA *) &self, sizeof(self));
+
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    if (reactor_add(reactor, sockfd, REACTOR_IN, on_socket, NULL) < 0)
+        err_sys("reactor_add error");
+    if (reactor_add(reactor, fileno(stdin), REACTOR_IN, on_input, NULL) < 0)
+        err_sys("reactor_add error");
+
+    flood = flood_create(reactor, sockfd, &self, neighbors, on_query, on_hit,
+                         NULL);
+    heartbeat(reactor, NULL);
+    reactor_timer(reactor, HEARTBEAT_MS, 1, heartbeat, NULL);
+
+    reactor_run(reactor);
+
+    flood_free(flood);
+    reactor_free(reactor);
+
+    exit(0);
+}
+
+static void on_neighbor_lost(const struct sockaddr_in *addr, void *arg)
+{
+    printf("Neighbor %s is gone\n", Sock_ntop((SA *) addr, sizeof(*addr)));
+}
+
+/* Greets the neighbors, and drops those that stopped greeting us. */
+static void heartbeat(struct reactor *reactor, void *arg)
+{
+    peer_table_expire(neighbors, now_ms() - GRACE_HEARTBEATS * HEARTBEAT_MS,
+                      on_neighbor_lost, NULL);
+    send_fanout(sockfd, heartbeat_frame, sizeof(heartbeat_frame),
+                neighbors->addrs, neighbors->count, NULL, &fanout);
+}
+
+/* A heartbeat makes its sender a neighbor, while there is room. */
+static void on_heartbeat(const struct sockaddr_in *from)
+{
+    if (peer_table_touch(neighbors, from) >= 0 ||
+            neighbors->count >= MAX_NEIGHBORS)
+        return;
+
+    peer_table_add(neighbors, from);
+    printf("New neighbor %s\n", Sock_ntop((SA *) from, sizeof(*from)));
+    /* Greeted back at once, so it knows we took it. */
+    Sendto(sockfd, heartbeat_frame, sizeof(heartbeat_frame), 0,
+           (const SA *) from, sizeof(*from));
+}
+
+/* We answer for our own name. */
+static void on_query(struct flood *f, const struct flood_query *q, void *arg)
+{
+    if (strcmp(q->payload, user_name) == 0)
+        flood_hit(f, q, user_name, strlen(user_name));
+}
+
+static void on_hit(struct flood *f, uint64_t id, const char *payload,
+                   size_t len, const struct sockaddr_in *from, void *arg)
+{
+    if (id != find_id || strcmp(payload, find_name) != 0)
+        return;
+
+    if (peer_table_add(peers, from))
+        printf("Found %s at %s\n", find_name,
+               Sock_ntop((SA *) from, sizeof(*from)));
+}
+
+/* The overlay and the chat come in on the same socket. */
+static void on_socket(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+    struct sockaddr_in peeraddr;
+    socklen_t len = sizeof(peeraddr);
+
+    if (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &peeraddr, &len) < 0) {
+        err_ret("recv_message error");
+        return;
+    }
+    if (flood_handle(flood, &msg, &peeraddr)) {
+        peer_table_touch(neighbors, &peeraddr);
+        return;
+    }
+
+    if (msg.op == P2P_OP_HEARTBEAT) {
+        on_heartbeat(&peeraddr);
+    } else if (msg.op == P2P_OP_CHAT) {
+        peer_table_add(peers, &peeraddr);
+        printf("%s\n", msg.body);
+    }
+}
+
+/* Collect input for sending */
+static void on_input(struct reactor *reactor, int fd, int events, void *arg)
+{
+    char message[1024];
+    ssize_t n;
+    if ( (n = Read(fd, message, sizeof(message) - 1)) == 0) {
+        reactor_stop(reactor);
+        return;
+    }
+    message[n] = 0;
+
+    if (strncmp(message, CMD_END, strlen(CMD_END)) == 0) {
+        reactor_stop(reactor);
+    } else if (strncmp(message, CMD_STATS, strlen(CMD_STATS)) == 0) {
+        printf("peers: %d, neighbors: %d\n", peers->count, neighbors->count);
+        flood_print_stats(flood);
+        fanout_print_stats(&fanout);
+    } else if (strncmp(message, CMD_FIND, strlen(CMD_FIND)) == 0) {
+        char *name = message + strlen(CMD_FIND);
+        name += strspn(name, " \t");
+        name[strcspn(name, " \t\r\n")] = 0;
+        if (*name == 0 || strlen(name) > P2P_MAXNAME) {
+            printf("usage: %s <user-name>\n", CMD_FIND);
+            return;
+        }
+        if (neighbors->count == 0) {
+            printf("No neighbors to ask\n");
+            return;
+        }
+
+        strcpy(find_name, name);
+        find_id = flood_query(flood, name, strlen(name), FLOOD_TTL);
+    } else {
+        struct send_msg to_send;
+        create_send_msg(message, &to_send);
+
+        send_to_peers(&to_send);
+    }
+}
+
+/* Sends one message to the whole peer table. */
+static void send_to_peers(const struct send_msg *to_send)
+{
+    send_fanout_report(sockfd, to_send->iov, to_send->iovcnt, peers->addrs,
+                       peers->count, &fanout);
+}
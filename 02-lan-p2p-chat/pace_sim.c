@@ -0,0 +1,221 @@
+/*
+ * Fans reliable messages (see rudp.c) out from one sender to `receivers'
+ * receivers on the loopback, each with its own socket, all on one reactor,
+ * first straight from the sender's socket and then through a pacer (see
+ * pacer.c). Each receiver's SO_RCVBUF is `rcvbuf' bytes, small, like that
+ * of a busy host that doesn't read often, so that a burst overflows it.
+ *
+ * The sender sends `messages' numbered messages to every receiver, as fast
+ * as the queues take them, to one receiver after the other, and each
+ * receiver checks that they come in order. For both runs it prints how long
+ * it took, the messages delivered a second, the DATA frames and ACKs lost
+ * on the way, and what was resent.
+ *
+ * Usage: pace_sim <receivers> [<messages> [<rcvbuf>]]
+ */
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define QUIET_MS    10000   /* give up when nothing comes this long */
+
+
+struct node {
+    struct rudp        *rudp;
+    int                 sockfd;
+    struct sockaddr_in  addr;
+    int                 sent;       /* the sender: next number to it */
+    int                 expect;     /* next number from the sender */
+};
+
+static struct reactor *reactor;
+static struct node sender;
+static struct node *nodes;
+static int nnodes;
+static int nmessages = 1000;
+static int rcvbuf = 4096;
+
+static unsigned long wrong, delivered, missing;
+
+static void on_deliver(struct rudp *r, struct p2p_msg *msg,
+                       const struct sockaddr_in *from, void *arg)
+{
+    struct node *n = arg;
+    int k = msg->op == P2P_OP_CHAT ? atoi(msg->body) : -1;
+
+    if (k < n->expect) {
+        if (wrong++ < 10)
+            err_msg("got \"%s\", wanted %d", msg->body, n->expect);
+        return;
+    }
+    missing += k - n->expect;
+    n->expect = k + 1;
+    delivered++;
+}
+
+static void on_node(struct reactor *r, int fd, int events, void *arg)
+{
+    struct node *n = arg;
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+
+    while (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &from, &len) >= 0) {
+        len = sizeof(from);
+        rudp_handle(n->rudp, fd, &msg, &from);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        err_ret("recv_message error");
+}
+
+static void node_open(struct node *n, int size)
+{
+    socklen_t len = sizeof(n->addr);
+
+    bzero(n, sizeof(*n));
+    n->sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+    if (size > 0)
+        Setsockopt(n->sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    n->addr.sin_family = AF_INET;
+    n->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    Bind(n->sockfd, (SA *) &n->addr, sizeof(n->addr));
+    Getsockname(n->sockfd, (SA *) &n->addr, &len);
+    Fcntl(n->sockfd, F_SETFL, Fcntl(n->sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+    n->rudp = rudp_create(reactor, n->sockfd, on_deliver, NULL, n);
+    if (reactor_add(reactor, n->sockfd, REACTOR_IN, on_node, n) < 0)
+        err_sys("reactor_add error");
+}
+
+static void node_close(struct node *n)
+{
+    reactor_del(reactor, n->sockfd);
+    rudp_free(n->rudp);
+    Close(n->sockfd);
+}
+
+/*
+ * Queues what the queues take, a message to each receiver in turn, as a
+ * message to a room would go; returns 1 once everything is queued.
+ */
+static int send_all(void)
+{
+    char body[16], frame[P2P_HDRLEN + sizeof(body)];
+    int i, more = 1, done;
+
+    while (more) {
+        more = 0;
+        done = 1;
+        for (i = 0; i < nnodes; ++i) {
+            if (nodes[i].sent == nmessages)
+                continue;
+            int len = snprintf(body, sizeof(body), "%d", nodes[i].sent);
+            size_t flen = frame_encode(frame, P2P_OP_CHAT, body, len);
+            if (rudp_send(sender.rudp, frame, flen, &nodes[i].addr) == 0) {
+                nodes[i].sent++;
+                more = 1;
+            }
+            if (nodes[i].sent < nmessages)
+                done = 0;
+        }
+    }
+    return done;
+}
+
+struct result {
+    double          secs;
+    unsigned long   delivered;
+    unsigned long   data_lost;
+    unsigned long   acks_lost;
+    unsigned long   resent;
+    unsigned long   timeouts;
+};
+
+static void run(int pace, struct result *res)
+{
+    struct pacer *pacer = NULL;
+    int i;
+
+    node_open(&sender, 0);
+    for (i = 0; i < nnodes; ++i)
+        node_open(&nodes[i], rcvbuf);
+    if (pace) {
+        pacer = pacer_create(reactor, sender.sockfd, 0);
+        rudp_set_pacer(sender.rudp, pacer);
+    }
+    delivered = missing = 0;
+
+    unsigned long want = (unsigned long) nnodes * nmessages;
+    uint64_t started = now_ms(), heard = started;
+    int queued = 0;
+    while (delivered + missing < want && now_ms() - heard < QUIET_MS) {
+        if (!queued)
+            queued = send_all();
+        if (reactor_once(reactor, 100) > 0)
+            heard = now_ms();
+    }
+    res->secs = (now_ms() - started) / 1000.0;
+
+    struct rudp_stats st, sum;
+    rudp_get_stats(sender.rudp, &st);
+    bzero(&sum, sizeof(sum));
+    for (i = 0; i < nnodes; ++i) {
+        struct rudp_stats rs;
+        rudp_get_stats(nodes[i].rudp, &rs);
+        sum.received += rs.received;
+        sum.acks_sent += rs.acks_sent;
+    }
+    /* Those the pacer had no room for never left. */
+    res->delivered = delivered;
+    res->data_lost = st.sent + st.retransmits + st.fast_retransmits -
+                     st.send_errors - sum.received;
+    res->acks_lost = sum.acks_sent - st.acks_received;
+    res->resent = st.retransmits + st.fast_retransmits;
+    res->timeouts = st.timeouts;
+
+    if (pacer != NULL)
+        pacer_print_stats(pacer);
+    node_close(&sender);
+    for (i = 0; i < nnodes; ++i)
+        node_close(&nodes[i]);
+    if (pacer != NULL)
+        pacer_free(pacer);
+}
+
+static void print_result(const char *what, const struct result *res)
+{
+    printf("%-8s %7.2f s %9.0f/s %9lu %9lu %9lu %8lu %7lu\n", what, res->secs,
+           res->delivered / res->secs, res->delivered, res->data_lost,
+           res->acks_lost, res->resent, res->timeouts);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+        err_quit("usage: pace_sim <receivers> [<messages> [<rcvbuf>]]");
+    if ( (nnodes = atoi(argv[1])) < 1)
+        err_quit("There must be at least one receiver");
+    if (argc > 2 && (nmessages = atoi(argv[2])) < 1)
+        err_quit("The number of messages must be positive");
+    if (argc > 3 && (rcvbuf = atoi(argv[3])) < 1)
+        err_quit("The receive buffer must be positive");
+
+    srandom(getpid());
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    nodes = Calloc(nnodes, sizeof(*nodes));
+
+    struct result off, on;
+    run(0, &off);
+    run(1, &on);
+
+    printf("%d receivers, %d messages to each, %d bytes SO_RCVBUF\n", nnodes,
+           nmessages, rcvbuf);
+    printf("                    rate delivered DATA lost ACKs lost   resent "
+           "timeouts\n");
+    print_result("unpaced", &off);
+    print_result("paced", &on);
+
+    exit(off.delivered + on.delivered == 2UL * nnodes * nmessages &&
+         wrong == 0 ? 0 : 1);
+}
@@ -0,0 +1,207 @@
+/*
+ * Runs reliable delivery (see rudp.c) between `nodes' nodes on the loopback,
+ * each with its own socket, all on one reactor, over a link that loses
+ * `loss' percent of the datagrams: every node drops that share of what it
+ * reads, DATA and ACKs alike, before handing the rest to rudp_handle.
+ *
+ * Every node sends `messages' numbered messages to every other, as fast as
+ * the queues take them. Each receiver checks that the numbers from each
+ * sender come in order and none twice; a gap is what a sender gave up on. At the end it prints
+ * how long that took, what was lost on the way and how it was made up.
+ * `min-rto' bounds the retransmit timeout from below, in microseconds;
+ * 2000000 behaves like rtt.c.
+ *
+ * Usage: rudp_sim <nodes> [<messages> [<loss%> [<min-rto>]]]
+ */
+#include "../lib/unprtt.h"
+#include "../lib/unprtt64.h"
+#include "../lib/p2p.h"
+
+#define QUIET_MS    10000   /* give up when nothing comes this long */
+
+
+struct node {
+    struct rudp        *rudp;
+    int                 sockfd;
+    struct sockaddr_in  addr;
+    int                 id;
+    int                *sent;       /* per node: next number to it */
+    int                *expect;     /* per node: next number from it */
+};
+
+static struct node *nodes;
+static int nnodes;
+static int nmessages = 1000;
+static double loss = 5;
+static int min_rto_us;
+
+static unsigned long dropped, wrong, delivered, missing;
+
+static int node_of(const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < nnodes; ++i) {
+        if (nodes[i].addr.sin_port == addr->sin_port)
+            return i;
+    }
+    return -1;
+}
+
+static void on_deliver(struct rudp *r, struct p2p_msg *msg,
+                       const struct sockaddr_in *from, void *arg)
+{
+    struct node *n = arg;
+    int i = node_of(from);
+
+    int k = msg->op == P2P_OP_CHAT ? atoi(msg->body) : -1;
+
+    if (i < 0 || k < n->expect[i]) {
+        if (wrong++ < 10)
+            err_msg("node %d: got \"%s\" from %d, wanted %d", n->id,
+                    msg->body, i, i < 0 ? -1 : n->expect[i]);
+        return;
+    }
+    missing += k - n->expect[i];
+    n->expect[i] = k + 1;
+    delivered++;
+}
+
+static void on_fail(struct rudp *r, const struct sockaddr_in *to, int lost,
+                    void *arg)
+{
+    err_msg("node %d gave up on %d messages to %d", ((struct node *) arg)->id,
+            lost, node_of(to));
+}
+
+static void on_node(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct node *n = arg;
+    char buf[MSG_POOL_BUFSIZE];
+    struct p2p_msg msg;
+    struct sockaddr_in from;
+    socklen_t len = sizeof(from);
+
+    while (recv_message(fd, buf, sizeof(buf), &msg, (SA *) &from, &len) >= 0) {
+        len = sizeof(from);
+        if (random() < loss / 100 * RAND_MAX) {
+            dropped++;
+            continue;
+        }
+        rudp_handle(n->rudp, fd, &msg, &from);
+    }
+    if (errno != EAGAIN && errno != EWOULDBLOCK)
+        err_ret("recv_message error");
+}
+
+/* Queues what the queues take; returns 1 once everything is queued. */
+static int send_all(void)
+{
+    char body[16], frame[P2P_HDRLEN + sizeof(body)];
+    int i, j, done = 1;
+
+    for (i = 0; i < nnodes; ++i) {
+        struct node *n = &nodes[i];
+        for (j = 0; j < nnodes; ++j) {
+            if (j == i)
+                continue;
+            while (n->sent[j] < nmessages) {
+                int len = snprintf(body, sizeof(body), "%d", n->sent[j]);
+                size_t flen = frame_encode(frame, P2P_OP_CHAT, body, len);
+                if (rudp_send(n->rudp, frame, flen, &nodes[j].addr) < 0)
+                    break;
+                n->sent[j]++;
+            }
+            if (n->sent[j] < nmessages)
+                done = 0;
+        }
+    }
+    return done;
+}
+
+int main(int argc, char **argv)
+{
+    int i;
+
+    if (argc < 2)
+        err_quit("usage: rudp_sim <nodes> [<messages> [<loss%%> [<min-rto>]]]");
+    if ( (nnodes = atoi(argv[1])) < 2)
+        err_quit("There must be at least two nodes");
+    if (argc > 2 && (nmessages = atoi(argv[2])) < 1)
+        err_quit("The number of messages must be positive");
+    if (argc > 3 && ((loss = atof(argv[3])) < 0 || loss >= 100))
+        err_quit("The loss must be at least 0%% and under 100%%");
+    if (argc > 4 && (min_rto_us = atoi(argv[4])) < 1)
+        err_quit("The minimum RTO must be positive");
+
+    if (getenv("RTT_DEBUG") != NULL)
+        rtt_d_flag = 1;
+    srandom(getpid());
+
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+
+    nodes = Calloc(nnodes, sizeof(*nodes));
+    for (i = 0; i < nnodes; ++i) {
+        struct node *n = &nodes[i];
+        socklen_t len = sizeof(n->addr);
+        int size = 1 << 20;
+
+        n->id = i;
+        n->sockfd = Socket(AF_INET, SOCK_DGRAM, 0);
+        Setsockopt(n->sockfd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+        n->addr.sin_family = AF_INET;
+        n->addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        Bind(n->sockfd, (SA *) &n->addr, sizeof(n->addr));
+        Getsockname(n->sockfd, (SA *) &n->addr, &len);
+        Fcntl(n->sockfd, F_SETFL, Fcntl(n->sockfd, F_GETFL, 0) | O_NONBLOCK);
+
+        n->sent = Calloc(nnodes, sizeof(int));
+        n->expect = Calloc(nnodes, sizeof(int));
+        n->rudp = rudp_create(reactor, n->sockfd, on_deliver, on_fail, n);
+        rudp_set_rto(n->rudp, (int64_t) min_rto_us * 1000, 0);
+        if (reactor_add(reactor, n->sockfd, REACTOR_IN, on_node, n) < 0)
+            err_sys("reactor_add error");
+    }
+
+    unsigned long want = (unsigned long) nnodes * (nnodes - 1) * nmessages;
+    uint64_t started = now_ms(), heard = started;
+    printf("%d nodes, %d messages each way, %.1f%% loss, min RTO %.3f ms\n",
+           nnodes, nmessages, loss,
+           (min_rto_us ? min_rto_us * 1000LL : RTT64_RXTMIN) / 1e6);
+
+    int queued = 0;
+    while (delivered + missing < want && now_ms() - heard < QUIET_MS) {
+        if (!queued)
+            queued = send_all();
+        if (reactor_once(reactor, 100) > 0)
+            heard = now_ms();
+    }
+
+    struct rudp_stats sum;
+    bzero(&sum, sizeof(sum));
+    for (i = 0; i < nnodes; ++i) {
+        struct rudp_stats st;
+        rudp_get_stats(nodes[i].rudp, &st);
+        sum.sent += st.sent;
+        sum.retransmits += st.retransmits;
+        sum.fast_retransmits += st.fast_retransmits;
+        sum.timeouts += st.timeouts;
+        sum.failed += st.failed;
+        sum.duplicates += st.duplicates;
+        sum.out_of_order += st.out_of_order;
+        sum.acks_sent += st.acks_sent;
+    }
+    rudp_print_stats(nodes[0].rudp);
+    printf("%lu of %lu delivered in order in %.2f s, %lu given up, "
+           "%lu wrong\n", delivered, want, (now_ms() - started) / 1000.0,
+           missing, wrong);
+    printf("%lu datagrams dropped; %lu messages, %lu resent on a timeout "
+           "(%lu timeouts), %lu fast, %lu given up\n", dropped, sum.sent,
+           sum.retransmits, sum.timeouts, sum.fast_retransmits, sum.failed);
+    printf("%lu duplicates and %lu out of order received, %lu acks\n",
+           sum.duplicates, sum.out_of_order, sum.acks_sent);
+
+    exit(delivered == want && wrong == 0 ? 0 : 1);
+}
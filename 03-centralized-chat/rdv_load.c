@@ -0,0 +1,368 @@
+/*
+ * Load test for the rendezvous server. From one UDP socket it registers
+ * `clients' names, each in one of clients/ROOM_SIZE rooms and with a port of
+ * its own, then looks up `lookups' names, then lookups/10 rooms, keeping
+ * WINDOW requests outstanding and sending and receiving them in batches.
+ * Last, it looks the names up again over one pipelined TCP connection.
+ *
+ * Every reply is checked against what was registered. For each phase the
+ * rate, the time from request to reply, and the requests lost and answered
+ * wrong are printed. Requests unanswered for TIMEOUT_MS count as lost.
+ *
+ * Usage: rdv_load <server-address>[:port] [<clients> [<lookups>]]
+ */
+#define _GNU_SOURCE     /* sendmmsg */
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define WINDOW      256     /* requests outstanding */
+#define CHUNK       64      /* requests per sendmmsg, and per TCP write */
+#define ROOM_WINDOW 64
+#define ROOM_SIZE   100
+#define TIMEOUT_MS  200
+#define STRIDE      7919    /* a prime, to visit the names out of order */
+
+
+static int nclients = 100000;
+static int nlookups = 1000000;
+static int nrooms;
+static int stride = STRIDE;
+
+/* Phase counters */
+static uint64_t *pending;   /* per key: us when sent, 0 if not outstanding */
+static unsigned long done, lost, wrong, late;
+static uint64_t total_us, max_us;
+
+typedef int (*make_fn)(int, char*);                 /* returns the key */
+typedef int (*check_fn)(struct p2p_msg*, int*);     /* key, and if it's right */
+
+static uint64_t now_us(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static int port_of(int i)
+{
+    return 1024 + i % 60000;
+}
+
+static int room_of(int i)
+{
+    return i % nrooms;
+}
+
+/* `u<i>' back to i, or -1 */
+static int client_of(const char *name)
+{
+    char *end;
+    long i;
+
+    if (name[0] != 'u')
+        return -1;
+    i = strtol(name + 1, &end, 10);
+    if (*end != 0 || i < 0 || i >= nclients)
+        return -1;
+    return i;
+}
+
+
+static int make_register(int seq, char *out)
+{
+    char name[16], room[16];
+
+    snprintf(name, sizeof(name), "u%d", seq);
+    snprintf(room, sizeof(room), "r%d", room_of(seq));
+    rdv_encode_register(out, port_of(seq), name, room);
+
+    return seq;
+}
+
+/* A lookup reply names one peer, which must be where it registered. */
+static int check_peer(struct p2p_msg *msg, int *ok)
+{
+    struct rdv_peer peer;
+    size_t off = 0;
+    int i;
+
+    if ((msg->op != P2P_OP_RDV_OK && msg->op != P2P_OP_RDV_PEERS) ||
+            rdv_peers_next(msg, &off, &peer) != 1 ||
+            (i = client_of(peer.name)) < 0)
+        return -1;
+
+    *ok = ntohs(peer.addr.sin_port) == port_of(i);
+    return i;
+}
+
+/* Names are looked up out of order, but every WINDOW in a row are apart. */
+static int make_lookup(int seq, char *out)
+{
+    char name[16];
+    int i = (int) ((long long) seq * stride % nclients);
+
+    snprintf(name, sizeof(name), "u%d", i);
+    frame_encode(out, P2P_OP_RDV_LOOKUP, name, strlen(name));
+
+    return i;
+}
+
+static int make_room(int seq, char *out)
+{
+    char room[16];
+    int r = seq % nrooms;
+
+    snprintf(room, sizeof(room), "r%d", r);
+    frame_encode(out, P2P_OP_RDV_ROOM, room, strlen(room));
+
+    return r;
+}
+
+/*
+ * Everyone in a room reply must be in that room; the room is the key. Names
+ * left over from an earlier, bigger run are passed over.
+ */
+static int check_room(struct p2p_msg *msg, int *ok)
+{
+    struct rdv_peer peer;
+    size_t off = 0;
+    int i, n, r = -1;
+
+    *ok = msg->op == P2P_OP_RDV_PEERS;
+    while ( (n = rdv_peers_next(msg, &off, &peer)) == 1) {
+        if ( (i = client_of(peer.name)) < 0)
+            continue;
+        if (r < 0)
+            r = room_of(i);
+        if (room_of(i) != r || ntohs(peer.addr.sin_port) != port_of(i))
+            *ok = 0;
+    }
+    if (n < 0)
+        *ok = 0;
+
+    return r;
+}
+
+
+static void phase_start(void)
+{
+    done = lost = wrong = late = 0;
+    total_us = max_us = 0;
+}
+
+static void phase_print(const char *what, int requests, uint64_t started)
+{
+    double secs = (now_us() - started) / 1e6;
+
+    printf("%s: %d in %.2f s, %.0f/s", what, requests, secs, requests / secs);
+    if (done > 0)
+        printf("; %.0f us avg, %llu us max", (double) total_us / done,
+               (unsigned long long) max_us);
+    printf("; %lu lost, %lu wrong, %lu late\n", lost, wrong, late);
+    fflush(stdout);
+}
+
+static void reply(int key, int ok)
+{
+    if (key < 0 || pending[key] == 0) {
+        late++;
+        return;
+    }
+
+    uint64_t us = now_us() - pending[key];
+    total_us += us;
+    max_us = max(max_us, us);
+    pending[key] = 0;
+    done++;
+    if (!ok)
+        wrong++;
+}
+
+/*
+ * Sends `total' requests built by `make' over the connected UDP socket, at
+ * most `window' at a time, and matches the replies to them with `check'.
+ */
+static void run_udp(int fd, const char *what, int total, int window, int nkeys,
+                    make_fn make, check_fn check)
+{
+    static char bufs[CHUNK][P2P_MAXMSG];
+    static struct msg_batch *batch;
+    struct iovec iovs[CHUNK];
+    int sent = 0, inflight = 0, i, n;
+    uint64_t started = now_us();
+
+    if (batch == NULL)
+        batch = msg_batch_create(CHUNK);
+    phase_start();
+
+    while (done + lost < (unsigned long) total) {
+        while (sent < total && inflight < window) {
+            int count = min(min(total - sent, window - inflight), CHUNK);
+            uint64_t now = now_us();
+
+            for (i = 0; i < count; ++i) {
+                int key = make(sent + i, bufs[i]);
+                struct p2p_hdr h;
+                memcpy(&h, bufs[i], P2P_HDRLEN);
+                iovs[i].iov_base = bufs[i];
+                iovs[i].iov_len = P2P_HDRLEN + ntohs(h.len);
+                pending[key] = now;
+            }
+#ifdef MSG_WAITFORONE
+            struct mmsghdr hdrs[CHUNK];
+            bzero(hdrs, sizeof(hdrs));
+            for (i = 0; i < count; ++i) {
+                hdrs[i].msg_hdr.msg_iov = &iovs[i];
+                hdrs[i].msg_hdr.msg_iovlen = 1;
+            }
+            for (i = 0; i < count; i += n) {
+                if ( (n = sendmmsg(fd, hdrs + i, count - i, 0)) < 0)
+                    err_sys("sendmmsg error");
+            }
+#else
+            for (i = 0; i < count; ++i)
+                Write(fd, bufs[i], iovs[i].iov_len);
+#endif
+            sent += count;
+            inflight += count;
+        }
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if ( (n = poll(&pfd, 1, TIMEOUT_MS)) < 0 && errno != EINTR)
+            err_sys("poll error");
+        if (n == 0) {
+            /* Whatever is still outstanding isn't coming. */
+            lost += inflight;
+            inflight = 0;
+            for (i = 0; i < nkeys; ++i)
+                pending[i] = 0;
+            continue;
+        }
+
+        if ( (n = recv_batch(fd, batch)) < 0)
+            err_sys("recv_batch error");
+        for (i = 0; i < n; ++i) {
+            struct p2p_msg msg;
+            struct sockaddr_in *from;
+            int ok = 0, key = -1;
+
+            if (batch_message(batch, i, &msg, &from) == 0)
+                key = check(&msg, &ok);
+            if (key >= 0 && pending[key] != 0)
+                inflight--;
+            reply(key, ok);
+        }
+    }
+
+    phase_print(what, total, started);
+}
+
+/*
+ * Looks up `total' names over one TCP connection, CHUNK frames to a write,
+ * with up to `window' outstanding.
+ */
+static void run_tcp(const char *host, const char *port, int total, int window)
+{
+    static char in[16 * P2P_MAXMSG + 1];
+    char out[CHUNK * (P2P_HDRLEN + P2P_MAXNAME + 1)];
+    size_t have = 0;
+    int sent = 0, inflight = 0, i;
+    uint64_t started = now_us();
+    int fd = Tcp_connect(host, port);
+
+    phase_start();
+    while (done < (unsigned long) total) {
+        while (sent < total && inflight < window) {
+            int count = min(min(total - sent, window - inflight), CHUNK);
+            size_t len = 0;
+            uint64_t now = now_us();
+            char name[P2P_MAXMSG];
+
+            for (i = 0; i < count; ++i) {
+                int key = make_lookup(sent + i, name);
+                struct p2p_hdr h;
+                memcpy(&h, name, P2P_HDRLEN);
+                memcpy(out + len, name, P2P_HDRLEN + ntohs(h.len));
+                len += P2P_HDRLEN + ntohs(h.len);
+                pending[key] = now;
+            }
+            Writen(fd, out, len);
+            sent += count;
+            inflight += count;
+        }
+
+        ssize_t n = Read(fd, in + have, sizeof(in) - 1 - have);
+        if (n == 0)
+            err_quit("the server closed the connection");
+        have += n;
+
+        size_t off = 0;
+        for ( ; ; ) {
+            struct p2p_hdr h;
+            struct p2p_msg msg;
+            if (have - off < P2P_HDRLEN)
+                break;
+            memcpy(&h, in + off, P2P_HDRLEN);
+            size_t flen = P2P_HDRLEN + ntohs(h.len);
+            if (have - off < flen)
+                break;
+
+            /* frame_decode puts a NUL where the next frame starts. */
+            char save = in[off + flen];
+            int ok = 0, key = -1;
+            if (frame_decode(in + off, flen, flen + 1, &msg) == 0)
+                key = check_peer(&msg, &ok);
+            in[off + flen] = save;
+            if (key < 0)
+                err_quit("bad reply over TCP");
+            reply(key, ok);
+            inflight--;
+            off += flen;
+        }
+        memmove(in, in + off, have - off);
+        have -= off;
+    }
+
+    Close(fd);
+    phase_print("tcp lookups", total, started);
+}
+
+int main(int argc, char **argv)
+{
+    char host[INET_ADDRSTRLEN], port[8];
+
+    if (argc < 2 || argc > 4)
+        err_quit("usage: rdv_load <server-address>[:port] [<clients> [<lookups>]]");
+    if (argc > 2 && (nclients = atoi(argv[2])) < 1)
+        err_quit("The number of clients must be positive");
+    if (argc > 3 && (nlookups = atoi(argv[3])) < 1)
+        err_quit("The number of lookups must be positive");
+    nrooms = max(nclients / ROOM_SIZE, 1);
+    if (nclients % STRIDE == 0)
+        stride = 1;
+
+    const char *colon = strchr(argv[1], ':');
+    size_t len = colon != NULL ? (size_t) (colon - argv[1]) : strlen(argv[1]);
+    snprintf(host, sizeof(host), "%.*s", (int) len, argv[1]);
+    if (colon != NULL)
+        snprintf(port, sizeof(port), "%s", colon + 1);
+    else
+        snprintf(port, sizeof(port), "%d", RDV_PORT);
+
+    pending = Calloc(nclients, sizeof(*pending));
+    int fd = Udp_connect(host, port);
+
+    printf("%d clients in %d rooms, %d lookups, %d outstanding\n", nclients,
+           nrooms, nlookups, WINDOW);
+    run_udp(fd, "register", nclients, min(WINDOW, nclients), nclients,
+            make_register, check_peer);
+    run_udp(fd, "lookups", nlookups, min(WINDOW, nclients), nclients,
+            make_lookup, check_peer);
+    /* A room reply is over a kilobyte; fewer at once fit the socket buffer. */
+    run_udp(fd, "room lookups", max(nlookups / 10, 1), min(ROOM_WINDOW, nrooms),
+            nrooms, make_room, check_room);
+    run_tcp(host, port, nlookups, min(WINDOW, nclients));
+
+    exit(0);
+}
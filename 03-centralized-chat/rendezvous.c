@@ -0,0 +1,458 @@
+/*
+ * A central rendezvous server for the chat: clients register their user name,
+ * and optionally a room, with the address they can be reached at, and look
+ * others up by name or by room, instead of flooding the LAN to find them.
+ * The protocol and the registry are in rdv.c.
+ *
+ * One thread serves UDP and TCP on the same port from one epoll reactor.
+ * Datagrams are drained RDV_BATCH at a time with recvmmsg and the replies to
+ * a whole batch go back in one sendmmsg. A TCP client may pipeline requests;
+ * everything a read brought in is answered with one write. Registrations
+ * not renewed within RDV_TTL_MS are dropped by a sweep every second.
+ *
+ * Usage: rendezvous [<bind-address> [<port>]]
+ */
+#define _GNU_SOURCE     /* sendmmsg */
+#include "../lib/unp.h"
+#include "../lib/p2p.h"
+
+#define RDV_BATCH       64          /* datagrams per recvmmsg and sendmmsg */
+#define RDV_RCVBUF      (4 << 20)   /* to ride out bursts of registrations */
+#define RDV_INBUF       (16 * P2P_MAXMSG)
+#define RDV_OUTMAX      (256 * 1024) /* stop reading a client that won't read */
+#define RDV_SWEEP_MS    1000
+#define RDV_STATS_MS    10000
+
+
+struct conn {
+    int                  fd;
+    struct sockaddr_in   addr;
+    char                 in[RDV_INBUF + 1];     /* one more for frame_decode */
+    size_t               inlen;
+    char                *out;
+    size_t               outlen, outcap;
+    int                  eof;       /* the client is done sending */
+};
+
+/* Replies to one batch of datagrams, all sent with one sendmmsg. */
+struct replies {
+    char                 bufs[RDV_BATCH][P2P_MAXMSG];
+    struct sockaddr_in   addrs[RDV_BATCH];
+    struct iovec         iovs[RDV_BATCH];
+    int                  count;
+};
+
+static struct rdv_registry *registry;
+static struct msg_batch *batch;
+static struct replies replies;
+
+static struct {
+    unsigned long   requests;
+    unsigned long   bad;
+    unsigned long   datagrams;
+    unsigned long   replies;
+    unsigned long   send_syscalls;
+    unsigned long   send_errors;
+    unsigned long   accepted;
+    int             clients;
+} stats;
+static unsigned long last_requests;
+
+static void on_udp(struct reactor*, int, int, void*);
+static void on_listen(struct reactor*, int, int, void*);
+static void on_conn(struct reactor*, int, int, void*);
+static void on_sweep(struct reactor*, void*);
+static void on_stats(struct reactor*, void*);
+
+static void set_nonblock(int fd)
+{
+    Fcntl(fd, F_SETFL, Fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = argc > 1 ? argv[1] : "0.0.0.0";
+    char port[8];
+    int udpfd, listenfd, rcvbuf = RDV_RCVBUF;
+
+    if (argc > 3)
+        err_quit("usage: rendezvous [<bind-address> [<port>]]");
+    if (argc > 2)
+        snprintf(port, sizeof(port), "%s", argv[2]);
+    else
+        snprintf(port, sizeof(port), "%d", RDV_PORT);
+
+    /* The registry is IPv4, so the sockets must be too. */
+    udpfd = Udp_server(host, port, NULL);
+    if (sockfd_to_family(udpfd) != AF_INET)
+        err_quit("%s is not an IPv4 address", host);
+    if (setsockopt(udpfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)) < 0)
+        err_ret("setsockopt SO_RCVBUF error");
+    set_nonblock(udpfd);
+
+    listenfd = Tcp_listen(host, port, NULL);
+    set_nonblock(listenfd);
+
+    registry = rdv_create(0);
+    batch = msg_batch_create(RDV_BATCH);
+    Signal(SIGPIPE, SIG_IGN);
+
+    struct reactor *reactor;
+    if ( (reactor = reactor_create()) == NULL)
+        err_sys("reactor_create error");
+    if (reactor_add(reactor, udpfd, REACTOR_IN, on_udp, NULL) < 0 ||
+            reactor_add(reactor, listenfd, REACTOR_IN, on_listen, NULL) < 0)
+        err_sys("reactor_add error");
+    reactor_timer(reactor, RDV_SWEEP_MS, 1, on_sweep, NULL);
+    reactor_timer(reactor, RDV_STATS_MS, 1, on_stats, NULL);
+
+    printf("Serving on %s port %s, UDP and TCP\n", host, port);
+    reactor_run(reactor);
+
+    exit(0);
+}
+
+/* Appends the peers named in a LOOKUP body to a PEERS body. */
+static size_t lookup_names(char *names, char *body, size_t size)
+{
+    struct rdv_peer miss;
+    char *name, *save;
+    size_t len = 0, n;
+
+    bzero(&miss, sizeof(miss));
+    for (name = strtok_r(names, " ", &save); name != NULL;
+            name = strtok_r(NULL, " ", &save)) {
+        const struct rdv_peer *peer = rdv_lookup(registry, name);
+        if (peer == NULL) {
+            snprintf(miss.name, sizeof(miss.name), "%s", name);
+            peer = &miss;
+        }
+        if ( (n = rdv_peers_add(body, len, size, peer)) == 0)
+            break;
+        len = n;
+    }
+
+    return len;
+}
+
+/*
+ * Answers one request from `from' into `out', which has room for
+ * P2P_MAXMSG bytes. Returns the length of the reply, or 0 for none.
+ */
+static size_t handle_request(struct p2p_msg *msg, const struct sockaddr_in *from,
+                             char *out)
+{
+    static const struct rdv_peer *members[P2P_MAXMSG / 8];
+    char *body = out + P2P_HDRLEN;
+    size_t size = P2P_MAXMSG - P2P_HDRLEN, len = 0;
+    struct rdv_peer peer;
+    char room[P2P_MAXNAME + 1];
+    int op, i, n;
+
+    stats.requests++;
+    switch (msg->op) {
+    case P2P_OP_RDV_REGISTER:
+        if (rdv_parse_register(msg, from, &peer, room) < 0 ||
+                (n = rdv_register(registry, peer.name, room, &peer.addr,
+                                  now_ms())) == -1)
+            goto bad;
+        if (n == -2) {
+            /* Taken: says by whom, so the client can pick another name. */
+            op = P2P_OP_RDV_PEERS;
+            len = rdv_peers_add(body, 0, size,
+                                rdv_lookup(registry, peer.name));
+            break;
+        }
+        /* Tells the client what it registered, as the server sees it. */
+        op = P2P_OP_RDV_OK;
+        len = rdv_peers_add(body, 0, size, &peer);
+        break;
+
+    case P2P_OP_RDV_LOOKUP:
+        op = P2P_OP_RDV_PEERS;
+        len = lookup_names(msg->body, body, size);
+        break;
+
+    case P2P_OP_RDV_ROOM:
+        op = P2P_OP_RDV_PEERS;
+        n = rdv_room(registry, msg->body, members,
+                     (int) (size / RDV_ENTRY_LEN));
+        for (i = 0; i < n; ++i)
+            len = rdv_peers_add(body, len, size, members[i]);
+        break;
+
+    case P2P_OP_RDV_LEAVE:
+        if (rdv_leave(registry, msg->body, from) < 0)
+            goto bad;
+        op = P2P_OP_RDV_OK;
+        break;
+
+    default:
+        goto bad;
+    }
+
+    return frame_hdr(out, op, 0, len) + len;
+
+bad:
+    stats.bad++;
+    return 0;
+}
+
+/*
+ * Sends the replies collected for a batch with as few sendmmsg calls as
+ * the kernel allows. A reply that can't be sent is dropped; the client
+ * asks again.
+ */
+static void send_replies(int fd)
+{
+    int i, sent = 0;
+
+#ifdef MSG_WAITFORONE
+    struct mmsghdr hdrs[RDV_BATCH];
+
+    bzero(hdrs, replies.count * sizeof(hdrs[0]));
+    for (i = 0; i < replies.count; ++i) {
+        hdrs[i].msg_hdr.msg_name = &replies.addrs[i];
+        hdrs[i].msg_hdr.msg_namelen = sizeof(replies.addrs[i]);
+        hdrs[i].msg_hdr.msg_iov = &replies.iovs[i];
+        hdrs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    while (sent < replies.count) {
+        int n = sendmmsg(fd, hdrs + sent, replies.count - sent, 0);
+        stats.send_syscalls++;
+        if (n < 0) {
+            /* The one at `sent' failed; skip it. */
+            stats.send_errors++;
+            sent++;
+            continue;
+        }
+        sent += n;
+        stats.replies += n;
+    }
+#else
+    for (i = 0; i < replies.count; ++i) {
+        stats.send_syscalls++;
+        if (sendto(fd, replies.bufs[i], replies.iovs[i].iov_len, 0,
+                   (SA *) &replies.addrs[i], sizeof(replies.addrs[i])) < 0)
+            stats.send_errors++;
+        else
+            stats.replies++;
+        sent++;
+    }
+#endif
+
+    replies.count = 0;
+}
+
+static void on_udp(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct p2p_msg msg;
+    struct sockaddr_in *from;
+    int i, n;
+
+    if ( (n = recv_batch(fd, batch)) < 0) {
+        err_ret("recv_batch error");
+        return;
+    }
+    stats.datagrams += n;
+
+    for (i = 0; i < n; ++i) {
+        if (batch_message(batch, i, &msg, &from) < 0) {
+            stats.bad++;
+            continue;
+        }
+
+        size_t len = handle_request(&msg, from, replies.bufs[replies.count]);
+        if (len == 0)
+            continue;
+        replies.addrs[replies.count] = *from;
+        replies.iovs[replies.count].iov_base = replies.bufs[replies.count];
+        replies.iovs[replies.count].iov_len = len;
+        replies.count++;
+    }
+
+    send_replies(fd);
+}
+
+
+static void conn_close(struct reactor *reactor, struct conn *c)
+{
+    reactor_del(reactor, c->fd);
+    Close(c->fd);
+    free(c->out);
+    free(c);
+    stats.clients--;
+}
+
+static void on_listen(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct sockaddr_in addr;
+    socklen_t len;
+    int connfd;
+
+    for ( ; ; ) {
+        len = sizeof(addr);
+        if ( (connfd = accept(fd, (SA *) &addr, &len)) < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK &&
+                    errno != ECONNABORTED && errno != EINTR)
+                err_ret("accept error");
+            return;
+        }
+
+        struct conn *c = Calloc(1, sizeof(*c));
+        c->fd = connfd;
+        c->addr = addr;
+        set_nonblock(connfd);
+        if (reactor_add(reactor, connfd, REACTOR_IN, on_conn, c) < 0) {
+            err_ret("reactor_add error");
+            Close(connfd);
+            free(c);
+            continue;
+        }
+        stats.accepted++;
+        stats.clients++;
+    }
+}
+
+/* Queues a reply for the client; the room is made before it's written. */
+static char *conn_reserve(struct conn *c, size_t len)
+{
+    if (c->outlen + len > c->outcap) {
+        c->outcap = max(2 * c->outcap, c->outlen + len);
+        if ( (c->out = realloc(c->out, c->outcap)) == NULL)
+            err_sys("realloc error");
+    }
+    return c->out + c->outlen;
+}
+
+/*
+ * Answers every whole frame in the input buffer and keeps the rest. Returns
+ * -1 if the client sent something that isn't a frame.
+ */
+static int conn_process(struct conn *c)
+{
+    struct p2p_msg msg;
+    struct p2p_hdr h;
+    size_t off = 0;
+
+    while (c->inlen - off >= P2P_HDRLEN) {
+        char *frame = c->in + off;
+        memcpy(&h, frame, P2P_HDRLEN);
+        if (h.magic != P2P_MAGIC || P2P_HDRLEN + ntohs(h.len) > P2P_MAXMSG)
+            return -1;
+
+        size_t total = P2P_HDRLEN + ntohs(h.len);
+        if (c->inlen - off < total)
+            break;
+
+        /* frame_decode puts a NUL where the next frame starts; put it back. */
+        char save = frame[total];
+        if (frame_decode(frame, total, total + 1, &msg) < 0)
+            return -1;
+
+        char *out = conn_reserve(c, P2P_MAXMSG);
+        c->outlen += handle_request(&msg, &c->addr, out);
+        frame[total] = save;
+        off += total;
+    }
+
+    memmove(c->in, c->in + off, c->inlen - off);
+    c->inlen -= off;
+
+    return 0;
+}
+
+/*
+ * Writes what it can. Returns -1 if the connection broke, else 0; waits
+ * for the socket to drain, and stops reading, as needed.
+ */
+static int conn_flush(struct reactor *reactor, struct conn *c)
+{
+    while (c->outlen > 0) {
+        ssize_t n = write(c->fd, c->out, c->outlen);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        memmove(c->out, c->out + n, c->outlen - n);
+        c->outlen -= n;
+    }
+
+    int events = 0;
+    if (c->outlen < RDV_OUTMAX && !c->eof)
+        events |= REACTOR_IN;
+    if (c->outlen > 0)
+        events |= REACTOR_OUT;
+    if (reactor_mod(reactor, c->fd, events) < 0)
+        return -1;
+
+    return 0;
+}
+
+/*
+ * A client may send its requests and shut down its side at once; what came
+ * before the EOF is answered, and the connection closed once that's sent.
+ */
+static void on_conn(struct reactor *reactor, int fd, int events, void *arg)
+{
+    struct conn *c = arg;
+
+    if (events & REACTOR_IN) {
+        ssize_t n;
+        while (!c->eof && c->inlen < RDV_INBUF) {
+            n = read(fd, c->in + c->inlen, RDV_INBUF - c->inlen);
+            if (n > 0)
+                c->inlen += n;
+            else if (n == 0)
+                c->eof = 1;
+            else if (errno == EINTR)
+                continue;
+            else if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            else {
+                conn_close(reactor, c);
+                return;
+            }
+        }
+
+        if (conn_process(c) < 0) {
+            stats.bad++;
+            conn_close(reactor, c);
+            return;
+        }
+    }
+
+    if (conn_flush(reactor, c) < 0 || (c->eof && c->outlen == 0))
+        conn_close(reactor, c);
+}
+
+
+static void on_sweep(struct reactor *reactor, void *arg)
+{
+    rdv_expire(registry, now_ms());
+}
+
+/* Prints the counters when there was something to count. */
+static void on_stats(struct reactor *reactor, void *arg)
+{
+    if (stats.requests == last_requests)
+        return;
+
+    printf("%.0f requests/s over the last %d s\n",
+           (stats.requests - last_requests) * 1000.0 / RDV_STATS_MS,
+           RDV_STATS_MS / 1000);
+    last_requests = stats.requests;
+
+    rdv_print_stats(registry);
+    printf("server: %lu requests, %lu bad; %lu datagrams, %lu replies in "
+           "%lu sends, %lu send errors; %d clients, %lu accepted\n",
+           stats.requests, stats.bad, stats.datagrams, stats.replies,
+           stats.send_syscalls, stats.send_errors, stats.clients,
+           stats.accepted);
+    batch_stats(batch, "udp");
+    fflush(stdout);
+}
@@ -0,0 +1,263 @@
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * Concurrent TCP connect scanner. connect_nonb does one non-blocking connect
+ * and waits for it with select; here up to `maxconns' of them are in flight
+ * at once, all on a reactor, each with its own deadline. As soon as one
+ * finishes, the next host is tried, so a range costs about
+ * (hosts / maxconns) * timeout instead of hosts * timeout.
+ *
+ * A host that accepts is handed to the caller as a connected socket in
+ * blocking mode, like connect_nonb leaves it; the scan also remembers the
+ * address for scan_found.
+ */
+struct scan_attempt {
+    struct scan            *s;
+    int                     fd;         /* -1 when the slot is free */
+    struct sockaddr_in      addr;
+    struct reactor_timer   *deadline;
+};
+
+struct scan {
+    struct reactor         *r;
+    int                     port;       /* network byte order */
+    int                     timeout_ms;
+
+    uint32_t                first;      /* host byte order */
+    uint32_t                count;
+    uint32_t                start;      /* index tried first */
+    uint32_t                next;       /* hosts tried so far */
+    int                     stopped;
+    int                     done;
+    uint64_t                started;    /* ms */
+    uint64_t                finished;
+
+    struct scan_attempt    *attempts;
+    int                     maxconns;
+    int                    *free_slots; /* stack of free attempts */
+    int                     nfree;
+    struct reactor_timer   *kick;       /* first fill, off the caller's stack */
+
+    struct peer_table      *found;
+    struct scan_stats       stats;
+
+    scan_cb                 on_found;
+    scan_done_cb            on_done;
+    void                   *arg;
+};
+
+
+static void fill(struct scan*);
+
+/* Closes the attempt's socket, unless it was handed over, and frees it. */
+static void attempt_end(struct scan_attempt *a, int handed_over)
+{
+    struct scan *s = a->s;
+
+    reactor_cancel(s->r, a->deadline);
+    a->deadline = NULL;
+    reactor_del(s->r, a->fd);
+    if (!handed_over)
+        close(a->fd);
+    a->fd = -1;
+
+    s->free_slots[s->nfree++] = a - s->attempts;
+    s->stats.inflight--;
+}
+
+static void on_deadline(struct reactor *r, void *arg)
+{
+    struct scan_attempt *a = arg;
+    struct scan *s = a->s;
+
+    /* One-shot: the handle is gone once we're called. */
+    a->deadline = NULL;
+    s->stats.timedout++;
+    attempt_end(a, 0);
+    fill(s);
+}
+
+static void on_connect(struct reactor *r, int fd, int events, void *arg)
+{
+    struct scan_attempt *a = arg;
+    struct scan *s = a->s;
+    int error = 0;
+    socklen_t len = sizeof(error);
+
+    if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0)
+        error = errno;
+
+    if (error == 0) {
+        struct sockaddr_in addr = a->addr;
+
+        s->stats.connected++;
+        peer_table_add(s->found, &addr);
+        attempt_end(a, 1);
+        Fcntl(fd, F_SETFL, Fcntl(fd, F_GETFL, 0) & ~O_NONBLOCK);
+        s->on_found(s, fd, &addr, s->arg);
+    } else {
+        if (error == ECONNREFUSED)
+            s->stats.refused++;
+        else
+            s->stats.failed++;
+        attempt_end(a, 0);
+    }
+
+    fill(s);
+}
+
+/* Returns 0, or -1 if no socket could be had for now. */
+static int attempt_start(struct scan *s, uint32_t idx)
+{
+    int fd;
+    if ( (fd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+        return -1;
+    Fcntl(fd, F_SETFL, Fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+
+    struct scan_attempt *a = &s->attempts[s->free_slots[--s->nfree]];
+    a->fd = fd;
+    bzero(&a->addr, sizeof(a->addr));
+    a->addr.sin_family = AF_INET;
+    a->addr.sin_port = s->port;
+    a->addr.sin_addr.s_addr = htonl(s->first + idx);
+
+    s->stats.attempts++;
+    s->stats.inflight++;
+    s->stats.max_inflight = max(s->stats.max_inflight, s->stats.inflight);
+
+    /* Even a connect that completes at once is reported by the reactor. */
+    if (connect(fd, (SA *) &a->addr, sizeof(a->addr)) < 0 &&
+            errno != EINPROGRESS) {
+        s->stats.failed++;
+        s->free_slots[s->nfree++] = a - s->attempts;
+        s->stats.inflight--;
+        a->fd = -1;
+        close(fd);
+        return 0;
+    }
+
+    if (reactor_add(s->r, fd, REACTOR_OUT, on_connect, a) < 0)
+        err_sys("reactor_add error");
+    a->deadline = reactor_timer(s->r, s->timeout_ms, 0, on_deadline, a);
+
+    return 0;
+}
+
+/* Tops up the attempts in flight, and ends the scan when there's no more. */
+static void fill(struct scan *s)
+{
+    while (!s->stopped && s->next < s->count && s->nfree > 0) {
+        if (attempt_start(s, (s->start + s->next) % s->count) < 0) {
+            /* Out of descriptors: wait for an attempt to finish. */
+            if (s->stats.inflight > 0)
+                break;
+            err_ret("socket error");
+            s->stats.failed++;
+        }
+        s->next++;
+    }
+
+    if (s->stats.inflight == 0 && (s->stopped || s->next == s->count) &&
+            !s->done) {
+        s->done = 1;
+        s->finished = now_ms();
+        /* Last, as it may well free the scan. */
+        s->on_done(s, s->arg);
+    }
+}
+
+static void on_kick(struct reactor *r, void *arg)
+{
+    struct scan *s = arg;
+
+    s->kick = NULL;
+    fill(s);
+}
+
+/*
+ * Tries to connect to `port' on every host of `range' (see sweep_parse),
+ * `maxconns' at a time, beginning with the host at index `start' and
+ * wrapping around. An attempt that hasn't finished after `timeout_ms' is
+ * given up. on_found is called with each connected socket, which is then
+ * the caller's, and on_done once the last attempt is over; both only ever
+ * from the reactor. Returns NULL with errno set on bad arguments.
+ */
+struct scan *scan_start(struct reactor *r, const char *range, int start,
+                        int port, int maxconns, int timeout_ms,
+                        scan_cb on_found, scan_done_cb on_done, void *arg)
+{
+    uint32_t first, count;
+    if (sweep_parse(range, &first, &count) < 0 || maxconns < 1 ||
+            timeout_ms < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct scan *s = Calloc(1, sizeof(*s));
+    s->r = r;
+    s->port = htons(port);
+    s->timeout_ms = timeout_ms;
+    s->first = first;
+    s->count = count;
+    s->start = (uint32_t) max(start, 0) % count;
+    s->found = peer_table_create(0);
+    s->on_found = on_found;
+    s->on_done = on_done;
+    s->arg = arg;
+
+    int i;
+    s->maxconns = maxconns;
+    s->attempts = Calloc(maxconns, sizeof(*s->attempts));
+    s->free_slots = Calloc(maxconns, sizeof(*s->free_slots));
+    for (i = 0; i < maxconns; ++i) {
+        s->attempts[i].s = s;
+        s->attempts[i].fd = -1;
+        s->free_slots[s->nfree++] = maxconns - 1 - i;
+    }
+
+    s->started = now_ms();
+    s->kick = reactor_timer(r, 0, 0, on_kick, s);
+
+    return s;
+}
+
+/*
+ * Starts no new attempts; the ones in flight may still connect. on_done is
+ * called once they're all over.
+ */
+void scan_stop(struct scan *s)
+{
+    s->stopped = 1;
+}
+
+/* Abandons whatever is still in flight; on_done is not called then. */
+void scan_free(struct scan *s)
+{
+    int i;
+
+    reactor_cancel(s->r, s->kick);
+    for (i = 0; i < s->maxconns; ++i) {
+        if (s->attempts[i].fd >= 0)
+            attempt_end(&s->attempts[i], 0);
+    }
+
+    peer_table_free(s->found);
+    free(s->attempts);
+    free(s->free_slots);
+    free(s);
+}
+
+/* Everyone who accepted so far */
+const struct peer_table *scan_found(const struct scan *s)
+{
+    return s->found;
+}
+
+void scan_get_stats(const struct scan *s, struct scan_stats *stats)
+{
+    *stats = s->stats;
+    stats->hosts = s->count;
+    stats->elapsed_ms = (s->done ? s->finished : now_ms()) - s->started;
+}
@@ -0,0 +1,138 @@
+#include "unprtt.h"
+#include "p2p.h"
+
+
+/*
+ * Adaptive discovery window. Instead of collecting answers for a fixed
+ * time, the window closes once no new peer has answered for a while, where
+ * "a while" follows what has been seen so far: a few smoothed round trips
+ * of the answers (from the rtt.c estimators), twice the largest gap between
+ * two new peers, and never less than `min_ms'. On a LAN where every answer
+ * comes within a couple of milliseconds that is tens of milliseconds; a
+ * slow or lossy network stretches it, up to `max_ms' at most.
+ *
+ * When the window would close, the probe may be sent again, up to
+ * `retries' times, for peers that missed it; each retransmission doubles
+ * the quiet period like an RTO backoff. Answers can't be matched to a
+ * probe, so following Karn only answers to the first one are timed.
+ */
+#define FIND_RTTS   4   /* smoothed RTTs of quiet before closing */
+#define FIND_GAPS   2   /* largest gaps between new peers, likewise */
+
+struct find_window {
+    struct rtt_info rtt;        /* rtt_nrexmt counts retransmissions */
+    uint32_t        probe_ts;   /* rtt_ts of the first probe */
+    int             samples;
+
+    uint64_t        started;    /* ms */
+    uint64_t        last;       /* last probe or new peer */
+    uint64_t        last_new;
+    int             max_gap;    /* ms between two new peers */
+    int             responders;
+
+    int             min_ms;
+    int             max_ms;
+    int             retries;
+};
+
+
+struct find_window *find_window_create(int min_ms, int max_ms, int retries)
+{
+    struct find_window *w = Calloc(1, sizeof(*w));
+
+    rtt_init(&w->rtt);
+    rtt_newpack(&w->rtt);
+    w->min_ms = max(min_ms, 1);
+    w->max_ms = max(max_ms, w->min_ms);
+    w->retries = max(retries, 0);
+
+    return w;
+}
+
+void find_window_free(struct find_window *w)
+{
+    free(w);
+}
+
+/* Call whenever the probe goes out, the first time included. */
+void find_window_sent(struct find_window *w)
+{
+    uint64_t now = now_ms();
+
+    if (w->started == 0) {
+        w->started = now;
+        w->probe_ts = rtt_ts(&w->rtt);
+    } else {
+        w->rtt.rtt_nrexmt++;
+    }
+    w->last = now;
+}
+
+/* Call for every answer; `is_new' tells if it came from a new peer. */
+void find_window_reply(struct find_window *w, int is_new)
+{
+    if (!is_new)
+        return;
+
+    uint64_t now = now_ms();
+    if (w->responders++ > 0)
+        w->max_gap = max(w->max_gap, (int) (now - w->last_new));
+    w->last_new = w->last = now;
+
+    if (w->rtt.rtt_nrexmt > 0)
+        return;     /* Karn: can't tell which probe this answers */
+
+    uint32_t ms = rtt_ts(&w->rtt) - w->probe_ts;
+    if (w->samples++ == 0) {
+        /* rtt_init's guess is for the Internet; start from the sample. */
+        w->rtt.rtt_srtt = ms / 1000.0;
+        w->rtt.rtt_rttvar = ms / 2000.0;
+    }
+    rtt_stop(&w->rtt, ms);
+    rtt_debug(&w->rtt);
+}
+
+static int quiet_ms(const struct find_window *w)
+{
+    int quiet = w->min_ms << w->rtt.rtt_nrexmt;
+
+    if (w->samples > 0)
+        quiet = max(quiet, (int) (FIND_RTTS * w->rtt.rtt_srtt * 1000 + 0.5));
+
+    return max(quiet, FIND_GAPS * w->max_gap);
+}
+
+/* Milliseconds until find_window_check has something new to say. */
+int find_window_timeout(const struct find_window *w)
+{
+    uint64_t now = now_ms();
+    uint64_t deadline = min(w->last + quiet_ms(w), w->started + w->max_ms);
+
+    return deadline > now ? (int) (deadline - now) : 1;
+}
+
+/*
+ * Returns FIND_WAIT if the window is still open, FIND_RETRY if the probe
+ * should be sent again (followed by find_window_sent) or FIND_DONE.
+ */
+int find_window_check(const struct find_window *w)
+{
+    uint64_t now = now_ms();
+
+    if (now - w->started >= (uint64_t) w->max_ms)
+        return FIND_DONE;
+    if (now - w->last < (uint64_t) quiet_ms(w))
+        return FIND_WAIT;
+    if (w->rtt.rtt_nrexmt < w->retries)
+        return FIND_RETRY;
+
+    return FIND_DONE;
+}
+
+void find_window_print_stats(const struct find_window *w)
+{
+    printf("discovery: %d peers in %llu ms, srtt %.1f ms, "
+           "largest gap %d ms, %d retransmissions\n",
+           w->responders, (unsigned long long) (now_ms() - w->started),
+           w->rtt.rtt_srtt * 1000, w->max_gap, w->rtt.rtt_nrexmt);
+}
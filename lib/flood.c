@@ -0,0 +1,321 @@
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * Flooded queries, as in Gnutella 0.4. A query carries a random 64-bit ID,
+ * a TTL and a hop count. Every node that gets one hands it to the caller
+ * and, if the TTL allows, sends it on to all of its neighbors but the one it
+ * came from. A node that has what was asked for answers the origin directly
+ * with a HIT; the origin's address is in the query.
+ *
+ * Without duplicate suppression, a node gets a query once from every path
+ * to it, and each copy is sent on again, so the traffic grows as the degree
+ * to the power of the TTL. With it, each node sends a query on once: it
+ * costs a node at most one datagram per neighbor, whatever the TTL.
+ *
+ * The IDs seen are kept in two Bloom filters. New IDs go into the newer one
+ * and both are checked; every FLOOD_ROTATE_MS the older one is cleared and
+ * becomes the newer. So an ID is remembered for one to two periods, far
+ * longer than a query takes to die out, in a fixed 2 * FLOOD_BLOOM_BITS
+ * bits. A false positive drops a query that wasn't a duplicate; at the sizes
+ * here that takes tens of thousands of queries a period.
+ *
+ * The origin in a query is taken on trust, so anyone can put a third party's
+ * address there and have every node that matches send that party a HIT: a
+ * reflection, which also hides who asked. Gnutella avoids it by routing hits
+ * back along the path the query came, hop by hop; here they go straight to
+ * the origin, so that it learns the answering node's address and can talk to
+ * it directly. What limits the damage is that a HIT is about as long as the
+ * query that caused it, and only nodes that have what was asked for answer;
+ * don't let flood_hit send much more than the query did.
+ *
+ * As with kad.c, the caller reads the socket and hands each message to
+ * flood_handle. The neighbors are the caller's peer table.
+ *
+ *   QUERY  id(8) ttl(1) hops(1) origin addr(4) port(2) payload
+ *   HIT    id(8) payload
+ */
+#define FLOOD_BLOOM_BITS    (1 << 18)   /* per filter: 32 KB */
+#define FLOOD_BLOOM_K       4           /* bits per ID */
+#define FLOOD_ROTATE_MS     (30 * 1000)
+
+#define QUERY_LEN   (8 + 1 + 1 + 4 + 2)
+
+struct flood {
+    struct reactor          *r;
+    int                      fd;
+    struct sockaddr_in       self;
+    struct peer_table       *neighbors;
+    int                      suppress;
+
+    uint64_t                *bloom[2];  /* the newer first */
+    struct reactor_timer    *rotate;
+
+    struct sockaddr_in      *to;        /* scratch: who a query goes on to */
+    int                      tocap;
+
+    flood_query_cb           query_cb;
+    flood_hit_cb             hit_cb;
+    void                    *arg;
+
+    struct flood_stats       stats;
+};
+
+
+/* splitmix64; random IDs are hashed anyway, in case one isn't */
+static uint64_t id_hash(uint64_t x)
+{
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+/* The K bits of `id' are h1 + i * h2, from the two halves of one hash. */
+static int bloom_has(const uint64_t *bits, uint64_t id)
+{
+    uint64_t h = id_hash(id);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < FLOOD_BLOOM_K; ++i) {
+        uint32_t b = (h1 + i * h2) & (FLOOD_BLOOM_BITS - 1);
+        if (!(bits[b / 64] & (1ULL << (b % 64))))
+            return 0;
+    }
+    return 1;
+}
+
+static void bloom_add(uint64_t *bits, uint64_t id)
+{
+    uint64_t h = id_hash(id);
+    uint32_t h1 = h, h2 = (h >> 32) | 1;
+    int i;
+
+    for (i = 0; i < FLOOD_BLOOM_K; ++i) {
+        uint32_t b = (h1 + i * h2) & (FLOOD_BLOOM_BITS - 1);
+        bits[b / 64] |= 1ULL << (b % 64);
+    }
+}
+
+static void on_rotate(struct reactor *r, void *arg)
+{
+    struct flood *f = arg;
+    uint64_t *older = f->bloom[1];
+
+    memset(older, 0, FLOOD_BLOOM_BITS / 8);
+    f->bloom[1] = f->bloom[0];
+    f->bloom[0] = older;
+    f->stats.rotations++;
+}
+
+/*
+ * Queries go out on `sockfd', which the caller reads, and name `self' as the
+ * origin, which must be an address the others can reach. `neighbors' is
+ * where they are sent; the caller keeps it up to date.
+ */
+struct flood *flood_create(struct reactor *r, int sockfd,
+                           const struct sockaddr_in *self,
+                           struct peer_table *neighbors,
+                           flood_query_cb query_cb, flood_hit_cb hit_cb,
+                           void *arg)
+{
+    struct flood *f = Calloc(1, sizeof(*f));
+
+    f->r = r;
+    f->fd = sockfd;
+    f->self = *self;
+    f->neighbors = neighbors;
+    f->suppress = 1;
+    f->bloom[0] = Calloc(FLOOD_BLOOM_BITS / 64, sizeof(uint64_t));
+    f->bloom[1] = Calloc(FLOOD_BLOOM_BITS / 64, sizeof(uint64_t));
+    f->rotate = reactor_timer(r, FLOOD_ROTATE_MS, 1, on_rotate, f);
+    f->query_cb = query_cb;
+    f->hit_cb = hit_cb;
+    f->arg = arg;
+
+    return f;
+}
+
+void flood_free(struct flood *f)
+{
+    reactor_cancel(f->r, f->rotate);
+    free(f->bloom[0]);
+    free(f->bloom[1]);
+    free(f->to);
+    free(f);
+}
+
+/*
+ * Turns duplicate suppression off, or back on. Duplicates are still counted
+ * when it's off; this is for measuring what the filter saves.
+ */
+void flood_suppress(struct flood *f, int on)
+{
+    f->suppress = on;
+}
+
+/* Sends a query to every neighbor but `except' and the origin. */
+static void send_query(struct flood *f, uint64_t id, int ttl, int hops,
+                       const struct sockaddr_in *origin, const void *payload,
+                       size_t len, const struct sockaddr_in *except)
+{
+    char hdr[P2P_HDRLEN], fixed[QUERY_LEN];
+    struct iovec iov[3];
+    struct peer_table *t = f->neighbors;
+    int i, n = 0;
+
+    if (f->tocap < t->count) {
+        f->tocap = t->cap;
+        if ( (f->to = realloc(f->to, f->tocap * sizeof(*f->to))) == NULL)
+            err_sys("realloc error");
+    }
+    for (i = 0; i < t->count; ++i) {
+        const struct sockaddr_in *a = &t->addrs[i];
+        if ((except != NULL && a->sin_addr.s_addr == except->sin_addr.s_addr &&
+                a->sin_port == except->sin_port) ||
+                (a->sin_addr.s_addr == origin->sin_addr.s_addr &&
+                 a->sin_port == origin->sin_port))
+            continue;
+        f->to[n++] = *a;
+    }
+    if (n == 0)
+        return;
+
+    memcpy(fixed, &id, 8);
+    fixed[8] = ttl;
+    fixed[9] = hops;
+    memcpy(fixed + 10, &origin->sin_addr.s_addr, 4);
+    memcpy(fixed + 14, &origin->sin_port, 2);
+
+    iov[0].iov_base = hdr;
+    iov[0].iov_len = frame_hdr(hdr, P2P_OP_FLOOD_QUERY, 0, QUERY_LEN + len);
+    iov[1].iov_base = fixed;
+    iov[1].iov_len = QUERY_LEN;
+    iov[2].iov_base = (void *) payload;
+    iov[2].iov_len = len;
+
+    int failed = send_fanoutv(f->fd, iov, 3, f->to, n, NULL, NULL);
+    f->stats.sent += n - failed;
+    f->stats.send_errors += failed;
+}
+
+/*
+ * Floods a query for `payload' to at most `ttl' hops and returns its ID,
+ * which the hits will carry.
+ */
+uint64_t flood_query(struct flood *f, const void *payload, size_t len, int ttl)
+{
+    uint64_t id = (uint64_t) random() << 33 ^ (uint64_t) random() << 2 ^
+                  random();
+
+    len = min(len, (size_t) FLOOD_MAXPAYLOAD);
+    bloom_add(f->bloom[0], id);
+    f->stats.originated++;
+    send_query(f, id, ttl, 1, &f->self, payload, len, NULL);
+
+    return id;
+}
+
+/* Answers query `q' with `payload', straight to its origin. */
+void flood_hit(struct flood *f, const struct flood_query *q,
+               const void *payload, size_t len)
+{
+    char buf[P2P_HDRLEN + 8 + FLOOD_MAXPAYLOAD];
+    size_t hdrlen;
+
+    len = min(len, (size_t) FLOOD_MAXPAYLOAD);
+    hdrlen = frame_hdr(buf, P2P_OP_FLOOD_HIT, 0, 8 + len);
+    memcpy(buf + hdrlen, &q->id, 8);
+    memcpy(buf + hdrlen + 8, payload, len);
+
+    if (sendto(f->fd, buf, hdrlen + 8 + len, 0, (const SA *) &q->origin,
+               sizeof(q->origin)) < 0)
+        f->stats.send_errors++;
+    else
+        f->stats.hits_sent++;
+}
+
+/*
+ * Handles a QUERY or a HIT from `from'. Returns 1 if the message was one of
+ * those, consumed whether or not it was valid, and 0 otherwise.
+ */
+int flood_handle(struct flood *f, const struct p2p_msg *msg,
+                 const struct sockaddr_in *from)
+{
+    uint64_t id;
+
+    if (msg->op == P2P_OP_FLOOD_HIT) {
+        if (msg->len < 8)
+            return 1;
+        memcpy(&id, msg->body, 8);
+        f->stats.hits_received++;
+        if (f->hit_cb != NULL)
+            f->hit_cb(f, id, msg->body + 8, msg->len - 8, from, f->arg);
+        return 1;
+    }
+
+    if (msg->op != P2P_OP_FLOOD_QUERY)
+        return 0;
+    if (msg->len < QUERY_LEN || msg->len - QUERY_LEN > FLOOD_MAXPAYLOAD)
+        return 1;
+
+    struct flood_query q;
+    const char *p = msg->body;
+    int ttl = (uint8_t) p[8];
+
+    memcpy(&q.id, p, 8);
+    q.hops = (uint8_t) p[9];
+    bzero(&q.origin, sizeof(q.origin));
+    q.origin.sin_family = AF_INET;
+    memcpy(&q.origin.sin_addr.s_addr, p + 10, 4);
+    memcpy(&q.origin.sin_port, p + 14, 2);
+    q.payload = p + QUERY_LEN;      /* the body's NUL ends it */
+    q.len = msg->len - QUERY_LEN;
+
+    f->stats.received++;
+    if (bloom_has(f->bloom[0], q.id) || bloom_has(f->bloom[1], q.id)) {
+        f->stats.duplicates++;
+        if (f->suppress)
+            return 1;
+    } else {
+        bloom_add(f->bloom[0], q.id);
+    }
+
+    if (f->query_cb != NULL)
+        f->query_cb(f, &q, f->arg);
+
+    if (ttl > 1)
+        send_query(f, q.id, ttl - 1, q.hops + 1, &q.origin, q.payload, q.len,
+                   from);
+    else
+        f->stats.expired++;
+
+    return 1;
+}
+
+void flood_get_stats(const struct flood *f, struct flood_stats *stats)
+{
+    int i, set = 0;
+
+    *stats = f->stats;
+    for (i = 0; i < FLOOD_BLOOM_BITS / 64; ++i)
+        set += __builtin_popcountll(f->bloom[0][i]);
+    stats->bloom_fill = (int) ((long long) set * 100 / FLOOD_BLOOM_BITS);
+}
+
+void flood_print_stats(const struct flood *f)
+{
+    struct flood_stats st;
+    flood_get_stats(f, &st);
+
+    printf("flood: %lu queries of ours, %lu received, %lu duplicates, "
+           "%lu expired\n", st.originated, st.received, st.duplicates,
+           st.expired);
+    printf("flood: %lu datagrams sent, %lu hits sent, %lu hits received, "
+           "%lu send errors\n", st.sent, st.hits_sent, st.hits_received,
+           st.send_errors);
+    printf("flood: filter %d%% full, %lu rotations\n", st.bloom_fill,
+           st.rotations);
+}
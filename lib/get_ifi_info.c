@@ -55,6 +55,9 @@ get_ifi_info(int family, int doaliases)
 			len = sizeof(struct sockaddr);
 			break;
 		}
+		/* without sa_len, the entries are whole ifreq{}s, which
+		   are larger than name + sockaddr on Linux */
+		len = max(len, sizeof(struct ifreq) - sizeof(ifr->ifr_name));
 #endif	/* HAVE_SOCKADDR_SA_LEN */
 		ptr += sizeof(ifr->ifr_name) + len;	/* for next one in buffer */
 
@@ -0,0 +1,186 @@
+#include "unpifi.h"
+#include "p2p.h"
+
+
+/*
+ * The links discovery runs on. get_ifi_info lists every interface that is
+ * up; of these we keep the IPv4 ones that aren't the loopback and can
+ * broadcast or multicast, whichever the caller needs, and add the netmask
+ * so a peer's address tells which of them it was found on.
+ *
+ * A multi-homed host thus asks on each of its links at once, instead of on
+ * the one the routing table picks for a single broadcast or group address.
+ * With an ifi_watch, the list can follow the links that come and go.
+ */
+
+static void fill(struct p2p_iface *iface, const struct ifi_info *ifi, int fd)
+{
+    bzero(iface, sizeof(*iface));
+    snprintf(iface->name, sizeof(iface->name), "%s", ifi->ifi_name);
+    iface->index = ifi->ifi_index;
+    if (iface->index == 0)
+        iface->index = if_nametoindex(ifi->ifi_name);
+    iface->flags = ifi->ifi_flags;
+    memcpy(&iface->addr, ifi->ifi_addr, sizeof(iface->addr));
+    if (ifi->ifi_brdaddr != NULL)
+        memcpy(&iface->brdaddr, ifi->ifi_brdaddr, sizeof(iface->brdaddr));
+    iface->sockfd = -1;
+
+    struct ifreq ifr;
+    bzero(&ifr, sizeof(ifr));
+    snprintf(ifr.ifr_name, sizeof(ifr.ifr_name), "%s", ifi->ifi_name);
+    if (ioctl(fd, SIOCGIFNETMASK, &ifr) == 0)
+        iface->netmask = ((struct sockaddr_in *) &ifr.ifr_addr)->sin_addr;
+    else
+        iface->netmask.s_addr = htonl(0xffffffff);   /* just the host */
+
+    /* An address configured without one reports 0.0.0.0; work it out. */
+    if ((iface->flags & IFF_BROADCAST) &&
+            iface->brdaddr.sin_addr.s_addr == htonl(INADDR_ANY)) {
+        iface->brdaddr.sin_family = AF_INET;
+        iface->brdaddr.sin_addr.s_addr =
+            iface->addr.sin_addr.s_addr | ~iface->netmask.s_addr;
+    }
+}
+
+/*
+ * Stores in *ifaces the interfaces that are up, aren't the loopback and
+ * have one of the IFF_xxx flags in `need'. With `bind_addr' not NULL, only
+ * the one with that address is taken; if none has it, the result is a
+ * single entry with just the address, index 0 and no netmask, and the
+ * routing table decides. Returns the number of entries, which may be 0.
+ */
+int iface_select(int need, const char *bind_addr, struct p2p_iface **ifaces)
+{
+    struct in_addr want;
+    if (bind_addr != NULL)
+        Inet_pton(AF_INET, bind_addr, &want);
+
+    struct ifi_info *ifi, *ifihead = get_ifi_info_nl(AF_INET, 0);
+    int fd = Socket(AF_INET, SOCK_DGRAM, 0);
+    int n = 0;
+
+    for (ifi = ifihead; ifi != NULL; ifi = ifi->ifi_next)
+        n++;
+    *ifaces = Calloc(max(n, 1), sizeof(**ifaces));
+
+    n = 0;
+    for (ifi = ifihead; ifi != NULL; ifi = ifi->ifi_next) {
+        if (ifi->ifi_addr == NULL || (ifi->ifi_flags & IFF_LOOPBACK) ||
+                (ifi->ifi_flags & need) == 0)
+            continue;
+        if (bind_addr != NULL &&
+                ((struct sockaddr_in *) ifi->ifi_addr)->sin_addr.s_addr !=
+                want.s_addr)
+            continue;
+        fill(&(*ifaces)[n++], ifi, fd);
+    }
+
+    if (bind_addr != NULL && n == 0) {
+        struct p2p_iface *iface = &(*ifaces)[n++];
+        strcpy(iface->name, "-");
+        iface->addr.sin_family = AF_INET;
+        iface->addr.sin_addr = want;
+        iface->sockfd = -1;
+    }
+
+    close(fd);
+    if (ifihead != NULL)
+        free_ifi_info(ifihead);
+
+    return n;
+}
+
+/* Appends `ifi' to *ifaces, which grows by one. Returns the new entry. */
+struct p2p_iface *iface_add(struct p2p_iface **ifaces, int *n,
+                            const struct ifi_info *ifi)
+{
+    int fd = Socket(AF_INET, SOCK_DGRAM, 0);
+
+    if ( (*ifaces = realloc(*ifaces, (*n + 1) * sizeof(**ifaces))) == NULL)
+        err_sys("realloc error");
+    struct p2p_iface *iface = &(*ifaces)[(*n)++];
+    fill(iface, ifi, fd);
+    close(fd);
+
+    return iface;
+}
+
+/* Returns the position of the entry for `ifi', or -1. */
+int iface_find(const struct p2p_iface *ifaces, int n,
+               const struct ifi_info *ifi)
+{
+    const struct sockaddr_in *addr = (const struct sockaddr_in *) ifi->ifi_addr;
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (ifaces[i].index == ifi->ifi_index &&
+                ifaces[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Removes the entry at `pos'; the last one takes its place. */
+void iface_remove(struct p2p_iface *ifaces, int *n, int pos)
+{
+    ifaces[pos] = ifaces[--*n];
+}
+
+/* Returns the interface whose subnet `addr' is on, or NULL. */
+struct p2p_iface *iface_of(struct p2p_iface *ifaces, int n,
+                           const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        uint32_t mask = ifaces[i].netmask.s_addr;
+        if ((addr->sin_addr.s_addr & mask) ==
+                (ifaces[i].addr.sin_addr.s_addr & mask))
+            return &ifaces[i];
+    }
+
+    return NULL;
+}
+
+/* Returns the index of the interface `addr' is on, or 0 if it isn't known. */
+int iface_index_of(struct p2p_iface *ifaces, int n,
+                   const struct sockaddr_in *addr)
+{
+    struct p2p_iface *iface = iface_of(ifaces, n, addr);
+
+    return iface != NULL ? iface->index : 0;
+}
+
+/* Returns 1 if `addr' is the address of one of the interfaces. */
+int iface_is_local(const struct p2p_iface *ifaces, int n,
+                   const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < n; ++i) {
+        if (ifaces[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr)
+            return 1;
+    }
+
+    return 0;
+}
+
+/* How many of the peers were found on each interface */
+void iface_print_peers(const struct p2p_iface *ifaces, int n,
+                       const struct peer_table *t)
+{
+    int i, j;
+
+    for (i = 0; i < n; ++i) {
+        int count = 0;
+        for (j = 0; j < t->count; ++j) {
+            if (t->iface[j] == ifaces[i].index)
+                count++;
+        }
+        printf("%s (%s): %d peers\n", ifaces[i].name,
+               Sock_ntop_host((const SA *) &ifaces[i].addr,
+                              sizeof(ifaces[i].addr)), count);
+    }
+}
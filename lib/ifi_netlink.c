@@ -0,0 +1,612 @@
+#include "unpifi.h"
+#include "p2p.h"
+
+/*
+ * Interface list from rtnetlink.
+ *
+ * get_ifi_info guesses at the size of the SIOCGIFCONF buffer until it stops
+ * growing, then asks for the flags, MTU and broadcast address of every
+ * interface with an ioctl each. Here one dump of the links and one of the
+ * addresses, on the same socket, bring everything at once; the ifi_info
+ * list is built from that and looks just like get_ifi_info's.
+ *
+ * An ifi_watch keeps that state up to date: its socket is also subscribed
+ * to the link and address groups, so the kernel tells it about every change
+ * as it happens. It sits on a reactor; after each batch of notifications
+ * the list is rebuilt and compared with the previous one, and the caller is
+ * told about every entry that went away or appeared. If the kernel had to
+ * drop notifications, everything is dumped again and compared the same way.
+ *
+ * Where there's no rtnetlink, get_ifi_info_nl is get_ifi_info and there's
+ * no watching.
+ */
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/rtnetlink.h>)
+#  define HAVE_RTNETLINK 1
+# endif
+#endif
+
+#ifdef HAVE_RTNETLINK
+
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define NL_BUFSIZE  16384
+#define NL_RETRIES  10      /* dumps spoiled by changes before giving up */
+
+struct nl_link {
+    int             index;
+    unsigned        flags;
+    int             mtu;
+    char            name[IFI_NAME];
+    u_char          haddr[IFI_HADDR];
+    int             hlen;
+};
+
+struct nl_addr {
+    int             index;
+    int             family;
+    u_char          local[16];  /* our address */
+    u_char          peer[16];   /* IFA_ADDRESS, the other end on a p2p link */
+    u_char          brd[4];
+    int             has_brd;
+};
+
+/* What the kernel told us so far */
+struct nl_state {
+    struct nl_link *links;
+    int             nlinks;
+    int             links_cap;
+    struct nl_addr *addrs;
+    int             naddrs;
+    int             addrs_cap;
+};
+
+struct ifi_watch {
+    struct reactor *r;
+    int             fd;
+    uint32_t        seq;
+    int             family;
+    int             doaliases;
+
+    struct nl_state st;
+    struct ifi_info *snapshot;
+
+    ifi_watch_cb    cb;
+    void           *arg;
+};
+
+
+static void state_clear(struct nl_state *st)
+{
+    free(st->links);
+    free(st->addrs);
+    bzero(st, sizeof(*st));
+}
+
+static struct nl_link *link_find(struct nl_state *st, int index)
+{
+    int i;
+
+    for (i = 0; i < st->nlinks; ++i) {
+        if (st->links[i].index == index)
+            return &st->links[i];
+    }
+
+    return NULL;
+}
+
+static int addr_len(int family)
+{
+    return family == AF_INET ? 4 : 16;
+}
+
+static struct nl_addr *addr_find(struct nl_state *st, const struct nl_addr *a)
+{
+    int i;
+
+    for (i = 0; i < st->naddrs; ++i) {
+        struct nl_addr *b = &st->addrs[i];
+        if (b->index == a->index && b->family == a->family &&
+                memcmp(b->local, a->local, addr_len(a->family)) == 0)
+            return b;
+    }
+
+    return NULL;
+}
+
+static void apply_link(struct nl_state *st, struct nlmsghdr *nh)
+{
+    struct ifinfomsg *ifi = NLMSG_DATA(nh);
+    struct nl_link *l = link_find(st, ifi->ifi_index);
+
+    if (nh->nlmsg_type == RTM_DELLINK) {
+        int i;
+        if (l != NULL)
+            *l = st->links[--st->nlinks];
+        /* Its addresses are gone with it. */
+        for (i = st->naddrs - 1; i >= 0; --i) {
+            if (st->addrs[i].index == ifi->ifi_index)
+                st->addrs[i] = st->addrs[--st->naddrs];
+        }
+        return;
+    }
+
+    if (l == NULL) {
+        if (st->nlinks == st->links_cap) {
+            st->links_cap = st->links_cap ? 2 * st->links_cap : 16;
+            st->links = realloc(st->links, st->links_cap * sizeof(*l));
+            if (st->links == NULL)
+                err_sys("realloc error");
+        }
+        l = &st->links[st->nlinks++];
+        bzero(l, sizeof(*l));
+        l->index = ifi->ifi_index;
+    }
+    l->flags = ifi->ifi_flags;
+
+    struct rtattr *rta;
+    int len = IFLA_PAYLOAD(nh);
+    for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        switch (rta->rta_type) {
+        case IFLA_IFNAME:
+            snprintf(l->name, sizeof(l->name), "%s", (char *) RTA_DATA(rta));
+            break;
+        case IFLA_MTU:
+            l->mtu = *(int *) RTA_DATA(rta);
+            break;
+        case IFLA_ADDRESS:
+            l->hlen = min(RTA_PAYLOAD(rta), IFI_HADDR);
+            memcpy(l->haddr, RTA_DATA(rta), l->hlen);
+            break;
+        }
+    }
+}
+
+static void apply_addr(struct nl_state *st, struct nlmsghdr *nh)
+{
+    struct ifaddrmsg *ifa = NLMSG_DATA(nh);
+    if (ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+        return;
+
+    struct nl_addr a;
+    bzero(&a, sizeof(a));
+    a.index = ifa->ifa_index;
+    a.family = ifa->ifa_family;
+
+    int alen = addr_len(a.family), has_local = 0;
+    struct rtattr *rta;
+    int len = IFA_PAYLOAD(nh);
+    for (rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+        if (RTA_PAYLOAD(rta) < (unsigned) alen)
+            continue;
+        switch (rta->rta_type) {
+        case IFA_LOCAL:
+            memcpy(a.local, RTA_DATA(rta), alen);
+            has_local = 1;
+            break;
+        case IFA_ADDRESS:
+            memcpy(a.peer, RTA_DATA(rta), alen);
+            break;
+        case IFA_BROADCAST:
+            memcpy(a.brd, RTA_DATA(rta), 4);
+            a.has_brd = 1;
+            break;
+        }
+    }
+    /* IPv6 only has IFA_ADDRESS, and so does IPv4 off a p2p link at times. */
+    if (!has_local)
+        memcpy(a.local, a.peer, alen);
+
+    struct nl_addr *b = addr_find(st, &a);
+    if (nh->nlmsg_type == RTM_DELADDR) {
+        if (b != NULL)
+            *b = st->addrs[--st->naddrs];
+        return;
+    }
+
+    if (b == NULL) {
+        if (st->naddrs == st->addrs_cap) {
+            st->addrs_cap = st->addrs_cap ? 2 * st->addrs_cap : 16;
+            st->addrs = realloc(st->addrs, st->addrs_cap * sizeof(a));
+            if (st->addrs == NULL)
+                err_sys("realloc error");
+        }
+        b = &st->addrs[st->naddrs++];
+    }
+    *b = a;
+}
+
+static void apply(struct nl_state *st, struct nlmsghdr *nh)
+{
+    switch (nh->nlmsg_type) {
+    case RTM_NEWLINK:
+    case RTM_DELLINK:
+        if (nh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifinfomsg)))
+            apply_link(st, nh);
+        break;
+    case RTM_NEWADDR:
+    case RTM_DELADDR:
+        if (nh->nlmsg_len >= NLMSG_LENGTH(sizeof(struct ifaddrmsg)))
+            apply_addr(st, nh);
+        break;
+    }
+}
+
+/*
+ * Reads what's there on `fd' into `st'. With `seq' not 0, blocks until the
+ * dump with that sequence number is over; what's left of older dumps is
+ * skipped. Returns 0, 1 if the dump has to be done again because the links
+ * or addresses changed while it went on or a datagram didn't fit in the
+ * buffer, or -1 with errno set; ENOBUFS means the kernel dropped
+ * notifications, or we lost one to truncation.
+ */
+static int nl_read(int fd, struct nl_state *st, uint32_t seq)
+{
+    long buf[NL_BUFSIZE / sizeof(long)];   /* nlmsghdr{}s are aligned */
+    int intr = 0;
+
+    for ( ; ; ) {
+        struct sockaddr_nl from;
+        struct iovec iov = { buf, sizeof(buf) };
+        struct msghdr msg;
+        bzero(&msg, sizeof(msg));
+        msg.msg_name = &from;
+        msg.msg_namelen = sizeof(from);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+
+        ssize_t n = recvmsg(fd, &msg, seq ? 0 : MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN && seq == 0)
+                return 0;
+            return -1;
+        }
+        if (from.nl_pid != 0)
+            continue;           /* not from the kernel */
+        if (msg.msg_flags & MSG_TRUNC) {
+            if (seq)
+                return 1;       /* and its NLMSG_DONE may be lost */
+            errno = ENOBUFS;
+            return -1;
+        }
+
+        struct nlmsghdr *nh;
+        int len = n;
+        for (nh = (struct nlmsghdr *) buf; NLMSG_OK(nh, len);
+                nh = NLMSG_NEXT(nh, len)) {
+            if (nh->nlmsg_seq != 0 && nh->nlmsg_seq != seq)
+                continue;       /* from a dump given up on */
+            if (nh->nlmsg_flags & NLM_F_DUMP_INTR)
+                intr = 1;
+            if (nh->nlmsg_type == NLMSG_DONE && seq && nh->nlmsg_seq == seq)
+                return intr;
+            if (nh->nlmsg_type == NLMSG_ERROR && seq &&
+                    nh->nlmsg_seq == seq) {
+                struct nlmsgerr *e = NLMSG_DATA(nh);
+                errno = -e->error;
+                return -1;
+            }
+            apply(st, nh);
+        }
+    }
+}
+
+static int nl_dump(int fd, struct nl_state *st, int type, uint32_t seq)
+{
+    struct {
+        struct nlmsghdr     nh;
+        union {
+            struct ifinfomsg link;
+            struct ifaddrmsg addr;
+        } u;
+    } req;
+
+    bzero(&req, sizeof(req));
+    req.nh.nlmsg_type = type;
+    req.nh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.nh.nlmsg_seq = seq;
+    if (type == RTM_GETLINK) {
+        req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.u.link));
+        req.u.link.ifi_family = AF_UNSPEC;
+    } else {
+        req.nh.nlmsg_len = NLMSG_LENGTH(sizeof(req.u.addr));
+        req.u.addr.ifa_family = AF_UNSPEC;
+    }
+
+    struct sockaddr_nl kernel;
+    bzero(&kernel, sizeof(kernel));
+    kernel.nl_family = AF_NETLINK;
+
+    if (sendto(fd, &req, req.nh.nlmsg_len, 0, (SA *) &kernel,
+               sizeof(kernel)) < 0)
+        return -1;
+
+    return nl_read(fd, st, seq);
+}
+
+/*
+ * Fills `st' afresh: the links first, so every address finds its link. Both
+ * are dumped again while either comes out inconsistent.
+ */
+static int nl_dump_all(int fd, struct nl_state *st, uint32_t *seq)
+{
+    int tries, n;
+
+    for (tries = 0; tries < NL_RETRIES; ++tries) {
+        state_clear(st);
+        if ( (n = nl_dump(fd, st, RTM_GETLINK, ++*seq)) == 0)
+            n = nl_dump(fd, st, RTM_GETADDR, ++*seq);
+        if (n <= 0)
+            return n;
+    }
+
+    errno = EBUSY;
+    return -1;
+}
+
+static int nl_open(unsigned groups)
+{
+    int fd;
+    if ( (fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC,
+                      NETLINK_ROUTE)) < 0)
+        return -1;
+
+    struct sockaddr_nl local;
+    bzero(&local, sizeof(local));
+    local.nl_family = AF_NETLINK;
+    local.nl_groups = groups;
+    if (bind(fd, (SA *) &local, sizeof(local)) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    return fd;
+}
+
+static struct sockaddr *make_sa(int family, const u_char *addr, int index)
+{
+    if (family == AF_INET) {
+        struct sockaddr_in *sin = Calloc(1, sizeof(*sin));
+        sin->sin_family = AF_INET;
+        memcpy(&sin->sin_addr, addr, 4);
+        return (struct sockaddr *) sin;
+    }
+
+    struct sockaddr_in6 *sin6 = Calloc(1, sizeof(*sin6));
+    sin6->sin6_family = AF_INET6;
+    memcpy(&sin6->sin6_addr, addr, 16);
+    if (IN6_IS_ADDR_LINKLOCAL(&sin6->sin6_addr))
+        sin6->sin6_scope_id = index;
+    return (struct sockaddr *) sin6;
+}
+
+/* The ifi_info list get_ifi_info would give for this state */
+static struct ifi_info *build(const struct nl_state *st, int family,
+                              int doaliases)
+{
+    struct ifi_info *ifihead = NULL, **ifipnext = &ifihead;
+    int i, j;
+
+    for (i = 0; i < st->nlinks; ++i) {
+        const struct nl_link *l = &st->links[i];
+        if ((l->flags & IFF_UP) == 0)
+            continue;
+
+        int naddrs = 0;
+        for (j = 0; j < st->naddrs; ++j) {
+            const struct nl_addr *a = &st->addrs[j];
+            if (a->index != l->index || a->family != family)
+                continue;
+            if (naddrs++ > 0 && doaliases == 0)
+                break;
+
+            struct ifi_info *ifi = Calloc(1, sizeof(*ifi));
+            *ifipnext = ifi;
+            ifipnext = &ifi->ifi_next;
+
+            memcpy(ifi->ifi_name, l->name, IFI_NAME);
+            ifi->ifi_index = l->index;
+            ifi->ifi_mtu = l->mtu;
+            ifi->ifi_hlen = l->hlen;
+            memcpy(ifi->ifi_haddr, l->haddr, l->hlen);
+            ifi->ifi_flags = l->flags;
+            ifi->ifi_myflags = naddrs > 1 ? IFI_ALIAS : 0;
+            ifi->ifi_addr = make_sa(family, a->local, l->index);
+
+            if (family == AF_INET && (l->flags & IFF_BROADCAST)) {
+                /* 0.0.0.0 without one, as SIOCGIFBRDADDR says */
+                u_char none[4] = { 0 };
+                ifi->ifi_brdaddr = make_sa(AF_INET,
+                                           a->has_brd ? a->brd : none, 0);
+            }
+            if (l->flags & IFF_POINTOPOINT)
+                ifi->ifi_dstaddr = make_sa(family, a->peer, l->index);
+        }
+    }
+
+    return ifihead;
+}
+
+/*
+ * Same as get_ifi_info, from one rtnetlink dump of the links and one of the
+ * addresses. Falls back to get_ifi_info if rtnetlink can't be had.
+ */
+struct ifi_info *get_ifi_info_nl(int family, int doaliases)
+{
+    struct nl_state st;
+    uint32_t seq = 0;
+    int fd;
+
+    if (family != AF_INET && family != AF_INET6)
+        return get_ifi_info(family, doaliases);
+    if ( (fd = nl_open(0)) < 0)
+        return get_ifi_info(family, doaliases);
+
+    bzero(&st, sizeof(st));
+    struct ifi_info *ifihead = NULL;
+    if (nl_dump_all(fd, &st, &seq) == 0)
+        ifihead = build(&st, family, doaliases);
+    else
+        ifihead = get_ifi_info(family, doaliases);
+
+    state_clear(&st);
+    close(fd);
+
+    return ifihead;
+}
+
+static int same_ifi(const struct ifi_info *a, const struct ifi_info *b)
+{
+    if (a->ifi_index != b->ifi_index ||
+            a->ifi_addr->sa_family != b->ifi_addr->sa_family)
+        return 0;
+
+    if (a->ifi_addr->sa_family == AF_INET)
+        return memcmp(&((struct sockaddr_in *) a->ifi_addr)->sin_addr,
+                      &((struct sockaddr_in *) b->ifi_addr)->sin_addr,
+                      sizeof(struct in_addr)) == 0;
+
+    return memcmp(&((struct sockaddr_in6 *) a->ifi_addr)->sin6_addr,
+                  &((struct sockaddr_in6 *) b->ifi_addr)->sin6_addr,
+                  sizeof(struct in6_addr)) == 0;
+}
+
+static int listed(const struct ifi_info *ifi, const struct ifi_info *list)
+{
+    for ( ; list != NULL; list = list->ifi_next) {
+        if (same_ifi(ifi, list))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Rebuilds the snapshot and tells the caller what changed. */
+static void refresh(struct ifi_watch *w)
+{
+    struct ifi_info *old = w->snapshot, *ifi;
+
+    w->snapshot = build(&w->st, w->family, w->doaliases);
+
+    for (ifi = old; ifi != NULL; ifi = ifi->ifi_next) {
+        if (!listed(ifi, w->snapshot))
+            w->cb(w, IFI_DELETED, ifi, w->arg);
+    }
+    for (ifi = w->snapshot; ifi != NULL; ifi = ifi->ifi_next) {
+        if (!listed(ifi, old))
+            w->cb(w, IFI_ADDED, ifi, w->arg);
+    }
+
+    if (old != NULL)
+        free_ifi_info(old);
+}
+
+static void on_netlink(struct reactor *r, int fd, int events, void *arg)
+{
+    struct ifi_watch *w = arg;
+
+    if (nl_read(fd, &w->st, 0) < 0) {
+        if (errno != ENOBUFS) {
+            err_ret("rtnetlink read error");
+            return;
+        }
+        /* Missed some; start over from a fresh dump. */
+        if (nl_dump_all(fd, &w->st, &w->seq) < 0) {
+            err_ret("rtnetlink dump error");
+            return;
+        }
+    }
+
+    refresh(w);
+}
+
+/*
+ * Starts watching the interfaces of `family' on `r'. The snapshot is there
+ * at once; from then on cb is called, from the reactor, for every entry
+ * that leaves or joins it, with IFI_DELETED or IFI_ADDED. The ifi_info is
+ * only good during the call. Returns NULL with errno set if rtnetlink isn't
+ * available.
+ */
+struct ifi_watch *ifi_watch_create(struct reactor *r, int family,
+                                   int doaliases, ifi_watch_cb cb, void *arg)
+{
+    unsigned groups = RTMGRP_LINK;
+    if (family == AF_INET)
+        groups |= RTMGRP_IPV4_IFADDR;
+    else if (family == AF_INET6)
+        groups |= RTMGRP_IPV6_IFADDR;
+    else {
+        errno = EAFNOSUPPORT;
+        return NULL;
+    }
+
+    int fd;
+    if ( (fd = nl_open(groups)) < 0)
+        return NULL;
+
+    struct ifi_watch *w = Calloc(1, sizeof(*w));
+    w->r = r;
+    w->fd = fd;
+    w->family = family;
+    w->doaliases = doaliases;
+    w->cb = cb;
+    w->arg = arg;
+
+    /* Notifications that come with the dump are applied along with it. */
+    if (nl_dump_all(fd, &w->st, &w->seq) < 0 ||
+            reactor_add(r, fd, REACTOR_IN, on_netlink, w) < 0) {
+        int saved = errno;
+        close(fd);
+        state_clear(&w->st);
+        free(w);
+        errno = saved;
+        return NULL;
+    }
+    w->snapshot = build(&w->st, family, doaliases);
+
+    return w;
+}
+
+void ifi_watch_free(struct ifi_watch *w)
+{
+    reactor_del(w->r, w->fd);
+    close(w->fd);
+    state_clear(&w->st);
+    if (w->snapshot != NULL)
+        free_ifi_info(w->snapshot);
+    free(w);
+}
+
+/* The interfaces as of the last notification; owned by the watch. */
+const struct ifi_info *ifi_watch_snapshot(const struct ifi_watch *w)
+{
+    return w->snapshot;
+}
+
+#else   /* !HAVE_RTNETLINK */
+
+struct ifi_info *get_ifi_info_nl(int family, int doaliases)
+{
+    return get_ifi_info(family, doaliases);
+}
+
+struct ifi_watch *ifi_watch_create(struct reactor *r, int family,
+                                   int doaliases, ifi_watch_cb cb, void *arg)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void ifi_watch_free(struct ifi_watch *w)
+{
+}
+
+const struct ifi_info *ifi_watch_snapshot(const struct ifi_watch *w)
+{
+    return NULL;
+}
+
+#endif  /* HAVE_RTNETLINK */
@@ -0,0 +1,965 @@
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * Kademlia (Maymounkov and Mazieres, 2002) over the chat framing.
+ *
+ * Every node has a random 160-bit ID, and the distance between two IDs is
+ * their XOR. A node keeps, for each bit position, a k-bucket of up to KAD_K
+ * contacts whose distance from it has that bit as its highest; so it knows
+ * many nodes near itself and a few far away. A bucket that is full only
+ * takes a newcomer if the contact seen the longest ago doesn't answer a
+ * ping: old contacts that are still there are the most likely to stay.
+ *
+ * A lookup asks the KAD_ALPHA known nodes nearest the target for the nodes
+ * they know nearest to it, then asks the nearest of those, KAD_ALPHA at a
+ * time, until the KAD_K nearest nodes it heard of have all answered. Each
+ * round at least halves the distance, so it takes O(log N) hops. A lookup
+ * for a value stops at the first node that has it.
+ *
+ * All messages start with the sender's ID and a transaction ID that the
+ * answer carries back; anyone we hear from goes into the routing table.
+ * As with swim.c, the caller reads the socket and hands each message to
+ * kad_handle; requests and answers must use the same socket.
+ */
+#define KAD_ALPHA       3       /* queries in flight per lookup */
+#define KAD_BUCKETS     (8 * KAD_ID_LEN)
+#define KAD_SHORTLIST   (3 * KAD_K)     /* candidates kept per lookup */
+#define KAD_RPC_MS      500
+#define KAD_EXPIRE_MS   (60 * 60 * 1000)
+#define KAD_MAXVALUES   4096    /* stored for others */
+
+#define PREFIX_LEN      (KAD_ID_LEN + 4)        /* sender, txid */
+#define CONTACT_LEN     (KAD_ID_LEN + 4 + 2)    /* id, addr, port */
+
+struct kad_bucket {
+    struct kad_contact     *c;          /* seen the longest ago first */
+    int                     n;
+    struct kad_contact      pending;    /* if the first one doesn't answer */
+    int                     has_pending;
+};
+
+struct kad_value {
+    uint8_t                 key[KAD_ID_LEN];
+    uint64_t                expires;
+    size_t                  len;
+    char                    data[KAD_MAXVALUE];
+};
+
+enum { CAND_NEW, CAND_ASKED, CAND_DONE, CAND_FAILED };
+
+struct kad_cand {
+    struct kad_contact      c;
+    uint8_t                 dist[KAD_ID_LEN];
+    int                     state;
+    int                     hop;        /* queries from us to learn of it */
+};
+
+struct kad_lookup {
+    struct kad             *k;
+    uint8_t                 target[KAD_ID_LEN];
+    int                     op;         /* P2P_OP_KAD_FIND_xxx */
+    struct kad_cand         cand[KAD_SHORTLIST];    /* nearest first */
+    int                     n;
+    int                     inflight;
+    int                     rpcs;
+    int                     timeouts;
+    uint64_t                started;
+    int                     done;
+
+    int                     store;      /* then store the value at the nearest */
+    size_t                  vlen;
+    char                    value[KAD_MAXVALUE];
+
+    kad_cb                  cb;
+    void                   *arg;
+    struct kad_lookup      *next, *prev;
+};
+
+struct kad_rpc {
+    struct kad             *k;
+    uint32_t                txid;
+    uint8_t                 id[KAD_ID_LEN];     /* of the node asked */
+    struct kad_lookup      *lookup;     /* or NULL */
+    int                     evict;      /* bucket, if a ping of its oldest */
+    int                     join;
+    struct reactor_timer   *timer;
+};
+
+struct kad {
+    struct reactor         *r;
+    int                     fd;
+    uint8_t                 id[KAD_ID_LEN];
+    uint32_t                next_txid;
+
+    struct kad_bucket       buckets[KAD_BUCKETS];
+    int                     ncontacts;
+
+    struct kad_value       *values;
+    int                     nvalues;
+    int                     vcap;
+
+    struct kad_rpc        **rpcs;
+    int                     nrpcs;
+    int                     rcap;
+
+    struct kad_lookup      *lookups;
+
+    int                     joining;
+    int                     join_left;  /* bootstrap pings unanswered */
+    int                     refresh;    /* next bucket to refresh on joining */
+    int                     refreshing; /* refresh lookups going */
+    kad_cb                  join_cb;
+    void                   *join_arg;
+
+    struct kad_stats        stats;
+};
+
+
+static void distance(uint8_t *d, const uint8_t *a, const uint8_t *b)
+{
+    int i;
+
+    for (i = 0; i < KAD_ID_LEN; ++i)
+        d[i] = a[i] ^ b[i];
+}
+
+/* The bucket of `id': the highest bit where it differs from ours, or -1. */
+static int bucket_of(const struct kad *k, const uint8_t *id)
+{
+    int i, bit;
+
+    for (i = 0; i < KAD_ID_LEN; ++i) {
+        uint8_t d = k->id[i] ^ id[i];
+        if (d == 0)
+            continue;
+        for (bit = 7; (d & (1 << bit)) == 0; --bit)
+            ;
+        return (KAD_ID_LEN - 1 - i) * 8 + bit;
+    }
+
+    return -1;
+}
+
+static char *put_contact(char *p, const struct kad_contact *c)
+{
+    memcpy(p, c->id, KAD_ID_LEN);
+    memcpy(p + KAD_ID_LEN, &c->addr.sin_addr.s_addr, 4);
+    memcpy(p + KAD_ID_LEN + 4, &c->addr.sin_port, 2);
+
+    return p + CONTACT_LEN;
+}
+
+static const char *get_contact(const char *p, struct kad_contact *c)
+{
+    memcpy(c->id, p, KAD_ID_LEN);
+    bzero(&c->addr, sizeof(c->addr));
+    c->addr.sin_family = AF_INET;
+    memcpy(&c->addr.sin_addr.s_addr, p + KAD_ID_LEN, 4);
+    memcpy(&c->addr.sin_port, p + KAD_ID_LEN + 4, 2);
+
+    return p + CONTACT_LEN;
+}
+
+/* Sends `op' with our ID, `txid' and `len' more bytes of body. */
+static void send_op(struct kad *k, int op, uint32_t txid, const void *body,
+                    size_t len, const struct sockaddr_in *to)
+{
+    char buf[P2P_HDRLEN + PREFIX_LEN + 1 + KAD_K * CONTACT_LEN];
+    uint32_t n = htonl(txid);
+    size_t hdrlen = frame_hdr(buf, op, 0, PREFIX_LEN + len);
+
+    memcpy(buf + hdrlen, k->id, KAD_ID_LEN);
+    memcpy(buf + hdrlen + KAD_ID_LEN, &n, 4);
+    memcpy(buf + hdrlen + PREFIX_LEN, body, len);
+
+    if (sendto(k->fd, buf, hdrlen + PREFIX_LEN + len, 0, (const SA *) to,
+               sizeof(*to)) < 0)
+        k->stats.send_errors++;
+}
+
+
+/* Routing table */
+
+static int bucket_find(const struct kad_bucket *b, const uint8_t *id)
+{
+    int i;
+
+    for (i = 0; i < b->n; ++i) {
+        if (memcmp(b->c[i].id, id, KAD_ID_LEN) == 0)
+            return i;
+    }
+
+    return -1;
+}
+
+static void bucket_append(struct kad *k, struct kad_bucket *b,
+                          const struct kad_contact *c)
+{
+    if (b->c == NULL)
+        b->c = Calloc(KAD_K, sizeof(*b->c));
+    b->c[b->n++] = *c;
+    k->ncontacts++;
+}
+
+static void bucket_remove(struct kad *k, struct kad_bucket *b, int pos)
+{
+    memmove(&b->c[pos], &b->c[pos + 1], (b->n - pos - 1) * sizeof(*b->c));
+    b->n--;
+    k->ncontacts--;
+
+    if (b->has_pending) {
+        b->has_pending = 0;
+        bucket_append(k, b, &b->pending);
+    }
+}
+
+static struct kad_rpc *rpc_start(struct kad*, const uint8_t*,
+                                 struct kad_lookup*);
+static void rpc_send(struct kad*, struct kad_rpc*, int, const void*, size_t,
+                     const struct sockaddr_in*);
+
+/* We heard from `c': it goes to the end of its bucket, if there's room. */
+static void update(struct kad *k, const struct kad_contact *c)
+{
+    int i = bucket_of(k, c->id);
+    if (i < 0)
+        return;     /* ourselves */
+
+    struct kad_bucket *b = &k->buckets[i];
+    int pos = bucket_find(b, c->id);
+    if (pos >= 0) {
+        memmove(&b->c[pos], &b->c[pos + 1], (b->n - pos - 1) * sizeof(*b->c));
+        b->c[b->n - 1] = *c;
+        return;
+    }
+
+    if (b->n < KAD_K) {
+        bucket_append(k, b, c);
+        return;
+    }
+
+    /* The newest one waits while the oldest is asked if it's still there. */
+    int asking = b->has_pending;
+    b->pending = *c;
+    b->has_pending = 1;
+    if (!asking) {
+        struct kad_rpc *rpc = rpc_start(k, b->c[0].id, NULL);
+        rpc->evict = i;
+        rpc_send(k, rpc, P2P_OP_KAD_PING, NULL, 0, &b->c[0].addr);
+    }
+}
+
+/* A contact that missed an answer is dropped. */
+static void forget(struct kad *k, const uint8_t *id)
+{
+    int i = bucket_of(k, id);
+    if (i < 0)
+        return;
+
+    struct kad_bucket *b = &k->buckets[i];
+    int pos = bucket_find(b, id);
+    if (pos >= 0) {
+        bucket_remove(k, b, pos);
+        k->stats.evicted++;
+    }
+}
+
+/*
+ * Stores in `out' up to `want' of the contacts nearest `target', nearest
+ * first. Most contacts are further than the ones kept so far and cost one
+ * comparison.
+ */
+static int closest(const struct kad *k, const uint8_t *target,
+                   struct kad_cand *out, int want)
+{
+    struct kad_cand cand;
+    int i, j, n = 0;
+
+    for (i = 0; i < KAD_BUCKETS; ++i) {
+        const struct kad_bucket *b = &k->buckets[i];
+        for (j = 0; j < b->n; ++j) {
+            distance(cand.dist, b->c[j].id, target);
+            if (n == want && memcmp(cand.dist, out[n - 1].dist, KAD_ID_LEN) >= 0)
+                continue;
+
+            int pos = n < want ? n++ : n - 1;
+            while (pos > 0 && memcmp(cand.dist, out[pos - 1].dist, KAD_ID_LEN) < 0) {
+                out[pos] = out[pos - 1];
+                pos--;
+            }
+            out[pos].c = b->c[j];
+            memcpy(out[pos].dist, cand.dist, KAD_ID_LEN);
+            out[pos].state = CAND_NEW;
+            out[pos].hop = 1;
+        }
+    }
+
+    return n;
+}
+
+
+/* Values stored for others */
+
+static struct kad_value *value_find(struct kad *k, const uint8_t *key)
+{
+    uint64_t now = now_ms();
+    int i;
+
+    for (i = 0; i < k->nvalues; ++i) {
+        if (k->values[i].expires <= now) {
+            k->values[i--] = k->values[--k->nvalues];
+            continue;
+        }
+        if (memcmp(k->values[i].key, key, KAD_ID_LEN) == 0)
+            return &k->values[i];
+    }
+
+    return NULL;
+}
+
+static void value_store(struct kad *k, const uint8_t *key, const void *data,
+                        size_t len)
+{
+    struct kad_value *v = value_find(k, key);
+
+    if (v == NULL) {
+        if (k->nvalues == KAD_MAXVALUES)
+            return;
+        if (k->nvalues == k->vcap) {
+            k->vcap = k->vcap ? 2 * k->vcap : 16;
+            k->values = realloc(k->values, k->vcap * sizeof(*v));
+            if (k->values == NULL)
+                err_sys("realloc error");
+        }
+        v = &k->values[k->nvalues++];
+        memcpy(v->key, key, KAD_ID_LEN);
+    }
+
+    v->len = min(len, KAD_MAXVALUE);
+    memcpy(v->data, data, v->len);
+    v->expires = now_ms() + KAD_EXPIRE_MS;
+}
+
+
+/* RPCs: a request waits for the answer with the same txid, or times out. */
+
+static void on_rpc_timeout(struct reactor*, void*);
+
+static struct kad_rpc *rpc_start(struct kad *k, const uint8_t *id,
+                                 struct kad_lookup *l)
+{
+    struct kad_rpc *rpc = Calloc(1, sizeof(*rpc));
+
+    rpc->k = k;
+    rpc->txid = k->next_txid++;
+    memcpy(rpc->id, id, KAD_ID_LEN);
+    rpc->lookup = l;
+    rpc->evict = -1;
+
+    if (k->nrpcs == k->rcap) {
+        k->rcap = k->rcap ? 2 * k->rcap : 16;
+        k->rpcs = realloc(k->rpcs, k->rcap * sizeof(*k->rpcs));
+        if (k->rpcs == NULL)
+            err_sys("realloc error");
+    }
+    k->rpcs[k->nrpcs++] = rpc;
+
+    return rpc;
+}
+
+static void rpc_send(struct kad *k, struct kad_rpc *rpc, int op,
+                     const void *body, size_t len, const struct sockaddr_in *to)
+{
+    send_op(k, op, rpc->txid, body, len, to);
+    rpc->timer = reactor_timer(k->r, KAD_RPC_MS, 0, on_rpc_timeout, rpc);
+    k->stats.rpcs++;
+}
+
+/* Takes the RPC for `txid' off the list; NULL if there is none. */
+static struct kad_rpc *rpc_end(struct kad *k, uint32_t txid)
+{
+    int i;
+
+    for (i = 0; i < k->nrpcs; ++i) {
+        if (k->rpcs[i]->txid == txid) {
+            struct kad_rpc *rpc = k->rpcs[i];
+            k->rpcs[i] = k->rpcs[--k->nrpcs];
+            return rpc;
+        }
+    }
+
+    return NULL;
+}
+
+
+/* Lookups */
+
+static void lookup_step(struct kad_lookup*);
+static void join_done(struct kad*, const struct kad_result*, void*);
+
+static struct kad_lookup *lookup_start(struct kad *k, const uint8_t *target,
+                                       int op, kad_cb cb, void *arg)
+{
+    struct kad_lookup *l = Calloc(1, sizeof(*l));
+
+    l->k = k;
+    memcpy(l->target, target, KAD_ID_LEN);
+    l->op = op;
+    l->cb = cb;
+    l->arg = arg;
+    l->started = now_ms();
+    l->n = closest(k, target, l->cand, KAD_K);
+
+    l->next = k->lookups;
+    if (k->lookups != NULL)
+        k->lookups->prev = l;
+    k->lookups = l;
+    k->stats.lookups++;
+
+    return l;
+}
+
+static void lookup_free(struct kad_lookup *l)
+{
+    struct kad *k = l->k;
+
+    if (l->prev != NULL)
+        l->prev->next = l->next;
+    else
+        k->lookups = l->next;
+    if (l->next != NULL)
+        l->next->prev = l->prev;
+    free(l);
+}
+
+static struct kad_cand *lookup_cand(struct kad_lookup *l, const uint8_t *id)
+{
+    int i;
+
+    for (i = 0; i < l->n; ++i) {
+        if (memcmp(l->cand[i].c.id, id, KAD_ID_LEN) == 0)
+            return &l->cand[i];
+    }
+
+    return NULL;
+}
+
+/* Takes a contact we were told of, if it's among the nearest so far. */
+static void lookup_learn(struct kad_lookup *l, const struct kad_contact *c,
+                         int hop)
+{
+    struct kad_cand cand;
+
+    if (memcmp(c->id, l->k->id, KAD_ID_LEN) == 0 || lookup_cand(l, c->id))
+        return;
+
+    cand.c = *c;
+    distance(cand.dist, c->id, l->target);
+    cand.state = CAND_NEW;
+    cand.hop = hop;
+
+    int pos = l->n;
+    while (pos > 0 && memcmp(cand.dist, l->cand[pos - 1].dist, KAD_ID_LEN) < 0)
+        pos--;
+    if (pos == KAD_SHORTLIST)
+        return;
+
+    int n = min(l->n, KAD_SHORTLIST - 1);
+    memmove(&l->cand[pos + 1], &l->cand[pos], (n - pos) * sizeof(cand));
+    l->cand[pos] = cand;
+    l->n = n + 1;
+}
+
+/*
+ * Ends the lookup: with the value, if one was found, and the nearest nodes
+ * that answered. A store goes out to those now.
+ */
+static void lookup_finish(struct kad_lookup *l, const struct kad_cand *from,
+                          const void *value, size_t len)
+{
+    struct kad *k = l->k;
+    struct kad_contact near[KAD_K];
+    struct kad_result res;
+    int i, n = 0, hops = 0;
+
+    l->done = 1;
+    for (i = 0; i < l->n && n < KAD_K; ++i) {
+        if (l->cand[i].state == CAND_DONE) {
+            near[n++] = l->cand[i].c;
+            hops = max(hops, l->cand[i].hop);
+        }
+    }
+
+    if (l->store) {
+        char body[KAD_ID_LEN + KAD_MAXVALUE];
+        memcpy(body, l->target, KAD_ID_LEN);
+        memcpy(body + KAD_ID_LEN, l->value, l->vlen);
+        for (i = 0; i < n; ++i)
+            send_op(k, P2P_OP_KAD_STORE, k->next_txid++, body,
+                    KAD_ID_LEN + l->vlen, &near[i].addr);
+
+        /* We may be one of the nearest ourselves, or the only node. */
+        uint8_t ours[KAD_ID_LEN], theirs[KAD_ID_LEN];
+        distance(ours, k->id, l->target);
+        if (n > 0)
+            distance(theirs, near[n - 1].id, l->target);
+        if (n < KAD_K || memcmp(ours, theirs, KAD_ID_LEN) < 0)
+            value_store(k, l->target, l->value, l->vlen);
+    }
+
+    bzero(&res, sizeof(res));
+    if (value != NULL) {
+        res.found = 1;
+        res.value = value;
+        res.len = len;
+        hops = from->hop;
+        k->stats.found++;
+
+        /*
+         * Cache it at the nearest node that didn't have it: the one that
+         * answered with it is done too, and may be the nearest.
+         */
+        for (i = 0; i < n; ++i) {
+            if (memcmp(near[i].id, from->c.id, KAD_ID_LEN) != 0)
+                break;
+        }
+        if (i < n) {
+            char body[KAD_ID_LEN + KAD_MAXVALUE];
+            memcpy(body, l->target, KAD_ID_LEN);
+            memcpy(body + KAD_ID_LEN, value, len);
+            send_op(k, P2P_OP_KAD_STORE, k->next_txid++, body,
+                    KAD_ID_LEN + len, &near[i].addr);
+        }
+    }
+    res.closest = near;
+    res.nclosest = n;
+    res.hops = hops;
+    res.rpcs = l->rpcs;
+    res.timeouts = l->timeouts;
+    res.elapsed_ms = now_ms() - l->started;
+    k->stats.hops += hops;
+
+    if (l->cb != NULL)
+        l->cb(k, &res, l->arg);
+    if (l->inflight == 0)
+        lookup_free(l);
+}
+
+/* Asks the nearest candidates not asked yet, or ends the lookup. */
+static void lookup_step(struct kad_lookup *l)
+{
+    int i, considered = 0;
+
+    for (i = 0; i < l->n && considered < KAD_K; ++i) {
+        struct kad_cand *c = &l->cand[i];
+        if (c->state == CAND_FAILED)
+            continue;
+        considered++;
+        if (c->state != CAND_NEW || l->inflight >= KAD_ALPHA)
+            continue;
+
+        struct kad_rpc *rpc = rpc_start(l->k, c->c.id, l);
+        rpc_send(l->k, rpc, l->op, l->target, KAD_ID_LEN, &c->c.addr);
+        c->state = CAND_ASKED;
+        l->inflight++;
+        l->rpcs++;
+    }
+
+    /* The KAD_K nearest we know of have all answered, or failed. */
+    if (l->inflight == 0)
+        lookup_finish(l, NULL, NULL, 0);
+}
+
+/* An answer to a lookup query, or NULL for a timeout */
+static void lookup_answer(struct kad_lookup *l, const uint8_t *id,
+                          const struct p2p_msg *msg)
+{
+    struct kad_cand *c = lookup_cand(l, id);
+    int hop = c != NULL ? c->hop : 1;
+
+    l->inflight--;
+    if (c != NULL)
+        c->state = msg != NULL ? CAND_DONE : CAND_FAILED;
+    if (msg == NULL)
+        l->timeouts++;
+
+    if (l->done) {
+        if (l->inflight == 0)
+            lookup_free(l);
+        return;
+    }
+
+    if (msg != NULL && msg->op == P2P_OP_KAD_VALUE && l->op == P2P_OP_KAD_FIND_VALUE) {
+        struct kad_cand from = c != NULL ? *c : l->cand[0];
+        from.hop = hop;
+        lookup_finish(l, &from, msg->body + PREFIX_LEN, msg->len - PREFIX_LEN);
+        return;
+    }
+
+    if (msg != NULL && msg->op == P2P_OP_KAD_NODES && msg->len > PREFIX_LEN) {
+        const char *p = msg->body + PREFIX_LEN + 1;
+        int i, n = (unsigned char) msg->body[PREFIX_LEN];
+        n = min(n, (int) ((msg->len - PREFIX_LEN - 1) / CONTACT_LEN));
+        for (i = 0; i < n; ++i) {
+            struct kad_contact contact;
+            p = get_contact(p, &contact);
+            lookup_learn(l, &contact, hop + 1);
+        }
+    }
+
+    lookup_step(l);
+}
+
+static void on_rpc_timeout(struct reactor *r, void *arg)
+{
+    struct kad_rpc *rpc = arg;
+    struct kad *k = rpc->k;
+
+    rpc_end(k, rpc->txid);
+    k->stats.timeouts++;
+    forget(k, rpc->id);
+
+    if (rpc->evict >= 0) {
+        /* forget() put the pending contact in its place. */
+    } else if (rpc->join) {
+        if (--k->join_left == 0 && k->joining) {
+            struct kad_result res;
+            bzero(&res, sizeof(res));
+            k->joining = 0;
+            if (k->join_cb != NULL)
+                k->join_cb(k, &res, k->join_arg);
+        }
+    } else if (rpc->lookup != NULL) {
+        lookup_answer(rpc->lookup, rpc->id, NULL);
+    }
+
+    free(rpc);
+}
+
+
+/*
+ * Starts a node on `r', with the UDP socket `sockfd' it is reached at, bound
+ * to `self'. Its ID is a hash of that and of the time.
+ */
+struct kad *kad_create(struct reactor *r, int sockfd,
+                       const struct sockaddr_in *self)
+{
+    struct kad *k = Calloc(1, sizeof(*k));
+    struct {
+        struct sockaddr_in  addr;
+        pid_t               pid;
+        uint64_t            now;
+        void               *k;
+    } seed;
+
+    bzero(&seed, sizeof(seed));
+    seed.addr = *self;
+    seed.pid = getpid();
+    seed.now = now_ms();
+    seed.k = k;
+    sha1(&seed, sizeof(seed), k->id);
+
+    k->r = r;
+    k->fd = sockfd;
+    k->next_txid = (uint32_t) random();
+
+    return k;
+}
+
+void kad_free(struct kad *k)
+{
+    int i;
+
+    for (i = 0; i < k->nrpcs; ++i) {
+        reactor_cancel(k->r, k->rpcs[i]->timer);
+        free(k->rpcs[i]);
+    }
+    while (k->lookups != NULL)
+        lookup_free(k->lookups);
+    for (i = 0; i < KAD_BUCKETS; ++i)
+        free(k->buckets[i].c);
+    free(k->rpcs);
+    free(k->values);
+    free(k);
+}
+
+const uint8_t *kad_id(const struct kad *k)
+{
+    return k->id;
+}
+
+/* The key a user name is stored under */
+void kad_key(const char *name, uint8_t key[KAD_ID_LEN])
+{
+    sha1(name, strlen(name), key);
+}
+
+static void random_id_in(const struct kad *k, int bucket, uint8_t *id)
+{
+    int byte = KAD_ID_LEN - 1 - bucket / 8, bit = bucket % 8, i;
+
+    memcpy(id, k->id, KAD_ID_LEN);
+    id[byte] ^= 1 << bit;
+    id[byte] ^= random() & ((1 << bit) - 1);
+    for (i = byte + 1; i < KAD_ID_LEN; ++i)
+        id[i] = random();
+}
+
+static void refresh_done(struct kad*, const struct kad_result*, void*);
+
+/* Keeps KAD_ALPHA refresh lookups going until every bucket had one. */
+static void refresh_more(struct kad *k)
+{
+    while (k->refreshing < KAD_ALPHA && k->refresh < KAD_BUCKETS) {
+        uint8_t id[KAD_ID_LEN];
+        random_id_in(k, k->refresh++, id);
+        k->refreshing++;
+        lookup_step(lookup_start(k, id, P2P_OP_KAD_FIND_NODE, refresh_done,
+                                 NULL));
+    }
+}
+
+static void refresh_done(struct kad *k, const struct kad_result *res,
+                         void *arg)
+{
+    k->refreshing--;
+    refresh_more(k);
+}
+
+/*
+ * The lookup of our own ID found our neighbours. The buckets further out
+ * than the nearest of them are filled by looking up an ID in each; there
+ * are up to 159 of them, so a few at a time rather than in one burst.
+ */
+static void join_done(struct kad *k, const struct kad_result *res, void *arg)
+{
+    int i, nearest = KAD_BUCKETS;
+
+    for (i = 0; i < KAD_BUCKETS; ++i) {
+        if (k->buckets[i].n > 0) {
+            nearest = i;
+            break;
+        }
+    }
+    k->refresh = nearest + 1;
+    refresh_more(k);
+
+    if (k->join_cb != NULL)
+        k->join_cb(k, res, k->join_arg);
+}
+
+/*
+ * Joins the network through the nodes at `addrs': once one of them answers,
+ * our own ID is looked up, which introduces us to our neighbours. cb gets
+ * the result of that, or an empty one if nobody answered.
+ */
+void kad_join(struct kad *k, const struct sockaddr_in *addrs, int n,
+              kad_cb cb, void *arg)
+{
+    static const uint8_t unknown[KAD_ID_LEN];
+    int i;
+
+    k->joining = 1;
+    k->join_left = n;
+    k->join_cb = cb;
+    k->join_arg = arg;
+
+    for (i = 0; i < n; ++i) {
+        struct kad_rpc *rpc = rpc_start(k, unknown, NULL);
+        rpc->join = 1;
+        rpc_send(k, rpc, P2P_OP_KAD_PING, NULL, 0, &addrs[i]);
+    }
+
+    if (n == 0) {
+        struct kad_result res;
+        bzero(&res, sizeof(res));
+        k->joining = 0;
+        if (cb != NULL)
+            cb(k, &res, arg);
+    }
+}
+
+/* Finds the KAD_K nodes nearest `target'. */
+void kad_find_node(struct kad *k, const uint8_t *target, kad_cb cb, void *arg)
+{
+    lookup_step(lookup_start(k, target, P2P_OP_KAD_FIND_NODE, cb, arg));
+}
+
+/* Finds the value stored under `key'; res->found tells if there is one. */
+void kad_find_value(struct kad *k, const uint8_t *key, kad_cb cb, void *arg)
+{
+    struct kad_value *v = value_find(k, key);
+
+    if (v != NULL) {
+        struct kad_result res;
+        bzero(&res, sizeof(res));
+        res.found = 1;
+        res.value = v->data;
+        res.len = v->len;
+        k->stats.lookups++;
+        k->stats.found++;
+        if (cb != NULL)
+            cb(k, &res, arg);
+        return;
+    }
+
+    lookup_step(lookup_start(k, key, P2P_OP_KAD_FIND_VALUE, cb, arg));
+}
+
+/*
+ * Stores `len' bytes at `value' under `key' on the KAD_K nodes nearest it.
+ * Values expire after KAD_EXPIRE_MS, so they have to be stored again now
+ * and then.
+ */
+void kad_store(struct kad *k, const uint8_t *key, const void *value,
+               size_t len, kad_cb cb, void *arg)
+{
+    struct kad_lookup *l = lookup_start(k, key, P2P_OP_KAD_FIND_NODE, cb, arg);
+
+    l->store = 1;
+    l->vlen = min(len, KAD_MAXVALUE);
+    memcpy(l->value, value, l->vlen);
+    lookup_step(l);
+}
+
+/* Answers a FIND_NODE, or a FIND_VALUE for a value we don't have. */
+static void send_nodes(struct kad *k, uint32_t txid, const uint8_t *target,
+                       const struct sockaddr_in *to)
+{
+    struct kad_cand near[KAD_K];
+    char body[1 + KAD_K * CONTACT_LEN], *p = body + 1;
+    int i, n = closest(k, target, near, KAD_K);
+
+    body[0] = n;
+    for (i = 0; i < n; ++i)
+        p = put_contact(p, &near[i].c);
+
+    send_op(k, P2P_OP_KAD_NODES, txid, body, p - body, to);
+}
+
+/*
+ * Hands a received message to the node; `from' is where it came from.
+ * Returns 1 if it was a Kademlia message, which is then taken care of, and
+ * 0 for the caller to go on with it.
+ */
+int kad_handle(struct kad *k, const struct p2p_msg *msg,
+               const struct sockaddr_in *from)
+{
+    if (msg->op < P2P_OP_KAD_PING || msg->op > P2P_OP_KAD_STORE)
+        return 0;
+    if ((msg->flags & P2P_FL_LEGACY) || msg->len < PREFIX_LEN)
+        return 1;
+
+    struct kad_contact sender;
+    uint32_t txid;
+    memcpy(sender.id, msg->body, KAD_ID_LEN);
+    sender.addr = *from;
+    memcpy(&txid, msg->body + KAD_ID_LEN, 4);
+    txid = ntohl(txid);
+
+    k->stats.received++;
+    update(k, &sender);
+
+    const uint8_t *arg = (const uint8_t *) msg->body + PREFIX_LEN;
+    size_t arglen = msg->len - PREFIX_LEN;
+    struct kad_value *v;
+    struct kad_rpc *rpc;
+
+    switch (msg->op) {
+    case P2P_OP_KAD_PING:
+        send_op(k, P2P_OP_KAD_PONG, txid, NULL, 0, from);
+        break;
+
+    case P2P_OP_KAD_FIND_NODE:
+        if (arglen >= KAD_ID_LEN)
+            send_nodes(k, txid, arg, from);
+        break;
+
+    case P2P_OP_KAD_FIND_VALUE:
+        if (arglen < KAD_ID_LEN)
+            break;
+        if ( (v = value_find(k, arg)) != NULL)
+            send_op(k, P2P_OP_KAD_VALUE, txid, v->data, v->len, from);
+        else
+            send_nodes(k, txid, arg, from);
+        break;
+
+    case P2P_OP_KAD_STORE:
+        if (arglen < KAD_ID_LEN)
+            break;
+        value_store(k, arg, arg + KAD_ID_LEN, arglen - KAD_ID_LEN);
+        k->stats.stored++;
+        break;
+
+    case P2P_OP_KAD_PONG:
+    case P2P_OP_KAD_NODES:
+    case P2P_OP_KAD_VALUE:
+        if ( (rpc = rpc_end(k, txid)) == NULL)
+            break;      /* late, or not ours */
+        reactor_cancel(k->r, rpc->timer);
+
+        if (rpc->join) {
+            k->join_left--;
+            if (k->joining) {
+                k->joining = 0;
+                struct kad_lookup *l = lookup_start(k, k->id,
+                        P2P_OP_KAD_FIND_NODE, join_done, NULL);
+                lookup_step(l);
+            }
+        } else if (rpc->lookup != NULL) {
+            lookup_answer(rpc->lookup, rpc->id, msg);
+        }
+        /* An eviction ping answered: update() kept the oldest. */
+        if (rpc->evict >= 0)
+            k->buckets[rpc->evict].has_pending = 0;
+        free(rpc);
+        break;
+    }
+
+    return 1;
+}
+
+/* Up to `want' contacts from the routing table, nearest `target' first */
+int kad_closest(const struct kad *k, const uint8_t *target,
+                struct kad_contact *out, int want)
+{
+    struct kad_cand *near = Malloc(max(want, 1) * sizeof(*near));
+    int i, n = want > 0 ? closest(k, target, near, want) : 0;
+
+    for (i = 0; i < n; ++i)
+        out[i] = near[i].c;
+    free(near);
+
+    return n;
+}
+
+void kad_get_stats(const struct kad *k, struct kad_stats *stats)
+{
+    int i;
+
+    *stats = k->stats;
+    stats->contacts = k->ncontacts;
+    stats->values = k->nvalues;
+    stats->buckets = 0;
+    for (i = 0; i < KAD_BUCKETS; ++i) {
+        if (k->buckets[i].n > 0)
+            stats->buckets++;
+    }
+}
+
+void kad_print_stats(const struct kad *k)
+{
+    struct kad_stats st;
+    kad_get_stats(k, &st);
+
+    printf("kad: id %02x%02x%02x%02x..., %d contacts in %d buckets, "
+           "%d values\n", k->id[0], k->id[1], k->id[2], k->id[3],
+           st.contacts, st.buckets, st.values);
+    printf("kad: %lu lookups, %lu values found, %.2f hops avg\n",
+           st.lookups, st.found, st.lookups ? (double) st.hops / st.lookups : 0.0);
+    printf("kad: %lu rpcs, %lu timeouts, %lu evicted, %lu received, "
+           "%lu stored, %lu send errors\n", st.rpcs, st.timeouts, st.evicted,
+           st.received, st.stored, st.send_errors);
+}
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE     /* recvmmsg */
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * A batch is a preallocated ring of `cap' receive buffers from the message
+ * pool, each with its own iovec and source address, so a single recvmmsg can
+ * drain everything that queued up on a socket since the last wakeup.
+ */
+struct msg_batch *msg_batch_create(int cap)
+{
+    struct msg_batch *b = Calloc(1, sizeof(*b));
+
+    b->cap = cap;
+    b->bufs = Calloc(cap, sizeof(*b->bufs));
+    b->addrs = Calloc(cap, sizeof(*b->addrs));
+    b->lens = Calloc(cap, sizeof(*b->lens));
+
+    int i;
+    for (i = 0; i < cap; ++i)
+        b->bufs[i] = Msg_pool_get();
+
+#ifdef MSG_WAITFORONE
+    b->iovs = Calloc(cap, sizeof(*b->iovs));
+    b->hdrs = Calloc(cap, sizeof(*b->hdrs));
+
+    for (i = 0; i < cap; ++i) {
+        b->iovs[i].iov_base = b->bufs[i];
+        b->iovs[i].iov_len = P2P_MAXMSG;
+
+        b->hdrs[i].msg_hdr.msg_iov = &b->iovs[i];
+        b->hdrs[i].msg_hdr.msg_iovlen = 1;
+        b->hdrs[i].msg_hdr.msg_name = &b->addrs[i];
+    }
+#endif
+
+    return b;
+}
+
+void msg_batch_free(struct msg_batch *b)
+{
+    int i;
+    for (i = 0; i < b->cap; ++i)
+        msg_pool_put(b->bufs[i]);
+
+    free(b->bufs);
+    free(b->addrs);
+    free(b->lens);
+#ifdef MSG_WAITFORONE
+    free(b->iovs);
+    free(b->hdrs);
+#endif
+    free(b);
+}
+
+static void batch_account(struct msg_batch *b, int n)
+{
+    int bucket = 0;
+
+    b->wakeups++;
+    b->received += n;
+    if (n > b->max_per_wakeup)
+        b->max_per_wakeup = n;
+
+    /* Histogram of batch sizes in powers of two: 1, 2-3, 4-7, ... */
+    while (n > 1 && bucket < BATCH_HIST - 1) {
+        n >>= 1;
+        bucket++;
+    }
+    b->hist[bucket]++;
+}
+
+/*
+ * Receives up to `cap' datagrams from `sockfd' without blocking once the
+ * first one is in. The socket should already be readable.
+ *
+ * Returns the number of datagrams now in the batch, 0 if none were waiting,
+ * or -1 with errno set.
+ */
+int recv_batch(int sockfd, struct msg_batch *b)
+{
+    int n;
+
+#ifdef MSG_WAITFORONE
+    int i;
+    for (i = 0; i < b->cap; ++i)
+        b->hdrs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+
+    n = recvmmsg(sockfd, b->hdrs, b->cap, MSG_DONTWAIT, NULL);
+    if (n < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            n = 0;
+        else
+            return -1;
+    }
+
+    for (i = 0; i < n; ++i)
+        b->lens[i] = b->hdrs[i].msg_len;
+#else
+    /* No recvmmsg: drain with plain recvfrom calls instead. */
+    for (n = 0; n < b->cap; ++n) {
+        socklen_t addrlen = sizeof(b->addrs[n]);
+        ssize_t len = recvfrom(sockfd, b->bufs[n],
+                               P2P_MAXMSG, MSG_DONTWAIT,
+                               (SA *) &b->addrs[n], &addrlen);
+        if (len < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (n == 0)
+                return -1;
+            break;
+        }
+        b->lens[n] = len;
+    }
+#endif
+
+    b->count = n;
+    if (n > 0)
+        batch_account(b, n);
+
+    return n;
+}
+
+/*
+ * Decodes the i-th datagram of the last recv_batch in place and points
+ * `peeraddr' at its source address.
+ *
+ * Returns 0 or -1 with errno set on a malformed frame.
+ */
+int batch_message(struct msg_batch *b, int i, struct p2p_msg *msg,
+                  struct sockaddr_in **peeraddr)
+{
+    *peeraddr = &b->addrs[i];
+
+    return frame_decode(b->bufs[i], b->lens[i], MSG_POOL_BUFSIZE, msg);
+}
+
+void batch_stats(const struct msg_batch *b, const char *name)
+{
+    printf("%s: %lu datagrams in %lu wakeups (%.2f avg, %d max)\n", name,
+           b->received, b->wakeups,
+           b->wakeups ? (double) b->received / b->wakeups : 0.0,
+           b->max_per_wakeup);
+
+    int i;
+    for (i = 0; i < BATCH_HIST; ++i) {
+        if (b->hist[i] > 0)
+            printf("  %4d-%-4d %lu\n", 1 << i, (2 << i) - 1, b->hist[i]);
+    }
+}
@@ -0,0 +1,154 @@
+#define _GNU_SOURCE     /* sendmmsg */
+#include "unp.h"
+#include "p2p.h"
+
+
+int fanout_d_flag = 0;  /* log every send; can be set by caller */
+
+#define FANOUT_CHUNK 64 /* messages handed to one sendmmsg */
+
+
+static void fanout_fail(const struct sockaddr_in *peer, int err, int *errs,
+                        int i, struct fanout_stats *stats)
+{
+    if (errs)
+        errs[i] = err;
+    if (stats)
+        stats->failures++;
+    if (fanout_d_flag)
+        fprintf(stderr, "fanout to %s failed: %s\n",
+                Sock_ntop((SA *) peer, sizeof(*peer)), strerror(err));
+}
+
+/*
+ * Sends the same message, gathered from `iov', to each of the `npeers'
+ * addresses in `peers'. The whole peer table goes out in as few sendmmsg
+ * calls as possible; a failing peer is skipped and the rest still get the
+ * message.
+ *
+ * If `errs' is not NULL, errs[i] is set to 0 or to the errno of the failed
+ * send to peers[i]. Returns the number of peers the send failed for.
+ */
+int send_fanoutv(int sockfd, const struct iovec *iov, int iovcnt,
+                 const struct sockaddr_in *peers, int npeers, int *errs,
+                 struct fanout_stats *stats)
+{
+    int failed = 0;
+    int i;
+
+    if (errs)
+        memset(errs, 0, npeers * sizeof(*errs));
+    if (stats)
+        stats->messages++;
+
+    if (fanout_d_flag) {
+        for (i = 0; i < npeers; ++i)
+            fprintf(stderr, "Sending to %s\n",
+                    Sock_ntop((SA *) &peers[i], sizeof(peers[i])));
+    }
+
+#ifdef MSG_WAITFORONE
+    struct mmsghdr hdrs[FANOUT_CHUNK];
+    int base = 0;
+    while (base < npeers) {
+        int count = min(npeers - base, FANOUT_CHUNK);
+        for (i = 0; i < count; ++i) {
+            bzero(&hdrs[i], sizeof(hdrs[i]));
+            hdrs[i].msg_hdr.msg_name = (void *) &peers[base + i];
+            hdrs[i].msg_hdr.msg_namelen = sizeof(peers[base + i]);
+            hdrs[i].msg_hdr.msg_iov = (struct iovec *) iov;
+            hdrs[i].msg_hdr.msg_iovlen = iovcnt;
+        }
+
+        int n = sendmmsg(sockfd, hdrs, count, 0);
+        if (stats)
+            stats->syscalls++;
+
+        /*
+         * sendmmsg stops at the first failing message. If some were sent the
+         * error is lost, so just go on; the next call reports it for the
+         * peer at the front.
+         */
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fanout_fail(&peers[base], errno, errs, base, stats);
+            ++failed;
+            ++base;
+        } else {
+            if (stats)
+                stats->sends += n;
+            base += n;
+        }
+    }
+#else
+    struct msghdr hdr;
+    bzero(&hdr, sizeof(hdr));
+    hdr.msg_iov = (struct iovec *) iov;
+    hdr.msg_iovlen = iovcnt;
+    for (i = 0; i < npeers; ++i) {
+        hdr.msg_name = (void *) &peers[i];
+        hdr.msg_namelen = sizeof(peers[i]);
+        if (stats)
+            stats->syscalls++;
+        if (sendmsg(sockfd, &hdr, 0) < 0) {
+            fanout_fail(&peers[i], errno, errs, i, stats);
+            ++failed;
+        } else if (stats) {
+            stats->sends++;
+        }
+    }
+#endif
+
+    return failed;
+}
+
+int send_fanout(int sockfd, const void *buf, size_t len,
+                const struct sockaddr_in *peers, int npeers, int *errs,
+                struct fanout_stats *stats)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) buf;
+    iov.iov_len = len;
+
+    return send_fanoutv(sockfd, &iov, 1, peers, npeers, errs, stats);
+}
+
+/*
+ * Like send_fanoutv, but reports each peer the send failed for with err_msg
+ * instead of handing back an error array. The array it uses internally grows
+ * with `npeers' and is kept between calls. Returns the number of failures.
+ */
+int send_fanout_report(int sockfd, const struct iovec *iov, int iovcnt,
+                       const struct sockaddr_in *peers, int npeers,
+                       struct fanout_stats *stats)
+{
+    static int *errs;
+    static int errs_cap;
+    int failed, i;
+
+    if (errs_cap < npeers) {
+        errs_cap = npeers;
+        if ( (errs = realloc(errs, errs_cap * sizeof(*errs))) == NULL)
+            err_sys("realloc error");
+    }
+
+    if ( (failed = send_fanoutv(sockfd, iov, iovcnt, peers, npeers, errs,
+                                stats)) == 0)
+        return 0;
+
+    for (i = 0; i < npeers; ++i) {
+        if (errs[i] != 0)
+            err_msg("send to %s failed: %s",
+                    Sock_ntop((SA *) &peers[i], sizeof(peers[i])),
+                    strerror(errs[i]));
+    }
+
+    return failed;
+}
+
+void fanout_print_stats(const struct fanout_stats *stats)
+{
+    printf("fanout: %lu messages, %lu sends in %lu syscalls, %lu failed\n",
+           stats->messages, stats->sends, stats->syscalls, stats->failures);
+}
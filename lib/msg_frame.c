@@ -0,0 +1,205 @@
+#include "unp.h"
+#include "p2p.h"
+
+#include <ctype.h>
+
+
+const char auth_can_frame[P2P_HDRLEN] = {
+    (char) P2P_MAGIC, P2P_OP_AUTH_CAN, 0, 0, 0, 0
+};
+const char auth_ofc_frame[P2P_HDRLEN] = {
+    (char) P2P_MAGIC, P2P_OP_AUTH_OFC, 0, 0, 0, 0
+};
+const char heartbeat_frame[P2P_HDRLEN] = {
+    (char) P2P_MAGIC, P2P_OP_HEARTBEAT, 0, 0, 0, 0
+};
+
+/*
+ * Writes a frame header for a body of `len' bytes into `hdr', which must have
+ * room for P2P_HDRLEN bytes. Returns the number of bytes written.
+ */
+size_t frame_hdr(char *hdr, int op, int flags, size_t len)
+{
+    struct p2p_hdr h;
+
+    h.magic = P2P_MAGIC;
+    h.op = op;
+    h.flags = htons(flags);
+    h.len = htons(len);
+    memcpy(hdr, &h, P2P_HDRLEN);
+
+    return P2P_HDRLEN;
+}
+
+/*
+ * Writes a whole frame into `out', which must have room for P2P_HDRLEN + len
+ * bytes. Returns the frame length.
+ */
+size_t frame_encode(char *out, int op, const char *body, size_t len)
+{
+    size_t hdrlen = frame_hdr(out, op, 0, len);
+    memcpy(out + hdrlen, body, len);
+
+    return hdrlen + len;
+}
+
+static int is_legacy(const char *buf, size_t n)
+{
+    return n >= 4 &&
+           isxdigit((unsigned char) buf[0]) && isxdigit((unsigned char) buf[1]) &&
+           isxdigit((unsigned char) buf[2]) && isxdigit((unsigned char) buf[3]);
+}
+
+/*
+ * Parses the `n' bytes of a frame held in `buf' (of size `buflen') in place.
+ * Both the binary format and the old pkt-line format are understood.
+ * The body is NUL-terminated, so `buf' must have room for one more byte.
+ *
+ * Returns 0 on success and -1 with errno set on a malformed frame.
+ */
+int frame_decode(char *buf, size_t n, size_t buflen, struct p2p_msg *msg)
+{
+    if (n >= buflen) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    if (n >= P2P_HDRLEN && (uint8_t) buf[0] == P2P_MAGIC) {
+        struct p2p_hdr h;
+        memcpy(&h, buf, P2P_HDRLEN);
+
+        msg->op = h.op;
+        msg->flags = ntohs(h.flags);
+        msg->body = buf + P2P_HDRLEN;
+        msg->len = ntohs(h.len);
+        if (P2P_HDRLEN + msg->len > n) {
+            errno = EBADMSG;
+            return -1;
+        }
+        /* Gossip comes after a pad byte, which takes the body's NUL. */
+        msg->gossip = NULL;
+        msg->gossip_len = 0;
+        if ((msg->flags & P2P_FL_GOSSIP) && P2P_HDRLEN + msg->len + 1 < n) {
+            msg->gossip = msg->body + msg->len + 1;
+            msg->gossip_len = n - P2P_HDRLEN - msg->len - 1;
+        }
+    } else if (is_legacy(buf, n)) {
+        /* The datagram size is authoritative; the hex length adds a NUL. */
+        msg->body = buf + 4;
+        msg->len = n - 4;
+        msg->flags = P2P_FL_LEGACY;
+        msg->gossip = NULL;
+        msg->gossip_len = 0;
+
+        if (strncmp(msg->body, AUTH_CAN, strlen(AUTH_CAN)) == 0)
+            msg->op = P2P_OP_AUTH_CAN;
+        else if (strncmp(msg->body, AUTH_OFC, strlen(AUTH_OFC)) == 0)
+            msg->op = P2P_OP_AUTH_OFC;
+        else
+            msg->op = P2P_OP_CHAT;
+    } else {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    msg->body[msg->len] = 0;
+
+    return 0;
+}
+
+
+/*
+ * Reads one datagram into the caller-supplied `buf' and decodes it in place.
+ * This is a single recvfrom; nothing is peeked at or allocated.
+ *
+ * Returns the datagram size, or -1 with errno set on a socket error or a
+ * malformed frame (EBADMSG).
+ */
+ssize_t recv_message(int sockfd, char *buf, size_t buflen, struct p2p_msg *msg,
+                     SA *peeraddr, socklen_t *peeraddr_len)
+{
+    ssize_t n = recvfrom(sockfd, buf, buflen - 1, 0, peeraddr, peeraddr_len);
+    if (n < 0)
+        return -1;
+
+    if (frame_decode(buf, n, buflen, msg) < 0)
+        return -1;
+
+    return n;
+}
+
+/*
+ * The length of the message at the start of the `n' bytes in `buf', or 0 if
+ * those don't tell yet. Both formats have at least four bytes before the
+ * body, which is enough to learn it. Returns -1 with errno set on garbage.
+ */
+static ssize_t frame_length(char *buf, size_t n)
+{
+    if (n >= 1 && (uint8_t) buf[0] == P2P_MAGIC) {
+        struct p2p_hdr h;
+        if (n < P2P_HDRLEN)
+            return 0;
+        memcpy(&h, buf, P2P_HDRLEN);
+        return P2P_HDRLEN + ntohs(h.len);
+    }
+    if (n < 4)
+        return 0;
+    if (!is_legacy(buf, n)) {
+        errno = EBADMSG;
+        return -1;
+    }
+
+    /* The pkt-line length counts a NUL that was never sent. */
+    ssize_t total = (ssize_t) hex_to_int(buf) - 1;
+    if (total < 4) {
+        errno = EBADMSG;
+        return -1;
+    }
+    return total;
+}
+
+/*
+ * Returns the next whole message from the non-blocking stream socket `fd',
+ * reading what's there into `in' until one is; a peer that sends half a
+ * message keeps nobody else waiting. The body stays good until the next
+ * call.
+ *
+ * Returns the message size, 0 on EOF, or -1 with errno set; EAGAIN means
+ * the rest hasn't come yet.
+ */
+ssize_t stream_read_message(int fd, struct stream_in *in, struct p2p_msg *msg)
+{
+    if (in->used > 0) {
+        in->buf[in->used] = in->save;
+        memmove(in->buf, in->buf + in->used, in->len - in->used);
+        in->len -= in->used;
+        in->used = 0;
+    }
+
+    for ( ; ; ) {
+        ssize_t total = frame_length(in->buf, in->len);
+        if (total < 0)
+            return -1;
+        if (total >= (ssize_t) sizeof(in->buf)) {
+            errno = EMSGSIZE;
+            return -1;
+        }
+        if (total > 0 && in->len >= (size_t) total) {
+            in->save = in->buf[total];
+            if (frame_decode(in->buf, total, sizeof(in->buf), msg) < 0)
+                return -1;
+            in->used = total;
+            return total;
+        }
+
+        ssize_t n = read(fd, in->buf + in->len, sizeof(in->buf) - 1 - in->len);
+        if (n == 0)
+            return 0;
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        in->len += n;
+    }
+}
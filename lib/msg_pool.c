@@ -0,0 +1,170 @@
+#include "unpthread.h"
+#include "p2p.h"
+
+
+/*
+ * Fixed-size message buffers of MSG_POOL_BUFSIZE bytes, carved out of slabs
+ * that are never given back to malloc. Each thread keeps a small cache of
+ * free buffers and only takes the pool lock to refill or flush half of it,
+ * so steady-state gets and puts touch no shared state at all.
+ */
+#define MSG_POOL_SLAB   64  /* buffers malloc'd at a time */
+#define MSG_POOL_CACHE  32  /* buffers cached per thread */
+
+struct free_buf {
+    struct free_buf *next;
+};
+
+struct buf_cache {
+    int      count;
+    void    *bufs[MSG_POOL_CACHE];
+};
+
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+static struct free_buf *pool_free;
+static int pool_nfree;
+static int pool_total;
+static int pool_max = MSG_POOL_MAX;
+static struct msg_pool_stats pool_stats;
+
+static __thread struct buf_cache cache;
+
+static pthread_key_t cache_key;
+static pthread_once_t cache_once = PTHREAD_ONCE_INIT;
+
+
+static void cache_flush(int);
+
+/* Gives a dying thread's cached buffers back to the pool. */
+static void cache_destructor(void *ptr)
+{
+    cache_flush(cache.count);
+}
+
+static void cache_key_create(void)
+{
+    Pthread_key_create(&cache_key, cache_destructor);
+}
+
+/* Must be called with pool_mutex held. */
+static int pool_grow(void)
+{
+    int n = min(MSG_POOL_SLAB, pool_max - pool_total);
+    if (n <= 0)
+        return -1;
+
+    char *slab = malloc(n * MSG_POOL_BUFSIZE);
+    if (slab == NULL)
+        return -1;
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        struct free_buf *b = (struct free_buf *) (slab + i * MSG_POOL_BUFSIZE);
+        b->next = pool_free;
+        pool_free = b;
+    }
+    pool_nfree += n;
+    pool_total += n;
+    pool_stats.slabs++;
+
+    return 0;
+}
+
+/* Moves up to half a cache worth of buffers from the pool to this thread. */
+static void cache_refill(void)
+{
+    Pthread_once(&cache_once, cache_key_create);
+    /* Any non-NULL value makes the destructor run at thread exit. */
+    Pthread_setspecific(cache_key, &cache);
+
+    Pthread_mutex_lock(&pool_mutex);
+    pool_stats.refills++;
+    while (cache.count < MSG_POOL_CACHE / 2) {
+        if (pool_free == NULL && pool_grow() < 0)
+            break;
+
+        cache.bufs[cache.count++] = pool_free;
+        pool_free = pool_free->next;
+        pool_nfree--;
+    }
+    Pthread_mutex_unlock(&pool_mutex);
+}
+
+/* Moves the last `n' cached buffers of this thread back to the pool. */
+static void cache_flush(int n)
+{
+    Pthread_mutex_lock(&pool_mutex);
+    pool_stats.flushes++;
+    while (n-- > 0) {
+        struct free_buf *b = cache.bufs[--cache.count];
+        b->next = pool_free;
+        pool_free = b;
+        pool_nfree++;
+    }
+    Pthread_mutex_unlock(&pool_mutex);
+}
+
+/*
+ * Returns a buffer of MSG_POOL_BUFSIZE bytes, or NULL if the pool has hit
+ * its limit and every buffer is in use.
+ */
+void *msg_pool_get(void)
+{
+    if (cache.count == 0)
+        cache_refill();
+
+    if (cache.count == 0) {
+        __atomic_add_fetch(&pool_stats.exhausted, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    return cache.bufs[--cache.count];
+}
+
+void msg_pool_put(void *buf)
+{
+    if (buf == NULL)
+        return;
+
+    if (cache.count == MSG_POOL_CACHE)
+        cache_flush(MSG_POOL_CACHE / 2);
+
+    cache.bufs[cache.count++] = buf;
+}
+
+void *Msg_pool_get(void)
+{
+    void *buf;
+
+    if ( (buf = msg_pool_get()) == NULL)
+        err_quit("message pool exhausted (%d buffers)", pool_max);
+    return buf;
+}
+
+/* Caps the number of buffers the pool may ever allocate. */
+void msg_pool_limit(int max_bufs)
+{
+    Pthread_mutex_lock(&pool_mutex);
+    pool_max = max_bufs;
+    Pthread_mutex_unlock(&pool_mutex);
+}
+
+void msg_pool_get_stats(struct msg_pool_stats *stats)
+{
+    Pthread_mutex_lock(&pool_mutex);
+    *stats = pool_stats;
+    stats->total = pool_total;
+    stats->free = pool_nfree;
+    Pthread_mutex_unlock(&pool_mutex);
+}
+
+void msg_pool_print_stats(void)
+{
+    struct msg_pool_stats stats;
+    msg_pool_get_stats(&stats);
+
+    printf("pool: %d buffers in %lu slabs, %d free in pool, "
+           "%lu refills, %lu flushes, %lu exhausted\n",
+           stats.total, stats.slabs, stats.free,
+           stats.refills, stats.flushes, stats.exhausted);
+}
@@ -0,0 +1,172 @@
+#include "unp.h"
+#include "p2p.h"
+
+#include <sys/eventfd.h>
+
+
+/*
+ * A bounded lock-free queue of pointers for handing messages from worker
+ * threads to the thread that owns the terminal. Any number of threads may
+ * push; pushes never block and fail when the queue is full.
+ *
+ * Every cell carries a sequence number telling whose turn it is: a producer
+ * claims a cell by advancing the enqueue position with a CAS and publishes
+ * it by bumping the cell's sequence, so producers only contend on that one
+ * counter and never wait for each other.
+ *
+ * The consumer sleeps on an eventfd. Producers only write to it when the
+ * consumer said it is about to sleep, so a busy queue costs no syscalls.
+ */
+#define CACHE_LINE 64
+
+struct queue_cell {
+    unsigned long    seq;
+    void            *item;
+};
+
+struct msg_queue {
+    struct queue_cell   *cells;
+    unsigned long        mask;
+    int                  efd;
+
+    char                 pad0[CACHE_LINE];
+    unsigned long        enqueue_pos;
+    char                 pad1[CACHE_LINE];
+    unsigned long        dequeue_pos;
+    int                  sleeping;      /* the consumer wants a wakeup */
+    char                 pad2[CACHE_LINE];
+
+    struct msg_queue_stats stats;
+};
+
+
+/* `cap' is rounded up to a power of two. */
+struct msg_queue *msg_queue_create(int cap)
+{
+    struct msg_queue *q = Calloc(1, sizeof(*q));
+    unsigned long n = 1, i;
+
+    while (n < (unsigned long) cap)
+        n <<= 1;
+
+    if ( (q->efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0) {
+        free(q);
+        return NULL;
+    }
+
+    q->cells = Calloc(n, sizeof(*q->cells));
+    q->mask = n - 1;
+    for (i = 0; i < n; ++i)
+        q->cells[i].seq = i;
+    q->sleeping = 1;
+
+    return q;
+}
+
+void msg_queue_free(struct msg_queue *q)
+{
+    close(q->efd);
+    free(q->cells);
+    free(q);
+}
+
+/* Readable when the consumer should call msg_queue_pop. */
+int msg_queue_fd(const struct msg_queue *q)
+{
+    return q->efd;
+}
+
+/* Returns 0, or -1 if the queue is full. */
+int msg_queue_push(struct msg_queue *q, void *item)
+{
+    struct queue_cell *cell;
+    unsigned long pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+
+    for ( ; ; ) {
+        cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) (seq - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->enqueue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            __atomic_add_fetch(&q->stats.dropped, 1, __ATOMIC_RELAXED);
+            return -1;
+        } else {
+            pos = __atomic_load_n(&q->enqueue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    cell->item = item;
+    __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+    /* Pairs with the fence in msg_queue_sleep. */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&q->sleeping, __ATOMIC_RELAXED) &&
+            __atomic_exchange_n(&q->sleeping, 0, __ATOMIC_RELAXED)) {
+        uint64_t one = 1;
+        __atomic_add_fetch(&q->stats.wakeups, 1, __ATOMIC_RELAXED);
+        if (write(q->efd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+            err_ret("eventfd write error");
+    }
+
+    return 0;
+}
+
+/* Returns the oldest item, or NULL if the queue is empty. */
+void *msg_queue_pop(struct msg_queue *q)
+{
+    struct queue_cell *cell;
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+
+    for ( ; ; ) {
+        cell = &q->cells[pos & q->mask];
+        unsigned long seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+        long diff = (long) (seq - (pos + 1));
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&q->dequeue_pos, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+                break;
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+        }
+    }
+
+    void *item = cell->item;
+    __atomic_store_n(&cell->seq, pos + q->mask + 1, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&q->stats.popped, 1, __ATOMIC_RELAXED);
+
+    return item;
+}
+
+/*
+ * Called by the consumer once msg_queue_pop returned NULL: asks for a wakeup
+ * on the next push. Returns 1 if something was pushed in the meantime and
+ * the consumer should keep popping instead of going to sleep.
+ */
+int msg_queue_sleep(struct msg_queue *q)
+{
+    uint64_t count;
+    if (read(q->efd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+        err_ret("eventfd read error");
+
+    __atomic_store_n(&q->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    unsigned long pos = __atomic_load_n(&q->dequeue_pos, __ATOMIC_RELAXED);
+    struct queue_cell *cell = &q->cells[pos & q->mask];
+
+    return __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) == pos + 1;
+}
+
+void msg_queue_get_stats(struct msg_queue *q, struct msg_queue_stats *stats)
+{
+    stats->popped = __atomic_load_n(&q->stats.popped, __ATOMIC_RELAXED);
+    stats->dropped = __atomic_load_n(&q->stats.dropped, __ATOMIC_RELAXED);
+    stats->wakeups = __atomic_load_n(&q->stats.wakeups, __ATOMIC_RELAXED);
+}
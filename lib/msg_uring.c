@@ -0,0 +1,705 @@
+#include "unp.h"
+#include "p2p.h"
+
+/*
+ * io_uring engine for the UDP data path.
+ *
+ * Receives are multishot recvmsg requests kept posted on each socket; the
+ * kernel picks a buffer from a provided buffer ring for every datagram, so
+ * one submission keeps delivering until the ring runs dry. A fan-out is one
+ * sendmsg SQE per peer, all handed to the kernel with a single io_uring_enter.
+ *
+ * The ring descriptor is pollable, so the engine plugs into the reactor like
+ * any other descriptor: when it's readable, msg_uring_process reaps the
+ * completions.
+ *
+ * This talks to the kernel directly through <linux/io_uring.h>; no liburing.
+ * Where the header or the kernel support is missing, msg_uring_create fails
+ * and callers keep using recvmmsg/sendmmsg.
+ */
+#if defined(__linux__) && defined(__has_include)
+# if __has_include(<linux/io_uring.h>)
+#  define HAVE_IO_URING 1
+# endif
+#endif
+
+#ifdef HAVE_IO_URING
+
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#define URING_ENTRIES   256     /* SQ size; the CQ is twice that */
+#define URING_RESERVE   (2 * URING_MAXSOCKS)    /* SQEs kept for receives */
+#define URING_BGID      0       /* provided buffer group */
+
+/* What multishot recvmsg puts ahead of the datagram, then a whole frame */
+#define URING_BUFSIZE   (sizeof(struct io_uring_recvmsg_out) + \
+                         sizeof(struct sockaddr_in) + MSG_POOL_BUFSIZE)
+
+/* user_data of receive requests; send contexts are pointers, never this low */
+#define UD_CANCEL       0
+#define UD_RECV_BASE    1
+#define UD_RECV_MAX     (UD_RECV_BASE + URING_MAXSOCKS)
+
+#define load_acquire(p)     __atomic_load_n((p), __ATOMIC_ACQUIRE)
+#define store_release(p, v) __atomic_store_n((p), (v), __ATOMIC_RELEASE)
+
+struct uring_fanout;
+
+/* One sendmsg of a fan-out; its address is the SQE's user_data. */
+struct uring_send {
+    struct msghdr        hdr;
+    struct uring_fanout *fanout;
+};
+
+/* One in-flight fan-out; freed when the last of its sends completes. */
+struct uring_fanout {
+    int                  pending;
+    int                  queued;    /* sends handed to the SQ so far */
+    int                  npeers;
+    int                  sockfd;
+    char                *buf;       /* copy of the payload, from the pool */
+    struct iovec         iov;
+    struct sockaddr_in  *peers;
+    struct uring_send   *sends;
+    struct uring_fanout *next;      /* in the backlog */
+};
+
+struct msg_uring {
+    int                      fd;
+    unsigned                 sq_entries;
+    unsigned                *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned                *sq_flags;
+    unsigned                 cq_entries;
+    unsigned                *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe     *sqes;
+    struct io_uring_cqe     *cqes;
+    void                    *sq_ptr, *cq_ptr;
+    size_t                   sq_len, cq_len;
+    unsigned                 to_submit;
+    unsigned                 inflight;  /* requests owing a last completion */
+    unsigned                 sending;   /* sends queued or in flight */
+    unsigned                 max_sending;
+    struct uring_fanout     *backlog;   /* sends waiting for CQ room */
+    struct uring_fanout    **backlog_tail;
+
+    struct io_uring_buf_ring *br;
+    size_t                   br_len;
+    unsigned                 nbufs;
+    uint16_t                 br_tail;
+    char                    *bufs;      /* nbufs of URING_BUFSIZE */
+
+    int                      socks[URING_MAXSOCKS];
+    struct msghdr            recv_hdr;  /* template for multishot recvmsg */
+
+    struct fanout_stats     *fanout;
+    struct uring_stats       stats;
+};
+
+
+static int sys_io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                              unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned opcode, void *arg,
+                                 unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+
+static int uring_map(struct msg_uring *u, struct io_uring_params *p)
+{
+    u->sq_len = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    u->cq_len = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP)
+        u->sq_len = u->cq_len = max(u->sq_len, u->cq_len);
+
+    u->sq_ptr = mmap(NULL, u->sq_len, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQ_RING);
+    if (u->sq_ptr == MAP_FAILED)
+        return -1;
+
+    if (p->features & IORING_FEAT_SINGLE_MMAP) {
+        u->cq_ptr = u->sq_ptr;
+    } else {
+        u->cq_ptr = mmap(NULL, u->cq_len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_CQ_RING);
+        if (u->cq_ptr == MAP_FAILED)
+            return -1;
+    }
+
+    u->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe),
+                   PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQES);
+    if (u->sqes == MAP_FAILED)
+        return -1;
+
+    char *sq = u->sq_ptr, *cq = u->cq_ptr;
+    u->sq_entries = p->sq_entries;
+    u->sq_head = (unsigned *) (sq + p->sq_off.head);
+    u->sq_tail = (unsigned *) (sq + p->sq_off.tail);
+    u->sq_mask = (unsigned *) (sq + p->sq_off.ring_mask);
+    u->sq_array = (unsigned *) (sq + p->sq_off.array);
+    u->sq_flags = (unsigned *) (sq + p->sq_off.flags);
+    u->cq_entries = p->cq_entries;
+    u->cq_head = (unsigned *) (cq + p->cq_off.head);
+    u->cq_tail = (unsigned *) (cq + p->cq_off.tail);
+    u->cq_mask = (unsigned *) (cq + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *) (cq + p->cq_off.cqes);
+
+    return 0;
+}
+
+/* Hands buffer `bid' (back) to the kernel through the provided buffer ring. */
+static void buf_ring_add(struct msg_uring *u, unsigned bid)
+{
+    struct io_uring_buf *b = &u->br->bufs[u->br_tail & (u->nbufs - 1)];
+
+    b->addr = (uintptr_t) (u->bufs + bid * URING_BUFSIZE);
+    b->len = URING_BUFSIZE;
+    b->bid = bid;
+    u->br_tail++;
+    store_release(&u->br->tail, u->br_tail);
+}
+
+static int buf_ring_setup(struct msg_uring *u, unsigned nbufs)
+{
+    u->nbufs = nbufs;
+    u->br_len = nbufs * sizeof(struct io_uring_buf);
+    u->br = mmap(NULL, u->br_len, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->br == MAP_FAILED) {
+        u->br = NULL;
+        return -1;
+    }
+
+    struct io_uring_buf_reg reg;
+    bzero(&reg, sizeof(reg));
+    reg.ring_addr = (uintptr_t) u->br;
+    reg.ring_entries = nbufs;
+    reg.bgid = URING_BGID;
+    if (sys_io_uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0)
+        return -1;
+
+    u->bufs = Malloc(nbufs * URING_BUFSIZE);
+    unsigned i;
+    for (i = 0; i < nbufs; ++i)
+        buf_ring_add(u, i);
+
+    return 0;
+}
+
+/*
+ * Sets up a ring with `nbufs' receive buffers (a power of two, at most
+ * half the CQ). Fan-out counters go to `fanout', which may be NULL.
+ *
+ * Returns NULL with errno set if the kernel can't do what we need.
+ */
+struct msg_uring *msg_uring_create(unsigned nbufs, struct fanout_stats *fanout)
+{
+    struct msg_uring *u = Calloc(1, sizeof(*u));
+    struct io_uring_params p;
+    int i;
+
+    for (i = 0; i < URING_MAXSOCKS; ++i)
+        u->socks[i] = -1;
+    u->fanout = fanout;
+    u->fd = -1;
+    u->backlog_tail = &u->backlog;
+
+    bzero(&p, sizeof(p));
+    if ( (u->fd = sys_io_uring_setup(URING_ENTRIES, &p)) < 0)
+        goto fail;
+    /*
+     * The receive msghdr is shared by every re-armed request, and a lost
+     * completion would leak a fan-out context; insist on both guarantees.
+     */
+    if (!(p.features & IORING_FEAT_SUBMIT_STABLE) ||
+            !(p.features & IORING_FEAT_NODROP)) {
+        errno = ENOTSUP;
+        goto fail;
+    }
+    if (nbufs > p.cq_entries / 2) {
+        errno = EINVAL;
+        goto fail;
+    }
+    if (uring_map(u, &p) < 0 || buf_ring_setup(u, nbufs) < 0)
+        goto fail;
+
+    /*
+     * Every datagram completion holds a buffer until it's reaped, and each
+     * receive or cancel ends with one more; sends get the rest of the CQ, so
+     * it never overflows.
+     */
+    u->max_sending = p.cq_entries - nbufs - 2 * URING_MAXSOCKS;
+
+    u->recv_hdr.msg_namelen = sizeof(struct sockaddr_in);
+
+    return u;
+
+fail:
+    {
+        int saved = errno;
+        msg_uring_free(u);
+        errno = saved;
+    }
+    return NULL;
+}
+
+static int uring_drain(struct msg_uring *u);
+
+/*
+ * Cancels the receives and waits for every request to finish before letting
+ * go of anything the kernel may still read from or write to: receive buffers,
+ * fan-out payloads and their addresses. If waiting fails, those are leaked
+ * rather than freed.
+ */
+void msg_uring_free(struct msg_uring *u)
+{
+    if (u->inflight > 0 && uring_drain(u) < 0) {
+        err_ret("io_uring drain error, leaking its buffers");
+        u->bufs = NULL;
+        u->br = NULL;
+    }
+    free(u->bufs);
+    if (u->br)
+        munmap(u->br, u->br_len);
+    if (u->sqes && u->sqes != MAP_FAILED)
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    if (u->cq_ptr && u->cq_ptr != MAP_FAILED && u->cq_ptr != u->sq_ptr)
+        munmap(u->cq_ptr, u->cq_len);
+    if (u->sq_ptr && u->sq_ptr != MAP_FAILED)
+        munmap(u->sq_ptr, u->sq_len);
+    if (u->fd >= 0)
+        close(u->fd);
+    free(u);
+}
+
+int msg_uring_fd(const struct msg_uring *u)
+{
+    return u->fd;
+}
+
+/*
+ * Pushes everything queued in the SQ to the kernel. If the kernel is busy
+ * with completions it couldn't fit in the CQ, what's left waits for
+ * msg_uring_process to reap some.
+ */
+static int uring_submit(struct msg_uring *u)
+{
+    while (u->to_submit > 0) {
+        int n = sys_io_uring_enter(u->fd, u->to_submit, 0, 0);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EBUSY)
+                return 0;
+            return -1;
+        }
+        u->stats.submits++;
+        u->to_submit -= n;
+    }
+
+    return 0;
+}
+
+static unsigned sq_space(const struct msg_uring *u)
+{
+    return u->sq_entries - (*u->sq_tail - load_acquire(u->sq_head));
+}
+
+/*
+ * Returns the next free SQE, cleared; sqe_commit makes it visible. Sends
+ * leave URING_RESERVE of them, so receives and cancels always find one.
+ */
+static struct io_uring_sqe *uring_get_sqe(struct msg_uring *u)
+{
+    unsigned tail = *u->sq_tail;
+
+    if (sq_space(u) == 0)
+        err_quit("io_uring SQ overrun");
+
+    struct io_uring_sqe *sqe = &u->sqes[tail & *u->sq_mask];
+    bzero(sqe, sizeof(*sqe));
+
+    return sqe;
+}
+
+static void sqe_commit(struct msg_uring *u)
+{
+    unsigned tail = *u->sq_tail;
+
+    u->sq_array[tail & *u->sq_mask] = tail & *u->sq_mask;
+    store_release(u->sq_tail, tail + 1);
+    u->to_submit++;
+}
+
+static void arm_recv(struct msg_uring *u, int slot)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = u->socks[slot];
+    sqe->addr = (uintptr_t) &u->recv_hdr;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    sqe->user_data = UD_RECV_BASE + slot;
+    sqe_commit(u);
+    u->inflight++;
+}
+
+/*
+ * Keeps a multishot receive posted on `sockfd'. Datagrams are reported to
+ * the callback of msg_uring_process with the slot number returned here.
+ */
+int msg_uring_recv(struct msg_uring *u, int sockfd)
+{
+    int slot;
+    for (slot = 0; slot < URING_MAXSOCKS; ++slot) {
+        if (u->socks[slot] < 0)
+            break;
+    }
+    if (slot == URING_MAXSOCKS) {
+        errno = ENOSPC;
+        return -1;
+    }
+
+    u->socks[slot] = sockfd;
+    arm_recv(u, slot);
+    if (uring_submit(u) < 0)
+        return -1;
+
+    return slot;
+}
+
+static void queue_send(struct msg_uring *u, struct uring_fanout *f, int i)
+{
+    struct uring_send *send = &f->sends[i];
+    send->hdr.msg_name = &f->peers[i];
+    send->hdr.msg_namelen = sizeof(f->peers[i]);
+    send->hdr.msg_iov = &f->iov;
+    send->hdr.msg_iovlen = 1;
+    send->fanout = f;
+
+    struct io_uring_sqe *sqe = uring_get_sqe(u);
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = f->sockfd;
+    sqe->addr = (uintptr_t) &send->hdr;
+    sqe->len = 1;
+    sqe->user_data = (uintptr_t) send;
+    sqe_commit(u);
+    u->inflight++;
+    u->sending++;
+}
+
+/*
+ * Queues the sends of the backlog while the CQ has room for their
+ * completions and submits them; the rest wait for msg_uring_process to reap
+ * some.
+ */
+static int uring_push(struct msg_uring *u)
+{
+    struct uring_fanout *f;
+
+    for ( ; ; ) {
+        while ( (f = u->backlog) != NULL) {
+            while (f->queued < f->npeers && u->sending < u->max_sending &&
+                   sq_space(u) > URING_RESERVE)
+                queue_send(u, f, f->queued++);
+            if (f->queued < f->npeers)
+                break;
+            if ( (u->backlog = f->next) == NULL)
+                u->backlog_tail = &u->backlog;
+        }
+        if (uring_submit(u) < 0)
+            return -1;
+        /* Stop when the kernel is busy, the CQ is full or all went. */
+        if (u->to_submit > 0 || u->backlog == NULL ||
+                u->sending == u->max_sending)
+            return 0;
+    }
+}
+
+/*
+ * Queues one sendmsg per peer and submits them, as many at once as the CQ
+ * has room for. The payload is copied once into a pool buffer, since the
+ * kernel may read it after we return. Results are collected by
+ * msg_uring_process, which also sends what didn't fit.
+ */
+int msg_uring_fanout(struct msg_uring *u, int sockfd, const struct iovec *iov,
+                     int iovcnt, const struct sockaddr_in *peers, int npeers)
+{
+    if (npeers == 0)
+        return 0;
+
+    struct uring_fanout *f = Malloc(sizeof(*f));
+    f->buf = Msg_pool_get();
+    f->peers = Malloc(npeers * sizeof(*peers));
+    f->sends = Calloc(npeers, sizeof(*f->sends));
+    f->pending = npeers;
+    f->queued = 0;
+    f->npeers = npeers;
+    f->sockfd = sockfd;
+    f->next = NULL;
+    memcpy(f->peers, peers, npeers * sizeof(*peers));
+
+    size_t len = 0;
+    int i;
+    for (i = 0; i < iovcnt; ++i) {
+        if (len + iov[i].iov_len > MSG_POOL_BUFSIZE)
+            err_quit("msg_uring_fanout: message too long");
+        memcpy(f->buf + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+    }
+    f->iov.iov_base = f->buf;
+    f->iov.iov_len = len;
+
+    *u->backlog_tail = f;
+    u->backlog_tail = &f->next;
+
+    if (u->fanout) {
+        u->fanout->messages++;
+        u->fanout->syscalls++;
+    }
+
+    return uring_push(u);
+}
+
+static void fanout_put(struct uring_fanout *f, int n)
+{
+    if ( (f->pending -= n) == 0) {
+        msg_pool_put(f->buf);
+        free(f->peers);
+        free(f->sends);
+        free(f);
+    }
+}
+
+static void fanout_done(struct msg_uring *u, struct uring_send *send,
+                        struct io_uring_cqe *cqe)
+{
+    struct uring_fanout *f = send->fanout;
+
+    if (cqe->res < 0) {
+        if (u->fanout)
+            u->fanout->failures++;
+        err_msg("send to %s failed: %s",
+                Sock_ntop(send->hdr.msg_name, send->hdr.msg_namelen),
+                strerror(-cqe->res));
+    } else if (u->fanout) {
+        u->fanout->sends++;
+    }
+
+    u->inflight--;
+    u->sending--;
+    fanout_put(f, 1);
+}
+
+static void recv_done(struct msg_uring *u, int slot, struct io_uring_cqe *cqe,
+                      uring_recv_cb cb, void *arg)
+{
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        unsigned bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buf = u->bufs + bid * URING_BUFSIZE;
+        struct io_uring_recvmsg_out *out = (struct io_uring_recvmsg_out *) buf;
+
+        if (cqe->res >= 0 && !(out->flags & MSG_TRUNC)) {
+            size_t off = sizeof(*out) + u->recv_hdr.msg_namelen;
+            struct sockaddr_in *peeraddr =
+                (struct sockaddr_in *) (buf + sizeof(*out));
+            struct p2p_msg msg;
+
+            u->stats.received++;
+            if (frame_decode(buf + off, out->payloadlen,
+                             URING_BUFSIZE - off, &msg) < 0)
+                err_ret("frame_decode error");
+            else
+                cb(slot, &msg, peeraddr, arg);
+        }
+
+        buf_ring_add(u, bid);
+    }
+
+    /* The kernel drops a multishot request when it runs out of buffers. */
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        u->inflight--;
+        arm_recv(u, slot);
+    }
+}
+
+/*
+ * Reaps all available completions: datagrams go to cb, finished sends are
+ * accounted. Returns -1 with errno set if a receive request failed for good,
+ * e.g. because the kernel has no multishot recvmsg; the caller should then
+ * fall back to the plain path.
+ */
+int msg_uring_process(struct msg_uring *u, uring_recv_cb cb, void *arg)
+{
+    unsigned head = *u->cq_head;
+    unsigned tail = load_acquire(u->cq_tail);
+    int n = 0;
+
+    u->stats.wakeups++;
+    for ( ; ; ) {
+        if (head == tail) {
+            /*
+             * Completions the kernel kept aside for want of room only come
+             * into the CQ on an io_uring_enter.
+             */
+            if (!(load_acquire(u->sq_flags) & IORING_SQ_CQ_OVERFLOW) ||
+                    sys_io_uring_enter(u->fd, 0, 0,
+                                       IORING_ENTER_GETEVENTS) < 0)
+                break;
+            if ( (tail = load_acquire(u->cq_tail)) == head)
+                break;
+        }
+        struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+        uint64_t ud = cqe->user_data;
+
+        if (ud >= UD_RECV_BASE && ud < UD_RECV_MAX) {
+            /* A receive that never worked is not going to start now. */
+            if (cqe->res < 0 && cqe->res != -ENOBUFS &&
+                    !(cqe->flags & IORING_CQE_F_MORE) &&
+                    u->stats.received == 0) {
+                u->inflight--;
+                store_release(u->cq_head, head + 1);
+                errno = -cqe->res;
+                return -1;
+            }
+            recv_done(u, ud - UD_RECV_BASE, cqe, cb, arg);
+            n++;
+        } else {
+            fanout_done(u, (struct uring_send *) (uintptr_t) ud, cqe);
+        }
+
+        head++;
+        tail = load_acquire(u->cq_tail);
+        store_release(u->cq_head, head);
+    }
+
+    /* Re-armed receives are waiting in the SQ, and maybe sends. */
+    if (uring_push(u) < 0)
+        return -1;
+
+    return n;
+}
+
+/*
+ * Asks the kernel to cancel the receives and reaps completions until no
+ * request is left: sends are accounted as usual, datagrams are dropped.
+ */
+static int uring_drain(struct msg_uring *u)
+{
+    struct uring_fanout *f;
+    int slot;
+
+    /* Sends that never went out are dropped. */
+    while ( (f = u->backlog) != NULL) {
+        u->backlog = f->next;
+        fanout_put(f, f->npeers - f->queued);
+    }
+    u->backlog_tail = &u->backlog;
+
+    for (slot = 0; slot < URING_MAXSOCKS; ++slot) {
+        if (u->socks[slot] < 0)
+            continue;
+        struct io_uring_sqe *sqe = uring_get_sqe(u);
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->addr = UD_RECV_BASE + slot;
+        sqe->user_data = UD_CANCEL;
+        sqe_commit(u);
+    }
+
+    while (u->inflight > 0) {
+        int n = sys_io_uring_enter(u->fd, u->to_submit, 1,
+                                   IORING_ENTER_GETEVENTS);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EBUSY)
+                return -1;
+            n = 0;      /* reap, then try again */
+        }
+        u->to_submit -= n;
+
+        unsigned head = *u->cq_head;
+        unsigned tail = load_acquire(u->cq_tail);
+        while (head != tail) {
+            struct io_uring_cqe *cqe = &u->cqes[head & *u->cq_mask];
+            uint64_t ud = cqe->user_data;
+
+            if (ud >= UD_RECV_BASE && ud < UD_RECV_MAX) {
+                if (!(cqe->flags & IORING_CQE_F_MORE))
+                    u->inflight--;
+            } else if (ud != UD_CANCEL) {
+                fanout_done(u, (struct uring_send *) (uintptr_t) ud, cqe);
+            }
+            head++;
+        }
+        store_release(u->cq_head, head);
+    }
+
+    return 0;
+}
+
+void msg_uring_print_stats(const struct msg_uring *u)
+{
+    printf("uring: %lu datagrams, %lu wakeups, %lu io_uring_enter calls\n",
+           u->stats.received, u->stats.wakeups, u->stats.submits);
+}
+
+#else   /* !HAVE_IO_URING */
+
+struct msg_uring *msg_uring_create(unsigned nbufs, struct fanout_stats *fanout)
+{
+    errno = ENOSYS;
+    return NULL;
+}
+
+void msg_uring_free(struct msg_uring *u)
+{
+}
+
+int msg_uring_fd(const struct msg_uring *u)
+{
+    return -1;
+}
+
+int msg_uring_recv(struct msg_uring *u, int sockfd)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int msg_uring_fanout(struct msg_uring *u, int sockfd, const struct iovec *iov,
+                     int iovcnt, const struct sockaddr_in *peers, int npeers)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+int msg_uring_process(struct msg_uring *u, uring_recv_cb cb, void *arg)
+{
+    errno = ENOSYS;
+    return -1;
+}
+
+void msg_uring_print_stats(const struct msg_uring *u)
+{
+}
+
+#endif  /* HAVE_IO_URING */
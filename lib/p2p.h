@@ -6,16 +6,698 @@
 #define AUTH_OFC "auth: OFC"
 
 
+/*
+ * Binary message framing.
+ *
+ * Every message starts with a fixed header carrying a binary body length, an
+ * opcode and flags, so a datagram can be read and parsed with a single
+ * recvfrom. The first byte is never an ASCII hex digit, which lets receivers
+ * tell it apart from the old pkt-line format (4 hex chars of length followed
+ * by text) and keep reading that during the migration.
+ */
+#define P2P_MAGIC   0xb5
+#define P2P_HDRLEN  6
+#define P2P_MAXMSG  2048    /* largest frame we send or accept */
+#define P2P_MAXNAME 10      /* longest user name */
+
+#define P2P_OP_CHAT     1
+#define P2P_OP_AUTH_CAN 2
+#define P2P_OP_AUTH_OFC 3
+#define P2P_OP_HEARTBEAT 4  /* empty body; says the sender is still around */
+#define P2P_OP_SWIM_PING 5      /* membership; see swim.c */
+#define P2P_OP_SWIM_ACK 6
+#define P2P_OP_SWIM_PING_REQ 7
+#define P2P_OP_SWIM_SYNC 8
+#define P2P_OP_SWIM_MEMBERS 9
+#define P2P_OP_KAD_PING 10      /* DHT; see kad.c */
+#define P2P_OP_KAD_PONG 11
+#define P2P_OP_KAD_FIND_NODE 12
+#define P2P_OP_KAD_FIND_VALUE 13
+#define P2P_OP_KAD_NODES 14
+#define P2P_OP_KAD_VALUE 15
+#define P2P_OP_KAD_STORE 16
+#define P2P_OP_RDV_REGISTER 17  /* rendezvous server; see rdv.c */
+#define P2P_OP_RDV_LOOKUP 18
+#define P2P_OP_RDV_ROOM 19
+#define P2P_OP_RDV_LEAVE 20
+#define P2P_OP_RDV_OK 21
+#define P2P_OP_RDV_PEERS 22
+#define P2P_OP_FLOOD_QUERY 23   /* flooded queries; see flood.c */
+#define P2P_OP_FLOOD_HIT 24
+#define P2P_OP_RUDP_DATA 25     /* reliable delivery; see rudp.c */
+#define P2P_OP_RUDP_ACK 26
+
+#define P2P_FL_GOSSIP   0x0001  /* membership deltas follow the body */
+#define P2P_FL_LEGACY   0x8000  /* set by the decoder on pkt-line input */
+
+struct p2p_hdr {
+    uint8_t  magic;     /* P2P_MAGIC */
+    uint8_t  op;        /* P2P_OP_xxx */
+    uint16_t flags;     /* network byte order */
+    uint16_t len;       /* body length, network byte order */
+};
+
+/*
+ * An outgoing chat message, gathered from the header, the cached user name
+ * prefix and the message text; see create_send_msg. The spare iovec is for
+ * what swim_piggyback adds.
+ */
+#define SEND_MSG_MAXIOV 4
+
+struct send_msg {
+    char         hdr[P2P_HDRLEN];
+    struct iovec iov[SEND_MSG_MAXIOV];
+    int          iovcnt;
+    size_t       len;
+};
+
+/* Auth frames never change; they are built at compile time. */
+extern const char auth_can_frame[P2P_HDRLEN];
+extern const char auth_ofc_frame[P2P_HDRLEN];
+extern const char heartbeat_frame[P2P_HDRLEN];
+
+/* A decoded message; body points into the receive buffer. */
+struct p2p_msg {
+    int      op;
+    int      flags;
+    char    *body;      /* NUL-terminated */
+    size_t   len;
+    char    *gossip;    /* with P2P_FL_GOSSIP, else NULL */
+    size_t   gossip_len;
+};
+
+/*
+ * What has come in on a non-blocking stream socket so far; messages are
+ * taken from it whole by stream_read_message.
+ */
+struct stream_in {
+    char     buf[P2P_MAXMSG + 1];   /* one more for frame_decode */
+    size_t   len;
+    size_t   used;      /* bytes of the message returned last */
+    char     save;      /* the byte its NUL went over */
+};
+
+/*
+ * Batched receive. A preallocated ring of buffers and source addresses is
+ * filled with one recvmmsg per wakeup.
+ */
+#define P2P_BATCH   32  /* default number of datagrams drained per wakeup */
+#define BATCH_HIST  8   /* buckets of the per-wakeup histogram */
+
+struct msg_batch {
+    int                  cap;
+    int                  count;     /* datagrams from the last recv_batch */
+    char               **bufs;      /* cap buffers from the message pool */
+    size_t              *lens;
+    struct sockaddr_in  *addrs;
+    struct iovec        *iovs;
+    struct mmsghdr      *hdrs;
+
+    unsigned long        wakeups;   /* recv_batch calls that got something */
+    unsigned long        received;  /* datagrams in total */
+    int                  max_per_wakeup;
+    unsigned long        hist[BATCH_HIST];
+};
+
+/* Counters kept by send_fanout. */
+struct fanout_stats {
+    unsigned long   messages;   /* send_fanout calls */
+    unsigned long   sends;      /* datagrams handed to the kernel */
+    unsigned long   syscalls;
+    unsigned long   failures;   /* peers a send failed for */
+};
+
+extern int fanout_d_flag;       /* log every send to stderr */
+
+/*
+ * Message buffer pool. Fixed-size buffers big enough for any frame plus the
+ * NUL that frame_decode appends, with a per-thread cache in front.
+ */
+#define MSG_POOL_BUFSIZE    (P2P_MAXMSG + 1)
+#define MSG_POOL_MAX        4096    /* default limit on buffers ever allocated */
+
+struct msg_pool_stats {
+    int             total;      /* buffers allocated so far */
+    int             free;       /* buffers in the pool, not counting caches */
+    unsigned long   slabs;
+    unsigned long   refills;    /* thread caches refilled from the pool */
+    unsigned long   flushes;    /* thread caches flushed to the pool */
+    unsigned long   exhausted;  /* gets that failed at the limit */
+};
+
+/*
+ * Event loop. Descriptors are registered with a callback for the events
+ * they're interested in; timers fire once or periodically.
+ */
+#define REACTOR_IN  0x01
+#define REACTOR_OUT 0x02
+#define REACTOR_ET  0x04    /* edge-triggered; cb must drain until EAGAIN */
+#define REACTOR_ERR 0x08    /* reported only: hangup or error */
+
+struct reactor;
+struct reactor_timer;
+
+typedef void (*reactor_cb)(struct reactor*, int, int, void*);
+typedef void (*timer_cb)(struct reactor*, void*);
+
+/*
+ * Hierarchical timer wheel with millisecond ticks, driven by a timerfd.
+ * Timers are embedded by the caller; adding and cancelling never allocate.
+ */
+struct timer_wheel;
+struct wheel_timer;
+
+typedef void (*wheel_cb)(struct wheel_timer*, void*);
+
+struct wheel_timer {
+    struct wheel_timer *next, *prev;    /* NULL when not pending */
+    uint64_t            expires;        /* ms on the monotonic clock */
+    wheel_cb            cb;
+    void               *arg;
+};
+
+/*
+ * io_uring data path: multishot receives over a provided buffer ring and
+ * fan-outs submitted as one batch of sendmsg requests.
+ */
+#define URING_MAXSOCKS  8   /* sockets with a receive posted */
+
+struct msg_uring;
+
+struct uring_stats {
+    unsigned long   received;   /* datagrams */
+    unsigned long   wakeups;    /* msg_uring_process calls */
+    unsigned long   submits;    /* io_uring_enter calls */
+};
+
+typedef void (*uring_recv_cb)(int, struct p2p_msg*, struct sockaddr_in*, void*);
+typedef void (*peer_cb)(const struct sockaddr_in*, void*);
+
+/*
+ * Peer table: a hash on address and port over a dense array of addresses.
+ * `count' and `addrs' may be read, e.g. to fan a message out, but not
+ * written; positions change when a peer is removed.
+ */
+struct peer_table {
+    int                  count;
+    struct sockaddr_in  *addrs;
+    uint64_t            *seen;      /* ms when last heard from, per peer */
+    int                 *iface;     /* index of its link, 0 if not known */
+    unsigned long        expired;   /* peers removed by peer_table_expire */
+
+    int                  cap;
+    int                 *index;     /* hash slot -> position in addrs */
+    unsigned             mask;
+};
+
+/*
+ * An interface discovery runs on, from iface_select. `sockfd' is left to
+ * the caller, for the socket it asks for peers on that link with.
+ */
+struct p2p_iface {
+    char                 name[16];  /* IFNAMSIZ */
+    int                  index;     /* 0 if not a known interface */
+    int                  flags;     /* IFF_xxx */
+    struct sockaddr_in   addr;
+    struct sockaddr_in   brdaddr;   /* with IFF_BROADCAST */
+    struct in_addr       netmask;
+    int                  sockfd;
+};
+
+/*
+ * Interface changes as rtnetlink reports them, on a reactor; see
+ * ifi_watch_create.
+ */
+struct ifi_info;
+struct ifi_watch;
+
+#define IFI_ADDED   1
+#define IFI_DELETED 2
+
+typedef void (*ifi_watch_cb)(struct ifi_watch*, int, const struct ifi_info*,
+                             void*);
+
+/*
+ * Subnet sweep: probes a whole address range at a fixed rate and collects
+ * the answers on a reactor.
+ */
+struct sweep;
+
+typedef void (*sweep_cb)(struct sweep*, const struct sockaddr_in*, void*);
+typedef void (*sweep_done_cb)(struct sweep*, void*);
+
+struct sweep_stats {
+    uint32_t        hosts;      /* addresses in the range */
+    unsigned long   sent;
+    unsigned long   failed;
+    unsigned long   syscalls;
+    unsigned long   stalls;     /* times the socket buffer was full */
+    int             responders;
+    uint64_t        elapsed_ms; /* from the first probe to the end */
+};
+
+/*
+ * Concurrent TCP connect scanner: many non-blocking connects in flight on a
+ * reactor, each with a deadline.
+ */
+struct scan;
+
+typedef void (*scan_cb)(struct scan*, int, const struct sockaddr_in*, void*);
+typedef void (*scan_done_cb)(struct scan*, void*);
+
+struct scan_stats {
+    uint32_t        hosts;      /* addresses in the range */
+    unsigned long   attempts;
+    unsigned long   connected;
+    unsigned long   refused;
+    unsigned long   timedout;
+    unsigned long   failed;     /* any other error */
+    int             inflight;
+    int             max_inflight;
+    uint64_t        elapsed_ms;
+};
+
+/*
+ * Discovery window that closes once answers stop coming; see
+ * find_window_check.
+ */
+struct find_window;
+
+#define FIND_WAIT   0
+#define FIND_RETRY  1
+#define FIND_DONE   2
+
+/*
+ * SWIM membership: randomized probing, indirect probes through others,
+ * suspicion and gossip piggybacked on the traffic; see swim.c.
+ */
+struct swim;
+
+#define SWIM_ALIVE      0   /* member states, as on the wire */
+#define SWIM_SUSPECT    1
+#define SWIM_DEAD       2
+
+#define SWIM_JOIN       3   /* events besides SWIM_SUSPECT and SWIM_ALIVE */
+#define SWIM_LEAVE      4
+
+typedef void (*swim_cb)(struct swim*, const struct sockaddr_in*, int, void*);
+
+struct swim_stats {
+    int             members;
+    int             suspects;
+    uint32_t        incarnation;
+    unsigned long   pings;
+    unsigned long   acks;       /* to our own pings, direct or not */
+    unsigned long   acks_sent;
+    unsigned long   ping_reqs;
+    unsigned long   relayed;    /* pings done for others */
+    unsigned long   suspected;
+    unsigned long   failed;
+    unsigned long   refuted;    /* suspicions of us we answered */
+    unsigned long   syncs;
+    unsigned long   gossip_sent;
+    unsigned long   gossip_received;
+    unsigned long   send_errors;
+};
+
+/*
+ * Kademlia DHT node: XOR-metric k-buckets and iterative lookups, KAD_ALPHA
+ * queries at a time; see kad.c.
+ */
+struct kad;
+
+#define KAD_ID_LEN      20      /* 160 bits */
+#define KAD_K           20      /* bucket size, and nodes a value is stored on */
+#define KAD_MAXVALUE    256
+
+struct kad_contact {
+    uint8_t              id[KAD_ID_LEN];
+    struct sockaddr_in   addr;
+};
+
+struct kad_result {
+    int                         found;      /* a value; for kad_find_value */
+    const void                 *value;
+    size_t                      len;
+    const struct kad_contact   *closest;    /* nearest that answered first */
+    int                         nclosest;
+    int                         hops;
+    int                         rpcs;
+    int                         timeouts;
+    uint64_t                    elapsed_ms;
+};
+
+typedef void (*kad_cb)(struct kad*, const struct kad_result*, void*);
+
+struct kad_stats {
+    int             contacts;
+    int             buckets;    /* not empty */
+    int             values;     /* stored for others */
+    unsigned long   received;
+    unsigned long   rpcs;
+    unsigned long   timeouts;
+    unsigned long   evicted;
+    unsigned long   lookups;
+    unsigned long   found;
+    unsigned long   hops;       /* over all lookups */
+    unsigned long   stored;
+    unsigned long   send_errors;
+};
+
+/*
+ * Rendezvous registry: who is registered under which user name, and in
+ * which room; see rdv.c.
+ */
+struct rdv_registry;
+
+#define RDV_PORT        11003
+#define RDV_TTL_MS      (5 * 60 * 1000)     /* unless registered again */
+#define RDV_ENTRY_LEN   (7 + P2P_MAXNAME)   /* most one peer takes on the wire */
+
+struct rdv_peer {
+    char                 name[P2P_MAXNAME + 1];
+    struct sockaddr_in   addr;
+};
+
+struct rdv_stats {
+    int             registered;
+    int             rooms;
+    unsigned long   registers;  /* new names */
+    unsigned long   renewals;
+    unsigned long   refused;    /* names held at another address */
+    unsigned long   leaves;
+    unsigned long   expired;
+    unsigned long   lookups;
+    unsigned long   hits;
+    unsigned long   room_lookups;
+};
+
+/*
+ * Gnutella-style flooded queries: forwarded to every neighbor until the TTL
+ * runs out, with duplicates dropped by a time-rotating Bloom filter; see
+ * flood.c.
+ */
+struct flood;
+
+#define FLOOD_TTL       7
+#define FLOOD_MAXPAYLOAD 256
+
+struct flood_query {
+    uint64_t             id;
+    int                  hops;      /* from the origin to us */
+    struct sockaddr_in   origin;
+    const char          *payload;   /* NUL-terminated */
+    size_t               len;
+};
+
+typedef void (*flood_query_cb)(struct flood*, const struct flood_query*, void*);
+typedef void (*flood_hit_cb)(struct flood*, uint64_t, const char*, size_t,
+                             const struct sockaddr_in*, void*);
+
+struct flood_stats {
+    unsigned long   originated;
+    unsigned long   received;   /* queries, duplicates included */
+    unsigned long   duplicates; /* dropped by the filter */
+    unsigned long   sent;       /* query datagrams, ours and forwarded */
+    unsigned long   expired;    /* not forwarded: TTL ran out */
+    unsigned long   hits_sent;
+    unsigned long   hits_received;
+    unsigned long   rotations;
+    unsigned long   send_errors;
+    int             bloom_fill; /* % of the newer filter's bits set */
+};
+
+/*
+ * Reliable delivery over UDP: sequence numbers, cumulative and selective
+ * ACKs, and a sliding window per peer, resent on each peer's own RTO; see
+ * rudp.c.
+ */
+struct rudp;
+
+typedef void (*rudp_deliver_cb)(struct rudp*, struct p2p_msg*,
+                                const struct sockaddr_in*, void*);
+typedef void (*rudp_fail_cb)(struct rudp*, const struct sockaddr_in*, int,
+                             void*);
+
+struct rudp_stats {
+    int             peers;
+    unsigned long   sent;           /* messages, each once */
+    unsigned long   acked;
+    unsigned long   inflight;       /* sent, not acknowledged yet */
+    unsigned long   waiting;        /* for room in the window */
+    unsigned long   failed;         /* given up on after the last RTO */
+    unsigned long   queue_full;     /* refused: RUDP_QUEUE waiting */
+    unsigned long   timeouts;
+    unsigned long   retransmits;    /* on a timeout */
+    unsigned long   fast_retransmits;
+    unsigned long   send_errors;
+    unsigned long   received;       /* DATA frames, duplicates included */
+    unsigned long   delivered;
+    unsigned long   duplicates;
+    unsigned long   out_of_order;   /* held back for an earlier one */
+    unsigned long   skipped;        /* never came; the sender gave up */
+    unsigned long   beyond;         /* past the window, ignored */
+    unsigned long   bad;            /* no valid frame inside */
+    unsigned long   acks_sent;
+    unsigned long   acks_received;
+};
+
+/*
+ * Pacing of outgoing datagrams: a token bucket and a queue per link, with
+ * the rate set by AIMD from the losses reported; see pacer.c.
+ */
+struct pacer;
+
+typedef void (*pacer_sent_cb)(struct pacer*, void*, uint32_t);
+
+struct pacer_stats {
+    int             links;
+    unsigned long   queued;
+    unsigned long   sent;
+    unsigned long   syscalls;
+    unsigned long   waiting;        /* for tokens */
+    unsigned long   dropped;        /* refused: PACER_QUEUE waiting */
+    unsigned long   send_errors;
+    unsigned long   losses;         /* reported, and out of buffer */
+    unsigned long   blocked;        /* the socket had no room */
+    unsigned long   decreases;      /* of a link's rate */
+    unsigned long   increases;
+};
+
+/* Lock-free queue from worker threads to the terminal thread */
+struct msg_queue;
+
+struct msg_queue_stats {
+    unsigned long   popped;
+    unsigned long   dropped;    /* pushes that found the queue full */
+    unsigned long   wakeups;    /* eventfd writes */
+};
+
+
 void int_to_hex_4(int, char*);
 unsigned int hex_to_int(char*);
 void chomp(char*);
 
-char* create_send_msg(char*, const char*);
-void create_send_msg_static(const char*, char*);
+void send_msg_init(const char*);
+void create_send_msg(char*, struct send_msg*);
 void auth_request(int, const SA*, socklen_t);
 int auth_try_confirm(int, SA*, socklen_t*);
 void auth_accept(int, const SA*, socklen_t);
-char* recv_message(int, SA*, socklen_t*);
+
+size_t frame_hdr(char*, int, int, size_t);
+size_t frame_encode(char*, int, const char*, size_t);
+int frame_decode(char*, size_t, size_t, struct p2p_msg*);
+ssize_t recv_message(int, char*, size_t, struct p2p_msg*, SA*, socklen_t*);
+ssize_t stream_read_message(int, struct stream_in*, struct p2p_msg*);
+
+struct msg_batch *msg_batch_create(int);
+void msg_batch_free(struct msg_batch*);
+int recv_batch(int, struct msg_batch*);
+int batch_message(struct msg_batch*, int, struct p2p_msg*, struct sockaddr_in**);
+void batch_stats(const struct msg_batch*, const char*);
+
+void *msg_pool_get(void);
+void *Msg_pool_get(void);
+void msg_pool_put(void*);
+void msg_pool_limit(int);
+void msg_pool_get_stats(struct msg_pool_stats*);
+void msg_pool_print_stats(void);
+
+struct timer_wheel *wheel_create(void);
+void wheel_free(struct timer_wheel*);
+int wheel_fd(const struct timer_wheel*);
+void wheel_timer_init(struct wheel_timer*, wheel_cb, void*);
+int wheel_pending(const struct wheel_timer*);
+void wheel_add(struct timer_wheel*, struct wheel_timer*, int);
+void wheel_cancel(struct timer_wheel*, struct wheel_timer*);
+int wheel_run(struct timer_wheel*);
+struct wheel_timer *wheel_pop(struct timer_wheel*);
+
+uint64_t now_ms(void);
+struct reactor *reactor_create(void);
+void reactor_free(struct reactor*);
+int reactor_add(struct reactor*, int, int, reactor_cb, void*);
+int reactor_mod(struct reactor*, int, int);
+int reactor_del(struct reactor*, int);
+struct reactor_timer *reactor_timer(struct reactor*, int, int, timer_cb, void*);
+void reactor_cancel(struct reactor*, struct reactor_timer*);
+int reactor_fd(const struct reactor*);
+int reactor_once(struct reactor*, int);
+void reactor_run(struct reactor*);
+void reactor_stop(struct reactor*);
+
+struct msg_uring *msg_uring_create(unsigned, struct fanout_stats*);
+void msg_uring_free(struct msg_uring*);
+int msg_uring_fd(const struct msg_uring*);
+int msg_uring_recv(struct msg_uring*, int);
+int msg_uring_fanout(struct msg_uring*, int, const struct iovec*, int,
+                     const struct sockaddr_in*, int);
+int msg_uring_process(struct msg_uring*, uring_recv_cb, void*);
+void msg_uring_print_stats(const struct msg_uring*);
+
+struct peer_table *peer_table_create(int);
+void peer_table_free(struct peer_table*);
+int peer_table_find(const struct peer_table*, const struct sockaddr_in*);
+int peer_table_add(struct peer_table*, const struct sockaddr_in*);
+int peer_table_add_on(struct peer_table*, const struct sockaddr_in*, int);
+int peer_table_remove(struct peer_table*, const struct sockaddr_in*);
+int peer_table_touch(struct peer_table*, const struct sockaddr_in*);
+int peer_table_expire(struct peer_table*, uint64_t, peer_cb, void*);
+
+int peer_cache_save(const char*, const struct peer_table*);
+int peer_cache_load(const char*, struct peer_table*);
+
+int sweep_parse(const char*, uint32_t*, uint32_t*);
+int addr_parse(const char*, int, struct sockaddr_in*);
+struct sweep *sweep_start(struct reactor*, int, const char*, int, int, int,
+                          sweep_cb, sweep_done_cb, void*);
+void sweep_free(struct sweep*);
+const struct peer_table *sweep_responders(const struct sweep*);
+void sweep_get_stats(const struct sweep*, struct sweep_stats*);
+
+struct scan *scan_start(struct reactor*, const char*, int, int, int, int,
+                        scan_cb, scan_done_cb, void*);
+void scan_stop(struct scan*);
+void scan_free(struct scan*);
+const struct peer_table *scan_found(const struct scan*);
+void scan_get_stats(const struct scan*, struct scan_stats*);
+
+struct find_window *find_window_create(int, int, int);
+void find_window_free(struct find_window*);
+void find_window_sent(struct find_window*);
+void find_window_reply(struct find_window*, int);
+int find_window_timeout(const struct find_window*);
+int find_window_check(const struct find_window*);
+void find_window_print_stats(const struct find_window*);
+
+int iface_select(int, const char*, struct p2p_iface**);
+struct p2p_iface *iface_add(struct p2p_iface**, int*, const struct ifi_info*);
+int iface_find(const struct p2p_iface*, int, const struct ifi_info*);
+void iface_remove(struct p2p_iface*, int*, int);
+struct p2p_iface *iface_of(struct p2p_iface*, int, const struct sockaddr_in*);
+int iface_index_of(struct p2p_iface*, int, const struct sockaddr_in*);
+int iface_is_local(const struct p2p_iface*, int, const struct sockaddr_in*);
+void iface_print_peers(const struct p2p_iface*, int, const struct peer_table*);
+
+struct ifi_watch *ifi_watch_create(struct reactor*, int, int, ifi_watch_cb,
+                                   void*);
+void ifi_watch_free(struct ifi_watch*);
+const struct ifi_info *ifi_watch_snapshot(const struct ifi_watch*);
+
+struct swim *swim_create(struct reactor*, int, int, int, swim_cb, void*);
+void swim_free(struct swim*);
+void swim_add_self(struct swim*, const struct sockaddr_in*);
+int swim_add(struct swim*, const struct sockaddr_in*);
+void swim_sync(struct swim*, const struct sockaddr_in*);
+int swim_handle(struct swim*, const struct p2p_msg*, const struct sockaddr_in*);
+void swim_piggyback(struct swim*, struct send_msg*);
+const struct peer_table *swim_members(const struct swim*);
+void swim_get_stats(const struct swim*, struct swim_stats*);
+void swim_print_stats(const struct swim*);
+
+void sha1(const void*, size_t, uint8_t[20]);
+
+struct kad *kad_create(struct reactor*, int, const struct sockaddr_in*);
+void kad_free(struct kad*);
+const uint8_t *kad_id(const struct kad*);
+void kad_key(const char*, uint8_t[KAD_ID_LEN]);
+void kad_join(struct kad*, const struct sockaddr_in*, int, kad_cb, void*);
+void kad_find_node(struct kad*, const uint8_t*, kad_cb, void*);
+void kad_find_value(struct kad*, const uint8_t*, kad_cb, void*);
+void kad_store(struct kad*, const uint8_t*, const void*, size_t, kad_cb, void*);
+int kad_handle(struct kad*, const struct p2p_msg*, const struct sockaddr_in*);
+int kad_closest(const struct kad*, const uint8_t*, struct kad_contact*, int);
+void kad_get_stats(const struct kad*, struct kad_stats*);
+void kad_print_stats(const struct kad*);
+
+struct rdv_registry *rdv_create(int);
+void rdv_free(struct rdv_registry*);
+int rdv_register(struct rdv_registry*, const char*, const char*,
+                 const struct sockaddr_in*, uint64_t);
+int rdv_leave(struct rdv_registry*, const char*, const struct sockaddr_in*);
+const struct rdv_peer *rdv_lookup(struct rdv_registry*, const char*);
+int rdv_room(struct rdv_registry*, const char*, const struct rdv_peer**, int);
+int rdv_expire(struct rdv_registry*, uint64_t);
+void rdv_get_stats(const struct rdv_registry*, struct rdv_stats*);
+void rdv_print_stats(const struct rdv_registry*);
+int rdv_valid_name(const char*);
+size_t rdv_encode_register(char*, int, const char*, const char*);
+int rdv_parse_register(const struct p2p_msg*, const struct sockaddr_in*,
+                       struct rdv_peer*, char*);
+size_t rdv_peers_add(char*, size_t, size_t, const struct rdv_peer*);
+int rdv_peers_next(const struct p2p_msg*, size_t*, struct rdv_peer*);
+
+struct flood *flood_create(struct reactor*, int, const struct sockaddr_in*,
+                           struct peer_table*, flood_query_cb, flood_hit_cb,
+                           void*);
+void flood_free(struct flood*);
+void flood_suppress(struct flood*, int);
+uint64_t flood_query(struct flood*, const void*, size_t, int);
+void flood_hit(struct flood*, const struct flood_query*, const void*, size_t);
+int flood_handle(struct flood*, const struct p2p_msg*, const struct sockaddr_in*);
+void flood_get_stats(const struct flood*, struct flood_stats*);
+void flood_print_stats(const struct flood*);
+
+struct rudp *rudp_create(struct reactor*, int, rudp_deliver_cb, rudp_fail_cb,
+                         void*);
+void rudp_free(struct rudp*);
+void rudp_set_rto(struct rudp*, int64_t, int64_t);
+int rudp_send(struct rudp*, const void*, size_t, const struct sockaddr_in*);
+void rudp_set_pacer(struct rudp*, struct pacer*);
+int rudp_fanout(struct rudp*, const struct iovec*, int,
+                const struct sockaddr_in*, const int*, int);
+int rudp_handle(struct rudp*, int, const struct p2p_msg*,
+                const struct sockaddr_in*);
+void rudp_get_stats(const struct rudp*, struct rudp_stats*);
+void rudp_print_stats(const struct rudp*);
+
+struct pacer *pacer_create(struct reactor*, int, int64_t);
+void pacer_free(struct pacer*);
+int pacer_sendv(struct pacer*, int, const struct iovec*, int,
+                const struct sockaddr_in*, pacer_sent_cb, void*, uint32_t);
+int pacer_fanout(struct pacer*, const struct iovec*, int,
+                 const struct sockaddr_in*, const int*, int);
+void pacer_flush(struct pacer*);
+void pacer_cancel(struct pacer*, void*);
+void pacer_loss(struct pacer*, int);
+void pacer_get_stats(const struct pacer*, struct pacer_stats*);
+void pacer_print_stats(const struct pacer*);
+
+struct msg_queue *msg_queue_create(int);
+void msg_queue_free(struct msg_queue*);
+int msg_queue_fd(const struct msg_queue*);
+int msg_queue_push(struct msg_queue*, void*);
+void *msg_queue_pop(struct msg_queue*);
+int msg_queue_sleep(struct msg_queue*);
+void msg_queue_get_stats(struct msg_queue*, struct msg_queue_stats*);
+
+int send_fanoutv(int, const struct iovec*, int, const struct sockaddr_in*, int,
+                 int*, struct fanout_stats*);
+int send_fanout(int, const void*, size_t, const struct sockaddr_in*, int,
+                int*, struct fanout_stats*);
+int send_fanout_report(int, const struct iovec*, int, const struct sockaddr_in*,
+                       int, struct fanout_stats*);
+void fanout_print_stats(const struct fanout_stats*);
 
 
-#endif	/* __unp_h */
+#endif	/* __p2p_h */
@@ -0,0 +1,490 @@
+#define _GNU_SOURCE     /* sendmmsg */
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * Paces the datagrams going out of one socket, so that a message to a large
+ * room doesn't leave as one burst of hundreds of datagrams, more than our
+ * SO_SNDBUF, the switch or the receivers' buffers take at once.
+ *
+ * Each link (an interface index, as in the peer table; 0 for unknown) has a
+ * token bucket, filled at the link's rate up to PACER_BURST_MS worth of it,
+ * and a queue. A datagram goes out while the bucket has tokens; the rest
+ * wait in the queue, and the reactor sends them as the tokens come in,
+ * PACER_CHUNK to a sendmmsg.
+ *
+ * The rate is set by AIMD, once every PACER_INTERVAL_MS. An interval with a
+ * loss in it halves the rate. One without, in which datagrams had to wait
+ * for tokens, raises it: it doubles until the first loss, as in slow start,
+ * and grows by PACER_AI after. What was queued at the old rate is still
+ * being lost for a while after a decrease, so, as in TCP's fast recovery,
+ * losses don't bring the rate down again until that has gone out and an
+ * interval more has passed. The caller reports losses with pacer_loss,
+ * as rudp.c does when an ACK or a timeout shows one; a datagram the socket
+ * has no buffer for (ENOBUFS, EAGAIN) is a loss too, and stays queued.
+ *
+ * A datagram may carry a callback, called when it leaves the queue, so the
+ * caller can time it from when it was sent rather than queued.
+ */
+#define PACER_QUEUE         65536   /* datagrams waiting per link, at most */
+#define PACER_QUEUE_MIN     256
+#define PACER_CHUNK         64      /* datagrams handed to one sendmmsg */
+#define PACER_INTERVAL_MS   10
+#define PACER_BURST_MS      2
+#define PACER_BURST_MIN     (2 * P2P_MAXMSG)
+#define PACER_OVERHEAD      28      /* IP and UDP headers */
+#define PACER_RATE_INIT     (1 << 20)           /* bytes a second */
+#define PACER_RATE_MIN      (64 << 10)
+#define PACER_RATE_MAX      (125 * 1000 * 1000) /* 1 Gbit/s */
+#define PACER_AI            (128 << 10)         /* per interval */
+
+/* A datagram, shared by every peer it was fanned out to */
+struct pacer_buf {
+    int         refs;
+    size_t      len;
+    char        data[];
+};
+
+struct pacer_item {
+    struct sockaddr_in  to;
+    struct pacer_buf   *buf;
+    pacer_sent_cb       sent_cb;    /* NULL if none, or cancelled */
+    void               *arg;
+    uint32_t            tag;
+};
+
+struct pacer_link {
+    int                 id;
+    int64_t             rate;       /* bytes a second */
+    int64_t             tokens;     /* bytes; negative after a big datagram */
+    uint64_t            filled;     /* ns when tokens were last added */
+    int                 slow_start;
+    uint64_t            recover;    /* ns until which losses are old news */
+
+    /* This interval */
+    int                 lost;
+    int                 limited;    /* datagrams waited for tokens */
+    int                 blocked;    /* the socket had no room */
+
+    struct pacer_item  *q;          /* ring of cap, grown up to PACER_QUEUE */
+    int                 head, count, cap;
+    int64_t             bytes;      /* waiting */
+
+    unsigned long       sent;
+    unsigned long       dropped;
+    unsigned long       losses;
+};
+
+struct pacer {
+    struct reactor          *reactor;
+    int                      fd;
+    int64_t                  max_rate;
+    struct pacer_link      **links;
+    int                      nlinks;
+    struct reactor_timer    *drain;     /* when tokens are there */
+    struct reactor_timer    *tick;      /* the next AIMD interval */
+
+    struct pacer_stats       stats;
+};
+
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int64_t burst_of(const struct pacer_link *l)
+{
+    return max(l->rate * PACER_BURST_MS / 1000, PACER_BURST_MIN);
+}
+
+static void buf_release(struct pacer_buf *b)
+{
+    if (--b->refs == 0)
+        free(b);
+}
+
+static struct pacer_link *link_get(struct pacer *pc, int id)
+{
+    struct pacer_link *l;
+    int i;
+
+    for (i = 0; i < pc->nlinks; ++i) {
+        if (pc->links[i]->id == id)
+            return pc->links[i];
+    }
+
+    l = Calloc(1, sizeof(*l));
+    l->id = id;
+    l->rate = min(PACER_RATE_INIT, pc->max_rate);
+    l->tokens = burst_of(l);
+    l->filled = now_ns();
+    l->slow_start = 1;
+
+    pc->links = realloc(pc->links, (pc->nlinks + 1) * sizeof(*pc->links));
+    if (pc->links == NULL)
+        err_sys("realloc error");
+    pc->links[pc->nlinks++] = l;
+    pc->stats.links = pc->nlinks;
+
+    return l;
+}
+
+static void refill(struct pacer_link *l, uint64_t now)
+{
+    /* A second fills any bucket, and longer would overflow. */
+    if (now - l->filled >= 1000000000)
+        l->tokens = burst_of(l);
+    else
+        l->tokens = min(l->tokens + (int64_t) ((now - l->filled) * l->rate /
+                                               1000000000), burst_of(l));
+    l->filled = now;
+}
+
+/* Takes the front datagram off; `sent' if it went out, or tried to. */
+static void pop(struct pacer *pc, struct pacer_link *l, int sent)
+{
+    struct pacer_item it = l->q[l->head];
+
+    l->bytes -= it.buf->len + PACER_OVERHEAD;
+    buf_release(it.buf);
+    l->head = (l->head + 1) % l->cap;
+    l->count--;
+    pc->stats.waiting--;
+    if (sent && it.sent_cb != NULL)
+        it.sent_cb(pc, it.arg, it.tag);
+}
+
+/* Doubles the ring, the wrapped part moved up to follow the rest. */
+static int queue_grow(struct pacer_link *l)
+{
+    int cap = l->cap ? l->cap * 2 : PACER_QUEUE_MIN;
+
+    if (cap > PACER_QUEUE)
+        return -1;
+    if ( (l->q = realloc(l->q, cap * sizeof(*l->q))) == NULL)
+        err_sys("realloc error");
+    if (l->head + l->count > l->cap) {
+        int wrapped = l->head + l->count - l->cap;
+        memcpy(l->q + l->cap, l->q, wrapped * sizeof(*l->q));
+    }
+    l->cap = cap;
+
+    return 0;
+}
+
+/* Sends from the front of the queue for as long as there are tokens. */
+static void drain(struct pacer *pc, struct pacer_link *l)
+{
+    int i, n, count;
+
+    refill(l, now_ns());
+    l->blocked = 0;
+    while (l->count > 0 && l->tokens > 0) {
+        /* The last one in may take the bucket below zero. */
+        int64_t budget = l->tokens;
+        for (count = 0; count < min(l->count, PACER_CHUNK) && budget > 0;
+                ++count)
+            budget -= l->q[(l->head + count) % l->cap].buf->len +
+                      PACER_OVERHEAD;
+
+#ifdef MSG_WAITFORONE
+        struct mmsghdr hdrs[PACER_CHUNK];
+        struct iovec iovs[PACER_CHUNK];
+        bzero(hdrs, count * sizeof(hdrs[0]));
+        for (i = 0; i < count; ++i) {
+            struct pacer_item *it = &l->q[(l->head + i) % l->cap];
+            iovs[i].iov_base = it->buf->data;
+            iovs[i].iov_len = it->buf->len;
+            hdrs[i].msg_hdr.msg_name = &it->to;
+            hdrs[i].msg_hdr.msg_namelen = sizeof(it->to);
+            hdrs[i].msg_hdr.msg_iov = &iovs[i];
+            hdrs[i].msg_hdr.msg_iovlen = 1;
+        }
+        n = sendmmsg(pc->fd, hdrs, count, 0);
+        pc->stats.syscalls++;
+#else
+        struct pacer_item *it = &l->q[l->head];
+        n = sendto(pc->fd, it->buf->data, it->buf->len, 0, (SA *) &it->to,
+                   sizeof(it->to)) < 0 ? -1 : 1;
+        pc->stats.syscalls++;
+#endif
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == ENOBUFS || errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* Kept for when the socket has room again. */
+                l->blocked = 1;
+                pacer_loss(pc, l->id);
+                pc->stats.blocked++;
+                break;
+            }
+            /* Like send_fanoutv: the peer at the front is skipped. */
+            pop(pc, l, 1);
+            pc->stats.send_errors++;
+            continue;
+        }
+        for (i = 0; i < n; ++i) {
+            l->tokens -= l->q[l->head].buf->len + PACER_OVERHEAD;
+            pop(pc, l, 1);
+        }
+        l->sent += n;
+        pc->stats.sent += n;
+    }
+    if (l->count > 0)
+        l->limited = 1;
+}
+
+static void on_drain(struct reactor*, void*);
+static void on_tick(struct reactor*, void*);
+
+/* Wakes up when the first waiting link has tokens again. */
+static void schedule(struct pacer *pc)
+{
+    int64_t wait = -1;
+    int i;
+
+    for (i = 0; i < pc->nlinks; ++i) {
+        struct pacer_link *l = pc->links[i];
+        int64_t ms;
+        if (l->count == 0)
+            continue;
+        if (l->blocked || l->tokens > 0)
+            ms = 1;
+        else
+            ms = ((1 - l->tokens) * 1000 + l->rate - 1) / l->rate;
+        wait = wait < 0 ? ms : min(wait, ms);
+    }
+
+    if (wait >= 0 && pc->drain == NULL)
+        pc->drain = reactor_timer(pc->reactor, max(wait, 1), 0, on_drain, pc);
+    if (pc->tick == NULL)
+        pc->tick = reactor_timer(pc->reactor, PACER_INTERVAL_MS, 0, on_tick,
+                                 pc);
+}
+
+static void on_drain(struct reactor *reactor, void *arg)
+{
+    struct pacer *pc = arg;
+
+    pc->drain = NULL;
+    pacer_flush(pc);
+}
+
+/* AIMD, with at most one decrease an interval however many were lost. */
+static void on_tick(struct reactor *reactor, void *arg)
+{
+    struct pacer *pc = arg;
+    int i, busy = 0;
+
+    pc->tick = NULL;
+    for (i = 0; i < pc->nlinks; ++i) {
+        struct pacer_link *l = pc->links[i];
+
+        if (l->lost) {
+            l->rate = max(l->rate / 2, PACER_RATE_MIN);
+            l->slow_start = 0;
+            l->recover = now_ns() + l->bytes * 1000000000 / l->rate +
+                         PACER_INTERVAL_MS * 1000000LL;
+            pc->stats.decreases++;
+        } else if (l->limited && l->rate < pc->max_rate) {
+            l->rate = l->slow_start ? l->rate * 2 : l->rate + PACER_AI;
+            l->rate = min(l->rate, pc->max_rate);
+            pc->stats.increases++;
+        }
+        busy |= l->lost || l->limited || l->count > 0;
+        l->lost = l->limited = 0;
+    }
+
+    /* Idle, there is nothing to judge; the next datagram starts it again. */
+    if (busy) {
+        pacer_flush(pc);
+        if (pc->tick == NULL)
+            pc->tick = reactor_timer(reactor, PACER_INTERVAL_MS, 0, on_tick,
+                                     pc);
+    }
+}
+
+/*
+ * Paces what goes out on `sockfd'. No link's rate goes above `max_rate'
+ * bytes a second, or 1 Gbit/s if it is 0.
+ */
+struct pacer *pacer_create(struct reactor *reactor, int sockfd, int64_t max_rate)
+{
+    struct pacer *pc = Calloc(1, sizeof(*pc));
+
+    pc->reactor = reactor;
+    pc->fd = sockfd;
+    pc->max_rate = max_rate > 0 ? max(max_rate, PACER_RATE_MIN) : PACER_RATE_MAX;
+
+    return pc;
+}
+
+/* What is still waiting is dropped. */
+void pacer_free(struct pacer *pc)
+{
+    int i;
+
+    for (i = 0; i < pc->nlinks; ++i) {
+        struct pacer_link *l = pc->links[i];
+        while (l->count > 0)
+            pop(pc, l, 0);
+        free(l->q);
+        free(l);
+    }
+    reactor_cancel(pc->reactor, pc->drain);
+    reactor_cancel(pc->reactor, pc->tick);
+    free(pc->links);
+    free(pc);
+}
+
+static int enqueue(struct pacer *pc, struct pacer_buf *b, int link,
+                   const struct sockaddr_in *to, pacer_sent_cb sent_cb,
+                   void *arg, uint32_t tag)
+{
+    struct pacer_link *l = link_get(pc, link);
+
+    if (l->count == l->cap && queue_grow(l) < 0) {
+        l->dropped++;
+        pc->stats.dropped++;
+        return -1;
+    }
+
+    struct pacer_item *it = &l->q[(l->head + l->count++) % l->cap];
+    it->to = *to;
+    it->buf = b;
+    it->sent_cb = sent_cb;
+    it->arg = arg;
+    it->tag = tag;
+    l->bytes += b->len + PACER_OVERHEAD;
+    b->refs++;
+    pc->stats.queued++;
+    pc->stats.waiting++;
+
+    return 0;
+}
+
+static struct pacer_buf *gather(const struct iovec *iov, int iovcnt)
+{
+    struct pacer_buf *b;
+    size_t len = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+
+    b = Malloc(sizeof(*b) + len);
+    b->refs = 1;
+    b->len = 0;
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(b->data + b->len, iov[i].iov_base, iov[i].iov_len);
+        b->len += iov[i].iov_len;
+    }
+
+    return b;
+}
+
+/*
+ * Queues the datagram gathered from `iov' for `to', over link `link'. It
+ * goes out with the next pacer_flush, or from the reactor when the link
+ * has tokens; then `sent_cb', if not NULL, gets `arg' and `tag'. Returns
+ * 0, or -1 if PACER_QUEUE are waiting on the link.
+ */
+int pacer_sendv(struct pacer *pc, int link, const struct iovec *iov, int iovcnt,
+                const struct sockaddr_in *to, pacer_sent_cb sent_cb, void *arg,
+                uint32_t tag)
+{
+    struct pacer_buf *b = gather(iov, iovcnt);
+    int ret = enqueue(pc, b, link, to, sent_cb, arg, tag);
+
+    buf_release(b);
+    return ret;
+}
+
+/*
+ * Sends the datagram gathered from `iov' to each of the `n' addresses in
+ * `to', the i-th over link links[i], or link 0 if `links' is NULL, and
+ * sends what the links' buckets allow. Returns the number of addresses it
+ * was dropped for, because their link's queue was full.
+ */
+int pacer_fanout(struct pacer *pc, const struct iovec *iov, int iovcnt,
+                 const struct sockaddr_in *to, const int *links, int n)
+{
+    struct pacer_buf *b = gather(iov, iovcnt);
+    int i, dropped = 0;
+
+    for (i = 0; i < n; ++i) {
+        if (enqueue(pc, b, links != NULL ? links[i] : 0, &to[i], NULL, NULL,
+                    0) < 0)
+            dropped++;
+    }
+    buf_release(b);
+    pacer_flush(pc);
+
+    return dropped;
+}
+
+/* Sends what the buckets allow now; the reactor sends the rest later. */
+void pacer_flush(struct pacer *pc)
+{
+    int i;
+
+    for (i = 0; i < pc->nlinks; ++i)
+        drain(pc, pc->links[i]);
+    schedule(pc);
+}
+
+/* The datagrams queued with `arg' go out without calling back. */
+void pacer_cancel(struct pacer *pc, void *arg)
+{
+    int i, k;
+
+    for (i = 0; i < pc->nlinks; ++i) {
+        struct pacer_link *l = pc->links[i];
+        for (k = 0; k < l->count; ++k) {
+            struct pacer_item *it = &l->q[(l->head + k) % l->cap];
+            if (it->arg == arg)
+                it->sent_cb = NULL;
+        }
+    }
+}
+
+/* Something sent over `link' was lost; the rate comes down. */
+void pacer_loss(struct pacer *pc, int link)
+{
+    struct pacer_link *l = link_get(pc, link);
+
+    if (now_ns() >= l->recover)
+        l->lost = 1;
+    l->losses++;
+    pc->stats.losses++;
+}
+
+void pacer_get_stats(const struct pacer *pc, struct pacer_stats *stats)
+{
+    *stats = pc->stats;
+}
+
+void pacer_print_stats(const struct pacer *pc)
+{
+    const struct pacer_stats *st = &pc->stats;
+    int i;
+
+    printf("pacer: %lu queued, %lu sent in %lu syscalls, %lu waiting, "
+           "%lu dropped, %lu send errors\n", st->queued, st->sent,
+           st->syscalls, st->waiting, st->dropped, st->send_errors);
+    printf("pacer: %lu losses, %lu times out of buffer; rate %lu times down, "
+           "%lu up\n", st->losses, st->blocked, st->decreases, st->increases);
+
+    for (i = 0; i < pc->nlinks; ++i) {
+        const struct pacer_link *l = pc->links[i];
+        printf("pacer: link %d at %.2f Mbit/s%s; %lu sent, %lu waiting, "
+               "%lu dropped, %lu losses\n", l->id, l->rate * 8 / 1e6,
+               l->slow_start ? " (slow start)" : "", l->sent,
+               (unsigned long) l->count, l->dropped, l->losses);
+    }
+}
@@ -0,0 +1,143 @@
+#include "unp.h"
+#include "p2p.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+
+
+/*
+ * On-disk peer cache, so a restarted node knows whom to probe without
+ * waiting for discovery. The file is a small header followed by one fixed
+ * size record per peer, all in network byte order, and is read and written
+ * through a mapping of the whole file.
+ *
+ * It is written to a temporary file that is renamed over the old one, so a
+ * reader never sees a half-written cache.
+ */
+#define PEER_CACHE_MAGIC    0x50324350  /* "P2CP" */
+#define PEER_CACHE_VERSION  1
+
+struct cache_hdr {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t count;
+    uint32_t reserved;
+};
+
+struct cache_entry {
+    uint32_t addr;      /* sin_addr */
+    uint16_t port;      /* sin_port */
+    uint16_t reserved;
+};
+
+
+/* Returns 0, or -1 with errno set. */
+int peer_cache_save(const char *path, const struct peer_table *t)
+{
+    char tmp[PATH_MAX];
+    if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int) sizeof(tmp)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    int fd;
+    if ( (fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600)) < 0)
+        return -1;
+
+    size_t size = sizeof(struct cache_hdr) +
+                  t->count * sizeof(struct cache_entry);
+    if (ftruncate(fd, size) < 0)
+        goto fail;
+
+    void *map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED)
+        goto fail;
+
+    struct cache_hdr *hdr = map;
+    struct cache_entry *e = (struct cache_entry *) (hdr + 1);
+    int i;
+
+    hdr->magic = htonl(PEER_CACHE_MAGIC);
+    hdr->version = htonl(PEER_CACHE_VERSION);
+    hdr->count = htonl(t->count);
+    hdr->reserved = 0;
+    for (i = 0; i < t->count; ++i) {
+        e[i].addr = t->addrs[i].sin_addr.s_addr;
+        e[i].port = t->addrs[i].sin_port;
+        e[i].reserved = 0;
+    }
+
+    if (munmap(map, size) < 0)
+        goto fail;
+    if (close(fd) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+
+    return 0;
+
+fail:
+    close(fd);
+    unlink(tmp);
+    return -1;
+}
+
+/*
+ * Adds the peers cached in `path' to `t'. Returns the number of peers in the
+ * cache, or -1 with errno set; a missing file is reported as ENOENT and a
+ * damaged one as EBADMSG.
+ */
+int peer_cache_load(const char *path, struct peer_table *t)
+{
+    int fd;
+    if ( (fd = open(path, O_RDONLY)) < 0)
+        return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size < (off_t) sizeof(struct cache_hdr)) {
+        close(fd);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+
+    const struct cache_hdr *hdr = map;
+    const struct cache_entry *e = (const struct cache_entry *) (hdr + 1);
+    uint32_t count = ntohl(hdr->count);
+
+    if (ntohl(hdr->magic) != PEER_CACHE_MAGIC ||
+            ntohl(hdr->version) != PEER_CACHE_VERSION ||
+            (st.st_size - sizeof(*hdr)) / sizeof(*e) < count) {
+        munmap(map, st.st_size);
+        errno = EBADMSG;
+        return -1;
+    }
+
+    uint32_t i;
+    for (i = 0; i < count; ++i) {
+        struct sockaddr_in addr;
+        bzero(&addr, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = e[i].addr;
+        addr.sin_port = e[i].port;
+        peer_table_add(t, &addr);
+    }
+
+    munmap(map, st.st_size);
+
+    return count;
+}
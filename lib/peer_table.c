@@ -0,0 +1,214 @@
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * Peers live in a dense array, in no particular order, so a fan-out can hand
+ * the whole of `addrs' to sendmmsg. An open-addressing hash with linear
+ * probing maps an address and port to its position in that array; it is
+ * kept at most half full, so lookups touch a slot or two.
+ *
+ * Removal moves the last peer into the hole and shifts the probe chain back
+ * over the freed slot, so there are no tombstones to clean up later.
+ *
+ * Every peer also carries the time it was last heard from, for expiring the
+ * ones that went quiet, and the interface it was found on.
+ */
+#define EMPTY -1
+
+static unsigned peer_hash(const struct sockaddr_in *sa)
+{
+    uint64_t k = ((uint64_t) sa->sin_addr.s_addr << 16) | sa->sin_port;
+
+    k *= 0x9e3779b97f4a7c15ULL;     /* Fibonacci hashing */
+    return k >> 32;
+}
+
+/* Unlike sock_cmp_addr, sock_cmp_port returns 1 when the ports match. */
+static int peer_eq(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return sock_cmp_addr((const SA *) a, (const SA *) b, sizeof(*a)) == 0 &&
+           sock_cmp_port((const SA *) a, (const SA *) b, sizeof(*a)) == 1;
+}
+
+static void index_build(struct peer_table *t, int nslots)
+{
+    int i;
+
+    free(t->index);
+    t->index = Malloc(nslots * sizeof(*t->index));
+    t->mask = nslots - 1;
+    for (i = 0; i < nslots; ++i)
+        t->index[i] = EMPTY;
+
+    for (i = 0; i < t->count; ++i) {
+        unsigned s = peer_hash(&t->addrs[i]) & t->mask;
+        while (t->index[s] != EMPTY)
+            s = (s + 1) & t->mask;
+        t->index[s] = i;
+    }
+}
+
+/* `hint' is the number of peers to make room for up front. */
+struct peer_table *peer_table_create(int hint)
+{
+    struct peer_table *t = Calloc(1, sizeof(*t));
+
+    t->cap = 16;
+    while (t->cap < hint)
+        t->cap <<= 1;
+    t->addrs = Calloc(t->cap, sizeof(*t->addrs));
+    t->seen = Calloc(t->cap, sizeof(*t->seen));
+    t->iface = Calloc(t->cap, sizeof(*t->iface));
+    index_build(t, 2 * t->cap);
+
+    return t;
+}
+
+void peer_table_free(struct peer_table *t)
+{
+    free(t->addrs);
+    free(t->seen);
+    free(t->iface);
+    free(t->index);
+    free(t);
+}
+
+/* Returns the hash slot of `addr', or of the empty slot where it would go. */
+static unsigned slot_of(const struct peer_table *t,
+                        const struct sockaddr_in *addr)
+{
+    unsigned s = peer_hash(addr) & t->mask;
+
+    while (t->index[s] != EMPTY && !peer_eq(&t->addrs[t->index[s]], addr))
+        s = (s + 1) & t->mask;
+
+    return s;
+}
+
+/* Returns the position of `addr' in t->addrs, or -1. */
+int peer_table_find(const struct peer_table *t, const struct sockaddr_in *addr)
+{
+    return t->index[slot_of(t, addr)];
+}
+
+/*
+ * Returns 1 if `addr' was added, 0 if it was already there. Either way it
+ * counts as heard from just now.
+ */
+int peer_table_add(struct peer_table *t, const struct sockaddr_in *addr)
+{
+    return peer_table_add_on(t, addr, 0);
+}
+
+/*
+ * Like peer_table_add, and tags the peer with the index of the interface it
+ * was found on, unless `iface' is 0.
+ */
+int peer_table_add_on(struct peer_table *t, const struct sockaddr_in *addr,
+                      int iface)
+{
+    unsigned s = slot_of(t, addr);
+    if (t->index[s] != EMPTY) {
+        t->seen[t->index[s]] = now_ms();
+        if (iface != 0)
+            t->iface[t->index[s]] = iface;
+        return 0;
+    }
+
+    if (t->count == t->cap) {
+        t->cap *= 2;
+        t->addrs = realloc(t->addrs, t->cap * sizeof(*t->addrs));
+        t->seen = realloc(t->seen, t->cap * sizeof(*t->seen));
+        t->iface = realloc(t->iface, t->cap * sizeof(*t->iface));
+        if (t->addrs == NULL || t->seen == NULL || t->iface == NULL)
+            err_sys("realloc error");
+        index_build(t, 2 * t->cap);
+        s = slot_of(t, addr);
+    }
+
+    t->addrs[t->count] = *addr;
+    t->seen[t->count] = now_ms();
+    t->iface[t->count] = iface;
+    t->index[s] = t->count++;
+
+    return 1;
+}
+
+/*
+ * Removes `addr'; the last peer takes its position in t->addrs. Returns 0,
+ * or -1 if it wasn't there.
+ */
+int peer_table_remove(struct peer_table *t, const struct sockaddr_in *addr)
+{
+    unsigned hole = slot_of(t, addr);
+    int pos = t->index[hole];
+    if (pos == EMPTY)
+        return -1;
+
+    /* Pull back every entry that probed past the hole. */
+    unsigned s = hole;
+    for ( ; ; ) {
+        s = (s + 1) & t->mask;
+        if (t->index[s] == EMPTY)
+            break;
+
+        unsigned home = peer_hash(&t->addrs[t->index[s]]) & t->mask;
+        /* Stays put if its home lies cyclically in (hole, s]. */
+        if (((s - home) & t->mask) < ((s - hole) & t->mask))
+            continue;
+
+        t->index[hole] = t->index[s];
+        hole = s;
+    }
+    t->index[hole] = EMPTY;
+
+    int last = --t->count;
+    if (pos != last) {
+        t->index[slot_of(t, &t->addrs[last])] = pos;
+        t->addrs[pos] = t->addrs[last];
+        t->seen[pos] = t->seen[last];
+        t->iface[pos] = t->iface[last];
+    }
+
+    return 0;
+}
+
+/*
+ * Marks `addr' as heard from just now. Returns its position, or -1 if it
+ * isn't in the table.
+ */
+int peer_table_touch(struct peer_table *t, const struct sockaddr_in *addr)
+{
+    int pos = peer_table_find(t, addr);
+    if (pos >= 0)
+        t->seen[pos] = now_ms();
+
+    return pos;
+}
+
+/*
+ * Removes every peer not heard from since `before' (ms on the monotonic
+ * clock), calling cb, if not NULL, for each one first. Returns the number of
+ * peers removed.
+ */
+int peer_table_expire(struct peer_table *t, uint64_t before, peer_cb cb,
+                      void *arg)
+{
+    int i, n = 0;
+
+    /* Backwards, so the peer moved into a hole has already been looked at. */
+    for (i = t->count - 1; i >= 0; --i) {
+        if (t->seen[i] >= before)
+            continue;
+
+        struct sockaddr_in addr = t->addrs[i];
+        if (cb != NULL)
+            cb(&addr, arg);
+        peer_table_remove(t, &addr);
+        n++;
+    }
+    t->expired += n;
+
+    return n;
+}
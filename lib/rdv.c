@@ -0,0 +1,552 @@
+#include "unp.h"
+#include "p2p.h"
+
+#include <ctype.h>
+
+
+/*
+ * The registry of a rendezvous server: user names mapped to the address
+ * they registered from, grouped into rooms.
+ *
+ * Registrations live in a dense array, like the peer table, with an
+ * open-addressing hash on the name kept at most half full; removal moves
+ * the last registration into the hole and shifts the probe chain back, so
+ * there are no tombstones. Rooms are a second such array and hash. Each room
+ * heads a doubly linked list, threaded through the registrations by
+ * position, of who is in it; a room goes away with its last member.
+ *
+ * Nothing here allocates per request: a lookup is a hash and a compare or
+ * two, whatever the number of names.
+ *
+ * On the wire (see rdv_encode_register and rdv_peers_add):
+ *
+ *   REGISTER   port(2) name [' ' room]   port 0 means the source port;
+ *                                        answered with OK, or with PEERS
+ *                                        naming the holder if it's taken
+ *   LOOKUP     name [' ' name ...]       answered with PEERS, in that order
+ *   ROOM       room                      answered with PEERS, as many as fit
+ *   LEAVE      name
+ *   OK, PEERS  peers: addr(4) port(2) namelen(1) name, packed
+ *
+ * The registered host is always the source address of the request, so no
+ * one can register another host's. A name is held by whoever registered it
+ * first, until it is left or expires: only a REGISTER from the address it
+ * is held at renews it. LOOKUP names no one holds come back with a zero
+ * address.
+ */
+#define EMPTY -1
+
+#define KEY(base, stride, i)    ((const char *) (base) + (size_t) (i) * (stride))
+
+struct name_index {
+    int         *slots;     /* hash slot -> position, or EMPTY */
+    unsigned     mask;
+};
+
+struct rdv_entry {
+    struct rdv_peer  peer;                      /* the name comes first */
+    char             room[P2P_MAXNAME + 1];     /* "" if in none */
+    uint64_t         expires;
+    int              prev, next;                /* in the room, -1 at the ends */
+};
+
+struct rdv_room {
+    char    name[P2P_MAXNAME + 1];
+    int     head;
+    int     count;
+};
+
+struct rdv_registry {
+    struct rdv_entry    *entries;
+    int                  count, cap;
+    struct name_index    names;
+
+    struct rdv_room     *rooms;
+    int                  nrooms, rooms_cap;
+    struct name_index    room_index;
+
+    struct rdv_stats     stats;
+};
+
+
+/* FNV-1a */
+static unsigned name_hash(const char *name)
+{
+    uint32_t h = 2166136261u;
+
+    while (*name != 0) {
+        h ^= (uint8_t) *name++;
+        h *= 16777619;
+    }
+    return h;
+}
+
+static void index_build(struct name_index *x, int nslots, const void *base,
+                        size_t stride, int count)
+{
+    int i;
+
+    free(x->slots);
+    x->slots = Malloc(nslots * sizeof(*x->slots));
+    x->mask = nslots - 1;
+    for (i = 0; i < nslots; ++i)
+        x->slots[i] = EMPTY;
+
+    for (i = 0; i < count; ++i) {
+        unsigned s = name_hash(KEY(base, stride, i)) & x->mask;
+        while (x->slots[s] != EMPTY)
+            s = (s + 1) & x->mask;
+        x->slots[s] = i;
+    }
+}
+
+/* Returns the slot of `name', or of the empty slot where it would go. */
+static unsigned index_slot(const struct name_index *x, const char *name,
+                           const void *base, size_t stride)
+{
+    unsigned s = name_hash(name) & x->mask;
+
+    while (x->slots[s] != EMPTY &&
+            strcmp(KEY(base, stride, x->slots[s]), name) != 0)
+        s = (s + 1) & x->mask;
+
+    return s;
+}
+
+/* Empties slot `hole', pulling back every entry that probed past it. */
+static void index_remove(struct name_index *x, unsigned hole, const void *base,
+                         size_t stride)
+{
+    unsigned s = hole;
+
+    for ( ; ; ) {
+        s = (s + 1) & x->mask;
+        if (x->slots[s] == EMPTY)
+            break;
+
+        unsigned home = name_hash(KEY(base, stride, x->slots[s])) & x->mask;
+        /* Stays put if its home lies cyclically in (hole, s]. */
+        if (((s - home) & x->mask) < ((s - hole) & x->mask))
+            continue;
+
+        x->slots[hole] = x->slots[s];
+        hole = s;
+    }
+    x->slots[hole] = EMPTY;
+}
+
+/* `hint' is the number of names to make room for up front. */
+struct rdv_registry *rdv_create(int hint)
+{
+    struct rdv_registry *reg = Calloc(1, sizeof(*reg));
+
+    reg->cap = 16;
+    while (reg->cap < hint)
+        reg->cap <<= 1;
+    reg->entries = Calloc(reg->cap, sizeof(*reg->entries));
+    index_build(&reg->names, 2 * reg->cap, reg->entries,
+                sizeof(*reg->entries), 0);
+
+    reg->rooms_cap = 16;
+    reg->rooms = Calloc(reg->rooms_cap, sizeof(*reg->rooms));
+    index_build(&reg->room_index, 2 * reg->rooms_cap, reg->rooms,
+                sizeof(*reg->rooms), 0);
+
+    return reg;
+}
+
+void rdv_free(struct rdv_registry *reg)
+{
+    free(reg->entries);
+    free(reg->names.slots);
+    free(reg->rooms);
+    free(reg->room_index.slots);
+    free(reg);
+}
+
+/* 1 to P2P_MAXNAME printable characters, none of them a space. */
+int rdv_valid_name(const char *name)
+{
+    size_t len = strlen(name);
+
+    if (len == 0 || len > P2P_MAXNAME)
+        return 0;
+    for ( ; *name != 0; ++name) {
+        if (!isgraph((unsigned char) *name))
+            return 0;
+    }
+    return 1;
+}
+
+static int find_entry(const struct rdv_registry *reg, const char *name)
+{
+    return reg->names.slots[index_slot(&reg->names, name, reg->entries,
+                                       sizeof(*reg->entries))];
+}
+
+static int find_room(const struct rdv_registry *reg, const char *name)
+{
+    return reg->room_index.slots[index_slot(&reg->room_index, name, reg->rooms,
+                                            sizeof(*reg->rooms))];
+}
+
+static void room_link(struct rdv_registry *reg, int pos)
+{
+    struct rdv_entry *e = &reg->entries[pos];
+    if (e->room[0] == 0)
+        return;
+
+    unsigned s = index_slot(&reg->room_index, e->room, reg->rooms,
+                            sizeof(*reg->rooms));
+    if (reg->room_index.slots[s] == EMPTY) {
+        if (reg->nrooms == reg->rooms_cap) {
+            reg->rooms_cap *= 2;
+            reg->rooms = realloc(reg->rooms, reg->rooms_cap * sizeof(*reg->rooms));
+            if (reg->rooms == NULL)
+                err_sys("realloc error");
+            index_build(&reg->room_index, 2 * reg->rooms_cap, reg->rooms,
+                        sizeof(*reg->rooms), reg->nrooms);
+            s = index_slot(&reg->room_index, e->room, reg->rooms,
+                           sizeof(*reg->rooms));
+        }
+        struct rdv_room *room = &reg->rooms[reg->nrooms];
+        strcpy(room->name, e->room);
+        room->head = -1;
+        room->count = 0;
+        reg->room_index.slots[s] = reg->nrooms++;
+    }
+
+    struct rdv_room *room = &reg->rooms[reg->room_index.slots[s]];
+    e->prev = -1;
+    e->next = room->head;
+    if (room->head >= 0)
+        reg->entries[room->head].prev = pos;
+    room->head = pos;
+    room->count++;
+}
+
+static void room_unlink(struct rdv_registry *reg, int pos)
+{
+    struct rdv_entry *e = &reg->entries[pos];
+    if (e->room[0] == 0)
+        return;
+
+    unsigned s = index_slot(&reg->room_index, e->room, reg->rooms,
+                            sizeof(*reg->rooms));
+    int r = reg->room_index.slots[s];
+    struct rdv_room *room = &reg->rooms[r];
+
+    if (e->prev >= 0)
+        reg->entries[e->prev].next = e->next;
+    else
+        room->head = e->next;
+    if (e->next >= 0)
+        reg->entries[e->next].prev = e->prev;
+
+    if (--room->count > 0)
+        return;
+
+    /* The last member left; the last room takes its place. */
+    index_remove(&reg->room_index, s, reg->rooms, sizeof(*reg->rooms));
+    int last = --reg->nrooms;
+    if (r != last) {
+        reg->room_index.slots[index_slot(&reg->room_index, reg->rooms[last].name,
+                                         reg->rooms, sizeof(*reg->rooms))] = r;
+        reg->rooms[r] = reg->rooms[last];
+    }
+}
+
+static void remove_entry(struct rdv_registry *reg, int pos)
+{
+    room_unlink(reg, pos);
+    index_remove(&reg->names,
+                 index_slot(&reg->names, reg->entries[pos].peer.name,
+                            reg->entries, sizeof(*reg->entries)),
+                 reg->entries, sizeof(*reg->entries));
+
+    int last = --reg->count;
+    if (pos == last)
+        return;
+
+    /* The last registration moves into the hole; so do the links to it. */
+    struct rdv_entry *e = &reg->entries[last];
+    reg->names.slots[index_slot(&reg->names, e->peer.name, reg->entries,
+                                sizeof(*reg->entries))] = pos;
+    if (e->room[0] != 0) {
+        if (e->prev >= 0)
+            reg->entries[e->prev].next = pos;
+        else
+            reg->rooms[find_room(reg, e->room)].head = pos;
+        if (e->next >= 0)
+            reg->entries[e->next].prev = pos;
+    }
+    reg->entries[pos] = *e;
+}
+
+static int same_addr(const struct sockaddr_in *a, const struct sockaddr_in *b)
+{
+    return a->sin_addr.s_addr == b->sin_addr.s_addr &&
+           a->sin_port == b->sin_port;
+}
+
+/*
+ * Registers `name' at `addr', in `room' if it isn't NULL or empty, until
+ * RDV_TTL_MS after `now'. Registering again from `addr' renews it, and may
+ * change the room; from anywhere else it has to be left or expired first.
+ *
+ * Returns 1 for a new name, 0 for a renewal, -1 if the name or the room
+ * isn't valid, or -2 if the name is held at another address.
+ */
+int rdv_register(struct rdv_registry *reg, const char *name, const char *room,
+                 const struct sockaddr_in *addr, uint64_t now)
+{
+    if (room == NULL)
+        room = "";
+    if (!rdv_valid_name(name) || (room[0] != 0 && !rdv_valid_name(room)))
+        return -1;
+
+    unsigned s = index_slot(&reg->names, name, reg->entries,
+                            sizeof(*reg->entries));
+    int pos = reg->names.slots[s];
+    if (pos != EMPTY) {
+        struct rdv_entry *e = &reg->entries[pos];
+        /* Expired but not yet dropped, it's anyone's. */
+        if (!same_addr(&e->peer.addr, addr) && e->expires > now) {
+            reg->stats.refused++;
+            return -2;
+        }
+        if (strcmp(e->room, room) != 0) {
+            room_unlink(reg, pos);
+            strcpy(e->room, room);
+            room_link(reg, pos);
+        }
+        e->peer.addr = *addr;
+        e->expires = now + RDV_TTL_MS;
+        reg->stats.renewals++;
+        return 0;
+    }
+
+    if (reg->count == reg->cap) {
+        reg->cap *= 2;
+        reg->entries = realloc(reg->entries, reg->cap * sizeof(*reg->entries));
+        if (reg->entries == NULL)
+            err_sys("realloc error");
+        index_build(&reg->names, 2 * reg->cap, reg->entries,
+                    sizeof(*reg->entries), reg->count);
+        s = index_slot(&reg->names, name, reg->entries, sizeof(*reg->entries));
+    }
+
+    pos = reg->count++;
+    struct rdv_entry *e = &reg->entries[pos];
+    strcpy(e->peer.name, name);
+    e->peer.addr = *addr;
+    strcpy(e->room, room);
+    e->expires = now + RDV_TTL_MS;
+    reg->names.slots[s] = pos;
+    room_link(reg, pos);
+    reg->stats.registers++;
+
+    return 1;
+}
+
+/*
+ * Drops `name' if it is registered at `addr'. Returns 0, or -1 if it isn't.
+ */
+int rdv_leave(struct rdv_registry *reg, const char *name,
+              const struct sockaddr_in *addr)
+{
+    int pos = find_entry(reg, name);
+    if (pos == EMPTY)
+        return -1;
+
+    if (!same_addr(&reg->entries[pos].peer.addr, addr))
+        return -1;
+
+    remove_entry(reg, pos);
+    reg->stats.leaves++;
+
+    return 0;
+}
+
+/*
+ * Returns who is registered under `name', or NULL. The pointer is good until
+ * the registry next changes.
+ */
+const struct rdv_peer *rdv_lookup(struct rdv_registry *reg, const char *name)
+{
+    reg->stats.lookups++;
+
+    int pos = find_entry(reg, name);
+    if (pos == EMPTY)
+        return NULL;
+
+    reg->stats.hits++;
+    return &reg->entries[pos].peer;
+}
+
+/*
+ * Points peers[0..] at up to `max' members of `room', the latest to register
+ * first, and returns how many. The pointers are good until the registry
+ * next changes.
+ */
+int rdv_room(struct rdv_registry *reg, const char *room,
+             const struct rdv_peer **peers, int max)
+{
+    reg->stats.room_lookups++;
+
+    int r = find_room(reg, room);
+    if (r == EMPTY)
+        return 0;
+
+    int n = 0, pos;
+    for (pos = reg->rooms[r].head; pos >= 0 && n < max;
+            pos = reg->entries[pos].next)
+        peers[n++] = &reg->entries[pos].peer;
+
+    return n;
+}
+
+/*
+ * Drops every registration that ran out by `now'. A full pass is a compare
+ * per name, so it is cheap enough to run every second even at 100k names.
+ * Returns the number dropped.
+ */
+int rdv_expire(struct rdv_registry *reg, uint64_t now)
+{
+    int i, n = 0;
+
+    /* Backwards, so the registration moved into a hole was looked at. */
+    for (i = reg->count - 1; i >= 0; --i) {
+        if (reg->entries[i].expires > now)
+            continue;
+        remove_entry(reg, i);
+        n++;
+    }
+    reg->stats.expired += n;
+
+    return n;
+}
+
+void rdv_get_stats(const struct rdv_registry *reg, struct rdv_stats *stats)
+{
+    *stats = reg->stats;
+    stats->registered = reg->count;
+    stats->rooms = reg->nrooms;
+}
+
+void rdv_print_stats(const struct rdv_registry *reg)
+{
+    struct rdv_stats st;
+    rdv_get_stats(reg, &st);
+
+    printf("rdv: %d names in %d rooms; %lu registered, %lu renewed, "
+           "%lu refused, %lu left, %lu expired\n", st.registered, st.rooms,
+           st.registers, st.renewals, st.refused, st.leaves, st.expired);
+    printf("rdv: %lu lookups, %lu hits, %lu room lookups\n", st.lookups,
+           st.hits, st.room_lookups);
+}
+
+
+/*
+ * Writes a REGISTER frame for `name' in `room' (NULL for none) into `out',
+ * which must have room for P2P_MAXMSG bytes. `port' is the one to register,
+ * in host byte order, or 0 for the port the frame is sent from. Returns the
+ * frame length.
+ */
+size_t rdv_encode_register(char *out, int port, const char *name,
+                           const char *room)
+{
+    char *body = out + P2P_HDRLEN;
+    uint16_t nport = htons(port);
+    int len;
+
+    memcpy(body, &nport, 2);
+    if (room != NULL && room[0] != 0)
+        len = snprintf(body + 2, P2P_MAXMSG - P2P_HDRLEN - 2, "%s %s", name, room);
+    else
+        len = snprintf(body + 2, P2P_MAXMSG - P2P_HDRLEN - 2, "%s", name);
+
+    return frame_hdr(out, P2P_OP_RDV_REGISTER, 0, 2 + len) + 2 + len;
+}
+
+/*
+ * Parses a REGISTER frame that came from `from' into `peer' and `room',
+ * which has room for P2P_MAXNAME + 1 bytes and is left empty if the frame
+ * names none. Returns 0, or -1 if the frame is malformed.
+ */
+int rdv_parse_register(const struct p2p_msg *msg, const struct sockaddr_in *from,
+                       struct rdv_peer *peer, char *room)
+{
+    uint16_t port;
+
+    if (msg->len < 3)
+        return -1;
+    memcpy(&port, msg->body, 2);
+
+    const char *name = msg->body + 2;
+    size_t namelen = strcspn(name, " ");
+    if (namelen == 0 || namelen > P2P_MAXNAME)
+        return -1;
+    memcpy(peer->name, name, namelen);
+    peer->name[namelen] = 0;
+
+    room[0] = 0;
+    if (name[namelen] == ' ') {
+        const char *r = name + namelen + 1;
+        if (strlen(r) > P2P_MAXNAME)
+            return -1;
+        strcpy(room, r);
+    }
+
+    peer->addr = *from;
+    if (port != 0)
+        peer->addr.sin_port = port;
+
+    return 0;
+}
+
+/*
+ * Appends `peer' to a PEERS or OK body of `len' bytes in a buffer of `size'.
+ * Returns the new length, or 0 if the peer doesn't fit.
+ */
+size_t rdv_peers_add(char *body, size_t len, size_t size,
+                     const struct rdv_peer *peer)
+{
+    size_t namelen = strlen(peer->name);
+
+    if (len + 7 + namelen > size)
+        return 0;
+
+    memcpy(body + len, &peer->addr.sin_addr.s_addr, 4);
+    memcpy(body + len + 4, &peer->addr.sin_port, 2);
+    body[len + 6] = namelen;
+    memcpy(body + len + 7, peer->name, namelen);
+
+    return len + 7 + namelen;
+}
+
+/*
+ * Parses the peer at `*off' in a PEERS or OK message into `peer' and moves
+ * `*off' past it. Returns 1, 0 at the end of the body, or -1 if the body is
+ * malformed.
+ */
+int rdv_peers_next(const struct p2p_msg *msg, size_t *off, struct rdv_peer *peer)
+{
+    const char *p = msg->body + *off;
+    size_t left = msg->len - *off;
+
+    if (left == 0)
+        return 0;
+    if (left < 7 || (uint8_t) p[6] > P2P_MAXNAME || left < 7u + (uint8_t) p[6])
+        return -1;
+
+    bzero(&peer->addr, sizeof(peer->addr));
+    peer->addr.sin_family = AF_INET;
+    memcpy(&peer->addr.sin_addr.s_addr, p, 4);
+    memcpy(&peer->addr.sin_port, p + 4, 2);
+    memcpy(peer->name, p + 7, (uint8_t) p[6]);
+    peer->name[(uint8_t) p[6]] = 0;
+    *off += 7 + (uint8_t) p[6];
+
+    return 1;
+}
@@ -0,0 +1,265 @@
+#include "unp.h"
+#include "p2p.h"
+
+#include <sys/epoll.h>
+
+
+/*
+ * A small epoll-based reactor. Descriptors are registered with a callback
+ * that runs when they become ready; handlers are kept in a table indexed by
+ * descriptor, so registering and dispatching are O(1) and a wakeup costs
+ * O(ready descriptors) no matter how many are registered.
+ *
+ * Timers live on a timer wheel whose timerfd sits in the epoll set like any
+ * other descriptor, so they need neither signals nor a computed timeout.
+ */
+#define REACTOR_MAXEVENTS 64
+
+struct fd_handler {
+    reactor_cb   cb;
+    void        *arg;
+    int          events;
+};
+
+struct reactor_timer {
+    struct wheel_timer   wt;
+    struct reactor      *r;
+    int                  interval;  /* ms; 0 for one-shot timers */
+    timer_cb             cb;
+    void                *arg;
+};
+
+struct reactor {
+    int                    epfd;
+    int                    running;
+
+    struct fd_handler     *handlers;
+    int                    nhandlers;
+
+    struct timer_wheel    *wheel;
+};
+
+
+uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+
+static void on_timers(struct reactor *r, int fd, int events, void *arg)
+{
+    wheel_run(r->wheel);
+}
+
+struct reactor *reactor_create(void)
+{
+    struct reactor *r = Calloc(1, sizeof(*r));
+
+    if ( (r->epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        free(r);
+        return NULL;
+    }
+
+    if ( (r->wheel = wheel_create()) == NULL ||
+            reactor_add(r, wheel_fd(r->wheel), REACTOR_IN, on_timers, NULL) < 0) {
+        reactor_free(r);
+        return NULL;
+    }
+
+    return r;
+}
+
+void reactor_free(struct reactor *r)
+{
+    if (r->wheel) {
+        struct wheel_timer *wt;
+        while ( (wt = wheel_pop(r->wheel)) != NULL)
+            free(wt->arg);
+        wheel_free(r->wheel);
+    }
+
+    close(r->epfd);
+    free(r->handlers);
+    free(r);
+}
+
+static uint32_t to_epoll(int events)
+{
+    uint32_t ev = 0;
+
+    if (events & REACTOR_IN)
+        ev |= EPOLLIN;
+    if (events & REACTOR_OUT)
+        ev |= EPOLLOUT;
+    if (events & REACTOR_ET)
+        ev |= EPOLLET;
+
+    return ev;
+}
+
+/*
+ * Registers `fd' so that cb is called when any of `events' is ready. With
+ * REACTOR_ET the descriptor is made non-blocking and cb must read or write
+ * until EAGAIN. Don't use REACTOR_ET on descriptors shared with other
+ * processes, like stdin: O_NONBLOCK would leak to them.
+ */
+int reactor_add(struct reactor *r, int fd, int events, reactor_cb cb, void *arg)
+{
+    if (fd >= r->nhandlers) {
+        int n = max(fd + 1, 2 * r->nhandlers);
+        r->handlers = realloc(r->handlers, n * sizeof(*r->handlers));
+        if (r->handlers == NULL)
+            err_sys("realloc error");
+        bzero(&r->handlers[r->nhandlers],
+              (n - r->nhandlers) * sizeof(*r->handlers));
+        r->nhandlers = n;
+    }
+
+    if (events & REACTOR_ET) {
+        int flags = Fcntl(fd, F_GETFL, 0);
+        Fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    }
+
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+        return -1;
+
+    r->handlers[fd].cb = cb;
+    r->handlers[fd].arg = arg;
+    r->handlers[fd].events = events;
+
+    return 0;
+}
+
+int reactor_mod(struct reactor *r, int fd, int events)
+{
+    struct epoll_event ev;
+    bzero(&ev, sizeof(ev));
+    ev.events = to_epoll(events);
+    ev.data.fd = fd;
+    if (epoll_ctl(r->epfd, EPOLL_CTL_MOD, fd, &ev) < 0)
+        return -1;
+
+    r->handlers[fd].events = events;
+
+    return 0;
+}
+
+int reactor_del(struct reactor *r, int fd)
+{
+    if (fd < r->nhandlers)
+        r->handlers[fd].cb = NULL;
+
+    return epoll_ctl(r->epfd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+
+static void timer_fire(struct wheel_timer *wt, void *arg)
+{
+    struct reactor_timer *t = arg;
+
+    if (t->interval > 0) {
+        /* Re-armed first, so the callback may cancel it. */
+        wheel_add(t->r->wheel, &t->wt, t->interval);
+        t->cb(t->r, t->arg);
+    } else {
+        t->cb(t->r, t->arg);
+        free(t);
+    }
+}
+
+/*
+ * Calls cb after `ms' milliseconds; if `persistent' is set, keeps calling it
+ * every `ms' milliseconds until the timer is cancelled. The returned handle
+ * stays valid until a one-shot timer fires or the timer is cancelled.
+ */
+struct reactor_timer *reactor_timer(struct reactor *r, int ms, int persistent,
+                                    timer_cb cb, void *arg)
+{
+    struct reactor_timer *t = Malloc(sizeof(*t));
+
+    wheel_timer_init(&t->wt, timer_fire, t);
+    t->r = r;
+    t->interval = persistent ? max(ms, 1) : 0;
+    t->cb = cb;
+    t->arg = arg;
+    wheel_add(r->wheel, &t->wt, ms);
+
+    return t;
+}
+
+/*
+ * Cancels a pending timer. A one-shot timer is already gone by the time its
+ * callback runs, so cancelling it there is a no-op.
+ */
+void reactor_cancel(struct reactor *r, struct reactor_timer *t)
+{
+    if (t == NULL || !wheel_pending(&t->wt))
+        return;
+
+    wheel_cancel(r->wheel, &t->wt);
+    free(t);
+}
+
+/*
+ * Readable when reactor_once has something to dispatch, so a loop of the
+ * caller's own can wait on it along with its other descriptors.
+ */
+int reactor_fd(const struct reactor *r)
+{
+    return r->epfd;
+}
+
+/*
+ * Waits at most `timeout' ms (-1 for no limit, besides timers) and
+ * dispatches whatever is ready. Returns the number of ready descriptors.
+ */
+int reactor_once(struct reactor *r, int timeout)
+{
+    struct epoll_event events[REACTOR_MAXEVENTS];
+
+    int n = epoll_wait(r->epfd, events, REACTOR_MAXEVENTS, timeout);
+    if (n < 0) {
+        if (errno != EINTR)
+            err_sys("epoll_wait error");
+        n = 0;
+    }
+
+    int i;
+    for (i = 0; i < n; ++i) {
+        int fd = events[i].data.fd;
+        /* An earlier callback may have unregistered it. */
+        if (fd >= r->nhandlers || r->handlers[fd].cb == NULL)
+            continue;
+
+        int ready = 0;
+        if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            ready |= REACTOR_IN;
+        if (events[i].events & EPOLLOUT)
+            ready |= REACTOR_OUT;
+        if (events[i].events & (EPOLLHUP | EPOLLERR))
+            ready |= REACTOR_ERR;
+
+        r->handlers[fd].cb(r, fd, ready, r->handlers[fd].arg);
+    }
+
+    return n;
+}
+
+void reactor_run(struct reactor *r)
+{
+    r->running = 1;
+    while (r->running)
+        reactor_once(r, -1);
+}
+
+void reactor_stop(struct reactor *r)
+{
+    r->running = 0;
+}
@@ -0,0 +1,183 @@
+#include	"unprtt.h"		/* rtt_d_flag */
+#include	"unprtt64.h"
+
+/*
+ * rtt.c for LANs, where a round trip takes a few hundred microseconds and
+ * rtt.c's 2 s floor on the RTO turns every lost datagram into a stall.
+ * Timestamps are nanoseconds of CLOCK_MONOTONIC, which neither jumps with
+ * the wall clock nor rounds a LAN RTT to zero, and the estimators are
+ * integers scaled by 8 and 4, so that a gain of 1/8 or 1/4 is a shift.
+ *
+ * The first measurement sets srtt to it and rttvar to half of it, as in
+ * RFC 6298, instead of rtt.c's fixed 0.75 s starting deviation, which
+ * would keep the RTO near a second for the first several packets.
+ */
+
+/*
+ * Calculate the RTO value based on current estimators:
+ *		smoothed RTT plus four times the deviation
+ * rttvar is kept four times over, so it is added as it is.
+ */
+#define	RTT64_RTOCALC(ptr) \
+	(((ptr)->rtt_srtt >> RTT64_SRTT_SHIFT) + (ptr)->rtt_rttvar)
+
+static int64_t
+rtt64_minmax(struct rtt64_info *ptr, int64_t rto)
+{
+	if (rto < ptr->rtt_rxtmin)
+		rto = ptr->rtt_rxtmin;
+	else if (rto > ptr->rtt_rxtmax)
+		rto = ptr->rtt_rxtmax;
+	return(rto);
+}
+
+static uint64_t
+rtt64_now(void)
+{
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		err_sys("clock_gettime error");
+	return((uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+/*
+ * `rxtmin' and `rxtmax' bound the RTO, in ns; 0 takes RTT64_RXTMIN or
+ * RTT64_RXTMAX.
+ */
+void
+rtt64_init(struct rtt64_info *ptr, int64_t rxtmin, int64_t rxtmax)
+{
+	ptr->rtt_base = rtt64_now();
+
+	ptr->rtt_rxtmin = rxtmin > 0 ? rxtmin : RTT64_RXTMIN;
+	ptr->rtt_rxtmax = rxtmax > 0 ? rxtmax : RTT64_RXTMAX;
+	if (ptr->rtt_rxtmax < ptr->rtt_rxtmin)
+		ptr->rtt_rxtmax = ptr->rtt_rxtmin;
+	ptr->rtt_maxnrexmt = RTT64_MAXNREXMT;
+	ptr->rtt_nrexmt = 0;
+
+	ptr->rtt_rtt    = 0;
+	ptr->rtt_srtt   = 0;		/* 0 until the first measurement */
+	ptr->rtt_rttvar = 0;
+	ptr->rtt_rto = rtt64_minmax(ptr, RTT64_RXTINIT);
+}
+
+/*
+ * Return the current timestamp: nanoseconds since rtt64_init() was
+ * called.
+ */
+uint64_t
+rtt64_ts(struct rtt64_info *ptr)
+{
+	return(rtt64_now() - ptr->rtt_base);
+}
+
+void
+rtt64_newpack(struct rtt64_info *ptr)
+{
+	ptr->rtt_nrexmt = 0;
+}
+
+/* The RTO in ns. */
+int64_t
+rtt64_start(struct rtt64_info *ptr)
+{
+	return(ptr->rtt_rto);
+}
+
+/*
+ * The RTO in milliseconds, rounded up, for timers that tick in them:
+ * at least 1, so that a sub-millisecond RTO still waits a tick.
+ */
+int
+rtt64_start_ms(struct rtt64_info *ptr)
+{
+	return((int) ((ptr->rtt_rto + RTT64_MS - 1) / RTT64_MS));
+}
+
+/* The estimators, unscaled, in ns. */
+int64_t
+rtt64_srtt(const struct rtt64_info *ptr)
+{
+	return(ptr->rtt_srtt >> RTT64_SRTT_SHIFT);
+}
+
+int64_t
+rtt64_rttvar(const struct rtt64_info *ptr)
+{
+	return(ptr->rtt_rttvar >> RTT64_RTTVAR_SHIFT);
+}
+
+/*
+ * A response was received, `ns' after the request was sent.
+ * Update the estimators of the RTT and its mean deviation, and the RTO.
+ *
+ * Karn's algorithm: once the request has been retransmitted, the response
+ * may be to any of the copies, so the measurement is dropped, and the
+ * backed-off RTO is kept until a request that was sent once is answered.
+ * Callers that can tell which copy was answered call rtt64_newpack first.
+ */
+void
+rtt64_stop(struct rtt64_info *ptr, int64_t ns)
+{
+	int64_t		delta;
+
+	if (ptr->rtt_nrexmt > 0)
+		return;
+	if (ns <= 0)
+		ns = 1;
+	ptr->rtt_rtt = ns;
+
+	if (ptr->rtt_srtt == 0) {
+		ptr->rtt_srtt = ns << RTT64_SRTT_SHIFT;
+		ptr->rtt_rttvar = (ns / 2) << RTT64_RTTVAR_SHIFT;
+	} else {
+		/*
+		 * Jacobson's SIGCOMM '88 paper, Appendix A, in fixed point:
+		 * srtt += (rtt - srtt) / 8, rttvar += (|delta| - rttvar) / 4.
+		 */
+		delta = ns - (ptr->rtt_srtt >> RTT64_SRTT_SHIFT);
+		ptr->rtt_srtt += delta;
+		if (ptr->rtt_srtt <= 0)
+			ptr->rtt_srtt = 1;
+
+		if (delta < 0)
+			delta = -delta;		/* |delta| */
+		delta -= ptr->rtt_rttvar >> RTT64_RTTVAR_SHIFT;
+		ptr->rtt_rttvar += delta;
+		if (ptr->rtt_rttvar < 0)
+			ptr->rtt_rttvar = 0;
+	}
+
+	ptr->rtt_rto = rtt64_minmax(ptr, RTT64_RTOCALC(ptr));
+}
+
+/*
+ * A timeout has occurred.
+ * Return -1 if it's time to give up, else return 0.
+ */
+int
+rtt64_timeout(struct rtt64_info *ptr)
+{
+	ptr->rtt_rto = rtt64_minmax(ptr, ptr->rtt_rto * 2);	/* next RTO */
+
+	if (++ptr->rtt_nrexmt > ptr->rtt_maxnrexmt)
+		return(-1);			/* time to give up for this packet */
+	return(0);
+}
+
+/*
+ * Print debugging information on stderr, if the "rtt_d_flag" is nonzero.
+ */
+void
+rtt64_debug(struct rtt64_info *ptr)
+{
+	if (rtt_d_flag == 0)
+		return;
+
+	fprintf(stderr, "rtt = %.3f ms, srtt = %.3f ms, rttvar = %.3f ms, "
+			"rto = %.3f ms\n", ptr->rtt_rtt / 1e6, rtt64_srtt(ptr) / 1e6,
+			rtt64_rttvar(ptr) / 1e6, ptr->rtt_rto / 1e6);
+	fflush(stderr);
+}
@@ -0,0 +1,839 @@
+#define _GNU_SOURCE     /* sendmmsg */
+#include "unprtt64.h"
+#include "p2p.h"
+
+
+/*
+ * Reliable delivery over UDP, for messages that must not be lost but don't
+ * warrant a TCP connection per peer. One socket carries it all; what is
+ * kept per peer is a few sequence numbers, a window of messages and an
+ * rtt64_info (rtt64.c), so the retransmit timeout follows each peer's RTT,
+ * down to a millisecond on a LAN; rudp_set_rto changes the bounds.
+ *
+ * Each message to a peer gets the next sequence number and goes out in a
+ * DATA frame, the caller's whole frame inside. At most RUDP_WINDOW are
+ * unacknowledged; up to RUDP_QUEUE in all wait behind them. The receiver
+ * answers every DATA with an ACK: the next sequence number it wants (the
+ * cumulative ACK) and a bitmap of those after it it already holds (the
+ * selective ACK), so the sender resends only the holes. It delivers in
+ * order, holding back what comes early.
+ *
+ * When a peer's RTO runs out, the oldest message not SACKed is resent and
+ * the RTO doubles; after RUDP_MAXNREXMT timeouts without progress they
+ * are given up on. Without waiting for the timer, a message is taken as
+ * lost and resent once one sent RUDP_DUPTHRESH sends after it is ACKed or
+ * SACKed, as in RACK (RFC 8985) but counting sends, not time; a resend
+ * that is lost too is caught the same way. A message not resent yet is
+ * also lost with RUDP_DUPTHRESH SACKed above it (RFC 6675). Each ACK
+ * echoes the send order of the DATA it answers, so that, as with TCP
+ * timestamps (RFC 7323), the copy of a resent message that got there is
+ * known: RACK goes by it, and its RTT counts, which Karn would otherwise
+ * have to leave out.
+ *
+ * The epoch is drawn at random when a sender starts on a peer, and it and
+ * the sender's oldest unacknowledged sequence number (una) ride on every
+ * DATA. A receiver that sees a new epoch starts over at una, and one that
+ * is behind una skips to it: the sender gave those messages up.
+ *
+ * As with flood.c, the caller reads the socket and hands each message to
+ * rudp_handle, which passes the messages inside DATA frames back to it.
+ * The ACK to a DATA goes out on the socket it came in on, which the caller
+ * names, so that it comes from the address the sender knows us by.
+ *
+ * With rudp_set_pacer, DATA frames go out through a pacer (pacer.c) instead
+ * of straight to the socket, and what rudp takes as lost, by ACK or by
+ * timeout, is reported to it, so the rate to a link follows the losses on
+ * it. A peer's link is the one last given for it to rudp_fanout. A frame is
+ * timed from when the pacer sends it, not from when it was queued, and the
+ * RTO doesn't run out on one still waiting there.
+ *
+ *   DATA  epoch(4) seq(4) una(4) order(4) frame
+ *   ACK   epoch(4) cum(4) sack(8) order(4)   bit i: cum + 1 + i is held;
+ *                                            order: of the DATA answered
+ */
+#define RUDP_WINDOW     64      /* unacknowledged, and held out of order */
+#define RUDP_QUEUE      256     /* per peer, in flight and waiting */
+#define RUDP_DUPTHRESH  3
+#define RUDP_IDLE_MS    (5 * 60 * 1000)
+#define RUDP_SWEEP_MS   (60 * 1000)
+#define RUDP_CHUNK      64      /* DATA frames handed to one sendmmsg */
+#define RUDP_RXTMAX     (4000 * RTT64_MS)   /* a peer this slow is gone */
+#define RUDP_MAXNREXMT  12
+
+#define DATA_LEN    16
+#define ACK_LEN     20
+#define RUDP_MAXDATA (P2P_MAXMSG - P2P_HDRLEN - DATA_LEN)
+
+/* A message, shared by every peer it was fanned out to */
+struct rudp_buf {
+    int         refs;
+    size_t      len;
+    char        data[];
+};
+
+struct rudp_slot {
+    struct rudp_buf    *buf;
+    uint64_t            ts;         /* rtt64_ts when last sent */
+    uint32_t            order;      /* of the last send, in p->sends */
+    int                 nrexmt;
+    int                 sacked;
+    int                 queued;     /* copies still in the pacer */
+};
+
+struct rudp_peer {
+    struct rudp            *r;
+    struct sockaddr_in      addr;
+    int                     link;       /* for the pacer */
+    uint64_t                active;     /* ms of the last DATA either way */
+
+    /* Sending: [una, nxt) are in flight, [nxt, end) wait. */
+    uint32_t                epoch;
+    uint32_t                una, nxt, end;
+    uint32_t                sends;      /* DATA frames sent, resends too */
+    uint32_t                rack;       /* latest order ACKed or SACKed */
+    struct rudp_slot        q[RUDP_QUEUE];
+    struct rtt64_info       rtt;
+    struct reactor_timer   *timer;
+    int                     paced;      /* DATA frames in the pacer */
+
+    /* Receiving: rcv_next is the next to deliver. */
+    int                     receiving;
+    uint32_t                rcv_epoch, rcv_next;
+    struct {
+        char   *data;                   /* NULL if not here yet */
+        size_t  len;
+    }                       rq[RUDP_WINDOW];
+};
+
+struct rudp {
+    struct reactor          *reactor;
+    int                      fd;
+    struct peer_table       *peers;
+    struct rudp_peer       **state;     /* parallel to peers->addrs */
+    int                      cap;
+    struct reactor_timer    *sweep;
+    int64_t                  rxtmin, rxtmax;    /* RTO bounds, ns */
+    struct pacer            *pacer;     /* NULL to send straight away */
+
+    /* DATA frames waiting for the next sendmmsg */
+    int                      nout;
+    char                     outhdr[RUDP_CHUNK][P2P_HDRLEN + DATA_LEN];
+    struct iovec             outiov[RUDP_CHUNK][2];
+    struct rudp_peer        *outpeer[RUDP_CHUNK];
+    uint32_t                 outseq[RUDP_CHUNK];
+
+    rudp_deliver_cb          deliver_cb;
+    rudp_fail_cb             fail_cb;
+    void                    *arg;
+
+    struct rudp_stats        stats;
+};
+
+
+/* Sequence numbers wrap; a is before b if it's less than 2^31 behind. */
+static int seq_before(uint32_t a, uint32_t b)
+{
+    return (int32_t) (a - b) < 0;
+}
+
+static void buf_release(struct rudp_buf *b)
+{
+    if (b != NULL && --b->refs == 0)
+        free(b);
+}
+
+static void on_paced(struct pacer*, void*, uint32_t);
+
+static void out_flush(struct rudp *r)
+{
+    int i, n;
+
+    if (r->nout == 0)
+        return;
+    if (r->pacer != NULL) {
+        /* A frame the pacer has no room for is lost; it's sent again. */
+        for (i = 0; i < r->nout; ++i) {
+            struct rudp_peer *p = r->outpeer[i];
+            if (pacer_sendv(r->pacer, p->link, r->outiov[i], 2, &p->addr,
+                            on_paced, p, r->outseq[i]) < 0) {
+                r->stats.send_errors++;
+            } else {
+                p->q[r->outseq[i] % RUDP_QUEUE].queued++;
+                p->paced++;
+            }
+        }
+        pacer_flush(r->pacer);
+        r->nout = 0;
+        return;
+    }
+#ifdef MSG_WAITFORONE
+    struct mmsghdr hdrs[RUDP_CHUNK];
+    bzero(hdrs, r->nout * sizeof(hdrs[0]));
+    for (i = 0; i < r->nout; ++i) {
+        hdrs[i].msg_hdr.msg_name = &r->outpeer[i]->addr;
+        hdrs[i].msg_hdr.msg_namelen = sizeof(r->outpeer[i]->addr);
+        hdrs[i].msg_hdr.msg_iov = r->outiov[i];
+        hdrs[i].msg_hdr.msg_iovlen = 2;
+    }
+    /* A failed send is a lost datagram; the timer sends it again. */
+    for (i = 0; i < r->nout; i += n) {
+        if ( (n = sendmmsg(r->fd, hdrs + i, r->nout - i, 0)) < 0) {
+            if (errno != EINTR) {
+                r->stats.send_errors++;
+                n = 1;
+            } else {
+                n = 0;
+            }
+        }
+    }
+#else
+    struct msghdr hdr;
+    bzero(&hdr, sizeof(hdr));
+    for (i = 0; i < r->nout; ++i) {
+        hdr.msg_name = &r->outpeer[i]->addr;
+        hdr.msg_namelen = sizeof(r->outpeer[i]->addr);
+        hdr.msg_iov = r->outiov[i];
+        hdr.msg_iovlen = 2;
+        if (sendmsg(r->fd, &hdr, 0) < 0)
+            r->stats.send_errors++;
+    }
+#endif
+    r->nout = 0;
+}
+
+/* Queues `seq' to `p' for the next sendmmsg. */
+static void transmit(struct rudp *r, struct rudp_peer *p, uint32_t seq)
+{
+    struct rudp_slot *s = &p->q[seq % RUDP_QUEUE];
+    char *h;
+    uint32_t v;
+
+    if (r->nout == RUDP_CHUNK)
+        out_flush(r);
+
+    s->ts = rtt64_ts(&p->rtt);
+    s->order = ++p->sends;
+
+    h = r->outhdr[r->nout];
+    frame_hdr(h, P2P_OP_RUDP_DATA, 0, DATA_LEN + s->buf->len);
+    v = htonl(p->epoch);
+    memcpy(h + P2P_HDRLEN, &v, 4);
+    v = htonl(seq);
+    memcpy(h + P2P_HDRLEN + 4, &v, 4);
+    v = htonl(p->una);
+    memcpy(h + P2P_HDRLEN + 8, &v, 4);
+    v = htonl(s->order);
+    memcpy(h + P2P_HDRLEN + 12, &v, 4);
+
+    r->outiov[r->nout][0].iov_base = h;
+    r->outiov[r->nout][0].iov_len = P2P_HDRLEN + DATA_LEN;
+    r->outiov[r->nout][1].iov_base = s->buf->data;
+    r->outiov[r->nout][1].iov_len = s->buf->len;
+    r->outpeer[r->nout] = p;
+    r->outseq[r->nout] = seq;
+    r->nout++;
+}
+
+static void on_timeout(struct reactor*, void*);
+
+static void rtt_start_over(struct rudp *r, struct rudp_peer *p)
+{
+    rtt64_init(&p->rtt, r->rxtmin, r->rxtmax);
+    p->rtt.rtt_maxnrexmt = RUDP_MAXNREXMT;
+}
+
+/* Runs the timer while anything is in flight and out of the pacer. */
+static void timer_arm(struct rudp_peer *p)
+{
+    if (p->timer == NULL && p->nxt - p->una > (uint32_t) p->paced)
+        p->timer = reactor_timer(p->r->reactor, rtt64_start_ms(&p->rtt), 0,
+                                 on_timeout, p);
+}
+
+static void timer_restart(struct rudp_peer *p)
+{
+    reactor_cancel(p->r->reactor, p->timer);
+    p->timer = NULL;
+    timer_arm(p);
+}
+
+/* Sends what the window has room for. */
+static void send_more(struct rudp *r, struct rudp_peer *p)
+{
+    while (p->nxt != p->end && p->nxt - p->una < RUDP_WINDOW) {
+        transmit(r, p, p->nxt++);
+        r->stats.sent++;
+    }
+    timer_arm(p);
+}
+
+/* DATA `seq' to `arg' left the pacer: its RTT, and the RTO, start now. */
+static void on_paced(struct pacer *pc, void *arg, uint32_t seq)
+{
+    struct rudp_peer *p = arg;
+
+    p->paced--;
+    if (seq_before(seq, p->una) || !seq_before(seq, p->nxt))
+        return;         /* acknowledged while a copy waited */
+
+    struct rudp_slot *s = &p->q[seq % RUDP_QUEUE];
+    s->queued--;
+    s->ts = rtt64_ts(&p->rtt);
+    timer_arm(p);
+}
+
+static void on_timeout(struct reactor *reactor, void *arg)
+{
+    struct rudp_peer *p = arg;
+    struct rudp *r = p->r;
+    uint32_t seq;
+
+    p->timer = NULL;
+    if (p->una == p->nxt)
+        return;
+
+    /* The oldest hasn't even left; on_paced runs the timer when it has. */
+    for (seq = p->una; seq != p->nxt && p->q[seq % RUDP_QUEUE].sacked; ++seq)
+        ;
+    if (seq != p->nxt && p->q[seq % RUDP_QUEUE].queued > 0)
+        return;
+    r->stats.timeouts++;
+    if (r->pacer != NULL)
+        pacer_loss(r->pacer, p->link);
+
+    if (rtt64_timeout(&p->rtt) < 0) {
+        int lost = p->nxt - p->una;
+
+        for (seq = p->una; seq != p->nxt; ++seq) {
+            buf_release(p->q[seq % RUDP_QUEUE].buf);
+            p->q[seq % RUDP_QUEUE].buf = NULL;
+        }
+        p->una = p->nxt;
+        r->stats.failed += lost;
+        /* What waits gets a fresh start, and may find the peer back. */
+        rtt_start_over(r, p);
+        if (r->fail_cb != NULL)
+            r->fail_cb(r, &p->addr, lost, r->arg);
+    } else {
+        rtt64_debug(&p->rtt);
+        /*
+         * Only the oldest goes again: its ACK, or the next timeout, shows
+         * what else is missing. Resending the window on a timeout that was
+         * only a slow ACK would send it all twice.
+         */
+        for (seq = p->una; seq != p->nxt; ++seq) {
+            struct rudp_slot *s = &p->q[seq % RUDP_QUEUE];
+            if (s->sacked)
+                continue;
+            s->nrexmt++;
+            transmit(r, p, seq);
+            r->stats.retransmits++;
+            break;
+        }
+    }
+
+    send_more(r, p);
+    out_flush(r);
+}
+
+static void peer_grow(struct rudp *r)
+{
+    if (r->cap >= r->peers->cap)
+        return;
+
+    r->cap = r->peers->cap;
+    if ( (r->state = realloc(r->state, r->cap * sizeof(*r->state))) == NULL)
+        err_sys("realloc error");
+}
+
+static struct rudp_peer *peer_get(struct rudp *r, const struct sockaddr_in *addr,
+                                  int create)
+{
+    int pos = peer_table_find(r->peers, addr);
+    if (pos >= 0)
+        return r->state[pos];
+    if (!create)
+        return NULL;
+
+    struct rudp_peer *p = Calloc(1, sizeof(*p));
+    p->r = r;
+    p->addr = *addr;
+    p->epoch = (uint32_t) random() << 1 ^ random();
+    rtt_start_over(r, p);
+
+    peer_table_add(r->peers, addr);
+    peer_grow(r);
+    r->state[r->peers->count - 1] = p;
+    r->stats.peers = r->peers->count;
+
+    return p;
+}
+
+static void rcv_reset(struct rudp_peer *p)
+{
+    int i;
+
+    for (i = 0; i < RUDP_WINDOW; ++i) {
+        free(p->rq[i].data);
+        p->rq[i].data = NULL;
+    }
+}
+
+/* The last peer takes the place of the one removed, as in peer_table. */
+static void peer_remove(struct rudp *r, int pos)
+{
+    struct rudp_peer *p = r->state[pos];
+    uint32_t seq;
+
+    reactor_cancel(r->reactor, p->timer);
+    if (r->pacer != NULL)
+        pacer_cancel(r->pacer, p);
+    for (seq = p->una; seq != p->end; ++seq)
+        buf_release(p->q[seq % RUDP_QUEUE].buf);
+    rcv_reset(p);
+
+    peer_table_remove(r->peers, &p->addr);
+    r->state[pos] = r->state[r->peers->count];
+    r->stats.peers = r->peers->count;
+    free(p);
+}
+
+/* Forgets the peers nothing has gone to or come from for RUDP_IDLE_MS. */
+static void on_sweep(struct reactor *reactor, void *arg)
+{
+    struct rudp *r = arg;
+    uint64_t before = now_ms() - RUDP_IDLE_MS;
+    int i;
+
+    for (i = r->peers->count - 1; i >= 0; --i) {
+        struct rudp_peer *p = r->state[i];
+        if (p->una == p->end && p->active < before)
+            peer_remove(r, i);
+    }
+}
+
+/*
+ * DATA goes out, and ACKs are answered, on `sockfd', which the caller reads.
+ * `deliver_cb' gets the messages that came in DATA frames, in order, and
+ * `fail_cb', if not NULL, hears of those we gave up sending.
+ */
+struct rudp *rudp_create(struct reactor *reactor, int sockfd,
+                         rudp_deliver_cb deliver_cb, rudp_fail_cb fail_cb,
+                         void *arg)
+{
+    struct rudp *r = Calloc(1, sizeof(*r));
+
+    r->reactor = reactor;
+    r->fd = sockfd;
+    r->peers = peer_table_create(0);
+    peer_grow(r);
+    r->rxtmin = RTT64_RXTMIN;
+    r->rxtmax = RUDP_RXTMAX;
+    r->sweep = reactor_timer(reactor, RUDP_SWEEP_MS, 1, on_sweep, r);
+    r->deliver_cb = deliver_cb;
+    r->fail_cb = fail_cb;
+    r->arg = arg;
+
+    return r;
+}
+
+/*
+ * Bounds the RTO to [min_ns, max_ns], for the peers we have and those to
+ * come; 0 keeps a bound as it is.
+ */
+void rudp_set_rto(struct rudp *r, int64_t min_ns, int64_t max_ns)
+{
+    int i;
+
+    if (min_ns > 0)
+        r->rxtmin = min_ns;
+    if (max_ns > 0)
+        r->rxtmax = max_ns;
+    r->rxtmax = max(r->rxtmax, r->rxtmin);
+
+    for (i = 0; i < r->peers->count; ++i) {
+        struct rtt64_info *rtt = &r->state[i]->rtt;
+        rtt->rtt_rxtmin = r->rxtmin;
+        rtt->rtt_rxtmax = r->rxtmax;
+        rtt->rtt_rto = min(max(rtt->rtt_rto, r->rxtmin), r->rxtmax);
+    }
+}
+
+/* From now on DATA frames go out through `pacer', which outlives `r'. */
+void rudp_set_pacer(struct rudp *r, struct pacer *pacer)
+{
+    out_flush(r);
+    r->pacer = pacer;
+}
+
+void rudp_free(struct rudp *r)
+{
+    while (r->peers->count > 0)
+        peer_remove(r, r->peers->count - 1);
+    reactor_cancel(r->reactor, r->sweep);
+    peer_table_free(r->peers);
+    free(r->state);
+    free(r);
+}
+
+static int enqueue(struct rudp *r, struct rudp_buf *b,
+                   const struct sockaddr_in *to, int link)
+{
+    struct rudp_peer *p = peer_get(r, to, 1);
+    struct rudp_slot *s;
+
+    p->link = link;
+    if (p->end - p->una == RUDP_QUEUE) {
+        r->stats.queue_full++;
+        return -1;
+    }
+
+    s = &p->q[p->end++ % RUDP_QUEUE];
+    s->buf = b;
+    s->nrexmt = 0;
+    s->sacked = 0;
+    s->queued = 0;
+    b->refs++;
+    p->active = now_ms();
+    send_more(r, p);
+
+    return 0;
+}
+
+/*
+ * Sends the frame gathered from `iov' reliably to each of the `n' addresses
+ * in `to', the i-th over link links[i] if `links' is not NULL. Returns the
+ * number of peers it could not be queued for, because RUDP_QUEUE messages
+ * to them are waiting already, or -1 with errno set to EMSGSIZE if the
+ * frame is too big to wrap.
+ */
+int rudp_fanout(struct rudp *r, const struct iovec *iov, int iovcnt,
+                const struct sockaddr_in *to, const int *links, int n)
+{
+    size_t len = 0;
+    int i, refused = 0;
+
+    for (i = 0; i < iovcnt; ++i)
+        len += iov[i].iov_len;
+    if (len > RUDP_MAXDATA) {
+        errno = EMSGSIZE;
+        return -1;
+    }
+
+    struct rudp_buf *b = Malloc(sizeof(*b) + len);
+    b->refs = 1;
+    b->len = 0;
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(b->data + b->len, iov[i].iov_base, iov[i].iov_len);
+        b->len += iov[i].iov_len;
+    }
+
+    for (i = 0; i < n; ++i) {
+        if (enqueue(r, b, &to[i], links != NULL ? links[i] : 0) < 0)
+            refused++;
+    }
+    out_flush(r);
+    buf_release(b);
+
+    return refused;
+}
+
+/* Sends one frame reliably to `to'; 0 if it was queued, else -1. */
+int rudp_send(struct rudp *r, const void *frame, size_t len,
+              const struct sockaddr_in *to)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) frame;
+    iov.iov_len = len;
+
+    return rudp_fanout(r, &iov, 1, to, NULL, 1) == 0 ? 0 : -1;
+}
+
+/* `data' has room for the NUL frame_decode adds. */
+static void deliver(struct rudp *r, struct rudp_peer *p, char *data, size_t len)
+{
+    struct p2p_msg msg;
+
+    if (frame_decode(data, len, len + 1, &msg) < 0) {
+        r->stats.bad++;
+        return;
+    }
+    r->stats.delivered++;
+    if (r->deliver_cb != NULL)
+        r->deliver_cb(r, &msg, &p->addr, r->arg);
+}
+
+/* Delivers what was held back, for as long as it comes in order. */
+static void deliver_held(struct rudp *r, struct rudp_peer *p)
+{
+    for ( ; ; ) {
+        int i = p->rcv_next % RUDP_WINDOW;
+        char *data = p->rq[i].data;
+        if (data == NULL)
+            return;
+        p->rq[i].data = NULL;
+        p->rcv_next++;
+        deliver(r, p, data, p->rq[i].len);
+        free(data);
+    }
+}
+
+static void send_ack(struct rudp *r, struct rudp_peer *p, int fd,
+                     const struct sockaddr_in *to, uint32_t order)
+{
+    char buf[P2P_HDRLEN + ACK_LEN];
+    uint64_t sack = 0;
+    uint32_t v;
+    int i;
+
+    for (i = 0; i < RUDP_WINDOW - 1; ++i) {
+        if (p->rq[(p->rcv_next + 1 + i) % RUDP_WINDOW].data != NULL)
+            sack |= 1ULL << i;
+    }
+
+    frame_hdr(buf, P2P_OP_RUDP_ACK, 0, ACK_LEN);
+    v = htonl(p->rcv_epoch);
+    memcpy(buf + P2P_HDRLEN, &v, 4);
+    v = htonl(p->rcv_next);
+    memcpy(buf + P2P_HDRLEN + 4, &v, 4);
+    v = htonl(sack >> 32);
+    memcpy(buf + P2P_HDRLEN + 8, &v, 4);
+    v = htonl(sack);
+    memcpy(buf + P2P_HDRLEN + 12, &v, 4);
+    v = htonl(order);
+    memcpy(buf + P2P_HDRLEN + 16, &v, 4);
+
+    if (sendto(fd, buf, sizeof(buf), 0, (const SA *) to, sizeof(*to)) < 0)
+        r->stats.send_errors++;
+    else
+        r->stats.acks_sent++;
+}
+
+static void handle_data(struct rudp *r, int fd, const struct p2p_msg *msg,
+                        const struct sockaddr_in *from)
+{
+    uint32_t epoch, seq, una, order;
+
+    if (msg->len < DATA_LEN + P2P_HDRLEN)
+        return;
+    memcpy(&epoch, msg->body, 4);
+    memcpy(&seq, msg->body + 4, 4);
+    memcpy(&una, msg->body + 8, 4);
+    memcpy(&order, msg->body + 12, 4);
+    epoch = ntohl(epoch);
+    seq = ntohl(seq);
+    una = ntohl(una);
+    order = ntohl(order);
+
+    struct rudp_peer *p = peer_get(r, from, 1);
+    char *data = msg->body + DATA_LEN;
+    size_t len = msg->len - DATA_LEN;
+
+    p->active = now_ms();
+    r->stats.received++;
+    if (!p->receiving || p->rcv_epoch != epoch) {
+        rcv_reset(p);
+        p->receiving = 1;
+        p->rcv_epoch = epoch;
+        p->rcv_next = una;
+    }
+
+    /* The sender gave up on what's before una; deliver what we have of it. */
+    if (seq_before(p->rcv_next, una)) {
+        uint32_t gap = una - p->rcv_next, held = min(gap, RUDP_WINDOW), k;
+        for (k = 0; k < held; ++k) {
+            int i = (p->rcv_next + k) % RUDP_WINDOW;
+            if (p->rq[i].data == NULL) {
+                r->stats.skipped++;
+                continue;
+            }
+            deliver(r, p, p->rq[i].data, p->rq[i].len);
+            free(p->rq[i].data);
+            p->rq[i].data = NULL;
+        }
+        r->stats.skipped += gap - held;
+        p->rcv_next = una;
+        deliver_held(r, p);
+    }
+
+    if (seq_before(seq, p->rcv_next)) {
+        r->stats.duplicates++;
+    } else if (seq - p->rcv_next >= RUDP_WINDOW) {
+        r->stats.beyond++;          /* not the sender's window; ignored */
+        return;
+    } else if (seq == p->rcv_next) {
+        /* The outer frame's NUL follows the inner one. */
+        p->rcv_next++;
+        deliver(r, p, data, len);
+        deliver_held(r, p);
+    } else {
+        int i = seq % RUDP_WINDOW;
+        if (p->rq[i].data != NULL) {
+            r->stats.duplicates++;
+        } else {
+            p->rq[i].data = Malloc(len + 1);
+            memcpy(p->rq[i].data, data, len);
+            p->rq[i].len = len;
+            r->stats.out_of_order++;
+        }
+    }
+
+    send_ack(r, p, fd, from, order);
+}
+
+static void handle_ack(struct rudp *r, const struct p2p_msg *msg,
+                       const struct sockaddr_in *from)
+{
+    uint32_t epoch, cum, hi, lo, order, seq;
+    struct rudp_peer *p;
+    int64_t sample = -1;
+    int i, above, advanced = 0, lost = 0;
+
+    if (msg->len < ACK_LEN)
+        return;
+    memcpy(&epoch, msg->body, 4);
+    memcpy(&cum, msg->body + 4, 4);
+    memcpy(&hi, msg->body + 8, 4);
+    memcpy(&lo, msg->body + 12, 4);
+    memcpy(&order, msg->body + 16, 4);
+    epoch = ntohl(epoch);
+    cum = ntohl(cum);
+    order = ntohl(order);
+    uint64_t sack = (uint64_t) ntohl(hi) << 32 | ntohl(lo);
+
+    r->stats.acks_received++;
+    if ( (p = peer_get(r, from, 0)) == NULL || epoch != p->epoch ||
+            seq_before(p->nxt, cum))
+        return;
+    uint64_t now = rtt64_ts(&p->rtt);
+
+    /*
+     * Karn: of a message sent more than once, only the copy the ACK echoes
+     * gives an RTT and a send order to judge the others by; which copy got
+     * there for one cumulatively ACKed or SACKed alongside isn't known.
+     */
+    if (!seq_before(p->sends, order) && seq_before(p->rack, order))
+        p->rack = order;
+    if (seq_before(p->una, cum)) {
+        for (seq = p->una; seq != cum; ++seq) {
+            struct rudp_slot *s = &p->q[seq % RUDP_QUEUE];
+            if (!s->sacked && (s->nrexmt == 0 || s->order == order)) {
+                sample = now - s->ts;
+                if (seq_before(p->rack, s->order))
+                    p->rack = s->order;
+            }
+            buf_release(s->buf);
+            s->buf = NULL;
+            r->stats.acked++;
+        }
+        p->una = cum;
+        advanced = 1;
+        rtt64_newpack(&p->rtt);
+    }
+
+    for (i = 0; i < 64 && sack != 0; ++i, sack >>= 1) {
+        seq = cum + 1 + i;
+        if (!(sack & 1) || !seq_before(seq, p->nxt) || seq_before(seq, p->una))
+            continue;
+        struct rudp_slot *s = &p->q[seq % RUDP_QUEUE];
+        if (!s->sacked) {
+            s->sacked = 1;
+            if (s->nrexmt == 0 || s->order == order) {
+                sample = now - s->ts;
+                if (seq_before(p->rack, s->order))
+                    p->rack = s->order;
+            }
+        }
+    }
+
+    /* Each sample is of a known copy, so it counts after a timeout too. */
+    if (sample >= 0) {
+        rtt64_newpack(&p->rtt);
+        rtt64_stop(&p->rtt, sample);
+        rtt64_debug(&p->rtt);
+    }
+
+    /*
+     * Lost: sent RUDP_DUPTHRESH sends before one that got there, or, if
+     * never resent, with RUDP_DUPTHRESH SACKed above it, as in RFC 6675;
+     * that finds the holes left behind a timeout.
+     */
+    for (seq = p->nxt, above = 0; seq != p->una; ) {
+        struct rudp_slot *s = &p->q[--seq % RUDP_QUEUE];
+        if (s->sacked) {
+            above++;
+        } else if ((int32_t) (p->rack - s->order) >= RUDP_DUPTHRESH ||
+                   (s->nrexmt == 0 && above >= RUDP_DUPTHRESH)) {
+            s->nrexmt++;
+            transmit(r, p, seq);
+            r->stats.fast_retransmits++;
+            lost = 1;
+        }
+    }
+    if (lost && r->pacer != NULL)
+        pacer_loss(r->pacer, p->link);
+
+    /* Progress earns the rest a full RTO. */
+    if (advanced)
+        timer_restart(p);
+    send_more(r, p);
+    out_flush(r);
+}
+
+/*
+ * Handles a DATA or an ACK from `from' that came in on `fd'; -1 is the
+ * socket given to rudp_create. Returns 1 if the message was one of those,
+ * consumed whether or not it was valid, and 0 otherwise.
+ */
+int rudp_handle(struct rudp *r, int fd, const struct p2p_msg *msg,
+                const struct sockaddr_in *from)
+{
+    if (msg->op == P2P_OP_RUDP_DATA)
+        handle_data(r, fd >= 0 ? fd : r->fd, msg, from);
+    else if (msg->op == P2P_OP_RUDP_ACK)
+        handle_ack(r, msg, from);
+    else
+        return 0;
+
+    return 1;
+}
+
+void rudp_get_stats(const struct rudp *r, struct rudp_stats *stats)
+{
+    int i;
+
+    *stats = r->stats;
+    stats->inflight = stats->waiting = 0;
+    for (i = 0; i < r->peers->count; ++i) {
+        const struct rudp_peer *p = r->state[i];
+        stats->inflight += p->nxt - p->una;
+        stats->waiting += p->end - p->nxt;
+    }
+}
+
+void rudp_print_stats(const struct rudp *r)
+{
+    struct rudp_stats st;
+    int i;
+
+    rudp_get_stats(r, &st);
+    printf("rudp: %d peers; %lu sent, %lu acked, %lu in flight, %lu waiting, "
+           "%lu given up, %lu refused\n", st.peers, st.sent, st.acked,
+           st.inflight, st.waiting, st.failed, st.queue_full);
+    printf("rudp: %lu timeouts, %lu retransmitted, %lu fast; %lu send errors\n",
+           st.timeouts, st.retransmits, st.fast_retransmits, st.send_errors);
+    printf("rudp: %lu received, %lu delivered, %lu duplicates, "
+           "%lu out of order, %lu skipped, %lu acks sent, %lu received\n",
+           st.received, st.delivered, st.duplicates, st.out_of_order,
+           st.skipped, st.acks_sent, st.acks_received);
+
+    for (i = 0; i < r->peers->count && i < 10; ++i) {
+        const struct rudp_peer *p = r->state[i];
+        if (p->end == 0 && p->una == 0)
+            continue;       /* only ever sent to us */
+        printf("rudp: %s srtt %.3f ms, rttvar %.3f ms, rto %.3f ms\n",
+               Sock_ntop((SA *) &p->addr, sizeof(p->addr)),
+               rtt64_srtt(&p->rtt) / 1e6, rtt64_rttvar(&p->rtt) / 1e6,
+               p->rtt.rtt_rto / 1e6);
+    }
+}
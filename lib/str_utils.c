@@ -8,10 +8,21 @@ void int_to_hex_4(int num, char *hex)
     hex[4] = 0;
 }
 
+/* Parses exactly four hex digits; `hex' need not be NUL-terminated. */
 unsigned int hex_to_int(char *hex)
 {
     unsigned int dec = 0;
-    sscanf(hex, "%x", &dec);
+    int i;
+    for (i = 0; i < 4; ++i) {
+        char c = hex[i];
+        dec <<= 4;
+        if (c >= '0' && c <= '9')
+            dec |= c - '0';
+        else if (c >= 'a' && c <= 'f')
+            dec |= c - 'a' + 10;
+        else if (c >= 'A' && c <= 'F')
+            dec |= c - 'A' + 10;
+    }
 
     return dec;
 }
@@ -22,27 +33,44 @@ void chomp(char *str)
 }
 
 
-char* create_send_msg(char *message, const char *user_name)
-{
-    chomp(message);
-
-    int to_send_len = 4 + strlen(user_name) + 
-                      2 + strlen(message) +
-                      1;
-    char hex_len[5];
-    int_to_hex_4(to_send_len, hex_len);
+/*
+ * The `<user_name>: ' prefix of every chat message never changes, so it is
+ * built once by send_msg_init and then referenced from each message.
+ */
+static char name_prefix[P2P_MAXNAME + 2];
+static size_t name_prefix_len;
 
-    char *to_send = malloc(to_send_len);
-    snprintf(to_send, to_send_len, "%s%s: %s", hex_len, user_name, message);
+void send_msg_init(const char *user_name)
+{
+    size_t name_len = strlen(user_name);
+    if (name_len > P2P_MAXNAME)
+        err_quit("The user_name must be at most %d characters", P2P_MAXNAME);
 
-    return to_send;
+    memcpy(name_prefix, user_name, name_len);
+    memcpy(name_prefix + name_len, ": ", 2);
+    name_prefix_len = name_len + 2;
 }
 
-void create_send_msg_static(const char *message, char *to_send)
+/*
+ * Describes a P2P_OP_CHAT frame with body `<user_name>: <message>' as three
+ * segments: the header encoded into m->hdr, the cached name prefix and the
+ * message itself, referenced in place. Nothing is copied or allocated; send
+ * it with sendmsg or send_fanoutv while `message' is still alive.
+ */
+void create_send_msg(char *message, struct send_msg *m)
 {
-    int to_send_len = 4 + strlen(message) + 1;
-    char hex_len[5];
-    int_to_hex_4(to_send_len, hex_len);
+    size_t message_len = strcspn(message, "\r\n");
+    message[message_len] = 0;
+
+    size_t body_len = name_prefix_len + message_len;
+    frame_hdr(m->hdr, P2P_OP_CHAT, 0, body_len);
 
-    snprintf(to_send, to_send_len, "%s%s", hex_len, message);
+    m->iov[0].iov_base = m->hdr;
+    m->iov[0].iov_len = P2P_HDRLEN;
+    m->iov[1].iov_base = name_prefix;
+    m->iov[1].iov_len = name_prefix_len;
+    m->iov[2].iov_base = message;
+    m->iov[2].iov_len = message_len;
+    m->iovcnt = 3;
+    m->len = P2P_HDRLEN + body_len;
 }
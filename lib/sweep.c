@@ -0,0 +1,300 @@
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * Subnet sweep. Every address of a range is sent an `auth: CAN', paced to a
+ * fixed number of probes per second, while the answers are collected by the
+ * reactor as they arrive; nothing waits for a host before asking the next
+ * one. Once the last probe is out, stragglers get SWEEP_LINGER_MS to answer
+ * and the caller is handed the full list of responders.
+ *
+ * Probes to hosts on the link that don't exist sit in the socket buffer
+ * until ARP gives up on them, seconds later. The socket is therefore made
+ * non-blocking while the sweep runs: a full buffer pauses the sweep until
+ * the next tick instead of stalling the whole event loop. The probes that
+ * didn't fit go out first then; the ones after them in the same sendmmsg
+ * may well have gone out, and aren't sent twice.
+ */
+#define SWEEP_LINGER_MS 200
+#define SWEEP_BURST     64      /* probes handed to one send_fanout */
+
+struct sweep {
+    struct reactor         *r;
+    int                     sockfd;
+    int                     port;       /* network byte order */
+    int                     pps;
+    int                     flags;      /* of sockfd, to restore */
+
+    uint32_t                first;      /* host byte order */
+    uint32_t                count;
+    uint32_t                start;      /* index probed first */
+    uint32_t                next;       /* probes sent so far */
+    uint32_t                retry[SWEEP_BURST];   /* indexes, to send again */
+    int                     nretry;
+    uint64_t                started;    /* ms */
+    uint64_t                finished;
+
+    struct reactor_timer   *timer;      /* pacing, then the linger */
+    int                     done;
+
+    struct peer_table      *responders;
+    struct sweep_stats      stats;
+
+    sweep_cb                on_reply;
+    sweep_done_cb           on_done;
+    void                   *arg;
+};
+
+
+/*
+ * Parses "a.b.c.d/prefix", or a bare address meaning its /24, into the range
+ * of host addresses to probe: the network and broadcast addresses are left
+ * out unless the prefix is /31 or /32. Returns 0, or -1 if `range' is bad.
+ */
+int sweep_parse(const char *range, uint32_t *first, uint32_t *count)
+{
+    char addr[INET_ADDRSTRLEN];
+    int prefix = 24;
+
+    const char *slash = strchr(range, '/');
+    size_t len = slash ? (size_t) (slash - range) : strlen(range);
+    if (len >= sizeof(addr))
+        return -1;
+    memcpy(addr, range, len);
+    addr[len] = 0;
+
+    if (slash) {
+        char *end;
+        long p = strtol(slash + 1, &end, 10);
+        if (*end != 0 || end == slash + 1 || p < 8 || p > 32)
+            return -1;
+        prefix = p;
+    }
+
+    struct in_addr in;
+    if (inet_aton(addr, &in) == 0)
+        return -1;
+
+    uint32_t mask = prefix == 32 ? 0xffffffff : ~(0xffffffff >> prefix);
+    uint32_t net = ntohl(in.s_addr) & mask;
+    uint64_t size = (uint64_t) 1 << (32 - prefix);
+
+    if (prefix <= 30) {
+        *first = net + 1;
+        *count = size - 2;
+    } else {
+        *first = net;
+        *count = size;
+    }
+
+    return 0;
+}
+
+/*
+ * Parses "a.b.c.d[:port]" into `addr'; `port' is used when none is given.
+ * Returns 0, or -1 if the address or the port is bad.
+ */
+int addr_parse(const char *str, int port, struct sockaddr_in *addr)
+{
+    char host[INET_ADDRSTRLEN];
+
+    const char *colon = strchr(str, ':');
+    size_t len = colon ? (size_t) (colon - str) : strlen(str);
+    if (len >= sizeof(host))
+        return -1;
+    memcpy(host, str, len);
+    host[len] = 0;
+
+    if (colon) {
+        char *end;
+        long p = strtol(colon + 1, &end, 10);
+        if (*end != 0 || end == colon + 1 || p < 1 || p > 65535)
+            return -1;
+        port = p;
+    }
+
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if (inet_aton(host, &addr->sin_addr) == 0)
+        return -1;
+
+    return 0;
+}
+
+static void on_answer(struct reactor *r, int fd, int events, void *arg)
+{
+    struct sweep *s = arg;
+    struct sockaddr_in addr;
+    socklen_t addrlen = sizeof(addr);
+
+    char *buf = Msg_pool_get();
+    struct p2p_msg msg;
+    if (recv_message(fd, buf, MSG_POOL_BUFSIZE, &msg, (SA *) &addr,
+                     &addrlen) < 0) {
+        if (errno != EBADMSG)
+            err_ret("recv_message error");
+    } else if (msg.op == P2P_OP_AUTH_OFC &&
+               peer_table_add(s->responders, &addr)) {
+        s->on_reply(s, &addr, s->arg);
+    }
+    msg_pool_put(buf);
+}
+
+static void finish(struct reactor *r, void *arg)
+{
+    struct sweep *s = arg;
+
+    s->timer = NULL;
+    s->done = 1;
+    s->finished = now_ms();
+    reactor_del(r, s->sockfd);
+    Fcntl(s->sockfd, F_SETFL, s->flags);
+
+    /* Last, as it may well free the sweep. */
+    s->on_done(s, s->arg);
+}
+
+/*
+ * Probes the hosts at the `n' indexes in `idx', at most SWEEP_BURST; those
+ * the socket had no room for are added to s->retry. `idx' may be s->retry.
+ * Returns the number added.
+ */
+static int probe(struct sweep *s, const uint32_t *idx, int n)
+{
+    struct sockaddr_in addrs[SWEEP_BURST];
+    int errs[SWEEP_BURST];
+    int i, full = 0;
+
+    bzero(addrs, n * sizeof(addrs[0]));
+    for (i = 0; i < n; ++i) {
+        addrs[i].sin_family = AF_INET;
+        addrs[i].sin_port = s->port;
+        addrs[i].sin_addr.s_addr = htonl(s->first + idx[i]);
+    }
+    send_fanout(s->sockfd, auth_can_frame, P2P_HDRLEN, addrs, n, errs, NULL);
+    s->stats.syscalls++;
+
+    for (i = 0; i < n; ++i) {
+        if (errs[i] == EAGAIN || errs[i] == ENOBUFS) {
+            s->retry[s->nretry++] = idx[i];
+            full++;
+        } else if (errs[i] == 0) {
+            s->stats.sent++;
+        } else {
+            s->stats.failed++;
+        }
+    }
+    if (full > 0)
+        s->stats.stalls++;
+
+    return full;
+}
+
+/*
+ * Sends the probes that are due by now. Going by the time since the start
+ * rather than counting ticks keeps the rate right when the timer is late.
+ */
+static void on_tick(struct reactor *r, void *arg)
+{
+    struct sweep *s = arg;
+    uint64_t due = (now_ms() - s->started) * s->pps / 1000 + 1;
+    if (due > s->count)
+        due = s->count;
+
+    /* Nothing new until what didn't fit last time has gone. */
+    if (s->nretry > 0) {
+        int n = s->nretry;
+        s->nretry = 0;
+        if (probe(s, s->retry, n) > 0)
+            return;
+    }
+
+    while (s->next < due) {
+        uint32_t idx[SWEEP_BURST];
+        int i, n = min(due - s->next, SWEEP_BURST);
+
+        for (i = 0; i < n; ++i)
+            idx[i] = (s->start + s->next + i) % s->count;
+        s->next += n;
+        if (probe(s, idx, n) > 0)
+            break;
+    }
+
+    if (s->next == s->count && s->nretry == 0) {
+        reactor_cancel(r, s->timer);
+        s->timer = reactor_timer(r, SWEEP_LINGER_MS, 0, finish, s);
+    }
+}
+
+/*
+ * Starts probing `range' (see sweep_parse) on `port' at `pps' probes a
+ * second, beginning with the host at index `start' and wrapping around.
+ * Answers are read from `sockfd', which the sweep has on the reactor until
+ * it is done: on_reply is called once for each host that answers, on_done
+ * once at the end. Returns NULL with errno set on a bad range.
+ */
+struct sweep *sweep_start(struct reactor *r, int sockfd, const char *range,
+                          int start, int port, int pps, sweep_cb on_reply,
+                          sweep_done_cb on_done, void *arg)
+{
+    uint32_t first, count;
+    if (sweep_parse(range, &first, &count) < 0 || pps < 1) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct sweep *s = Calloc(1, sizeof(*s));
+    s->r = r;
+    s->sockfd = sockfd;
+    s->port = htons(port);
+    s->pps = pps;
+    s->first = first;
+    s->count = count;
+    s->start = (uint32_t) max(start, 0) % count;
+    s->responders = peer_table_create(0);
+    s->on_reply = on_reply;
+    s->on_done = on_done;
+    s->arg = arg;
+
+    if (reactor_add(r, sockfd, REACTOR_IN, on_answer, s) < 0) {
+        s->done = 1;
+        sweep_free(s);
+        return NULL;
+    }
+    s->flags = Fcntl(sockfd, F_GETFL, 0);
+    Fcntl(sockfd, F_SETFL, s->flags | O_NONBLOCK);
+
+    s->started = now_ms();
+    s->timer = reactor_timer(r, max(1000 / pps, 1), 1, on_tick, s);
+    on_tick(r, s);
+
+    return s;
+}
+
+/* Stops the sweep if it is still going; on_done is not called then. */
+void sweep_free(struct sweep *s)
+{
+    if (!s->done) {
+        reactor_cancel(s->r, s->timer);
+        reactor_del(s->r, s->sockfd);
+        Fcntl(s->sockfd, F_SETFL, s->flags);
+    }
+    peer_table_free(s->responders);
+    free(s);
+}
+
+/* Everyone who answered so far */
+const struct peer_table *sweep_responders(const struct sweep *s)
+{
+    return s->responders;
+}
+
+void sweep_get_stats(const struct sweep *s, struct sweep_stats *stats)
+{
+    *stats = s->stats;
+    stats->hosts = s->count;
+    stats->responders = s->responders->count;
+    stats->elapsed_ms = (s->done ? s->finished : now_ms()) - s->started;
+}
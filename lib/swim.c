@@ -0,0 +1,780 @@
+#include "unp.h"
+#include "p2p.h"
+
+
+/*
+ * SWIM group membership (Das, Gupta and Motivala, 2002).
+ *
+ * Failure detection: every protocol period one member, taken in a random
+ * order that still visits everyone once a round, is pinged. Without an ack
+ * in a fraction of the period, SWIM_K other members are asked to ping it for
+ * us; without any ack by the end of the period it is suspected. A suspect
+ * that doesn't refute the suspicion, by gossiping that it's alive under a
+ * higher incarnation number, is declared dead after a while that grows with
+ * the log of the group size, and removed.
+ *
+ * Dissemination: every change is queued as a delta and piggybacked, a few
+ * at a time, on the pings and acks, and on chat messages if the caller
+ * wants, each one a number of times that also grows with the log of the
+ * group size. So each member sends and receives about one ping and one ack
+ * per period however large the group gets, instead of everyone answering
+ * every request.
+ *
+ * A new member learns the group from whoever it first hears of: it asks for
+ * the whole member list once, and follows the deltas from then on.
+ *
+ * Members are known by their address and the port the caller gives; the
+ * requests go there. Replies go back to wherever a request came from, so
+ * the socket the swim sends from must be read by the caller too, and every
+ * message passed to swim_handle.
+ */
+#define SWIM_K              3   /* members asked to ping for us */
+#define SWIM_MAX_GOSSIP     8   /* deltas piggybacked on one message */
+#define SWIM_MAX_RELAYS     16  /* pings we do for others at once */
+#define SWIM_SUSPECT_MULT   4   /* suspicion lasts this many periods per log10 N */
+#define SWIM_RETRANSMIT_MULT 4  /* each delta goes out this many times per log10 N */
+
+#define ENTRY_LEN           12  /* addr, port, state, pad, incarnation */
+#define MAX_ENTRIES         ((P2P_MAXMSG - P2P_HDRLEN) / ENTRY_LEN)
+
+struct swim_update {
+    struct sockaddr_in      addr;
+    int                     state;
+    uint32_t                inc;
+    int                     left;       /* times still to send it */
+};
+
+/* A member declared dead, so older news of it doesn't bring it back */
+struct swim_tombstone {
+    struct sockaddr_in      addr;
+    uint32_t                inc;
+    uint64_t                expires;
+};
+
+/* A ping we do for someone else; its ack is passed on. */
+struct swim_relay {
+    struct sockaddr_in      requester;
+    uint32_t                their_seq;
+    uint32_t                our_seq;    /* 0 if the slot is free */
+    uint64_t                expires;
+};
+
+struct swim {
+    struct reactor         *r;
+    int                     fd;
+    int                     port;       /* network byte order */
+    int                     period_ms;
+    uint32_t                incarnation;
+    uint32_t                next_seq;
+
+    struct sockaddr_in     *selves;     /* our addresses, not members */
+    int                     nselves;
+
+    /* by position in members, moved along with it */
+    struct peer_table      *members;
+    int                    *state;
+    uint32_t               *inc;
+    uint64_t               *suspected;  /* ms */
+    int                     cap;
+    int                     nsuspects;
+
+    /* the member probed this period */
+    struct sockaddr_in      target;
+    uint32_t                probe_seq;  /* 0 if none */
+    int                     acked;
+    struct reactor_timer   *tick;
+    struct reactor_timer   *ack_timer;
+
+    /* round: visits every position once, from a random start and stride */
+    int                     round_pos;
+    int                     round_stride;
+    int                     round_left;
+    int                     round_n;
+
+    struct swim_relay       relays[SWIM_MAX_RELAYS];
+
+    struct swim_tombstone  *dead;
+    int                     ndead;
+    int                     dcap;
+
+    struct swim_update     *updates;
+    int                     nupdates;
+    int                     ucap;
+    char                    piggyback[1 + SWIM_MAX_GOSSIP * ENTRY_LEN];
+
+    struct swim_stats       stats;
+    swim_cb                 cb;
+    void                   *arg;
+};
+
+
+/* ceil(log10(n + 1)), at least 1: the scale of everything that's per log N */
+static int log_scale(int n)
+{
+    int scale = 1;
+
+    for (n /= 10; n > 0; n /= 10)
+        scale++;
+
+    return scale;
+}
+
+static int gcd(int a, int b)
+{
+    while (b != 0) {
+        int t = a % b;
+        a = b;
+        b = t;
+    }
+
+    return a;
+}
+
+static int is_self(const struct swim *s, const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < s->nselves; ++i) {
+        if (s->selves[i].sin_addr.s_addr == addr->sin_addr.s_addr &&
+                s->selves[i].sin_port == addr->sin_port)
+            return 1;
+    }
+
+    return 0;
+}
+
+static char *put_entry(char *p, const struct sockaddr_in *addr, int state,
+                       uint32_t inc)
+{
+    uint32_t n = htonl(inc);
+
+    memcpy(p, &addr->sin_addr.s_addr, 4);
+    memcpy(p + 4, &addr->sin_port, 2);
+    p[6] = state;
+    p[7] = 0;
+    memcpy(p + 8, &n, 4);
+
+    return p + ENTRY_LEN;
+}
+
+static const char *get_entry(const char *p, struct sockaddr_in *addr,
+                             int *state, uint32_t *inc)
+{
+    uint32_t n;
+
+    bzero(addr, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    memcpy(&addr->sin_addr.s_addr, p, 4);
+    memcpy(&addr->sin_port, p + 4, 2);
+    *state = (unsigned char) p[6];
+    memcpy(&n, p + 8, 4);
+    *inc = ntohl(n);
+
+    return p + ENTRY_LEN;
+}
+
+/* Queues a delta, replacing any older one about the same member. */
+static void gossip(struct swim *s, const struct sockaddr_in *addr, int state,
+                   uint32_t inc)
+{
+    struct swim_update *u = NULL;
+    int i;
+
+    for (i = 0; i < s->nupdates; ++i) {
+        if (s->updates[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+                s->updates[i].addr.sin_port == addr->sin_port) {
+            u = &s->updates[i];
+            break;
+        }
+    }
+
+    if (u == NULL) {
+        if (s->nupdates == s->ucap) {
+            s->ucap = s->ucap ? 2 * s->ucap : 16;
+            s->updates = realloc(s->updates, s->ucap * sizeof(*u));
+            if (s->updates == NULL)
+                err_sys("realloc error");
+        }
+        u = &s->updates[s->nupdates++];
+    }
+
+    u->addr = *addr;
+    u->state = state;
+    u->inc = inc;
+    u->left = SWIM_RETRANSMIT_MULT * log_scale(s->members->count);
+}
+
+/*
+ * Writes up to SWIM_MAX_GOSSIP deltas into `out', the least sent first, and
+ * retires the ones sent often enough. Returns the bytes written.
+ */
+static size_t pack_gossip(struct swim *s, char *out, size_t room)
+{
+    int n = min(SWIM_MAX_GOSSIP, (int) (room / ENTRY_LEN));
+    char *p = out;
+    int i, k;
+
+    for (k = 0; k < n && s->nupdates > 0; ++k) {
+        int best = 0;
+        for (i = 1; i < s->nupdates; ++i) {
+            if (s->updates[i].left > s->updates[best].left)
+                best = i;
+        }
+        /* The ones already packed this time are at -left. */
+        if (s->updates[best].left <= 0)
+            break;
+
+        struct swim_update *u = &s->updates[best];
+        p = put_entry(p, &u->addr, u->state, u->inc);
+        u->left = -(u->left - 1);
+    }
+
+    for (i = s->nupdates - 1; i >= 0; --i) {
+        if (s->updates[i].left < 0)
+            s->updates[i].left = -s->updates[i].left;
+        if (s->updates[i].left == 0)
+            s->updates[i] = s->updates[--s->nupdates];
+    }
+
+    s->stats.gossip_sent += (p - out) / ENTRY_LEN;
+
+    return p - out;
+}
+
+/* Sends a frame with `body' to `to', with whatever gossip fits after it. */
+static void send_frame(struct swim *s, int op, const void *body, size_t len,
+                       const struct sockaddr_in *to, int with_gossip)
+{
+    char buf[P2P_MAXMSG];
+    size_t n = P2P_HDRLEN + len, g = 0;
+
+    memcpy(buf + P2P_HDRLEN, body, len);
+    if (with_gossip && s->nupdates > 0) {
+        buf[n] = 0;     /* where the receiver puts the body's NUL */
+        g = pack_gossip(s, buf + n + 1, sizeof(buf) - n - 1);
+    }
+    frame_hdr(buf, op, g > 0 ? P2P_FL_GOSSIP : 0, len);
+    if (g > 0)
+        n += 1 + g;
+
+    if (sendto(s->fd, buf, n, 0, (const SA *) to, sizeof(*to)) < 0)
+        s->stats.send_errors++;
+}
+
+static void send_seq(struct swim *s, int op, uint32_t seq,
+                     const struct sockaddr_in *to)
+{
+    uint32_t n = htonl(seq);
+
+    send_frame(s, op, &n, sizeof(n), to, 1);
+}
+
+static void member_grow(struct swim *s)
+{
+    if (s->cap >= s->members->cap)
+        return;
+
+    s->cap = s->members->cap;
+    s->state = realloc(s->state, s->cap * sizeof(*s->state));
+    s->inc = realloc(s->inc, s->cap * sizeof(*s->inc));
+    s->suspected = realloc(s->suspected, s->cap * sizeof(*s->suspected));
+    if (s->state == NULL || s->inc == NULL || s->suspected == NULL)
+        err_sys("realloc error");
+}
+
+/* The last member takes the place of the one removed, as in peer_table. */
+static void member_remove(struct swim *s, int pos)
+{
+    struct sockaddr_in addr = s->members->addrs[pos];
+    int last = s->members->count - 1;
+
+    if (s->state[pos] == SWIM_SUSPECT)
+        s->nsuspects--;
+    peer_table_remove(s->members, &addr);
+    s->state[pos] = s->state[last];
+    s->inc[pos] = s->inc[last];
+    s->suspected[pos] = s->suspected[last];
+}
+
+static int find_dead(const struct swim *s, const struct sockaddr_in *addr)
+{
+    int i;
+
+    for (i = 0; i < s->ndead; ++i) {
+        if (s->dead[i].addr.sin_addr.s_addr == addr->sin_addr.s_addr &&
+                s->dead[i].addr.sin_port == addr->sin_port)
+            return i;
+    }
+
+    return -1;
+}
+
+/* Kept for as long as the news of the death may still be going round. */
+static void bury(struct swim *s, const struct sockaddr_in *addr, uint32_t inc)
+{
+    int i = find_dead(s, addr);
+
+    if (i < 0) {
+        if (s->ndead == s->dcap) {
+            s->dcap = s->dcap ? 2 * s->dcap : 8;
+            s->dead = realloc(s->dead, s->dcap * sizeof(*s->dead));
+            if (s->dead == NULL)
+                err_sys("realloc error");
+        }
+        i = s->ndead++;
+    }
+
+    s->dead[i].addr = *addr;
+    s->dead[i].inc = inc;
+    s->dead[i].expires = now_ms() + (uint64_t) 2 * SWIM_SUSPECT_MULT *
+                         log_scale(s->members->count) * s->period_ms;
+}
+
+/*
+ * Merges what we heard about `addr' with what we know, by the SWIM rules:
+ * a higher incarnation wins; at the same one, suspect beats alive; dead
+ * beats both. Anything new is gossiped on.
+ */
+static void apply(struct swim *s, const struct sockaddr_in *addr, int state,
+                  uint32_t inc)
+{
+    if (is_self(s, addr)) {
+        if (state != SWIM_ALIVE && inc >= s->incarnation) {
+            /* Not dead yet. */
+            s->incarnation = inc + 1;
+            s->stats.refuted++;
+            gossip(s, addr, SWIM_ALIVE, s->incarnation);
+        }
+        return;
+    }
+
+    int pos = peer_table_find(s->members, addr);
+    if (pos < 0) {
+        if (state == SWIM_DEAD)
+            return;
+        /* Only a new incarnation comes back from the dead. */
+        int d = find_dead(s, addr);
+        if (d >= 0) {
+            if (inc <= s->dead[d].inc)
+                return;
+            s->dead[d] = s->dead[--s->ndead];
+        }
+        peer_table_add(s->members, addr);
+        member_grow(s);
+        pos = s->members->count - 1;
+        s->state[pos] = state;
+        s->inc[pos] = inc;
+        s->suspected[pos] = now_ms();
+        if (state == SWIM_SUSPECT)
+            s->nsuspects++;
+        gossip(s, addr, state, inc);
+        s->cb(s, addr, SWIM_JOIN, s->arg);
+        return;
+    }
+
+    switch (state) {
+    case SWIM_ALIVE:
+        if (inc <= s->inc[pos])
+            return;
+        s->inc[pos] = inc;
+        gossip(s, addr, state, inc);
+        if (s->state[pos] == SWIM_SUSPECT) {
+            s->state[pos] = SWIM_ALIVE;
+            s->nsuspects--;
+            s->cb(s, addr, SWIM_ALIVE, s->arg);
+        }
+        break;
+
+    case SWIM_SUSPECT:
+        if (inc < s->inc[pos] ||
+                (inc == s->inc[pos] && s->state[pos] == SWIM_SUSPECT))
+            return;
+        s->inc[pos] = inc;
+        gossip(s, addr, state, inc);
+        if (s->state[pos] != SWIM_SUSPECT) {
+            s->state[pos] = SWIM_SUSPECT;
+            s->suspected[pos] = now_ms();
+            s->nsuspects++;
+            s->stats.suspected++;
+            s->cb(s, addr, SWIM_SUSPECT, s->arg);
+        }
+        break;
+
+    case SWIM_DEAD:
+        if (inc < s->inc[pos])
+            return;
+        gossip(s, addr, state, inc);
+        s->stats.failed++;
+        bury(s, addr, inc);
+        member_remove(s, pos);
+        s->cb(s, addr, SWIM_LEAVE, s->arg);
+        break;
+    }
+}
+
+static void apply_entries(struct swim *s, const char *p, size_t len)
+{
+    const char *end = p + len - len % ENTRY_LEN;
+
+    while (p < end) {
+        struct sockaddr_in addr;
+        int state;
+        uint32_t inc;
+
+        p = get_entry(p, &addr, &state, &inc);
+        if (state <= SWIM_DEAD)
+            apply(s, &addr, state, inc);
+        s->stats.gossip_received++;
+    }
+}
+
+/* Takes the next member of the round, starting a new round as needed. */
+static int next_target(struct swim *s)
+{
+    int n = s->members->count;
+    if (n == 0)
+        return -1;
+
+    if (s->round_left == 0 || s->round_n != n) {
+        int stride;
+        do {
+            stride = 1 + random() % n;
+        } while (n > 1 && gcd(stride, n) != 1);
+
+        s->round_pos = random() % n;
+        s->round_stride = stride;
+        s->round_left = n;
+        s->round_n = n;
+    }
+
+    int pos = s->round_pos;
+    s->round_pos = (s->round_pos + s->round_stride) % n;
+    s->round_left--;
+
+    return pos;
+}
+
+/* Nobody got an ack from the target: ask SWIM_K others to try. */
+static void on_ack_timeout(struct reactor *r, void *arg)
+{
+    struct swim *s = arg;
+    s->ack_timer = NULL;
+    if (s->acked || s->probe_seq == 0)
+        return;
+
+    int n = s->members->count;
+    int target = peer_table_find(s->members, &s->target);
+    int want = min(SWIM_K, n - (target >= 0));
+    int i, tries;
+
+    char body[12];
+    uint32_t seq = htonl(s->probe_seq);
+    memcpy(body, &seq, 4);
+    memcpy(body + 4, &s->target.sin_addr.s_addr, 4);
+    memcpy(body + 8, &s->target.sin_port, 2);
+    body[10] = body[11] = 0;
+
+    /* Distinct enough; with few members some may be asked twice. */
+    for (i = 0, tries = 0; i < want && tries < 4 * SWIM_K; ++tries) {
+        int pos = random() % n;
+        if (pos == target)
+            continue;
+        send_frame(s, P2P_OP_SWIM_PING_REQ, body, sizeof(body),
+                   &s->members->addrs[pos], 1);
+        s->stats.ping_reqs++;
+        i++;
+    }
+}
+
+/* One protocol period */
+static void on_tick(struct reactor *r, void *arg)
+{
+    struct swim *s = arg;
+    uint64_t now = now_ms();
+    int i;
+
+    /* The last probe, direct or not, got no ack. */
+    if (s->probe_seq != 0 && !s->acked) {
+        int pos = peer_table_find(s->members, &s->target);
+        if (pos >= 0 && s->state[pos] == SWIM_ALIVE)
+            apply(s, &s->target, SWIM_SUSPECT, s->inc[pos]);
+    }
+    s->probe_seq = 0;
+
+    if (s->nsuspects > 0) {
+        uint64_t timeout = (uint64_t) SWIM_SUSPECT_MULT *
+                           log_scale(s->members->count) * s->period_ms;
+        for (i = s->members->count - 1; i >= 0; --i) {
+            if (s->state[i] == SWIM_SUSPECT &&
+                    now - s->suspected[i] >= timeout) {
+                struct sockaddr_in addr = s->members->addrs[i];
+                apply(s, &addr, SWIM_DEAD, s->inc[i]);
+            }
+        }
+    }
+
+    for (i = 0; i < SWIM_MAX_RELAYS; ++i) {
+        if (s->relays[i].our_seq != 0 && s->relays[i].expires <= now)
+            s->relays[i].our_seq = 0;
+    }
+
+    for (i = s->ndead - 1; i >= 0; --i) {
+        if (s->dead[i].expires <= now)
+            s->dead[i] = s->dead[--s->ndead];
+    }
+
+    int pos = next_target(s);
+    if (pos < 0)
+        return;
+
+    s->target = s->members->addrs[pos];
+    s->probe_seq = ++s->next_seq;
+    s->acked = 0;
+    send_seq(s, P2P_OP_SWIM_PING, s->probe_seq, &s->target);
+    s->stats.pings++;
+
+    reactor_cancel(s->r, s->ack_timer);
+    s->ack_timer = reactor_timer(s->r, max(s->period_ms / 4, 1), 0,
+                                 on_ack_timeout, s);
+}
+
+/*
+ * Starts the protocol on `r', sending from `sockfd' to members on `port',
+ * with a protocol period of `period_ms'. cb is told about every member that
+ * joins, is suspected, turns out alive after all, or leaves.
+ */
+struct swim *swim_create(struct reactor *r, int sockfd, int port,
+                         int period_ms, swim_cb cb, void *arg)
+{
+    struct swim *s = Calloc(1, sizeof(*s));
+
+    s->r = r;
+    s->fd = sockfd;
+    s->port = htons(port);
+    s->period_ms = max(period_ms, 1);
+    s->members = peer_table_create(0);
+    member_grow(s);
+    s->cb = cb;
+    s->arg = arg;
+
+    srandom(getpid() ^ now_ms());
+    s->tick = reactor_timer(r, s->period_ms, 1, on_tick, s);
+
+    return s;
+}
+
+void swim_free(struct swim *s)
+{
+    reactor_cancel(s->r, s->tick);
+    reactor_cancel(s->r, s->ack_timer);
+    peer_table_free(s->members);
+    free(s->state);
+    free(s->inc);
+    free(s->suspected);
+    free(s->updates);
+    free(s->dead);
+    free(s->selves);
+    free(s);
+}
+
+/* One of our own addresses; gossip about it is about us. */
+void swim_add_self(struct swim *s, const struct sockaddr_in *addr)
+{
+    s->selves = realloc(s->selves, (s->nselves + 1) * sizeof(*s->selves));
+    if (s->selves == NULL)
+        err_sys("realloc error");
+    s->selves[s->nselves] = *addr;
+    s->selves[s->nselves].sin_port = s->port;
+    s->nselves++;
+}
+
+/*
+ * A member we learnt of some other way, say it answered a discovery request.
+ * Hearing from it directly is proof of life, even if it was declared dead.
+ * Returns 1 if it's new to us.
+ */
+int swim_add(struct swim *s, const struct sockaddr_in *addr)
+{
+    struct sockaddr_in member = *addr;
+    member.sin_port = s->port;
+
+    if (is_self(s, &member) || peer_table_find(s->members, &member) >= 0)
+        return 0;
+
+    int d = find_dead(s, &member);
+    uint32_t inc = d >= 0 ? s->dead[d].inc + 1 : 0;
+    apply(s, &member, SWIM_ALIVE, inc);
+    return 1;
+}
+
+/* Asks `addr' for everyone it knows. */
+void swim_sync(struct swim *s, const struct sockaddr_in *addr)
+{
+    struct sockaddr_in member = *addr;
+    member.sin_port = s->port;
+
+    send_seq(s, P2P_OP_SWIM_SYNC, 0, &member);
+    s->stats.syncs++;
+}
+
+/* The whole member list, in as many frames as it takes */
+static void send_members(struct swim *s, const struct sockaddr_in *to)
+{
+    char body[MAX_ENTRIES * ENTRY_LEN];
+    int i = 0;
+
+    do {
+        char *p = body;
+        for ( ; i < s->members->count && p - body < (int) sizeof(body); ++i)
+            p = put_entry(p, &s->members->addrs[i], s->state[i], s->inc[i]);
+        send_frame(s, P2P_OP_SWIM_MEMBERS, body, p - body, to, 0);
+    } while (i < s->members->count);
+}
+
+/*
+ * Hands a received message to the swim; `from' is where it came from. The
+ * membership frames are taken care of and 1 is returned. Anything else may
+ * carry gossip, which is taken, and 0 is returned for the caller to go on
+ * with the message.
+ */
+int swim_handle(struct swim *s, const struct p2p_msg *msg,
+                const struct sockaddr_in *from)
+{
+    if (msg->gossip_len > 0)
+        apply_entries(s, msg->gossip, msg->gossip_len);
+
+    if (msg->op < P2P_OP_SWIM_PING || msg->op > P2P_OP_SWIM_MEMBERS)
+        return 0;
+    if (msg->flags & P2P_FL_LEGACY)
+        return 1;
+
+    /* Whoever sends us requests is a member; a newcomer learns the rest. */
+    if (msg->op != P2P_OP_SWIM_ACK && msg->op != P2P_OP_SWIM_MEMBERS) {
+        int knew_none = s->members->count == 0;
+        if (swim_add(s, from) && knew_none)
+            swim_sync(s, from);
+    }
+
+    uint32_t seq = 0;
+    if (msg->len >= 4 && msg->op != P2P_OP_SWIM_MEMBERS) {
+        memcpy(&seq, msg->body, 4);
+        seq = ntohl(seq);
+    }
+
+    int i;
+    switch (msg->op) {
+    case P2P_OP_SWIM_PING:
+        send_seq(s, P2P_OP_SWIM_ACK, seq, from);
+        s->stats.acks_sent++;
+        break;
+
+    case P2P_OP_SWIM_ACK:
+        if (seq != 0 && seq == s->probe_seq) {
+            s->acked = 1;
+            s->stats.acks++;
+            break;
+        }
+        for (i = 0; i < SWIM_MAX_RELAYS; ++i) {
+            if (s->relays[i].our_seq == seq && seq != 0) {
+                send_seq(s, P2P_OP_SWIM_ACK, s->relays[i].their_seq,
+                         &s->relays[i].requester);
+                s->relays[i].our_seq = 0;
+                break;
+            }
+        }
+        break;
+
+    case P2P_OP_SWIM_PING_REQ:
+        if (msg->len < 12)
+            break;
+        for (i = 0; i < SWIM_MAX_RELAYS; ++i) {
+            if (s->relays[i].our_seq == 0)
+                break;
+        }
+        if (i == SWIM_MAX_RELAYS)
+            break;      /* busy; the requester asked others too */
+
+        struct sockaddr_in target;
+        bzero(&target, sizeof(target));
+        target.sin_family = AF_INET;
+        memcpy(&target.sin_addr.s_addr, msg->body + 4, 4);
+        memcpy(&target.sin_port, msg->body + 8, 2);
+
+        s->relays[i].requester = *from;
+        s->relays[i].their_seq = seq;
+        s->relays[i].our_seq = ++s->next_seq;
+        s->relays[i].expires = now_ms() + s->period_ms;
+        send_seq(s, P2P_OP_SWIM_PING, s->relays[i].our_seq, &target);
+        s->stats.relayed++;
+        break;
+
+    case P2P_OP_SWIM_SYNC:
+        send_members(s, from);
+        break;
+
+    case P2P_OP_SWIM_MEMBERS:
+        /* The sender doesn't list itself. */
+        swim_add(s, from);
+        apply_entries(s, msg->body, msg->len);
+        break;
+    }
+
+    return 1;
+}
+
+/*
+ * Adds what gossip fits to an outgoing message, after the body, and flags
+ * it. The message must be sent before the next call.
+ */
+void swim_piggyback(struct swim *s, struct send_msg *m)
+{
+    if (s->nupdates == 0 || m->iovcnt >= SEND_MSG_MAXIOV)
+        return;
+
+    size_t room = P2P_MAXMSG - m->len - 1;
+    size_t g = pack_gossip(s, s->piggyback + 1, min(room,
+                           sizeof(s->piggyback) - 1));
+    if (g == 0)
+        return;
+    s->piggyback[0] = 0;
+
+    struct p2p_hdr h;
+    memcpy(&h, m->hdr, P2P_HDRLEN);
+    h.flags = htons(ntohs(h.flags) | P2P_FL_GOSSIP);
+    memcpy(m->hdr, &h, P2P_HDRLEN);
+
+    m->iov[m->iovcnt].iov_base = s->piggyback;
+    m->iov[m->iovcnt].iov_len = 1 + g;
+    m->iovcnt++;
+    m->len += 1 + g;
+}
+
+/* Everyone alive or suspected, as far as we know */
+const struct peer_table *swim_members(const struct swim *s)
+{
+    return s->members;
+}
+
+void swim_get_stats(const struct swim *s, struct swim_stats *stats)
+{
+    *stats = s->stats;
+    stats->members = s->members->count;
+    stats->suspects = s->nsuspects;
+    stats->incarnation = s->incarnation;
+}
+
+void swim_print_stats(const struct swim *s)
+{
+    struct swim_stats st;
+    swim_get_stats(s, &st);
+
+    printf("swim: %d members, %d suspect, incarnation %u\n",
+           st.members, st.suspects, st.incarnation);
+    printf("swim: %lu pings, %lu acks, %lu acks sent, %lu ping-reqs, "
+           "%lu relayed\n", st.pings, st.acks, st.acks_sent, st.ping_reqs,
+           st.relayed);
+    printf("swim: %lu suspected, %lu failed, %lu refuted, %lu syncs\n",
+           st.suspected, st.failed, st.refuted, st.syncs);
+    printf("swim: %lu deltas sent, %lu received, %lu send errors\n",
+           st.gossip_sent, st.gossip_received, st.send_errors);
+}
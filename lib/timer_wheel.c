@@ -0,0 +1,279 @@
+#include "unp.h"
+#include "p2p.h"
+
+#include <sys/timerfd.h>
+
+
+/*
+ * A hierarchical timing wheel with millisecond ticks. Level 0 has a slot per
+ * millisecond for the next 256 ms, level 1 a slot per 256 ms for the next
+ * 65 s, and so on up to about 49 days. A timer goes straight into the slot
+ * of its expiry on the coarsest level it needs, so adding and cancelling are
+ * O(1) list operations; when the wheel turns past a coarse slot, its timers
+ * are cascaded one level down.
+ *
+ * The wheel arms a timerfd for the next slot that has work, so the owner
+ * only has to poll wheel_fd along with its other descriptors and call
+ * wheel_run when it is readable. No signals are involved, and any number of
+ * timers can be pending at once.
+ */
+#define WHEEL_BITS      8
+#define WHEEL_SIZE      (1 << WHEEL_BITS)
+#define WHEEL_MASK      (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS    4
+#define WHEEL_MAXDELTA  (((uint64_t) 1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1)
+
+struct timer_wheel {
+    int                 tfd;
+    uint64_t            now;        /* last tick processed */
+    uint64_t            armed;      /* tick the timerfd fires at, or 0 */
+    int                 count;      /* pending timers */
+    struct wheel_timer  slots[WHEEL_LEVELS][WHEEL_SIZE];   /* list heads */
+};
+
+
+static void list_init(struct wheel_timer *head)
+{
+    head->next = head->prev = head;
+}
+
+static int list_empty(const struct wheel_timer *head)
+{
+    return head->next == head;
+}
+
+static void list_add(struct wheel_timer *head, struct wheel_timer *t)
+{
+    t->prev = head->prev;
+    t->next = head;
+    head->prev->next = t;
+    head->prev = t;
+}
+
+static void list_del(struct wheel_timer *t)
+{
+    t->prev->next = t->next;
+    t->next->prev = t->prev;
+    t->next = t->prev = NULL;
+}
+
+
+struct timer_wheel *wheel_create(void)
+{
+    struct timer_wheel *w = Calloc(1, sizeof(*w));
+    int l, i;
+
+    if ( (w->tfd = timerfd_create(CLOCK_MONOTONIC,
+                                  TFD_NONBLOCK | TFD_CLOEXEC)) < 0) {
+        free(w);
+        return NULL;
+    }
+
+    for (l = 0; l < WHEEL_LEVELS; ++l)
+        for (i = 0; i < WHEEL_SIZE; ++i)
+            list_init(&w->slots[l][i]);
+    w->now = now_ms();
+
+    return w;
+}
+
+/* Pending timers are dropped; use wheel_pop first to get them back. */
+void wheel_free(struct timer_wheel *w)
+{
+    close(w->tfd);
+    free(w);
+}
+
+int wheel_fd(const struct timer_wheel *w)
+{
+    return w->tfd;
+}
+
+void wheel_timer_init(struct wheel_timer *t, wheel_cb cb, void *arg)
+{
+    t->next = t->prev = NULL;
+    t->expires = 0;
+    t->cb = cb;
+    t->arg = arg;
+}
+
+int wheel_pending(const struct wheel_timer *t)
+{
+    return t->next != NULL;
+}
+
+/*
+ * Files `t' under the slot its expiry falls in, as seen from w->now. A timer
+ * due right now only lands in the current slot while cascading, just before
+ * that slot is run.
+ */
+static void wheel_insert(struct timer_wheel *w, struct wheel_timer *t)
+{
+    if (t->expires - w->now > WHEEL_MAXDELTA)
+        t->expires = w->now + WHEEL_MAXDELTA;
+
+    uint64_t delta = t->expires - w->now;
+    int level = 0;
+    while (level < WHEEL_LEVELS - 1 &&
+           delta >= (uint64_t) 1 << (WHEEL_BITS * (level + 1)))
+        level++;
+
+    int slot = (t->expires >> (WHEEL_BITS * level)) & WHEEL_MASK;
+    list_add(&w->slots[level][slot], t);
+}
+
+/*
+ * Returns the tick at which something next has to happen, or 0: the expiry
+ * of the nearest timer on level 0 or the cascade of the nearest coarse slot,
+ * whichever comes first.
+ */
+static uint64_t wheel_next(const struct timer_wheel *w)
+{
+    uint64_t next = 0;
+    int l, i;
+
+    for (l = 0; l < WHEEL_LEVELS; ++l) {
+        int shift = WHEEL_BITS * l;
+        uint64_t base = w->now >> shift;
+
+        for (i = 1; i <= WHEEL_SIZE; ++i) {
+            if (!list_empty(&w->slots[l][(base + i) & WHEEL_MASK])) {
+                uint64_t tick = (base + i) << shift;
+                if (next == 0 || tick < next)
+                    next = tick;
+                break;
+            }
+        }
+    }
+
+    return next;
+}
+
+static void wheel_arm(struct timer_wheel *w, uint64_t tick)
+{
+    struct itimerspec its;
+
+    bzero(&its, sizeof(its));
+    its.it_value.tv_sec = tick / 1000;
+    its.it_value.tv_nsec = (tick % 1000) * 1000000;
+    if (timerfd_settime(w->tfd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+        err_sys("timerfd_settime error");
+    w->armed = tick;
+}
+
+/*
+ * Schedules `t' to run `ms' milliseconds from now. A pending timer is
+ * rescheduled.
+ */
+void wheel_add(struct timer_wheel *w, struct wheel_timer *t, int ms)
+{
+    if (wheel_pending(t))
+        wheel_cancel(w, t);
+
+    /* An idle wheel hasn't been turning; catch it up first. */
+    if (w->count == 0)
+        w->now = now_ms();
+
+    t->expires = now_ms() + max(ms, 0);
+    /* Already due: the next tick is the earliest we can still run it. */
+    if (t->expires <= w->now)
+        t->expires = w->now + 1;
+    wheel_insert(w, t);
+    w->count++;
+
+    if (w->armed == 0 || t->expires < w->armed)
+        wheel_arm(w, t->expires);
+}
+
+/* Cancelling a timer that isn't pending is a no-op. */
+void wheel_cancel(struct timer_wheel *w, struct wheel_timer *t)
+{
+    if (!wheel_pending(t))
+        return;
+
+    list_del(t);
+    w->count--;
+    /* The timerfd may still fire for it; wheel_run copes with that. */
+}
+
+/* Moves the timers of the current slot of `level' one level down. */
+static void cascade(struct timer_wheel *w, int level)
+{
+    struct wheel_timer *head =
+        &w->slots[level][(w->now >> (WHEEL_BITS * level)) & WHEEL_MASK];
+
+    while (!list_empty(head)) {
+        struct wheel_timer *t = head->next;
+        list_del(t);
+        wheel_insert(w, t);
+    }
+}
+
+/*
+ * Turns the wheel up to the current time and runs every timer that expired.
+ * Call it when wheel_fd is readable. Returns the number of timers run.
+ */
+int wheel_run(struct timer_wheel *w)
+{
+    uint64_t expirations;
+    if (read(w->tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN)
+        err_sys("timerfd read error");
+
+    uint64_t now = now_ms();
+    int fired = 0;
+
+    while (w->now < now && w->count > 0) {
+        w->now++;
+
+        int l;
+        for (l = 1; l < WHEEL_LEVELS; ++l) {
+            if ((w->now & (((uint64_t) 1 << (WHEEL_BITS * l)) - 1)) != 0)
+                break;
+        }
+        /* Coarsest first, so timers can trickle all the way down. */
+        while (--l > 0)
+            cascade(w, l);
+
+        /*
+         * Callbacks may add and cancel timers, including ones in this slot,
+         * so take the timers off one at a time.
+         */
+        struct wheel_timer *head = &w->slots[0][w->now & WHEEL_MASK];
+        while (!list_empty(head)) {
+            struct wheel_timer *t = head->next;
+            list_del(t);
+            w->count--;
+            fired++;
+            t->cb(t, t->arg);
+        }
+    }
+    if (w->count == 0)
+        w->now = now;
+
+    w->armed = 0;
+    uint64_t next = wheel_next(w);
+    if (next != 0)
+        wheel_arm(w, next);
+
+    return fired;
+}
+
+/* Takes any pending timer off the wheel, or returns NULL. */
+struct wheel_timer *wheel_pop(struct timer_wheel *w)
+{
+    int l, i;
+
+    for (l = 0; l < WHEEL_LEVELS; ++l) {
+        for (i = 0; i < WHEEL_SIZE; ++i) {
+            struct wheel_timer *head = &w->slots[l][i];
+            if (!list_empty(head)) {
+                struct wheel_timer *t = head->next;
+                list_del(t);
+                w->count--;
+                return t;
+            }
+        }
+    }
+
+    return NULL;
+}
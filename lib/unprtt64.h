@@ -0,0 +1,44 @@
+#ifndef	__unp_rtt64_h
+#define	__unp_rtt64_h
+
+#include	"unp.h"
+
+/*
+ * Like rtt_info, but in nanoseconds from CLOCK_MONOTONIC, with the
+ * estimators in scaled integers as in the BSD TCP code, and the RTO
+ * clamped to bounds set at rtt64_init, down to well under a millisecond.
+ */
+struct rtt64_info {
+  int64_t	rtt_rtt;	/* most recent measured RTT, in ns */
+  int64_t	rtt_srtt;	/* smoothed RTT estimator, in ns << RTT64_SRTT_SHIFT */
+  int64_t	rtt_rttvar;	/* smoothed mean deviation, in ns << RTT64_RTTVAR_SHIFT */
+  int64_t	rtt_rto;	/* current RTO to use, in ns */
+  int64_t	rtt_rxtmin;	/* bounds of the RTO, in ns */
+  int64_t	rtt_rxtmax;
+  int		rtt_nrexmt;	/* # times retransmitted: 0, 1, 2, ... */
+  int		rtt_maxnrexmt;	/* give up after this many; may be changed */
+  uint64_t	rtt_base;	/* CLOCK_MONOTONIC in ns at start */
+};
+
+#define	RTT64_SRTT_SHIFT	3	/* srtt is kept times 8 ... */
+#define	RTT64_RTTVAR_SHIFT	2	/* ... and rttvar times 4 */
+
+#define	RTT64_MS		1000000LL	/* ns */
+#define	RTT64_RXTMIN	(1 * RTT64_MS)	/* default min retransmit timeout */
+#define	RTT64_RXTMAX	(60000 * RTT64_MS)	/* default max retransmit timeout */
+#define	RTT64_RXTINIT	(1000 * RTT64_MS)	/* RTO before any RTT is measured */
+#define	RTT64_MAXNREXMT	10	/* default max # times to retransmit */
+
+				/* function prototypes */
+void	 rtt64_debug(struct rtt64_info *);
+void	 rtt64_init(struct rtt64_info *, int64_t, int64_t);
+void	 rtt64_newpack(struct rtt64_info *);
+int64_t	 rtt64_start(struct rtt64_info *);
+int		 rtt64_start_ms(struct rtt64_info *);
+void	 rtt64_stop(struct rtt64_info *, int64_t);
+int		 rtt64_timeout(struct rtt64_info *);
+uint64_t rtt64_ts(struct rtt64_info *);
+int64_t	 rtt64_srtt(const struct rtt64_info *);
+int64_t	 rtt64_rttvar(const struct rtt64_info *);
+
+#endif	/* __unp_rtt64_h */